@@ -26,6 +26,7 @@
 
 #ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
 #include <pthread.h>
+#include <sys/time.h>
 #if 0 /* debugging */
 #define LOCK(mutex)                   (rfbLog("%s:%d LOCK(%s,0x%x)\n",__FILE__,__LINE__,#mutex,&(mutex)), pthread_mutex_lock(&(mutex)))
 #define UNLOCK(mutex)                 (rfbLog("%s:%d UNLOCK(%s,0x%x)\n",__FILE__,__LINE__,#mutex,&(mutex)), pthread_mutex_unlock(&(mutex)))
@@ -49,6 +50,13 @@
 #define TINI_MUTEX(mutex)             pthread_mutex_destroy(&(mutex))
 #define TSIGNAL(cond)                 pthread_cond_signal(&(cond))
 #define WAIT(cond,mutex)              pthread_cond_wait(&(cond),&(mutex))
+/* like WAIT, but gives up after ms milliseconds */
+#define TIMEDWAIT(cond,mutex,ms)      do { struct timeval _tv; struct timespec _ts; \
+                                        gettimeofday(&_tv,NULL); \
+                                        _ts.tv_sec = _tv.tv_sec + (ms)/1000; \
+                                        _ts.tv_nsec = (_tv.tv_usec + ((ms)%1000)*1000L)*1000L; \
+                                        if(_ts.tv_nsec >= 1000000000L) { _ts.tv_sec++; _ts.tv_nsec -= 1000000000L; } \
+                                        pthread_cond_timedwait(&(cond),&(mutex),&_ts); } while(0)
 #define COND(cond)                    pthread_cond_t (cond)
 #define INIT_COND(cond)               pthread_cond_init(&(cond),NULL)
 #define TINI_COND(cond)               pthread_cond_destroy(&(cond))
@@ -69,6 +77,7 @@
 #define TINI_MUTEX(mutex)             DeleteCriticalSection(&(mutex))
 #define TSIGNAL(cond)                 WakeAllConditionVariable(&(cond))
 #define WAIT(cond,mutex)              SleepConditionVariableCS(&(cond),&(mutex),INFINITE);
+#define TIMEDWAIT(cond,mutex,ms)      SleepConditionVariableCS(&(cond),&(mutex),(ms));
 #define COND(cond)                    CONDITION_VARIABLE (cond)
 #define INIT_COND(cond)               InitializeConditionVariable(&(cond));
 #define TINI_COND(cond)
@@ -86,6 +95,7 @@
 #define TINI_MUTEX(mutex)
 #define TSIGNAL(cond)
 #define WAIT(cond,mutex)              this_is_unsupported
+#define TIMEDWAIT(cond,mutex,ms)      this_is_unsupported
 #define COND(cond)
 #define INIT_COND(cond)
 #define TINI_COND(cond)
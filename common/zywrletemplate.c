@@ -475,6 +475,11 @@ static InlineX void FilterWaveletSquare(int* pBuf, int width, int height, int le
 }
 #  endif
 
+/*
+ ZYWRLE_HARR_PAIRS(x0,x1,n,stride), if defined, does Harr() on the coefficient
+ pairs x0[i*stride], x1[i*stride] for i < n. Then the pairs of a whole row, and
+ of two whole rows for the columns, are handed over at once.
+*/
 static InlineX void Wavelet(int* pBuf, int width, int height, int level)
 {
 	int l, s;
@@ -486,9 +491,22 @@ static InlineX void Wavelet(int* pBuf, int width, int height, int level)
 		pEnd = pBuf+height*width;
 		s = width<<l;
 		while (pTop < pEnd) {
+#ifdef ZYWRLE_HARR_PAIRS
+			ZYWRLE_HARR_PAIRS(pTop, pTop+(1<<l), width>>(l+1), 2<<l);
+#else
 			WaveletLevel(pTop, width, l, 1);
+#endif
+			pTop += s;
+		}
+#ifdef ZYWRLE_HARR_PAIRS
+		pTop = pBuf;
+		s = (2<<l)*width;
+		pEnd = pBuf+(height>>(l+1))*s;
+		while (pTop < pEnd) {
+			ZYWRLE_HARR_PAIRS(pTop, pTop+(width<<l), width>>l, 1<<l);
 			pTop += s;
 		}
+#else
 		pTop = pBuf;
 		pEnd = pBuf+width;
 		s = 1<<l;
@@ -496,6 +514,7 @@ static InlineX void Wavelet(int* pBuf, int width, int height, int level)
 			WaveletLevel(pTop, height,l, width);
 			pTop += s;
 		}
+#endif
 		FilterWaveletSquare(pBuf, width, height, level, l);
 	}
 }
@@ -0,0 +1,267 @@
+/*
+ * adaptive.c - let the Tight encoder follow the link and the content.
+ *
+ * With rfbScreenInfo::adaptiveTight set, clients that enabled JPEG no
+ * longer get one quality for everything. The time from writing an update
+ * to the client's next FramebufferUpdateRequest gives the throughput of
+ * its link, and the JPEG quality and chroma subsampling are lowered for
+ * slow links, never above what the client asked for. Tight itself decides
+ * per subrectangle whether JPEG pays off at all, see SendSubrect().
+ *
+ * Whatever went out lossy is remembered. Once no damage came in for
+ * adaptiveRefineDelay ms, those areas are marked as modified again and
+ * the next update sends them without JPEG, so text does not stay blurry
+ * after scrolling or a video stopped. Their tile hashes are forgotten,
+ * so the refinement is not left out as already sent.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "adaptive.h"
+#include "tilehash.h"
+
+#ifdef LIBVNCSERVER_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+/* Updates smaller than this say more about latency than throughput. */
+#define ADAPTIVE_MIN_SAMPLE 16384
+
+typedef struct rfbAdaptiveState {
+    /* link throughput in bytes per second, 0 while unknown */
+    double throughput;
+    /* rfbStatGetSentBytes() when the update being encoded started */
+    int startBytes;
+    /* the last update written, bytes 0 if it is not being timed */
+    struct timeval sent;
+    long sentBytes;
+    /* areas the client has lossy pixels in */
+    sraRegionPtr lossy;
+    /* the next update refines the lossy areas, or this one does */
+    rfbBool refineNext, refining;
+} rfbAdaptiveState;
+
+/* The most JPEG is allowed to cost from a throughput up. chroma is how
+   many pixels share a chroma sample. */
+static const struct {
+    double bytesPerSecond;
+    int maxQuality;
+    int chroma;
+} adaptiveTiers[] = {
+    { 12500000, 100, 1 },	/* 100 Mbit/s */
+    {  2500000,  80, 2 },	/* 20 Mbit/s */
+    {   625000,  60, 4 },	/* 5 Mbit/s */
+    {        0,  40, 4 }
+};
+
+/* rfbClientRec::turboSubsampLevel to pixels per chroma sample and back;
+   level 3 is grayscale, which stays as it is. */
+static const int levelChroma[4] = { 1, 4, 2, 0 };
+
+static int
+chromaLevel(int chroma)
+{
+    return chroma >= 4 ? 1 : chroma == 2 ? 2 : 0;
+}
+
+static long
+usSince(struct timeval *then, struct timeval *now)
+{
+    return (now->tv_sec - then->tv_sec) * 1000000L + (now->tv_usec - then->tv_usec);
+}
+
+static rfbBool
+adaptiveEnabled(rfbClientPtr cl)
+{
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
+    /* lossy areas of a scaled client are not where they are on screen */
+    return cl->screen->adaptiveTight && cl->turboQualityLevel != -1 &&
+	cl->screen == cl->scaledScreen &&
+	(cl->preferredEncoding == rfbEncodingTight ||
+	 cl->preferredEncoding == rfbEncodingTightPng);
+#else
+    return FALSE;
+#endif
+}
+
+void
+rfbAdaptiveBeginUpdate(rfbClientPtr cl, sraRegionPtr updateRegion)
+{
+    rfbAdaptiveState *a = cl->adaptive;
+
+    if (!adaptiveEnabled(cl)) {
+	/* e.g. JPEG was turned off, which makes every update lossless */
+	rfbAdaptiveFree(cl);
+	return;
+    }
+    if (!a) {
+	a = (rfbAdaptiveState *)calloc(sizeof(rfbAdaptiveState), 1);
+	if (!a) {
+	    rfbErr("rfbAdaptiveBeginUpdate: out of memory\n");
+	    return;
+	}
+	a->lossy = sraRgnCreate();
+	cl->adaptive = a;
+    }
+
+    /* what is sent now replaces what the client had there */
+    sraRgnSubtract(a->lossy, updateRegion);
+    a->refining = a->refineNext;
+    a->refineNext = FALSE;
+    a->startBytes = rfbStatGetSentBytes(cl);
+}
+
+void
+rfbAdaptiveEndUpdate(rfbClientPtr cl)
+{
+    rfbAdaptiveState *a = cl->adaptive;
+    long bytes;
+
+    if (!a)
+	return;
+    bytes = (long)((unsigned int)rfbStatGetSentBytes(cl) - (unsigned int)a->startBytes);
+
+    LOCK(cl->updateMutex);
+    a->refining = FALSE;
+    if (bytes >= ADAPTIVE_MIN_SAMPLE) {
+	gettimeofday(&a->sent, NULL);
+	a->sentBytes = bytes;
+    }
+    /* the hashes of lossy tiles are not what the client shows */
+    rfbTileHashForget(cl, a->lossy);
+    UNLOCK(cl->updateMutex);
+}
+
+void
+rfbAdaptiveRequest(rfbClientPtr cl)
+{
+    rfbAdaptiveState *a = cl->adaptive;
+    struct timeval now;
+    double sample;
+    long us;
+
+    if (!a || a->sentBytes == 0)
+	return;
+    gettimeofday(&now, NULL);
+    us = usSince(&a->sent, &now);
+    /* a client asking ahead of time only shows the link is not full */
+    if (us < 1000)
+	us = 1000;
+    sample = a->sentBytes * 1000000.0 / us;
+    a->throughput = a->throughput > 0 ? (3 * a->throughput + sample) / 4 : sample;
+    a->sentBytes = 0;
+}
+
+rfbBool
+rfbAdaptiveJpeg(rfbClientPtr cl, int *quality, int *subsampLevel)
+{
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
+    rfbAdaptiveState *a = cl->adaptive;
+    double throughput;
+    rfbBool refining;
+    int i;
+
+    if (!a || !adaptiveEnabled(cl))
+	return FALSE;
+
+    LOCK(cl->updateMutex);
+    throughput = a->throughput;
+    refining = a->refining;
+    UNLOCK(cl->updateMutex);
+
+    *quality = cl->turboQualityLevel;
+    *subsampLevel = cl->turboSubsampLevel;
+    if (refining) {
+	*quality = -1;
+	return TRUE;
+    }
+    if (throughput <= 0)
+	return TRUE;
+
+    for (i = 0; throughput < adaptiveTiers[i].bytesPerSecond; i++)
+	;
+    if (*quality > adaptiveTiers[i].maxQuality)
+	*quality = adaptiveTiers[i].maxQuality;
+    if (*subsampLevel >= 0 && *subsampLevel < 3 &&
+	levelChroma[*subsampLevel] < adaptiveTiers[i].chroma)
+	*subsampLevel = chromaLevel(adaptiveTiers[i].chroma);
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+void
+rfbAdaptiveLossy(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    rfbAdaptiveState *a = cl->adaptive;
+    sraRegionPtr rect;
+
+    if (!a)
+	return;
+    rect = sraRgnCreateRect(x, y, x + w, y + h);
+    LOCK(cl->updateMutex);
+    sraRgnOr(a->lossy, rect);
+    UNLOCK(cl->updateMutex);
+    sraRgnDestroy(rect);
+}
+
+rfbBool
+rfbAdaptiveRefinePending(rfbClientPtr cl)
+{
+    rfbAdaptiveState *a = cl->adaptive;
+
+    return a && cl->screen->adaptiveRefineDelay > 0 && !a->refineNext &&
+	!sraRgnEmpty(a->lossy);
+}
+
+int
+rfbAdaptiveRefine(rfbClientPtr cl)
+{
+    rfbAdaptiveState *a = cl->adaptive;
+    int delay = cl->screen->adaptiveRefineDelay;
+    struct timeval now;
+    long quiet;
+
+    if (!rfbAdaptiveRefinePending(cl))
+	return -1;
+
+    gettimeofday(&now, NULL);
+    quiet = (now.tv_sec - cl->lastDamage.tv_sec) * 1000 +
+	(now.tv_usec - cl->lastDamage.tv_usec) / 1000;
+    if (quiet >= 0 && quiet < delay)
+	return (int)(delay - quiet);
+
+    sraRgnOr(cl->modifiedRegion, a->lossy);
+    a->refineNext = TRUE;
+    return 0;
+}
+
+void
+rfbAdaptiveFree(rfbClientPtr cl)
+{
+    rfbAdaptiveState *a = cl->adaptive;
+
+    if (!a)
+	return;
+    sraRgnDestroy(a->lossy);
+    free(a);
+    cl->adaptive = NULL;
+}
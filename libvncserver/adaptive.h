@@ -0,0 +1,57 @@
+/*
+ * adaptive.h - private interface to the adaptive Tight quality control.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef RFB_ADAPTIVE_H
+#define RFB_ADAPTIVE_H
+
+#include <rfb/rfb.h>
+
+/* An update of updateRegion is about to be encoded; called by
+   rfbSendFramebufferUpdate() with cl->updateMutex held. */
+void rfbAdaptiveBeginUpdate(rfbClientPtr cl, sraRegionPtr updateRegion);
+
+/* The update is written or queued; starts timing its delivery. */
+void rfbAdaptiveEndUpdate(rfbClientPtr cl);
+
+/* A FramebufferUpdateRequest came in; called with cl->updateMutex held. */
+void rfbAdaptiveRequest(rfbClientPtr cl);
+
+/* The JPEG quality and subsampling level for the update being encoded.
+   Returns FALSE if the client's own settings apply; a quality of -1
+   means no JPEG at all. */
+rfbBool rfbAdaptiveJpeg(rfbClientPtr cl, int *quality, int *subsampLevel);
+
+/* A rectangle of the update being encoded went out lossy. */
+void rfbAdaptiveLossy(rfbClientPtr cl, int x, int y, int w, int h);
+
+/* Whether the client has lossy areas to be refined; called with
+   cl->updateMutex held. */
+rfbBool rfbAdaptiveRefinePending(rfbClientPtr cl);
+
+/* Once the damage has stopped, add the lossy areas to cl->modifiedRegion
+   so the next update sends them without loss. Returns 0 if it did, the
+   ms after which to ask again if it is too early, and -1 if there is
+   nothing to refine. Called with cl->updateMutex held. */
+int rfbAdaptiveRefine(rfbClientPtr cl);
+
+void rfbAdaptiveFree(rfbClientPtr cl);
+
+#endif
@@ -36,6 +36,28 @@ rfbUsage(void)
                                                              "(default 40)\n");
     fprintf(stderr, "-deferptrupdate time   time in ms to defer pointer updates"
                                                            " (default none)\n");
+    fprintf(stderr, "-deferarea pixels      send updates up to this size without deferring\n"
+                    "                       them (default 4096, 0: always defer)\n");
+    fprintf(stderr, "-deferquiet time       send deferred updates once no damage came in for\n"
+                    "                       time ms (default 2, 0: always wait -deferupdate)\n");
+    fprintf(stderr, "-workers n             serve clients from a pool of n threads when running\n"
+                    "                       in the background (-1: one per core, 0: two per client)\n");
+    fprintf(stderr, "-encodecache kbytes    share up to kbytes of encoded rectangles between\n"
+                    "                       clients with the same settings (default 0: off)\n");
+    fprintf(stderr, "-sharetranslation      translate pixels once for all clients with the same\n"
+                    "                       pixel format\n");
+    fprintf(stderr, "-compositecursor       composite the cursor into the pixels sent to clients\n"
+                    "                       without cursor shapes instead of drawing it\n");
+    fprintf(stderr, "-sendqueue kbytes      never block on slow clients, queue their output and\n"
+                    "                       skip updates while kbytes are queued (default 0: off)\n");
+    fprintf(stderr, "-detectdamage [n]      only send what differs from a shadow copy of the\n"
+                    "                       framebuffer, compare on n threads (default 0: one per core)\n");
+    fprintf(stderr, "-detectmoves           with -detectdamage, send scrolled areas as copies\n");
+    fprintf(stderr, "-tilehashes            don't send clients tiles they already have\n");
+    fprintf(stderr, "-encodethreads n       encode large updates on n threads (default 0: off,\n"
+                    "                       -1: one per core)\n");
+    fprintf(stderr, "-adaptivetight [ms]    adapt Tight JPEG to each client's link and content,\n"
+                    "                       refine lossy areas after ms without damage (default 500)\n");
     fprintf(stderr, "-desktop name          VNC desktop name (default \"LibVNCServer\")\n");
     fprintf(stderr, "-alwaysshared          always treat new clients as shared\n");
     fprintf(stderr, "-nevershared           never treat new clients as shared\n");
@@ -145,6 +167,58 @@ rfbProcessArguments(rfbScreenInfoPtr rfbScreen,int* argc, char *argv[])
 		return FALSE;
 	    }
             rfbScreen->deferPtrUpdateTime = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-deferarea") == 0) {  /* -deferarea pixels */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->deferUpdateSmallArea = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-deferquiet") == 0) {  /* -deferquiet milliseconds */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->deferUpdateQuietTime = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-workers") == 0) {  /* -workers count */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->backgroundWorkers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-encodecache") == 0) {  /* -encodecache kbytes */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->encodeCacheSize = atoi(argv[++i]) * 1024;
+        } else if (strcmp(argv[i], "-sharetranslation") == 0) {
+            rfbScreen->shareTranslation = TRUE;
+        } else if (strcmp(argv[i], "-compositecursor") == 0) {
+            rfbScreen->compositeCursor = TRUE;
+        } else if (strcmp(argv[i], "-sendqueue") == 0) {  /* -sendqueue kbytes */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->sendQueueSize = atoi(argv[++i]) * 1024;
+        } else if (strcmp(argv[i], "-detectdamage") == 0) {  /* -detectdamage [threads] */
+            rfbScreen->detectDamage = TRUE;
+            if (i + 1 < *argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9')
+                rfbScreen->damageThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-detectmoves") == 0) {
+            rfbScreen->detectMoves = TRUE;
+        } else if (strcmp(argv[i], "-tilehashes") == 0) {
+            rfbScreen->clientTileHashes = TRUE;
+        } else if (strcmp(argv[i], "-encodethreads") == 0) {  /* -encodethreads threads */
+            if (i + 1 >= *argc) {
+		rfbUsage();
+		return FALSE;
+	    }
+            rfbScreen->encodeThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-adaptivetight") == 0) {  /* -adaptivetight [milliseconds] */
+            rfbScreen->adaptiveTight = TRUE;
+            if (i + 1 < *argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9')
+                rfbScreen->adaptiveRefineDelay = atoi(argv[++i]);
         } else if (strcmp(argv[i], "-desktop") == 0) {  /* -desktop desktop-name */
             if (i + 1 >= *argc) {
 		rfbUsage();
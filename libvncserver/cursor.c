@@ -25,6 +25,10 @@
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
 #include "private.h"
+#include "rfbpoll.h"
+#include "encodecache.h"
+#include "translatecache.h"
+#include "tilehash.h"
 
 void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2);
 
@@ -505,64 +509,21 @@ void rfbHideCursor(rfbClientPtr cl)
 	    s->underCursorBuffer+j*x2*bpp,
 	    x2*bpp);
 
-   /* Copy to all scaled versions */
+   /* Rescale it in all scaled versions */
    rfbScaledScreenUpdate(s, x1, y1, x1+x2, y1+y2);
+   rfbEncodeCacheInvalidateRect(s, x1, y1, x1+x2, y1+y2);
+   rfbTranslateCacheInvalidateRect(s, x1, y1, x1+x2, y1+y2);
    
    UNLOCK(s->cursorMutex);
 }
 
-void rfbShowCursor(rfbClientPtr cl)
+/* Draw x2 by y2 pixels of the cursor, from i1,j1 in it on, over what is
+   in buf, rowstride bytes per line; called with cursorMutex held. */
+static void rfbDrawCursor(rfbScreenInfoPtr s, rfbCursorPtr c, char *buf,
+			  int rowstride, int i1, int j1, int x2, int y2)
 {
-   rfbScreenInfoPtr s=cl->screen;
-   rfbCursorPtr c=s->cursor;
-   int i,j,x1,x2,y1,y2,i1,j1,bpp=s->serverFormat.bitsPerPixel/8,
-     rowstride=s->paddedWidthInBytes,
-     bufSize,w;
-   rfbBool wasChanged=FALSE;
+   int i,j,bpp=s->serverFormat.bitsPerPixel/8,w=(c->width+7)/8;
 
-   if(!c) return;
-   LOCK(s->cursorMutex);
-
-   bufSize=c->width*c->height*bpp;
-   w=(c->width+7)/8;
-   if(s->underCursorBufferLen<bufSize) {
-      if(s->underCursorBuffer!=NULL)
-	free(s->underCursorBuffer);
-      s->underCursorBuffer=malloc(bufSize);
-      s->underCursorBufferLen=bufSize;
-   }
-
-   /* save what is under the cursor */
-   i1=j1=0; /* offset in cursor */
-   x1=cl->cursorX-c->xhot;
-   x2=x1+c->width;
-   if(x1<0) { i1=-x1; x1=0; }
-   if(x2>=s->width) x2=s->width-1;
-   x2-=x1; if(x2<=0) {
-     UNLOCK(s->cursorMutex);
-     return; /* nothing to do */
-   }
-
-   y1=cl->cursorY-c->yhot;
-   y2=y1+c->height;
-   if(y1<0) { j1=-y1; y1=0; }
-   if(y2>=s->height) y2=s->height-1;
-   y2-=y1; if(y2<=0) {
-     UNLOCK(s->cursorMutex);
-     return; /* nothing to do */
-   }
-
-   /* save data */
-   for(j=0;j<y2;j++) {
-     char* dest=s->underCursorBuffer+j*x2*bpp;
-     const char* src=s->frameBuffer+(y1+j)*rowstride+x1*bpp;
-     unsigned int count=x2*bpp;
-     if(wasChanged || memcmp(dest,src,count)) {
-       wasChanged=TRUE;
-       memcpy(dest,src,count);
-     }
-   }
-   
    if(!c->richSource)
      rfbMakeRichCursorFromXCursor(s,c);
   
@@ -596,7 +557,7 @@ void rfbShowCursor(rfbClientPtr cl)
 			int rdst, gdst, bdst;		/* fb RGB */
 			int asrc, rsrc, gsrc, bsrc;	/* rich source ARGB */
 
-			dest = s->frameBuffer + (j+y1)*rowstride + (i+x1)*bpp;
+			dest = buf + j*rowstride + i*bpp;
 			src  = c->richSource  + (j+j1)*c->width*bpp + (i+i1)*bpp;
 			aptr = c->alphaSource + (j+j1)*c->width + (i+i1);
 
@@ -661,14 +622,232 @@ void rfbShowCursor(rfbClientPtr cl)
       for(j=0;j<y2;j++)
         for(i=0;i<x2;i++)
           if((c->mask[(j+j1)*w+(i+i1)/8]<<((i+i1)&7))&0x80)
-   	 memcpy(s->frameBuffer+(j+y1)*rowstride+(i+x1)*bpp,
+   	 memcpy(buf+j*rowstride+i*bpp,
    		c->richSource+(j+j1)*c->width*bpp+(i+i1)*bpp,bpp);
    }
+}
+
+void rfbShowCursor(rfbClientPtr cl)
+{
+   rfbScreenInfoPtr s=cl->screen;
+   rfbCursorPtr c=s->cursor;
+   int j,x1,x2,y1,y2,i1,j1,bpp=s->serverFormat.bitsPerPixel/8,
+     rowstride=s->paddedWidthInBytes,
+     bufSize;
+   rfbBool wasChanged=FALSE;
+
+   if(!c) return;
+   LOCK(s->cursorMutex);
+
+   bufSize=c->width*c->height*bpp;
+   if(s->underCursorBufferLen<bufSize) {
+      if(s->underCursorBuffer!=NULL)
+	free(s->underCursorBuffer);
+      s->underCursorBuffer=malloc(bufSize);
+      s->underCursorBufferLen=bufSize;
+   }
 
-   /* Copy to all scaled versions */
+   /* save what is under the cursor */
+   i1=j1=0; /* offset in cursor */
+   x1=cl->cursorX-c->xhot;
+   x2=x1+c->width;
+   if(x1<0) { i1=-x1; x1=0; }
+   if(x2>=s->width) x2=s->width-1;
+   x2-=x1; if(x2<=0) {
+     UNLOCK(s->cursorMutex);
+     return; /* nothing to do */
+   }
+
+   y1=cl->cursorY-c->yhot;
+   y2=y1+c->height;
+   if(y1<0) { j1=-y1; y1=0; }
+   if(y2>=s->height) y2=s->height-1;
+   y2-=y1; if(y2<=0) {
+     UNLOCK(s->cursorMutex);
+     return; /* nothing to do */
+   }
+
+   /* save data */
+   for(j=0;j<y2;j++) {
+     char* dest=s->underCursorBuffer+j*x2*bpp;
+     const char* src=s->frameBuffer+(y1+j)*rowstride+x1*bpp;
+     unsigned int count=x2*bpp;
+     if(wasChanged || memcmp(dest,src,count)) {
+       wasChanged=TRUE;
+       memcpy(dest,src,count);
+     }
+   }
+   
+   rfbDrawCursor(s,c,s->frameBuffer+y1*rowstride+x1*bpp,rowstride,i1,j1,x2,y2);
+
+   /* Rescale it in all scaled versions */
    rfbScaledScreenUpdate(s, x1, y1, x1+x2, y1+y2);
+   rfbEncodeCacheInvalidateRect(s, x1, y1, x1+x2, y1+y2);
+   rfbTranslateCacheInvalidateRect(s, x1, y1, x1+x2, y1+y2);
+
+   UNLOCK(s->cursorMutex);
+}
+
+/*
+ * With compositeCursor, clients without cursor shape updates get the cursor
+ * into their pixels as they are translated: rfbCursorOverlayBegin() draws it
+ * over a copy of what is under it and puts translateWithCursor() in place of
+ * the client's translateFn for the update, which translates the pixels of
+ * that copy over the part of the rectangle it covers. Tight reads the
+ * framebuffer directly for solid areas and JPEG and a scaled client's pixels
+ * come from its scaled screen, so those still get it drawn by
+ * rfbShowCursor().
+ */
+
+typedef struct rfbCursorOverlay {
+   rfbScreenInfoPtr screen;
+   /* the client's own */
+   rfbTranslateFnType translateFn;
+   char *translateLookupTable;
+   /* the cursor on the framebuffer and what the client is to see there,
+      w*h pixels in the server's format */
+   int x,y,w,h;
+   char *pixels;
+   int pixelsLen;
+} rfbCursorOverlay;
+
+static void translateWithCursor(char *table, rfbPixelFormat *in,
+				rfbPixelFormat *out, char *iptr, char *optr,
+				int bytesBetweenInputLines, int width, int height)
+{
+   rfbCursorOverlay *o=(rfbCursorOverlay *)table;
+   rfbScreenInfoPtr s=o->screen;
+   int bpp=s->serverFormat.bitsPerPixel/8,outBytes=out->bitsPerPixel/8;
+   long offset=(long)(iptr-s->frameBuffer);
+   int x,y,x1,y1,x2,y2,j;
+
+   (*o->translateFn)(o->translateLookupTable,in,out,iptr,optr,
+		     bytesBetweenInputLines,width,height);
+
+   /* Pixels that are not part of the framebuffer, like cursor shapes,
+      have nothing under the cursor. */
+   if(bytesBetweenInputLines!=s->paddedWidthInBytes || offset<0 ||
+      offset>=(long)s->paddedWidthInBytes*s->height ||
+      offset%s->paddedWidthInBytes%bpp!=0)
+     return;
+   y=(int)(offset/s->paddedWidthInBytes);
+   x=(int)(offset%s->paddedWidthInBytes/bpp);
+
+   x1=x>o->x?x:o->x;
+   y1=y>o->y?y:o->y;
+   x2=x+width<o->x+o->w?x+width:o->x+o->w;
+   y2=y+height<o->y+o->h?y+height:o->y+o->h;
+   for(j=y1;j<y2 && x1<x2;j++)
+     (*o->translateFn)(o->translateLookupTable,in,out,
+		       o->pixels+((j-o->y)*o->w+x1-o->x)*bpp,
+		       optr+((size_t)(j-y)*width+x1-x)*outBytes,
+		       o->w*bpp,x2-x1,1);
+}
+
+rfbBool rfbCursorOverlayBegin(rfbClientPtr cl)
+{
+   rfbScreenInfoPtr s=cl->screen;
+   rfbCursorOverlay *o=cl->cursorOverlay;
+   rfbCursorPtr c;
+   int j,x1,x2,y1,y2,i1,j1,bpp=s->serverFormat.bitsPerPixel/8,size;
+
+   if(!s->compositeCursor || cl->scaledScreen!=s ||
+      cl->preferredEncoding==rfbEncodingTight ||
+      cl->preferredEncoding==rfbEncodingTightPng)
+     return FALSE;
+
+   if(!o) {
+     o=(rfbCursorOverlay *)calloc(sizeof(rfbCursorOverlay),1);
+     if(!o) {
+       rfbErr("rfbCursorOverlayBegin: out of memory\n");
+       return FALSE;
+     }
+     cl->cursorOverlay=o;
+   }
+
+   LOCK(s->cursorMutex);
+   c=s->cursor;
+   if(!c) {
+     UNLOCK(s->cursorMutex);
+     return TRUE; /* nothing to draw */
+   }
+
+   i1=j1=0; /* offset in cursor */
+   x1=cl->cursorX-c->xhot;
+   x2=x1+c->width;
+   if(x1<0) { i1=-x1; x1=0; }
+   if(x2>s->width) x2=s->width;
+   y1=cl->cursorY-c->yhot;
+   y2=y1+c->height;
+   if(y1<0) { j1=-y1; y1=0; }
+   if(y2>s->height) y2=s->height;
+   if(x2<=x1 || y2<=y1) {
+     UNLOCK(s->cursorMutex);
+     return TRUE; /* nothing to draw */
+   }
 
+   size=(x2-x1)*(y2-y1)*bpp;
+   if(o->pixelsLen<size) {
+     free(o->pixels);
+     o->pixels=(char *)malloc(size);
+     o->pixelsLen=o->pixels ? size : 0;
+     if(!o->pixels) {
+       UNLOCK(s->cursorMutex);
+       rfbErr("rfbCursorOverlayBegin: out of memory\n");
+       return FALSE;
+     }
+   }
+   for(j=y1;j<y2;j++)
+     memcpy(o->pixels+(j-y1)*(x2-x1)*bpp,
+	    s->frameBuffer+j*s->paddedWidthInBytes+x1*bpp,(x2-x1)*bpp);
+   rfbDrawCursor(s,c,o->pixels,(x2-x1)*bpp,i1,j1,x2-x1,y2-y1);
    UNLOCK(s->cursorMutex);
+
+   o->screen=s;
+   o->x=x1;
+   o->y=y1;
+   o->w=x2-x1;
+   o->h=y2-y1;
+   o->translateFn=cl->translateFn;
+   o->translateLookupTable=cl->translateLookupTable;
+   cl->translateFn=translateWithCursor;
+   cl->translateLookupTable=(char *)o;
+   return TRUE;
+}
+
+void rfbCursorOverlayEnd(rfbClientPtr cl)
+{
+   rfbCursorOverlay *o=cl->cursorOverlay;
+   sraRegionPtr region;
+
+   if(!o || cl->translateFn!=translateWithCursor)
+     return;
+   cl->translateFn=o->translateFn;
+   cl->translateLookupTable=o->translateLookupTable;
+
+   /* the client's tiles there are not what the framebuffer holds */
+   region=sraRgnCreateRect(o->x,o->y,o->x+o->w,o->y+o->h);
+   LOCK(cl->updateMutex);
+   rfbTileHashForget(cl,region);
+   UNLOCK(cl->updateMutex);
+   sraRgnDestroy(region);
+}
+
+rfbBool rfbCursorOverlayCovers(rfbClientPtr cl,int x,int y,int w,int h)
+{
+   rfbCursorOverlay *o=(rfbCursorOverlay *)cl->translateLookupTable;
+
+   return cl->translateFn==translateWithCursor &&
+     x<o->x+o->w && o->x<x+w && y<o->y+o->h && o->y<y+h;
+}
+
+void rfbCursorOverlayFree(rfbClientPtr cl)
+{
+   if(cl->cursorOverlay) {
+     free(cl->cursorOverlay->pixels);
+     free(cl->cursorOverlay);
+     cl->cursorOverlay=NULL;
+   }
 }
 
 /* 
@@ -752,5 +931,7 @@ void rfbSetCursor(rfbScreenInfoPtr rfbScreen,rfbCursorPtr c)
   rfbReleaseClientIterator(iterator);
 
   UNLOCK(rfbScreen->cursorMutex);
+
+  rfbPollScheduleFullScan(rfbScreen);
 }
 
@@ -0,0 +1,719 @@
+/*
+ * damage.c - find out what really changed in the framebuffer.
+ *
+ * Integrations that cannot tell what changed tend to mark the whole screen
+ * as modified for every frame. With rfbScreenInfo::detectDamage set, the
+ * library keeps a shadow copy of the framebuffer and compares every marked
+ * area against it in tiles of DAMAGE_TILE x DAMAGE_TILE pixels; only the
+ * tiles that differ are passed on to the clients and copied to the shadow.
+ * Large areas are split over a few threads.
+ *
+ * With rfbScreenInfo::detectMoves set as well, every large marked rectangle
+ * is first checked for content that moved up or down, like a scrolling
+ * terminal or browser: rows are hashed in stripes of DAMAGE_MOVE_STRIPE
+ * pixels in the framebuffer and in the shadow, rows that changed vote for
+ * the distance at which their new hash was found in the shadow, and runs of
+ * rows that match at the winning distance are sent as a copy instead of
+ * being encoded again.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "workerpool.h"
+#include "damage.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define DAMAGE_TILE 32
+/* areas smaller than this are compared on the calling thread only */
+#define DAMAGE_PARALLEL_BYTES (1024 * 1024)
+/* pieces of work per thread, so that uneven rows even out */
+#define DAMAGE_CHUNKS_PER_THREAD 4
+/* rows that have to move together before a copy is worth it */
+#define DAMAGE_MOVE_MIN_ROWS 16
+/* width of the columns rows are hashed in, so that a window scrolling in
+   a larger marked area is found as well */
+#define DAMAGE_MOVE_STRIPE 64
+
+/* At most one row of tiles, clipped to one rectangle of the marked area. */
+typedef struct {
+    int x1, y1, x2, y2;
+} rfbDamageRow;
+
+typedef struct {
+    int first, count;
+    unsigned char *tileChanged;
+    sraRegionPtr changed;
+    uint64_t scanned, changedBytes;
+} rfbDamageChunk;
+
+typedef struct rfbDamageDetector rfbDamageDetector;
+
+struct rfbDamageDetector {
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+    MUTEX(mutex);
+#endif
+    char *shadow;
+    size_t shadowSize;
+    int width, height, bpp, stride;
+    /* the shadow does not match the framebuffer format or was never filled */
+    rfbBool stale;
+    rfbWorkerPool *workers;
+    rfbDamageRow *rows;
+    int rowsSize;
+    rfbDamageChunk *chunks;
+    int maxChunks;
+    unsigned char *tileChanged;
+    int tilesPerChunk;
+    /* row hashes of one rectangle for detectMoves, stripe by stripe */
+    uint64_t *fbHash, *shadowHash;
+    int moveHashes, moveStripes;
+    int *moveTable, *moveVotes;
+    int moveRows, moveTableSize;
+};
+
+typedef struct {
+    rfbScreenInfoPtr screen;
+    rfbDamageDetector *d;
+} rfbDamageScan;
+
+typedef struct {
+    rfbScreenInfoPtr screen;
+    rfbDamageDetector *d;
+    const sraRect *rect;
+    int chunks;
+} rfbDamageHashJob;
+
+void
+rfbDamageInit(rfbScreenInfoPtr screen)
+{
+    rfbDamageDetector *d;
+    int threads;
+
+    if (!screen->detectDamage || screen->damageDetector)
+	return;
+
+    d = (rfbDamageDetector *)calloc(sizeof(rfbDamageDetector), 1);
+    if (!d) {
+	rfbErr("rfbDamageInit: out of memory\n");
+	return;
+    }
+    d->stale = TRUE;
+
+    threads = screen->damageThreads > 0 ? screen->damageThreads : rfbWorkerPoolDefaultSize();
+    /* the calling thread does its share of the work */
+    if (threads > 1)
+	d->workers = rfbWorkerPoolCreate(threads - 1);
+    d->maxChunks = d->workers ? DAMAGE_CHUNKS_PER_THREAD * (rfbWorkerPoolSize(d->workers) + 1) : 1;
+    d->chunks = (rfbDamageChunk *)calloc(sizeof(rfbDamageChunk), d->maxChunks);
+    if (!d->chunks) {
+	rfbErr("rfbDamageInit: out of memory\n");
+	rfbWorkerPoolDestroy(d->workers);
+	free(d);
+	return;
+    }
+
+    INIT_MUTEX(d->mutex);
+    screen->damageDetector = d;
+}
+
+void
+rfbDamageCleanup(rfbScreenInfoPtr screen)
+{
+    rfbDamageDetector *d = screen->damageDetector;
+
+    if (!d)
+	return;
+
+    if (screen->damageBytesScanned > 0)
+	rfbLog("Damage detection: %.1f MB compared, %.1f MB changed, %.1f MB moved\n",
+	       screen->damageBytesScanned / 1048576.0,
+	       screen->damageBytesChanged / 1048576.0,
+	       screen->damageBytesMoved / 1048576.0);
+
+    rfbWorkerPoolDestroy(d->workers);
+    TINI_MUTEX(d->mutex);
+    free(d->shadow);
+    free(d->rows);
+    free(d->chunks);
+    free(d->tileChanged);
+    free(d->fbHash);
+    free(d->shadowHash);
+    free(d->moveTable);
+    free(d->moveVotes);
+    free(d);
+    screen->damageDetector = NULL;
+}
+
+void
+rfbDamageReset(rfbScreenInfoPtr screen)
+{
+    rfbDamageDetector *d = screen->damageDetector;
+
+    if (!d)
+	return;
+    LOCK(d->mutex);
+    d->stale = TRUE;
+    UNLOCK(d->mutex);
+}
+
+static rfbBool
+damageClip(sraRect *rect, int x1, int y1, int x2, int y2)
+{
+    if (rect->x1 < x1)
+	rect->x1 = x1;
+    if (rect->y1 < y1)
+	rect->y1 = y1;
+    if (rect->x2 > x2)
+	rect->x2 = x2;
+    if (rect->y2 > y2)
+	rect->y2 = y2;
+    return rect->x1 < rect->x2 && rect->y1 < rect->y2;
+}
+
+static rfbBool
+damageDiffers(const char *a, const char *b, int len)
+{
+#ifdef __SSE2__
+    __m128i eq;
+
+    while (len >= 64) {
+	eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a),
+			    _mm_loadu_si128((const __m128i *)b));
+	eq = _mm_and_si128(eq, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + 16)),
+					      _mm_loadu_si128((const __m128i *)(b + 16))));
+	eq = _mm_and_si128(eq, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + 32)),
+					      _mm_loadu_si128((const __m128i *)(b + 32))));
+	eq = _mm_and_si128(eq, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + 48)),
+					      _mm_loadu_si128((const __m128i *)(b + 48))));
+	if (_mm_movemask_epi8(eq) != 0xffff)
+	    return TRUE;
+	a += 64;
+	b += 64;
+	len -= 64;
+    }
+    while (len >= 16) {
+	eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)a),
+			    _mm_loadu_si128((const __m128i *)b));
+	if (_mm_movemask_epi8(eq) != 0xffff)
+	    return TRUE;
+	a += 16;
+	b += 16;
+	len -= 16;
+    }
+#endif
+    return len > 0 && memcmp(a, b, len) != 0;
+}
+
+/* Compare one row of tiles; copy the tiles that changed to the shadow and
+   add them to the chunk's region. */
+static void
+damageScanRow(rfbScreenInfoPtr screen, rfbDamageDetector *d,
+              const rfbDamageRow *row, rfbDamageChunk *chunk)
+{
+    int bpp = d->bpp, fbStride = screen->paddedWidthInBytes;
+    int first = row->x1 / DAMAGE_TILE, n = (row->x2 - 1) / DAMAGE_TILE - first + 1;
+    int left = n, t, start, x1, x2, y;
+    unsigned char *changed = chunk->tileChanged;
+    const char *fb;
+    char *sh;
+    sraRegionPtr rect;
+
+    memset(changed, 0, n);
+    for (y = row->y1; y < row->y2 && left > 0; y++) {
+	fb = screen->frameBuffer + y * fbStride;
+	sh = d->shadow + y * d->stride;
+	for (t = 0; t < n; t++) {
+	    if (changed[t])
+		continue;
+	    x1 = (first + t) * DAMAGE_TILE;
+	    x2 = x1 + DAMAGE_TILE;
+	    if (x1 < row->x1)
+		x1 = row->x1;
+	    if (x2 > row->x2)
+		x2 = row->x2;
+	    if (damageDiffers(fb + x1 * bpp, sh + x1 * bpp, (x2 - x1) * bpp)) {
+		changed[t] = 1;
+		left--;
+	    }
+	}
+    }
+    chunk->scanned += (uint64_t)(row->x2 - row->x1) * (row->y2 - row->y1) * bpp;
+    if (left == n)
+	return;
+
+    for (t = 0; t < n; t++) {
+	if (!changed[t])
+	    continue;
+	for (start = t; t + 1 < n && changed[t + 1]; t++)
+	    ;
+	x1 = (first + start) * DAMAGE_TILE;
+	x2 = (first + t + 1) * DAMAGE_TILE;
+	if (x1 < row->x1)
+	    x1 = row->x1;
+	if (x2 > row->x2)
+	    x2 = row->x2;
+
+	for (y = row->y1; y < row->y2; y++)
+	    memcpy(d->shadow + y * d->stride + x1 * bpp,
+		   screen->frameBuffer + y * fbStride + x1 * bpp, (x2 - x1) * bpp);
+	chunk->changedBytes += (uint64_t)(x2 - x1) * (row->y2 - row->y1) * bpp;
+
+	rect = sraRgnCreateRect(x1, row->y1, x2, row->y2);
+	if (!chunk->changed) {
+	    chunk->changed = rect;
+	} else {
+	    sraRgnOr(chunk->changed, rect);
+	    sraRgnDestroy(rect);
+	}
+    }
+}
+
+static void
+damageScanChunk(void *data, int index)
+{
+    rfbDamageScan *scan = (rfbDamageScan *)data;
+    rfbDamageChunk *chunk = &scan->d->chunks[index];
+    int i;
+
+    for (i = chunk->first; i < chunk->first + chunk->count; i++)
+	damageScanRow(scan->screen, scan->d, &scan->d->rows[i], chunk);
+}
+
+/* Make the shadow a copy of the whole framebuffer. */
+static rfbBool
+damageRefresh(rfbScreenInfoPtr screen, rfbDamageDetector *d)
+{
+    int bpp = screen->serverFormat.bitsPerPixel / 8, y, tiles;
+    size_t size = (size_t)screen->width * bpp * screen->height;
+    char *shadow;
+    unsigned char *tileChanged;
+
+    if (!screen->frameBuffer || bpp == 0)
+	return FALSE;
+
+    if (size != d->shadowSize) {
+	if (!(shadow = (char *)malloc(size))) {
+	    rfbErr("rfbDamageDetect: out of memory\n");
+	    return FALSE;
+	}
+	free(d->shadow);
+	d->shadow = shadow;
+	d->shadowSize = size;
+    }
+    tiles = (screen->width + DAMAGE_TILE - 1) / DAMAGE_TILE;
+    if (tiles != d->tilesPerChunk || !d->tileChanged) {
+	if (!(tileChanged = (unsigned char *)malloc(tiles * d->maxChunks))) {
+	    rfbErr("rfbDamageDetect: out of memory\n");
+	    return FALSE;
+	}
+	free(d->tileChanged);
+	d->tileChanged = tileChanged;
+	d->tilesPerChunk = tiles;
+    }
+
+    d->width = screen->width;
+    d->height = screen->height;
+    d->bpp = bpp;
+    d->stride = screen->width * bpp;
+    for (y = 0; y < screen->height; y++)
+	memcpy(d->shadow + y * d->stride,
+	       screen->frameBuffer + y * screen->paddedWidthInBytes, d->stride);
+    d->stale = FALSE;
+    return TRUE;
+}
+
+/* Do a copy on the shadow, in the same order as rfbDoCopyRegion() so that
+   overlapping copies work. */
+static void
+damageCopy(rfbDamageDetector *d, sraRegionPtr region, int dx, int dy)
+{
+    sraRectangleIterator *i;
+    sraRect rect;
+    int j, widthInBytes;
+    char *in, *out;
+
+    i = sraRgnGetReverseIterator(region, dx < 0, dy < 0);
+    while (sraRgnIteratorNext(i, &rect)) {
+	/* both the destination and the source have to be on the screen */
+	if (!damageClip(&rect, 0, 0, d->width, d->height) ||
+	    !damageClip(&rect, dx, dy, d->width + dx, d->height + dy))
+	    continue;
+	widthInBytes = (rect.x2 - rect.x1) * d->bpp;
+	out = d->shadow + rect.x1 * d->bpp + rect.y1 * d->stride;
+	in = d->shadow + (rect.x1 - dx) * d->bpp + (rect.y1 - dy) * d->stride;
+	if (dy < 0) {
+	    for (j = rect.y1; j < rect.y2; j++, out += d->stride, in += d->stride)
+		memmove(out, in, widthInBytes);
+	} else {
+	    out += d->stride * (rect.y2 - rect.y1 - 1);
+	    in += d->stride * (rect.y2 - rect.y1 - 1);
+	    for (j = rect.y2 - 1; j >= rect.y1; j--, out -= d->stride, in -= d->stride)
+		memmove(out, in, widthInBytes);
+	}
+    }
+    sraRgnReleaseIterator(i);
+}
+
+uint64_t
+rfbDamageHash(const char *p, int len, uint64_t seed)
+{
+    uint64_t h1 = 0x9e3779b97f4a7c15ULL ^ seed, h2 = (uint64_t)len, w1, w2;
+
+    /* two independent lanes, so the multiplications overlap */
+    while (len >= 16) {
+	memcpy(&w1, p, 8);
+	memcpy(&w2, p + 8, 8);
+	h1 = (h1 ^ w1) * 0xff51afd7ed558ccdULL;
+	h2 = (h2 ^ w2) * 0xc4ceb9fe1a85ec53ULL;
+	h1 ^= h1 >> 29;
+	h2 ^= h2 >> 29;
+	p += 16;
+	len -= 16;
+    }
+    while (len > 0) {
+	h1 = (h1 ^ (unsigned char)*p++) * 0x100000001b3ULL;
+	len--;
+    }
+    h1 ^= h2 * 0x9e3779b97f4a7c15ULL;
+    return h1 ^ (h1 >> 32);
+}
+
+/* The column range of stripe s of the hashed rectangle. */
+static void
+damageStripe(const sraRect *rect, int s, int *x1, int *x2)
+{
+    *x1 = rect->x1 + s * DAMAGE_MOVE_STRIPE;
+    *x2 = *x1 + DAMAGE_MOVE_STRIPE;
+    if (*x2 > rect->x2)
+	*x2 = rect->x2;
+}
+
+static void
+damageHashChunk(void *data, int index)
+{
+    rfbDamageHashJob *job = (rfbDamageHashJob *)data;
+    rfbDamageDetector *d = job->d;
+    const sraRect *rect = job->rect;
+    int rows = rect->y2 - rect->y1, stripes = d->moveStripes, s, x1, x2;
+    int k = (int)((long)rows * index / job->chunks);
+    int end = (int)((long)rows * (index + 1) / job->chunks);
+    const char *fb, *sh;
+
+    for (; k < end; k++) {
+	fb = job->screen->frameBuffer + (rect->y1 + k) * job->screen->paddedWidthInBytes;
+	sh = d->shadow + (rect->y1 + k) * d->stride;
+	for (s = 0; s < stripes; s++) {
+	    damageStripe(rect, s, &x1, &x2);
+	    d->fbHash[s * rows + k] = rfbDamageHash(fb + x1 * d->bpp, (x2 - x1) * d->bpp, 0);
+	    d->shadowHash[s * rows + k] = rfbDamageHash(sh + x1 * d->bpp, (x2 - x1) * d->bpp, 0);
+	}
+    }
+}
+
+static rfbBool
+damageMoveBuffers(rfbDamageDetector *d, int rows, int stripes)
+{
+    int tableSize = 64;
+
+    while (tableSize < 2 * rows)
+	tableSize *= 2;
+    if (rows * stripes > d->moveHashes) {
+	uint64_t *fbHash = (uint64_t *)realloc(d->fbHash, rows * stripes * sizeof(uint64_t));
+	uint64_t *shadowHash;
+
+	if (fbHash)
+	    d->fbHash = fbHash;
+	shadowHash = (uint64_t *)realloc(d->shadowHash, rows * stripes * sizeof(uint64_t));
+	if (shadowHash)
+	    d->shadowHash = shadowHash;
+	if (!fbHash || !shadowHash)
+	    return FALSE;
+	d->moveHashes = rows * stripes;
+    }
+    if (rows > d->moveRows) {
+	int *votes = (int *)realloc(d->moveVotes, 2 * rows * sizeof(int));
+
+	if (!votes)
+	    return FALSE;
+	d->moveVotes = votes;
+	d->moveRows = rows;
+    }
+    if (tableSize > d->moveTableSize) {
+	int *table = (int *)realloc(d->moveTable, tableSize * sizeof(int));
+
+	if (!table)
+	    return FALSE;
+	d->moveTable = table;
+	d->moveTableSize = tableSize;
+    }
+    return TRUE;
+}
+
+/* The distance most changed rows of the hashed rectangle moved by, or 0.
+   Per stripe, a table maps shadow row hashes to row + 1, negated when the
+   hash is found on more than one row, like the blank lines of a terminal;
+   rows that changed vote for where they came from. */
+static int
+damageBestShift(rfbDamageDetector *d, int rows)
+{
+    int mask = d->moveTableSize - 1, k, s, slot, v, best = 0;
+    const uint64_t *fbHash, *shadowHash;
+
+    memset(d->moveVotes, 0, 2 * rows * sizeof(int));
+    for (s = 0; s < d->moveStripes; s++) {
+	fbHash = d->fbHash + s * rows;
+	shadowHash = d->shadowHash + s * rows;
+
+	memset(d->moveTable, 0, d->moveTableSize * sizeof(int));
+	for (k = 0; k < rows; k++) {
+	    for (slot = (int)(shadowHash[k] & mask); (v = d->moveTable[slot]) != 0;
+		 slot = (slot + 1) & mask)
+		if (shadowHash[(v < 0 ? -v : v) - 1] == shadowHash[k])
+		    break;
+	    if (v == 0)
+		d->moveTable[slot] = k + 1;
+	    else if (v > 0)
+		d->moveTable[slot] = -v;
+	}
+
+	for (k = 0; k < rows; k++) {
+	    if (fbHash[k] == shadowHash[k])
+		continue;
+	    for (slot = (int)(fbHash[k] & mask); (v = d->moveTable[slot]) != 0;
+		 slot = (slot + 1) & mask)
+		if (shadowHash[(v < 0 ? -v : v) - 1] == fbHash[k])
+		    break;
+	    if (v > 0)
+		d->moveVotes[k - (v - 1) + rows]++;
+	}
+    }
+
+    for (k = 1; k < 2 * rows; k++)
+	if (d->moveVotes[k] > d->moveVotes[best])
+	    best = k;
+    if (d->moveVotes[best] < DAMAGE_MOVE_MIN_ROWS)
+	return 0;
+    return best - rows;
+}
+
+/* Add the runs of rows in each stripe of the hashed rectangle that are the
+   shadow's rows moved by dy to *moved. A run has to be long enough and to
+   contain rows that changed. */
+static void
+damageAddRuns(rfbScreenInfoPtr screen, rfbDamageDetector *d, const sraRect *rect,
+              int dy, sraRegionPtr *moved)
+{
+    int rows = rect->y2 - rect->y1, first = dy > 0 ? dy : 0, last = dy < 0 ? rows + dy : rows;
+    int k, s, x1, x2, start, changed;
+    const uint64_t *fbHash, *shadowHash;
+    rfbBool match;
+    sraRegionPtr run;
+
+    for (s = 0; s < d->moveStripes; s++) {
+	fbHash = d->fbHash + s * rows;
+	shadowHash = d->shadowHash + s * rows;
+	damageStripe(rect, s, &x1, &x2);
+	start = -1;
+	changed = 0;
+	for (k = first; k <= last; k++) {
+	    match = k < last && fbHash[k] == shadowHash[k - dy] &&
+		!damageDiffers(screen->frameBuffer + (rect->y1 + k) * screen->paddedWidthInBytes +
+			       x1 * d->bpp,
+			       d->shadow + (rect->y1 + k - dy) * d->stride + x1 * d->bpp,
+			       (x2 - x1) * d->bpp);
+	    if (match) {
+		if (start < 0) {
+		    start = k;
+		    changed = 0;
+		}
+		if (fbHash[k] != shadowHash[k])
+		    changed++;
+		continue;
+	    }
+	    if (start >= 0 && changed > 0 && k - start >= DAMAGE_MOVE_MIN_ROWS) {
+		run = sraRgnCreateRect(x1, rect->y1 + start, x2, rect->y1 + k);
+		if (!*moved) {
+		    *moved = run;
+		} else {
+		    sraRgnOr(*moved, run);
+		    sraRgnDestroy(run);
+		}
+	    }
+	    start = -1;
+	}
+    }
+}
+
+/* Look for content of the marked area that moved vertically. All moves
+   found have the same dy, as a client can only have one copy pending. */
+static sraRegionPtr
+damageFindMove(rfbScreenInfoPtr screen, rfbDamageDetector *d, sraRegionPtr region, int *dy)
+{
+    sraRectangleIterator *i;
+    sraRect rect;
+    sraRegionPtr moved = NULL;
+    rfbDamageHashJob job;
+    int shift, rows;
+
+    *dy = 0;
+    job.screen = screen;
+    job.d = d;
+    job.rect = &rect;
+    i = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(i, &rect)) {
+	if (!damageClip(&rect, 0, 0, d->width, d->height) ||
+	    rect.x2 - rect.x1 < DAMAGE_TILE || rect.y2 - rect.y1 < 2 * DAMAGE_MOVE_MIN_ROWS)
+	    continue;
+	rows = rect.y2 - rect.y1;
+	d->moveStripes = (rect.x2 - rect.x1 + DAMAGE_MOVE_STRIPE - 1) / DAMAGE_MOVE_STRIPE;
+	if (!damageMoveBuffers(d, rows, d->moveStripes)) {
+	    rfbErr("rfbDamageDetect: out of memory\n");
+	    break;
+	}
+
+	job.chunks = 1;
+	if (d->workers && (uint64_t)(rect.x2 - rect.x1) * rows * d->bpp >= DAMAGE_PARALLEL_BYTES / 2)
+	    job.chunks = rfbWorkerPoolSize(d->workers) + 1;
+	rfbWorkerPoolRun(job.chunks > 1 ? d->workers : NULL, damageHashChunk, &job, job.chunks);
+
+	shift = damageBestShift(d, rows);
+	if (shift == 0 || (moved && shift != *dy))
+	    continue;
+	damageAddRuns(screen, d, &rect, shift, &moved);
+	if (moved)
+	    *dy = shift;
+    }
+    sraRgnReleaseIterator(i);
+    return moved;
+}
+
+sraRegionPtr
+rfbDamageDetect(rfbScreenInfoPtr screen, sraRegionPtr region,
+                sraRegionPtr *moved, int *dy)
+{
+    rfbDamageDetector *d = screen->damageDetector;
+    sraRectangleIterator *i;
+    sraRect rect;
+    sraRegionPtr changed;
+    rfbDamageScan scan;
+    rfbDamageRow *row;
+    uint64_t bytes = 0;
+    int nRows = 0, nChunks = 1, c, y;
+
+    *moved = NULL;
+    *dy = 0;
+    LOCK(d->mutex);
+
+    if (d->stale || d->width != screen->width || d->height != screen->height ||
+	d->bpp != screen->serverFormat.bitsPerPixel / 8) {
+	/* nothing to compare with yet */
+	damageRefresh(screen, d);
+	UNLOCK(d->mutex);
+	return sraRgnCreateRgn(region);
+    }
+
+    if (screen->detectMoves && (*moved = damageFindMove(screen, d, region, dy))) {
+	/* the clients will do the same copy before the rest is compared */
+	damageCopy(d, *moved, 0, *dy);
+	i = sraRgnGetIterator(*moved);
+	while (sraRgnIteratorNext(i, &rect))
+	    screen->damageBytesMoved += (uint64_t)(rect.x2 - rect.x1) * (rect.y2 - rect.y1) * d->bpp;
+	sraRgnReleaseIterator(i);
+    }
+
+    i = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(i, &rect)) {
+	if (!damageClip(&rect, 0, 0, screen->width, screen->height))
+	    continue;
+	for (y = rect.y1; y < rect.y2; y = (y / DAMAGE_TILE + 1) * DAMAGE_TILE) {
+	    if (nRows == d->rowsSize) {
+		int size = d->rowsSize ? d->rowsSize * 2 : 256;
+		rfbDamageRow *rows = (rfbDamageRow *)realloc(d->rows, size * sizeof(rfbDamageRow));
+		if (!rows) {
+		    rfbErr("rfbDamageDetect: out of memory\n");
+		    sraRgnReleaseIterator(i);
+		    UNLOCK(d->mutex);
+		    return sraRgnCreateRgn(region);
+		}
+		d->rows = rows;
+		d->rowsSize = size;
+	    }
+	    row = &d->rows[nRows++];
+	    row->x1 = rect.x1;
+	    row->x2 = rect.x2;
+	    row->y1 = y;
+	    row->y2 = (y / DAMAGE_TILE + 1) * DAMAGE_TILE;
+	    if (row->y2 > rect.y2)
+		row->y2 = rect.y2;
+	    bytes += (uint64_t)(row->x2 - row->x1) * (row->y2 - row->y1) * d->bpp;
+	}
+    }
+    sraRgnReleaseIterator(i);
+
+    if (d->workers && bytes >= DAMAGE_PARALLEL_BYTES)
+	nChunks = nRows < d->maxChunks ? nRows : d->maxChunks;
+    for (c = 0; c < nChunks; c++) {
+	d->chunks[c].first = (int)((long)nRows * c / nChunks);
+	d->chunks[c].count = (int)((long)nRows * (c + 1) / nChunks) - d->chunks[c].first;
+	d->chunks[c].tileChanged = d->tileChanged + c * d->tilesPerChunk;
+	d->chunks[c].changed = NULL;
+	d->chunks[c].scanned = d->chunks[c].changedBytes = 0;
+    }
+
+    scan.screen = screen;
+    scan.d = d;
+    rfbWorkerPoolRun(nChunks > 1 ? d->workers : NULL, damageScanChunk, &scan, nChunks);
+
+    /* the chunks are in y order, so this mostly appends */
+    changed = NULL;
+    for (c = 0; c < nChunks; c++) {
+	rfbDamageChunk *chunk = &d->chunks[c];
+	screen->damageBytesScanned += chunk->scanned;
+	screen->damageBytesChanged += chunk->changedBytes;
+	if (!chunk->changed)
+	    continue;
+	if (!changed) {
+	    changed = chunk->changed;
+	} else {
+	    sraRgnOr(changed, chunk->changed);
+	    sraRgnDestroy(chunk->changed);
+	}
+    }
+
+    UNLOCK(d->mutex);
+    return changed;
+}
+
+void
+rfbDamageCopyRegion(rfbScreenInfoPtr screen, sraRegionPtr region, int dx, int dy)
+{
+    rfbDamageDetector *d = screen->damageDetector;
+
+    if (!d)
+	return;
+
+    LOCK(d->mutex);
+    if (!d->stale)
+	damageCopy(d, region, dx, dy);
+    UNLOCK(d->mutex);
+}
@@ -0,0 +1,48 @@
+/*
+ * damage.h - private interface to the shadow framebuffer damage detector.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef RFB_DAMAGE_H
+#define RFB_DAMAGE_H
+
+#include <rfb/rfb.h>
+
+/* Set up screen->damageDetector if screen->detectDamage asks for one. */
+void rfbDamageInit(rfbScreenInfoPtr screen);
+void rfbDamageCleanup(rfbScreenInfoPtr screen);
+
+/* Return the part of region where the framebuffer differs from the shadow
+   copy, in tiles clipped to region, and bring the shadow up to date there.
+   NULL means nothing changed. With screen->detectMoves, *moved may return
+   rows that are the shadow's content moved by *dy; they have to be
+   scheduled as a copy before the returned region is marked as modified. */
+sraRegionPtr rfbDamageDetect(rfbScreenInfoPtr screen, sraRegionPtr region,
+                             sraRegionPtr *moved, int *dy);
+
+/* Apply a copy the framebuffer went through to the shadow as well. */
+void rfbDamageCopyRegion(rfbScreenInfoPtr screen, sraRegionPtr region, int dx, int dy);
+
+/* The framebuffer was replaced; everything counts as changed once. */
+void rfbDamageReset(rfbScreenInfoPtr screen);
+
+/* A 64 bit hash of len bytes; chain rows by passing the last hash as seed. */
+uint64_t rfbDamageHash(const char *p, int len, uint64_t seed);
+
+#endif
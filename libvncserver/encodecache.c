@@ -0,0 +1,522 @@
+/*
+ * encodecache.c - share encoded rectangles between clients.
+ *
+ * When many viewers with the same pixel format and encoding settings watch
+ * one screen, each damaged rectangle would be encoded once per client. The
+ * cache keeps the bytes the first client got for a rectangle and hands them
+ * to the others, until the framebuffer changes under that rectangle.
+ *
+ * Only encodings that can be decoded without state left over from earlier
+ * rectangles are shared: Raw, RRE, CoRRE, Hextile, Ultra and TRLE, plus Tight
+ * and TightPng, which reset their zlib streams on every rectangle while the
+ * cache is in use (see tightResetStreams). Zlib, ZRLE and ZYWRLE keep one
+ * zlib stream per client which the protocol offers no way to reset.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+#include "encodecache.h"
+
+#define ENCODE_CACHE_BUCKETS 1024
+/* Entries are also filed under every band of 32 scan lines they cover, so
+   an invalidation only looks at entries in the bands it touches. Bands
+   further down wrap around. */
+#define ENCODE_CACHE_ROW_SHIFT 5
+#define ENCODE_CACHE_ROWS 64
+
+/* Everything the encoded bytes of a rectangle depend on, apart from the
+   pixels. Unused members stay zero so keys can be compared with memcmp(). */
+typedef struct {
+    int x, y, w, h;
+    uint32_t encoding;
+    rfbPixelFormat format;
+    int compressLevel, qualityLevel, subsampLevel;
+    int maxWidth, maxHeight;
+    rfbBool lastRect;
+} rfbEncodeCacheKey;
+
+typedef struct rfbEncodeCacheRowLink {
+    struct rfbEncodeCacheEntry *entry;
+    struct rfbEncodeCacheRowLink *prev, *next;
+} rfbEncodeCacheRowLink;
+
+typedef struct rfbEncodeCacheEntry {
+    rfbEncodeCacheKey key;
+    uint32_t hash;
+    struct rfbEncodeCacheEntry *hashNext;
+    /* one link per band, at most ENCODE_CACHE_ROWS */
+    rfbEncodeCacheRowLink *rows;
+    int numRows;
+    /* LRU list, most recently used first */
+    struct rfbEncodeCacheEntry *prev, *next;
+    /* clients sending this entry right now */
+    int refCount;
+    rfbBool unlinked;
+    int len;
+    char *data;
+} rfbEncodeCacheEntry;
+
+typedef struct rfbEncodeCache rfbEncodeCache;
+
+struct rfbEncodeCache {
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+    MUTEX(mutex);
+#endif
+    /* bumped by every invalidation; a rectangle is only stored if nothing
+       changed while it was being encoded */
+    unsigned long generation;
+    rfbEncodeCacheEntry *buckets[ENCODE_CACHE_BUCKETS];
+    rfbEncodeCacheRowLink *rows[ENCODE_CACHE_ROWS];
+    rfbEncodeCacheEntry *head, *tail;
+    size_t bytes, maxBytes, maxEntryBytes;
+    unsigned long hits, misses;
+};
+
+/* The bytes one client produces for a rectangle, see rfbSendUpdateBuf(). */
+typedef struct rfbEncodeCapture {
+    char *data;
+    int len, size;
+    /* start of the rectangle's bytes in updateBuf */
+    int start;
+    int limit;
+    rfbBool overflow;
+} rfbEncodeCapture;
+
+void
+rfbEncodeCacheInit(rfbScreenInfoPtr screen)
+{
+    rfbEncodeCache *cache;
+
+    if (screen->encodeCacheSize <= 0 || screen->encodeCache)
+	return;
+
+    cache = (rfbEncodeCache *)calloc(sizeof(rfbEncodeCache), 1);
+    if (!cache) {
+	rfbErr("rfbEncodeCacheInit: out of memory\n");
+	return;
+    }
+    cache->maxBytes = screen->encodeCacheSize;
+    /* a single full screen update must not push out everything else */
+    cache->maxEntryBytes = cache->maxBytes / 2;
+    INIT_MUTEX(cache->mutex);
+    screen->encodeCache = cache;
+}
+
+static void
+entryFree(rfbEncodeCacheEntry *e)
+{
+    free(e->rows);
+    free(e->data);
+    free(e);
+}
+
+static int
+encodeCacheRow(int y)
+{
+    return (y >> ENCODE_CACHE_ROW_SHIFT) % ENCODE_CACHE_ROWS;
+}
+
+/* Number of bands from y1 to y2, each counted once. */
+static int
+encodeCacheRowCount(int y1, int y2)
+{
+    int n = ((y2 - 1) >> ENCODE_CACHE_ROW_SHIFT) -
+	(y1 >> ENCODE_CACHE_ROW_SHIFT) + 1;
+
+    return n < ENCODE_CACHE_ROWS ? n : ENCODE_CACHE_ROWS;
+}
+
+/* Take an entry out of the cache; called with the mutex held. */
+static void
+entryUnlink(rfbEncodeCache *cache, rfbEncodeCacheEntry *e)
+{
+    rfbEncodeCacheEntry **p = &cache->buckets[e->hash % ENCODE_CACHE_BUCKETS];
+    int i;
+
+    while (*p != e)
+	p = &(*p)->hashNext;
+    *p = e->hashNext;
+
+    for (i = 0; i < e->numRows; i++) {
+	rfbEncodeCacheRowLink *link = &e->rows[i];
+	if (link->prev)
+	    link->prev->next = link->next;
+	else
+	    cache->rows[(encodeCacheRow(e->key.y) + i) % ENCODE_CACHE_ROWS] =
+		link->next;
+	if (link->next)
+	    link->next->prev = link->prev;
+    }
+
+    if (e->prev)
+	e->prev->next = e->next;
+    else
+	cache->head = e->next;
+    if (e->next)
+	e->next->prev = e->prev;
+    else
+	cache->tail = e->prev;
+
+    cache->bytes -= e->len;
+
+    if (e->refCount == 0)
+	entryFree(e);
+    else
+	e->unlinked = TRUE;
+}
+
+void
+rfbEncodeCacheCleanup(rfbScreenInfoPtr screen)
+{
+    rfbEncodeCache *cache = screen->encodeCache;
+
+    if (!cache)
+	return;
+
+    if (cache->hits + cache->misses > 0)
+	rfbLog("Encoded rectangle cache: %lu hits, %lu misses\n",
+	       cache->hits, cache->misses);
+
+    while (cache->head)
+	entryUnlink(cache, cache->head);
+
+    TINI_MUTEX(cache->mutex);
+    free(cache);
+    screen->encodeCache = NULL;
+}
+
+static rfbBool
+encodeCacheKey(rfbClientPtr cl, int x, int y, int w, int h,
+               rfbEncodeCacheKey *key)
+{
+    memset(key, 0, sizeof(*key));
+
+    switch (cl->preferredEncoding) {
+    case -1:
+    case rfbEncodingRaw:
+	key->encoding = rfbEncodingRaw;
+	break;
+    case rfbEncodingRRE:
+    case rfbEncodingHextile:
+    case rfbEncodingUltra:
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    case rfbEncodingTRLE:
+#endif
+	key->encoding = cl->preferredEncoding;
+	break;
+    case rfbEncodingCoRRE:
+	key->encoding = rfbEncodingCoRRE;
+	key->maxWidth = cl->correMaxWidth;
+	key->maxHeight = cl->correMaxHeight;
+	break;
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
+    case rfbEncodingTight:
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+    case rfbEncodingTightPng:
+#endif
+	/* the JPEG quality follows the client's link, and what went out
+	   lossy has to be noted for that client */
+	if (cl->screen->adaptiveTight && cl->turboQualityLevel != -1)
+	    return FALSE;
+	key->encoding = cl->preferredEncoding;
+	key->compressLevel = cl->tightCompressLevel;
+	key->qualityLevel = cl->turboQualityLevel;
+	key->subsampLevel = cl->turboSubsampLevel;
+	/* decides how large rectangles are split up */
+	key->lastRect = cl->enableLastRectEncoding;
+	break;
+#endif
+    default:
+	return FALSE;
+    }
+
+    key->x = x;
+    key->y = y;
+    key->w = w;
+    key->h = h;
+    key->format = cl->format;
+    key->format.pad1 = 0;
+    key->format.pad2 = 0;
+    return TRUE;
+}
+
+static uint32_t
+encodeCacheHash(const rfbEncodeCacheKey *key)
+{
+    const unsigned char *p = (const unsigned char *)key;
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < sizeof(*key); i++)
+	hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+}
+
+/* Called with the mutex held. */
+static rfbEncodeCacheEntry *
+encodeCacheFind(rfbEncodeCache *cache, const rfbEncodeCacheKey *key,
+                uint32_t hash)
+{
+    rfbEncodeCacheEntry *e;
+
+    for (e = cache->buckets[hash % ENCODE_CACHE_BUCKETS]; e; e = e->hashNext)
+	if (e->hash == hash && memcmp(&e->key, key, sizeof(*key)) == 0)
+	    return e;
+    return NULL;
+}
+
+static void
+captureAppend(rfbEncodeCapture *capture, const char *buf, int len)
+{
+    if (capture->overflow || len <= 0)
+	return;
+
+    if (capture->len + len > capture->limit) {
+	capture->overflow = TRUE;
+	return;
+    }
+    if (capture->len + len > capture->size) {
+	int size = capture->size ? capture->size : UPDATE_BUF_SIZE;
+	char *data;
+	while (size < capture->len + len)
+	    size *= 2;
+	data = (char *)realloc(capture->data, size);
+	if (!data) {
+	    capture->overflow = TRUE;
+	    return;
+	}
+	capture->data = data;
+	capture->size = size;
+    }
+    memcpy(capture->data + capture->len, buf, len);
+    capture->len += len;
+}
+
+void
+rfbEncodeCacheCapture(rfbClientPtr cl)
+{
+    rfbEncodeCapture *capture = cl->encodeCapture;
+
+    captureAppend(capture, cl->updateBuf + capture->start,
+		  cl->ublen - capture->start);
+    capture->start = 0;
+}
+
+void
+rfbEncodeCacheCaptureData(rfbClientPtr cl, const char *buf, int len)
+{
+    captureAppend(cl->encodeCapture, buf, len);
+}
+
+/* Like an encoder would, but with bytes someone else encoded. */
+static rfbBool
+sendCached(rfbClientPtr cl, rfbEncodeCacheEntry *e)
+{
+    if (cl->ublen + e->len > UPDATE_BUF_SIZE) {
+	if (!rfbSendUpdateData(cl, e->data, e->len))
+	    return FALSE;
+    } else {
+	memcpy(cl->updateBuf + cl->ublen, e->data, e->len);
+	cl->ublen += e->len;
+    }
+
+    rfbStatRecordEncodingSent(cl, e->key.encoding, e->len,
+			      sz_rfbFramebufferUpdateRectHeader +
+			      e->key.w * e->key.h * (cl->format.bitsPerPixel / 8));
+    return TRUE;
+}
+
+rfbBool
+rfbEncodeCacheSendRect(rfbClientPtr cl, int x, int y, int w, int h,
+                       rfbEncodeRectProc encode)
+{
+    rfbEncodeCache *cache = cl->screen->encodeCache;
+    rfbEncodeCacheKey key;
+    rfbEncodeCacheEntry *e;
+    rfbEncodeCapture capture;
+    unsigned long generation;
+    uint32_t hash;
+    int i, row;
+    rfbBool result;
+
+    /* colour maps on either side, scaling and a composited cursor are not
+       part of the key */
+    if (!cache || !cl->format.trueColour ||
+	!cl->screen->serverFormat.trueColour || cl->screen != cl->scaledScreen ||
+	rfbCursorOverlayCovers(cl, x, y, w, h) ||
+	!encodeCacheKey(cl, x, y, w, h, &key))
+	return encode(cl, x, y, w, h);
+
+    /* From now on the client may get Tight rectangles another client's
+       zlib streams produced, so its own have to start over each time. */
+    cl->tightResetStreams = TRUE;
+
+    hash = encodeCacheHash(&key);
+
+    LOCK(cache->mutex);
+    e = encodeCacheFind(cache, &key, hash);
+    if (e) {
+	cache->hits++;
+	e->refCount++;
+	if (e != cache->head) {
+	    e->prev->next = e->next;
+	    if (e->next)
+		e->next->prev = e->prev;
+	    else
+		cache->tail = e->prev;
+	    e->prev = NULL;
+	    e->next = cache->head;
+	    cache->head->prev = e;
+	    cache->head = e;
+	}
+    } else
+	cache->misses++;
+    generation = cache->generation;
+    UNLOCK(cache->mutex);
+
+    if (e) {
+	/* the socket write may block, so do not hold the mutex */
+	result = sendCached(cl, e);
+	LOCK(cache->mutex);
+	if (--e->refCount == 0 && e->unlinked)
+	    entryFree(e);
+	UNLOCK(cache->mutex);
+	return result;
+    }
+
+    memset(&capture, 0, sizeof(capture));
+    capture.start = cl->ublen;
+    capture.limit = (int)cache->maxEntryBytes;
+    cl->encodeCapture = &capture;
+    result = encode(cl, x, y, w, h);
+    cl->encodeCapture = NULL;
+
+    if (result)
+	captureAppend(&capture, cl->updateBuf + capture.start,
+		      cl->ublen - capture.start);
+
+    if (!result || capture.overflow || capture.len == 0) {
+	free(capture.data);
+	return result;
+    }
+
+    e = (rfbEncodeCacheEntry *)calloc(sizeof(rfbEncodeCacheEntry), 1);
+    if (!e) {
+	free(capture.data);
+	return result;
+    }
+    memcpy(&e->key, &key, sizeof(key));
+    e->hash = hash;
+    e->len = capture.len;
+    e->data = capture.data;
+    e->numRows = encodeCacheRowCount(y, y + h);
+    e->rows = (rfbEncodeCacheRowLink *)calloc(sizeof(rfbEncodeCacheRowLink),
+					       e->numRows);
+    if (!e->rows) {
+	entryFree(e);
+	return result;
+    }
+
+    LOCK(cache->mutex);
+    if (generation != cache->generation ||
+	encodeCacheFind(cache, &key, hash)) {
+	/* stale already, or somebody was quicker */
+	UNLOCK(cache->mutex);
+	entryFree(e);
+	return result;
+    }
+    e->hashNext = cache->buckets[hash % ENCODE_CACHE_BUCKETS];
+    cache->buckets[hash % ENCODE_CACHE_BUCKETS] = e;
+    for (i = 0, row = encodeCacheRow(y); i < e->numRows;
+	 i++, row = (row + 1) % ENCODE_CACHE_ROWS) {
+	e->rows[i].entry = e;
+	e->rows[i].next = cache->rows[row];
+	if (cache->rows[row])
+	    cache->rows[row]->prev = &e->rows[i];
+	cache->rows[row] = &e->rows[i];
+    }
+    e->next = cache->head;
+    if (cache->head)
+	cache->head->prev = e;
+    else
+	cache->tail = e;
+    cache->head = e;
+    cache->bytes += e->len;
+    while (cache->bytes > cache->maxBytes && cache->tail != e)
+	entryUnlink(cache, cache->tail);
+    UNLOCK(cache->mutex);
+
+    return result;
+}
+
+void
+rfbEncodeCacheInvalidate(rfbScreenInfoPtr screen, sraRegionPtr region)
+{
+    rfbEncodeCache *cache = screen->encodeCache;
+    rfbEncodeCacheRowLink *link, *next;
+    rfbEncodeCacheEntry *e;
+    sraRectangleIterator *i;
+    sraRect rect;
+    int row, n;
+
+    if (!cache)
+	return;
+
+    LOCK(cache->mutex);
+    cache->generation++;
+    if (!region) {
+	while (cache->head)
+	    entryUnlink(cache, cache->head);
+    } else if (cache->head) {
+	i = sraRgnGetIterator(region);
+	while (sraRgnIteratorNext(i, &rect) && cache->head) {
+	    /* an entry has at most one link per band, so unlinking it
+	       leaves next alone */
+	    for (row = encodeCacheRow(rect.y1),
+		     n = encodeCacheRowCount(rect.y1, rect.y2); n > 0;
+		 row = (row + 1) % ENCODE_CACHE_ROWS, n--) {
+		for (link = cache->rows[row]; link; link = next) {
+		    next = link->next;
+		    e = link->entry;
+		    if (e->key.x < rect.x2 && rect.x1 < e->key.x + e->key.w &&
+			e->key.y < rect.y2 && rect.y1 < e->key.y + e->key.h)
+			entryUnlink(cache, e);
+		}
+	    }
+	}
+	sraRgnReleaseIterator(i);
+    }
+    UNLOCK(cache->mutex);
+}
+
+void
+rfbEncodeCacheInvalidateRect(rfbScreenInfoPtr screen,
+                             int x1, int y1, int x2, int y2)
+{
+    sraRegionPtr region;
+
+    if (!screen->encodeCache)
+	return;
+
+    region = sraRgnCreateRect(x1, y1, x2, y2);
+    rfbEncodeCacheInvalidate(screen, region);
+    sraRgnDestroy(region);
+}
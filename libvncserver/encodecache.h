@@ -0,0 +1,51 @@
+/*
+ * encodecache.h - private interface to the shared encoded rectangle cache.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef RFB_ENCODECACHE_H
+#define RFB_ENCODECACHE_H
+
+#include <rfb/rfb.h>
+
+typedef rfbBool (*rfbEncodeRectProc)(rfbClientPtr cl, int x, int y, int w, int h);
+
+/* Set up screen->encodeCache if screen->encodeCacheSize asks for one. */
+void rfbEncodeCacheInit(rfbScreenInfoPtr screen);
+void rfbEncodeCacheCleanup(rfbScreenInfoPtr screen);
+
+/* Send one rectangle of a framebuffer update. If another client with the
+   same pixel format and encoding parameters already got this rectangle and
+   the framebuffer has not changed there since, its bytes are sent again;
+   otherwise encode() runs and its output is kept for the next client. */
+rfbBool rfbEncodeCacheSendRect(rfbClientPtr cl, int x, int y, int w, int h,
+                               rfbEncodeRectProc encode);
+
+/* Forget everything that overlaps a change of the framebuffer; a NULL
+   region drops the whole cache. */
+void rfbEncodeCacheInvalidate(rfbScreenInfoPtr screen, sraRegionPtr region);
+void rfbEncodeCacheInvalidateRect(rfbScreenInfoPtr screen,
+                                  int x1, int y1, int x2, int y2);
+
+/* Called by rfbSendUpdateBuf() before updateBuf goes out, and by
+   rfbSendUpdateData() for data sent around it. */
+void rfbEncodeCacheCapture(rfbClientPtr cl);
+void rfbEncodeCacheCaptureData(rfbClientPtr cl, const char *buf, int len);
+
+#endif
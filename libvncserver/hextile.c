@@ -26,6 +26,7 @@
  */
 
 #include <rfb/rfb.h>
+#include "private.h"
 
 static rfbBool sendHextiles8(rfbClientPtr cl, int x, int y, int w, int h);
 static rfbBool sendHextiles16(rfbClientPtr cl, int x, int y, int w, int h);
@@ -64,6 +65,23 @@ rfbSendRectEncodingHextile(rfbClientPtr cl,
           sz_rfbFramebufferUpdateRectHeader,
           sz_rfbFramebufferUpdateRectHeader + w * (cl->format.bitsPerPixel / 8) * h);
 
+    return rfbSendHextiles(cl, x, y, w, h);
+}
+
+
+/*
+ * rfbSendHextiles - send the tiles of a rectangle whose header went out
+ * already. The first tile specifies its colours, so tiles of the same
+ * rectangle can be encoded apart, 16 rows at a time.
+ */
+
+rfbBool
+rfbSendHextiles(rfbClientPtr cl,
+                int x,
+                int y,
+                int w,
+                int h)
+{
     switch (cl->format.bitsPerPixel) {
     case 8:
         return sendHextiles8(cl, x, y, w, h);
@@ -58,6 +58,7 @@
 #endif
 
 #include "sockets.h"
+#include "rfbpoll.h"
 
 #ifdef USE_LIBWRAP
 #include <tcpd.h>
@@ -111,6 +112,7 @@ rfbHttpInitSockets(rfbScreenInfoPtr rfbScreen)
     }
     rfbLog("Listening for HTTP connections on TCP port %d\n", rfbScreen->httpPort);
     rfbLog("  URL http://%s:%d\n",rfbScreen->thisHost,rfbScreen->httpPort);
+    rfbPollAddSocket(rfbScreen, rfbScreen->httpListenSock, NULL);
 
 #ifdef LIBVNCSERVER_IPv6
     if (rfbScreen->http6Port == 0) {
@@ -124,25 +126,26 @@ rfbHttpInitSockets(rfbScreenInfoPtr rfbScreen)
     }
     rfbLog("Listening for HTTP connections on TCP6 port %d\n", rfbScreen->http6Port);
     rfbLog("  URL http://%s:%d\n",rfbScreen->thisHost,rfbScreen->http6Port);
+    rfbPollAddSocket(rfbScreen, rfbScreen->httpListen6Sock, NULL);
 #endif
 }
 
 void rfbHttpShutdownSockets(rfbScreenInfoPtr rfbScreen) {
     if(rfbScreen->httpSock>-1) {
+	rfbPollRemoveSocket(rfbScreen, rfbScreen->httpSock);
 	rfbCloseSocket(rfbScreen->httpSock);
-	FD_CLR(rfbScreen->httpSock,&rfbScreen->allFds);
 	rfbScreen->httpSock=RFB_INVALID_SOCKET;
     }
 
     if(rfbScreen->httpListenSock>-1) {
+	rfbPollRemoveSocket(rfbScreen, rfbScreen->httpListenSock);
 	rfbCloseSocket(rfbScreen->httpListenSock);
-	FD_CLR(rfbScreen->httpListenSock,&rfbScreen->allFds);
 	rfbScreen->httpListenSock=RFB_INVALID_SOCKET;
     }
 
     if(rfbScreen->httpListen6Sock>-1) {
+	rfbPollRemoveSocket(rfbScreen, rfbScreen->httpListen6Sock);
 	rfbCloseSocket(rfbScreen->httpListen6Sock);
-	FD_CLR(rfbScreen->httpListen6Sock,&rfbScreen->allFds);
 	rfbScreen->httpListen6Sock=RFB_INVALID_SOCKET;
     }
 }
@@ -155,9 +158,7 @@ void rfbHttpShutdownSockets(rfbScreenInfoPtr rfbScreen) {
 void
 rfbHttpCheckFds(rfbScreenInfoPtr rfbScreen)
 {
-    int nfds;
-    fd_set fds;
-    struct timeval tv;
+    rfbSocket listenSock = RFB_INVALID_SOCKET;
 #ifdef LIBVNCSERVER_IPv6
     struct sockaddr_storage addr;
 #else
@@ -171,47 +172,26 @@ rfbHttpCheckFds(rfbScreenInfoPtr rfbScreen)
     if (rfbScreen->httpListenSock == RFB_INVALID_SOCKET)
 	return;
 
-    FD_ZERO(&fds);
-    FD_SET(rfbScreen->httpListenSock, &fds);
-    if (rfbScreen->httpListen6Sock != RFB_INVALID_SOCKET) {
-	FD_SET(rfbScreen->httpListen6Sock, &fds);
-    }
-    if (rfbScreen->httpSock != RFB_INVALID_SOCKET) {
-	FD_SET(rfbScreen->httpSock, &fds);
-    }
-    tv.tv_sec = 0;
-    tv.tv_usec = 0;
-    nfds = select(rfbMax(rfbScreen->httpListen6Sock, rfbMax(rfbScreen->httpSock,rfbScreen->httpListenSock)) + 1, &fds, NULL, NULL, &tv);
-    if (nfds == 0) {
-	return;
-    }
-    if (nfds < 0) {
-#ifdef WIN32
-		errno = WSAGetLastError();
-#endif
-	if (errno != EINTR)
-		rfbLogPerror("httpCheckFds: select");
-	return;
-    }
-
-    if ((rfbScreen->httpSock != RFB_INVALID_SOCKET) && FD_ISSET(rfbScreen->httpSock, &fds)) {
+    /* poll the sockets one by one, so their numbers are not limited by
+       FD_SETSIZE */
+    if ((rfbScreen->httpSock != RFB_INVALID_SOCKET) && rfbPollSocket(rfbScreen->httpSock, FALSE, 0) > 0) {
 	httpProcessInput(rfbScreen);
     }
 
-    if (FD_ISSET(rfbScreen->httpListenSock, &fds) || FD_ISSET(rfbScreen->httpListen6Sock, &fds)) {
-	if (rfbScreen->httpSock != RFB_INVALID_SOCKET) rfbCloseSocket(rfbScreen->httpSock);
+    if (rfbPollSocket(rfbScreen->httpListenSock, FALSE, 0) > 0)
+	listenSock = rfbScreen->httpListenSock;
+    else if (rfbScreen->httpListen6Sock != RFB_INVALID_SOCKET && rfbPollSocket(rfbScreen->httpListen6Sock, FALSE, 0) > 0)
+	listenSock = rfbScreen->httpListen6Sock;
 
-	if(FD_ISSET(rfbScreen->httpListenSock, &fds)) {
-	    if ((rfbScreen->httpSock = accept(rfbScreen->httpListenSock, (struct sockaddr *)&addr, &addrlen)) == RFB_INVALID_SOCKET) {
-	      rfbLogPerror("httpCheckFds: accept");
-	      return;
-	    }
+    if (listenSock != RFB_INVALID_SOCKET) {
+	if (rfbScreen->httpSock != RFB_INVALID_SOCKET) {
+	    rfbPollRemoveSocket(rfbScreen, rfbScreen->httpSock);
+	    rfbCloseSocket(rfbScreen->httpSock);
 	}
-	else if(FD_ISSET(rfbScreen->httpListen6Sock, &fds)) {
-	    if ((rfbScreen->httpSock = accept(rfbScreen->httpListen6Sock, (struct sockaddr *)&addr, &addrlen)) == RFB_INVALID_SOCKET) {
-	      rfbLogPerror("httpCheckFds: accept");
-	      return;
-	    }
+
+	if ((rfbScreen->httpSock = accept(listenSock, (struct sockaddr *)&addr, &addrlen)) == RFB_INVALID_SOCKET) {
+	  rfbLogPerror("httpCheckFds: accept");
+	  return;
 	}
 
 #ifdef USE_LIBWRAP
@@ -239,6 +219,7 @@ rfbHttpCheckFds(rfbScreenInfoPtr rfbScreen)
 	    return;
 	}
 	/*AddEnabledDevice(httpSock);*/
+	rfbPollAddSocket(rfbScreen, rfbScreen->httpSock, NULL);
     }
 }
 
@@ -246,6 +227,7 @@ rfbHttpCheckFds(rfbScreenInfoPtr rfbScreen)
 static void
 httpCloseSock(rfbScreenInfoPtr rfbScreen)
 {
+    rfbPollRemoveSocket(rfbScreen, rfbScreen->httpSock);
     rfbCloseSocket(rfbScreen->httpSock);
     rfbScreen->httpSock = RFB_INVALID_SOCKET;
     buf_filled = 0;
@@ -343,6 +325,7 @@ httpProcessInput(rfbScreenInfoPtr rfbScreen)
 	    /* proxy connection */
 	    rfbLog("httpd: client asked for CONNECT\n");
 	    rfbWriteExact(&cl,PROXY_OK_STR,strlen(PROXY_OK_STR));
+	    rfbPollRemoveSocket(rfbScreen, rfbScreen->httpSock);
 	    rfbNewClientConnection(rfbScreen,rfbScreen->httpSock);
 	    rfbScreen->httpSock = RFB_INVALID_SOCKET;
 	    return;
@@ -351,6 +334,7 @@ httpProcessInput(rfbScreenInfoPtr rfbScreen)
 	    /* proxy connection */
 	    rfbLog("httpd: client asked for /proxied.connection\n");
 	    rfbWriteExact(&cl,PROXY_OK_STR,strlen(PROXY_OK_STR));
+	    rfbPollRemoveSocket(rfbScreen, rfbScreen->httpSock);
 	    rfbNewClientConnection(rfbScreen,rfbScreen->httpSock);
 	    rfbScreen->httpSock = RFB_INVALID_SOCKET;
 	    return;
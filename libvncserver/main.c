@@ -16,6 +16,14 @@
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
 #include "private.h"
+#include "rfbpoll.h"
+#include "workerpool.h"
+#include "encodecache.h"
+#include "translatecache.h"
+#include "scale.h"
+#include "damage.h"
+#include "tilehash.h"
+#include "adaptive.h"
 
 #include <stdarg.h>
 #include <errno.h>
@@ -275,14 +283,21 @@ void rfbLogPerror(const char *str)
 #endif
 }
 
-void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,int dx,int dy)
-{  
+static void rfbScheduleCopyToClients(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,int dx,int dy)
+{
    rfbClientIteratorPtr iterator;
    rfbClientPtr cl;
+   struct timeval now;
+
+   rfbEncodeCacheInvalidate(rfbScreen,copyRegion);
+   rfbTranslateCacheInvalidate(rfbScreen,copyRegion);
+   rfbScaledScreenInvalidate(rfbScreen,copyRegion);
+   gettimeofday(&now,NULL);
 
    iterator=rfbGetClientIterator(rfbScreen);
    while((cl=rfbClientIteratorNext(iterator))) {
      LOCK(cl->updateMutex);
+     cl->lastDamage=now;
      if(cl->useCopyRect) {
        sraRegionPtr modifiedRegionBackup;
        if(!sraRgnEmpty(cl->copyRegion)) {
@@ -362,6 +377,13 @@ void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,in
    }
 
    rfbReleaseClientIterator(iterator);
+   rfbPollScheduleFullScan(rfbScreen);
+}
+
+void rfbScheduleCopyRegion(rfbScreenInfoPtr rfbScreen,sraRegionPtr copyRegion,int dx,int dy)
+{
+   rfbDamageCopyRegion(rfbScreen,copyRegion,dx,dy);
+   rfbScheduleCopyToClients(rfbScreen,copyRegion,dx,dy);
 }
 
 void rfbDoCopyRegion(rfbScreenInfoPtr screen,sraRegionPtr copyRegion,int dx,int dy)
@@ -407,23 +429,56 @@ void rfbScheduleCopyRect(rfbScreenInfoPtr screen,int x1,int y1,int x2,int y2,int
   sraRgnDestroy(region);
 }
 
-void rfbMarkRegionAsModified(rfbScreenInfoPtr screen,sraRegionPtr modRegion)
+static void rfbScheduleModifiedRegion(rfbScreenInfoPtr screen,sraRegionPtr modRegion)
 {
    rfbClientIteratorPtr iterator;
    rfbClientPtr cl;
+   struct timeval now;
+
+   rfbEncodeCacheInvalidate(screen,modRegion);
+   rfbTranslateCacheInvalidate(screen,modRegion);
+   rfbScaledScreenInvalidate(screen,modRegion);
+   gettimeofday(&now,NULL);
 
    iterator=rfbGetClientIterator(screen);
    while((cl=rfbClientIteratorNext(iterator))) {
      LOCK(cl->updateMutex);
+     cl->lastDamage=now;
      sraRgnOr(cl->modifiedRegion,modRegion);
      TSIGNAL(cl->updateCond);
      UNLOCK(cl->updateMutex);
    }
 
    rfbReleaseClientIterator(iterator);
+   rfbPollScheduleFullScan(screen);
+}
+
+/* Pass on only what differs from the damage detector's shadow copy; areas
+   that moved go out as a copy before the rest. */
+static void rfbScheduleDetectedDamage(rfbScreenInfoPtr screen,sraRegionPtr region)
+{
+   sraRegionPtr changed,moved;
+   int dy;
+
+   changed=rfbDamageDetect(screen,region,&moved,&dy);
+   if(moved) {
+     rfbScheduleCopyToClients(screen,moved,0,dy);
+     sraRgnDestroy(moved);
+   }
+   if(changed) {
+     rfbScheduleModifiedRegion(screen,changed);
+     sraRgnDestroy(changed);
+   }
+}
+
+void rfbMarkRegionAsModified(rfbScreenInfoPtr screen,sraRegionPtr modRegion)
+{
+   if(screen->damageDetector)
+     rfbScheduleDetectedDamage(screen,modRegion);
+   else
+     rfbScheduleModifiedRegion(screen,modRegion);
 }
 
-void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2);
 void rfbMarkRectAsModified(rfbScreenInfoPtr screen,int x1,int y1,int x2,int y2)
 {
    sraRegionPtr region;
@@ -439,37 +494,126 @@ void rfbMarkRectAsModified(rfbScreenInfoPtr screen,int x1,int y1,int x2,int y2)
    if(y2>screen->height) y2=screen->height;
    if(y1==y2) return;
 
-   /* update scaled copies for this rectangle */
-   rfbScaledScreenUpdate(screen,x1,y1,x2,y2);
-
    region = sraRgnCreateRect(x1,y1,x2,y2);
-   rfbMarkRegionAsModified(screen,region);
+
+   if(screen->damageDetector)
+     rfbScheduleDetectedDamage(screen,region);
+   else
+     rfbScheduleModifiedRegion(screen,region);
    sraRgnDestroy(region);
 }
 
+static long
+rfbMsSince(struct timeval *then, struct timeval *now)
+{
+  return (now->tv_sec-then->tv_sec)*1000+(now->tv_usec-then->tv_usec)/1000;
+}
+
+/* the number of pixels a pending update covers, counted up to limit+1 */
+static long
+rfbPendingArea(rfbClientPtr cl, long limit)
+{
+  sraRegionPtr region;
+  sraRectangleIterator *i;
+  sraRect rect;
+  long area = 0;
+
+  region = sraRgnCreateRgn(cl->modifiedRegion);
+  sraRgnOr(region,cl->copyRegion);
+  sraRgnAnd(region,cl->requestedRegion);
+  i = sraRgnGetIterator(region);
+  while(area <= limit && sraRgnIteratorNext(i,&rect))
+    area += (long)(rect.x2-rect.x1)*(rect.y2-rect.y1);
+  sraRgnReleaseIterator(i);
+  sraRgnDestroy(region);
+
+  return area;
+}
+
+/*
+ * Decide when a pending framebuffer update goes out. Damage is collected
+ * for at most deferUpdateTime ms after it started piling up, so that a
+ * stream of changes is sent in few updates. Updates of up to
+ * deferUpdateSmallArea pixels go out right away, and so does damage that
+ * stopped coming in deferUpdateQuietTime ms ago.
+ * Returns 0 if the update is due, else the ms after which to ask again.
+ * Call with cl->updateMutex held.
+ */
+
+static int
+rfbUpdateDelay(rfbClientPtr cl)
+{
+  rfbScreenInfoPtr screen = cl->screen;
+  struct timeval now;
+  long elapsed, quiet;
+  int delay;
+
+  if(screen->deferUpdateTime <= 0)
+    return 0;
+
+  gettimeofday(&now,NULL);
+  if(cl->startDeferring.tv_usec == 0) {
+    cl->startDeferring = now;
+    if(cl->startDeferring.tv_usec == 0)
+      cl->startDeferring.tv_usec++;
+  }
+
+  elapsed = rfbMsSince(&cl->startDeferring,&now);
+  quiet = rfbMsSince(&cl->lastDamage,&now);
+  if(elapsed < 0 /* clock went backwards */
+     || elapsed >= screen->deferUpdateTime
+     || (screen->deferUpdateQuietTime > 0 && quiet >= screen->deferUpdateQuietTime)
+     || (screen->deferUpdateSmallArea > 0
+         && rfbPendingArea(cl,screen->deferUpdateSmallArea) <= screen->deferUpdateSmallArea)) {
+    cl->startDeferring.tv_usec = 0;
+    return 0;
+  }
+
+  delay = screen->deferUpdateTime - elapsed;
+  if(screen->deferUpdateQuietTime > 0 && quiet >= 0
+     && screen->deferUpdateQuietTime - quiet < delay)
+    delay = screen->deferUpdateQuietTime - quiet;
+  return delay;
+}
+
 #if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
 
+/* how long clientOutput() waits for a client to take queued output */
+#define SEND_QUEUE_WAIT 100
+
 static THREAD_ROUTINE_RETURN_TYPE
 clientOutput(void *data)
 {
     rfbClientPtr cl = (rfbClientPtr)data;
-    rfbBool haveUpdate;
+    rfbBool haveUpdate, useQueue, full;
     sraRegion* updateRegion;
+    int delay, refine;
 
     while (1) {
-        haveUpdate = false;
+        haveUpdate = FALSE;
+        LOCK(cl->updateMutex);
         while (!haveUpdate) {
 		if (cl->sock == RFB_INVALID_SOCKET) {
 			/* Client has disconnected. */
+			UNLOCK(cl->updateMutex);
 			return THREAD_ROUTINE_RETURN_VALUE;
 		}
 		if (cl->state != RFB_NORMAL || cl->onHold) {
-			/* just sleep until things get normal */
-		        THREAD_SLEEP_MS(cl->screen->deferUpdateTime);
+			/* signalled once things get normal */
+			WAIT(cl->updateCond, cl->updateMutex);
 			continue;
 		}
 
-		LOCK(cl->updateMutex);
+		useQueue = cl->screen->sendQueueSize > 0;
+		if (useQueue && rfbSendQueueLength(cl) > 0) {
+			/* do not encode more while the client is behind */
+			full = rfbSendQueueFull(cl);
+			UNLOCK(cl->updateMutex);
+			rfbFlushSendQueue(cl, full ? SEND_QUEUE_WAIT : 0);
+			LOCK(cl->updateMutex);
+			if (rfbSendQueueFull(cl))
+				continue;
+		}
 
 		if (sraRgnEmpty(cl->requestedRegion)) {
 			; /* always require a FB Update Request (otherwise can crash.) */
@@ -483,21 +627,39 @@ clientOutput(void *data)
 		}
 
 		if (!haveUpdate) {
-			WAIT(cl->updateCond, cl->updateMutex);
+			/* nothing new, maybe time to refine lossy areas */
+			refine = sraRgnEmpty(cl->requestedRegion) ? -1 : rfbAdaptiveRefine(cl);
+			if (refine == 0)
+				continue;
+			if (!useQueue && refine > 0)
+				TIMEDWAIT(cl->updateCond, cl->updateMutex, refine);
+			else if (!useQueue)
+				WAIT(cl->updateCond, cl->updateMutex);
+			else if (rfbSendQueueLength(cl) > 0) {
+				UNLOCK(cl->updateMutex);
+				rfbFlushSendQueue(cl, SEND_QUEUE_WAIT);
+				LOCK(cl->updateMutex);
+			} else
+				/* rfbWriteExact() signals a new queue without
+				   updateMutex, do not miss it for long */
+				TIMEDWAIT(cl->updateCond, cl->updateMutex, SEND_QUEUE_WAIT);
+			continue;
 		}
 
-		UNLOCK(cl->updateMutex);
+		/* To save bandwidth, wait a little while for more updates
+		   to come along, unless the update is due already. New
+		   damage wakes us up to reconsider. */
+		delay = rfbUpdateDelay(cl);
+		if (delay > 0) {
+			TIMEDWAIT(cl->updateCond, cl->updateMutex, delay);
+			haveUpdate = FALSE;
+		}
         }
-        
-        /* OK, now, to save bandwidth, wait a little while for more
-           updates to come along. */
-	THREAD_SLEEP_MS(cl->screen->deferUpdateTime);
 
         /* Now, get the region we're going to update, and remove
            it from cl->modifiedRegion _before_ we send the update.
            That way, if anything that overlaps the region we're sending
            is updated, we'll be sure to do another update later. */
-        LOCK(cl->updateMutex);
 	updateRegion = sraRgnCreateRgn(cl->modifiedRegion);
         UNLOCK(cl->updateMutex);
 
@@ -652,9 +814,12 @@ listenerRun(void *data)
 void 
 rfbStartOnHoldClient(rfbClientPtr cl)
 {
+    LOCK(cl->updateMutex);
     cl->onHold = FALSE;
+    TSIGNAL(cl->updateCond);
+    UNLOCK(cl->updateMutex);
 #ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
-    if(cl->screen->backgroundLoop) {
+    if(cl->screen->backgroundLoop && !cl->screen->backgroundPool) {
 #ifndef WIN32
         if (pipe(cl->pipe_notify_client_thread) == -1) {
             cl->pipe_notify_client_thread[0] = -1;
@@ -665,7 +830,7 @@ rfbStartOnHoldClient(rfbClientPtr cl)
         pthread_create(&cl->client_thread, NULL, clientInput, (void *)cl);
     }
 #elif defined(LIBVNCSERVER_HAVE_WIN32THREADS)
-    if(cl->screen->backgroundLoop) {
+    if(cl->screen->backgroundLoop && !cl->screen->backgroundPool) {
 	cl->client_thread = _beginthread(clientInput, 0, cl);
     }
 #endif
@@ -709,6 +874,7 @@ rfbDefaultPtrAddEvent(int buttonMask, int x, int y, rfbClientPtr cl)
       }
     }
     rfbReleaseClientIterator(iterator);
+    rfbPollScheduleFullScan(s);
   }
 }
 
@@ -950,6 +1116,9 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
    screen->listenInterface = htonl(INADDR_ANY);
 
    screen->deferUpdateTime=5;
+   screen->deferUpdateSmallArea=64*64;
+   screen->deferUpdateQuietTime=2;
+   screen->adaptiveRefineDelay=500;
    screen->maxRectsPerUpdate=50;
 
    screen->handleEventsEagerly = FALSE;
@@ -1011,6 +1180,8 @@ rfbScreenInfoPtr rfbGetScreen(int* argc,char** argv,
    /* initialize client list and iterator mutex */
    rfbClientListInit(screen);
 
+   rfbPollInit(screen);
+
    return(screen);
 }
 
@@ -1052,6 +1223,10 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
   }
 
   screen->frameBuffer = framebuffer;
+  rfbEncodeCacheInvalidate(screen, NULL);
+  rfbTranslateCacheInvalidate(screen, NULL);
+  rfbScaledScreenInvalidate(screen, NULL);
+  rfbDamageReset(screen);
 
   /* Adjust pointer position if necessary */
 
@@ -1073,11 +1248,13 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
        NewFBSize message if supported by this client. */
 
     LOCK(cl->updateMutex);
+    gettimeofday(&cl->lastDamage, NULL);
     sraRgnDestroy(cl->modifiedRegion);
     cl->modifiedRegion = sraRgnCreateRect(0, 0, width, height);
     sraRgnMakeEmpty(cl->copyRegion);
     cl->copyDX = 0;
     cl->copyDY = 0;
+    rfbTileHashInvalidate(cl);
 
     if (cl->useNewFBSize)
       cl->newFBSizePending = TRUE;
@@ -1086,20 +1263,38 @@ void rfbNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
     UNLOCK(cl->updateMutex);
   }
   rfbReleaseClientIterator(iterator);
+  rfbPollScheduleFullScan(screen);
 }
 
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+static void rfbStopBackgroundPool(rfbScreenInfoPtr screen);
+#endif
+
 /* hang up on all clients and free all reserved memory */
 
 void rfbScreenCleanup(rfbScreenInfoPtr screen)
 {
-  rfbClientIteratorPtr i=rfbGetClientIterator(screen);
-  rfbClientPtr cl,cl1=rfbClientIteratorNext(i);
+  rfbClientIteratorPtr i;
+  rfbClientPtr cl,cl1;
+
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+  rfbStopBackgroundPool(screen);
+#endif
+
+  i=rfbGetClientIterator(screen);
+  cl1=rfbClientIteratorNext(i);
   while(cl1) {
     cl=rfbClientIteratorNext(i);
     rfbClientConnectionGone(cl1);
     cl1=cl;
   }
   rfbReleaseClientIterator(i);
+
+  rfbPollCleanup(screen);
+  rfbEncodeCacheCleanup(screen);
+  rfbTranslateCacheCleanup(screen);
+  rfbDamageCleanup(screen);
+  rfbWorkerPoolDestroy(screen->encodePool);
     
 #define FREE_IF(x) if(screen->x) free(screen->x)
   FREE_IF(colourMap.data.bytes);
@@ -1110,9 +1305,6 @@ void rfbScreenCleanup(rfbScreenInfoPtr screen)
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
   rfbZlibCleanup(screen);
-#ifdef LIBVNCSERVER_HAVE_LIBJPEG
-  rfbTightCleanup(screen);
-#endif
 
   /* free all 'scaled' versions of this screen */
   while (screen->scaledScreenNext!=NULL)
@@ -1120,8 +1312,7 @@ void rfbScreenCleanup(rfbScreenInfoPtr screen)
       rfbScreenInfoPtr ptr;
       ptr = screen->scaledScreenNext;
       screen->scaledScreenNext = ptr->scaledScreenNext;
-      free(ptr->frameBuffer);
-      free(ptr);
+      rfbScaledScreenFree(ptr);
   }
 
 #endif
@@ -1132,6 +1323,15 @@ void rfbInitServer(rfbScreenInfoPtr screen)
 {
   rfbInitSockets(screen);
   rfbHttpInitSockets(screen);
+  rfbEncodeCacheInit(screen);
+  rfbTranslateCacheInit(screen);
+  rfbDamageInit(screen);
+  if(screen->encodeThreads != 0 && !screen->encodePool) {
+    int threads = screen->encodeThreads > 0 ? screen->encodeThreads : rfbWorkerPoolDefaultSize();
+    /* the thread sending an update does its share of the encoding */
+    if(threads > 1)
+      screen->encodePool = rfbWorkerPoolCreate(threads - 1);
+  }
 #ifndef WIN32
   if(screen->ignoreSIGPIPE)
     signal(SIGPIPE,SIG_IGN);
@@ -1139,6 +1339,11 @@ void rfbInitServer(rfbScreenInfoPtr screen)
 }
 
 void rfbShutdownServer(rfbScreenInfoPtr screen,rfbBool disconnectClients) {
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+  /* the pool threads are gone afterwards, clients are freed right here */
+  rfbStopBackgroundPool(screen);
+#endif
+
   if(disconnectClients) {
     rfbClientIteratorPtr iter = rfbGetClientIterator(screen);
     rfbClientPtr nextCl, currentCl = rfbClientIteratorNext(iter);
@@ -1191,89 +1396,486 @@ static void gettimeofday(struct timeval* tv,char* dummy)
 }
 #endif
 
-rfbBool
-rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
+/*
+ * A client stays on the pending list of the event backend as long as
+ * rfbUpdateClient() has to come back to it without any new input.
+ */
+
+static rfbBool
+rfbClientHasPendingWork(rfbClientPtr cl)
+{
+  return cl->startDeferring.tv_usec != 0
+    || (!cl->onHold && !sraRgnEmpty(cl->requestedRegion) && rfbAdaptiveRefinePending(cl))
+    || (cl->screen->sendQueueSize > 0 && rfbSendQueueLength(cl) > 0)
+    || (!cl->viewOnly && cl->lastPtrX >= 0)
+    || (cl->fileTransfer.fd != -1 && cl->fileTransfer.sending == 1)
+    || (!cl->onHold && FB_UPDATE_PENDING(cl) && !sraRgnEmpty(cl->requestedRegion));
+}
+
+/* Send the updates that are due; returns TRUE if any client had one pending. */
+
+static rfbBool
+rfbServeClients(rfbScreenInfoPtr screen)
 {
   rfbClientIteratorPtr i;
   rfbClientPtr cl,clPrev;
+  rfbClientPtr *pending;
+  int n, pendingCount;
   rfbBool result=FALSE;
   extern rfbClientIteratorPtr
     rfbGetClientIteratorWithClosed(rfbScreenInfoPtr rfbScreen);
 
+  if(rfbPollBeginSweep(screen,&pending,&pendingCount)) {
+    /* the screen changed, every client may have something to send */
+    i = rfbGetClientIteratorWithClosed(screen);
+    cl=rfbClientIteratorHead(i);
+    while(cl) {
+      result = rfbUpdateClient(cl);
+      clPrev=cl;
+      cl=rfbClientIteratorNext(i);
+      if(clPrev->sock==RFB_INVALID_SOCKET) {
+        rfbClientConnectionGone(clPrev);
+        result=TRUE;
+      } else if(rfbClientHasPendingWork(clPrev))
+        rfbPollMarkClient(screen,clPrev);
+    }
+    rfbReleaseClientIterator(i);
+  } else {
+    /* only clients with input or unfinished work; entries are NULLed
+       if a client goes away meanwhile */
+    for(n=0;n<pendingCount;n++) {
+      cl=pending[n];
+      if(!cl)
+        continue;
+      result = rfbUpdateClient(cl);
+      if(cl->sock==RFB_INVALID_SOCKET) {
+        rfbClientConnectionGone(cl);
+        result=TRUE;
+      } else if(rfbClientHasPendingWork(cl))
+        rfbPollMarkClient(screen,cl);
+    }
+  }
+  rfbPollEndSweep(screen);
+
+  return result;
+}
+
+rfbBool
+rfbProcessEvents(rfbScreenInfoPtr screen,long usec)
+{
+  rfbBool result;
+  int wakeup;
+
   if(usec<0)
     usec=screen->deferUpdateTime*1000;
 
+  /* Changes made since the last call may be due right away; don't let
+     them wait for the sockets. */
+  result = rfbServeClients(screen);
+
+  /* do not sleep past the first deferred update */
+  wakeup = rfbPollNextWakeup(screen);
+  if(wakeup >= 0 && wakeup*1000L < usec)
+    usec = wakeup*1000L;
+
   rfbCheckFds(screen,usec);
   rfbHttpCheckFds(screen);
 
-  i = rfbGetClientIteratorWithClosed(screen);
-  cl=rfbClientIteratorHead(i);
-  while(cl) {
-    result = rfbUpdateClient(cl);
-    clPrev=cl;
-    cl=rfbClientIteratorNext(i);
-    if(clPrev->sock==RFB_INVALID_SOCKET) {
-      rfbClientConnectionGone(clPrev);
-      result=TRUE;
-    }
-  }
-  rfbReleaseClientIterator(i);
+  if(rfbServeClients(screen))
+    result = TRUE;
 
   return result;
 }
 
+/*
+ * Returns TRUE once deferTime ms have passed since the deferral was
+ * started by the first call; *start is reset then.
+ */
+
+static rfbBool
+rfbDeferralElapsed(struct timeval *start, int deferTime)
+{
+  struct timeval tv;
+
+  if(start->tv_usec == 0) {
+    gettimeofday(start,NULL);
+    if(start->tv_usec == 0)
+      start->tv_usec++;
+    return FALSE;
+  }
+
+  gettimeofday(&tv,NULL);
+  if(tv.tv_sec < start->tv_sec /* at midnight */
+     || ((tv.tv_sec-start->tv_sec)*1000
+         +(tv.tv_usec-start->tv_usec)/1000)
+       > deferTime) {
+    start->tv_usec = 0;
+    return TRUE;
+  }
+  return FALSE;
+}
+
+/*
+ * With adaptiveTight, a client that is waiting for an update while nothing
+ * changes gets the areas it was sent lossy again once the damage stopped.
+ * Call with cl->updateMutex held.
+ */
+
+static void
+rfbScheduleRefinement(rfbClientPtr cl)
+{
+  int delay;
+
+  if (cl->sock == RFB_INVALID_SOCKET || cl->onHold || FB_UPDATE_PENDING(cl)
+      || sraRgnEmpty(cl->requestedRegion))
+    return;
+  delay = rfbAdaptiveRefine(cl);
+  if (delay > 0)
+    rfbPollWakeup(cl->screen, delay);
+}
+
 rfbBool
 rfbUpdateClient(rfbClientPtr cl)
 {
-  struct timeval tv;
   rfbBool result=FALSE;
   rfbScreenInfoPtr screen = cl->screen;
 
+  int delay;
+
+  if (screen->sendQueueSize > 0 && cl->sock != RFB_INVALID_SOCKET)
+      rfbFlushSendQueue(cl,0);
+
+  if (cl->adaptive) {
+      LOCK(cl->updateMutex);
+      rfbScheduleRefinement(cl);
+      UNLOCK(cl->updateMutex);
+  }
+
   if (cl->sock != RFB_INVALID_SOCKET && !cl->onHold && FB_UPDATE_PENDING(cl) &&
         !sraRgnEmpty(cl->requestedRegion)) {
       result=TRUE;
-      if(screen->deferUpdateTime == 0) {
-          rfbSendFramebufferUpdate(cl,cl->modifiedRegion);
-      } else if(cl->startDeferring.tv_usec == 0) {
-        gettimeofday(&cl->startDeferring,NULL);
-        if(cl->startDeferring.tv_usec == 0)
-          cl->startDeferring.tv_usec++;
-      } else {
-        gettimeofday(&tv,NULL);
-        if(tv.tv_sec < cl->startDeferring.tv_sec /* at midnight */
-           || ((tv.tv_sec-cl->startDeferring.tv_sec)*1000
-               +(tv.tv_usec-cl->startDeferring.tv_usec)/1000)
-             > screen->deferUpdateTime) {
-          cl->startDeferring.tv_usec = 0;
-          rfbSendFramebufferUpdate(cl,cl->modifiedRegion);
-        }
+      /* a client that is behind gets its damage once the socket drains */
+      if (!rfbSendQueueFull(cl)) {
+          LOCK(cl->updateMutex);
+          delay = rfbUpdateDelay(cl);
+          UNLOCK(cl->updateMutex);
+          if(delay == 0)
+              rfbSendFramebufferUpdate(cl,cl->modifiedRegion);
+          else
+              rfbPollWakeup(screen,delay);
       }
     }
 
+  if (screen->sendQueueSize > 0 && cl->sock != RFB_INVALID_SOCKET)
+      rfbPollSetOutputInterest(screen,cl,rfbSendQueueLength(cl) > 0);
+
     if (!cl->viewOnly && cl->lastPtrX >= 0) {
-      if(cl->startPtrDeferring.tv_usec == 0) {
-        gettimeofday(&cl->startPtrDeferring,NULL);
-        if(cl->startPtrDeferring.tv_usec == 0)
-          cl->startPtrDeferring.tv_usec++;
-      } else {
-        struct timeval tv;
-        gettimeofday(&tv,NULL);
-        if(tv.tv_sec < cl->startPtrDeferring.tv_sec /* at midnight */
-           || ((tv.tv_sec-cl->startPtrDeferring.tv_sec)*1000
-           +(tv.tv_usec-cl->startPtrDeferring.tv_usec)/1000)
-           > cl->screen->deferPtrUpdateTime) {
-          cl->startPtrDeferring.tv_usec = 0;
-          cl->screen->ptrAddEvent(cl->lastPtrButtons,
-                                  cl->lastPtrX,
-                                  cl->lastPtrY, cl);
-          cl->lastPtrX = -1;
-        }
-      }
+      if (rfbDeferralElapsed(&cl->startPtrDeferring,screen->deferPtrUpdateTime)) {
+        screen->ptrAddEvent(cl->lastPtrButtons,
+                            cl->lastPtrX,
+                            cl->lastPtrY, cl);
+        cl->lastPtrX = -1;
+      } else
+        rfbPollWakeup(screen,screen->deferPtrUpdateTime);
     }
 
     return result;
 }
 
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+
+/*
+ * Worker pool background mode: a single dispatcher thread waits for socket
+ * events and decides when updates are due, all per-client work is queued
+ * on a pool of backgroundWorkers threads. A client has at most one task in
+ * flight, its socket is not watched meanwhile.
+ */
+
+#define POOL_TASK_INPUT   1
+#define POOL_TASK_UPDATE  2
+#define POOL_TASK_POINTER 4
+#define POOL_TASK_FILE    8
+
+struct rfbBackgroundPool {
+    rfbWorkerPool *workers;
+    volatile rfbBool stop;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    pthread_t dispatcher;
+#else
+    uintptr_t dispatcher;
+#endif
+};
+
+typedef struct {
+    rfbClientPtr cl;
+    int what;
+} rfbPoolTask;
+
+static void
+poolClientTask(void *data)
+{
+    rfbPoolTask *task = (rfbPoolTask *)data;
+    rfbClientPtr cl = task->cl;
+    rfbScreenInfoPtr screen = cl->screen;
+    sraRegion* updateRegion;
+
+    if ((task->what & POOL_TASK_INPUT) && cl->sock != RFB_INVALID_SOCKET) {
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+        do {
+            rfbProcessClientMessage(cl);
+        } while (cl->sock != RFB_INVALID_SOCKET && webSocketsHasDataInBuffer(cl));
+#else
+        rfbProcessClientMessage(cl);
+#endif
+    }
+
+    if ((task->what & POOL_TASK_POINTER) && cl->lastPtrX >= 0) {
+        screen->ptrAddEvent(cl->lastPtrButtons, cl->lastPtrX, cl->lastPtrY, cl);
+        cl->lastPtrX = -1;
+    }
+
+    if ((task->what & POOL_TASK_UPDATE) && cl->sock != RFB_INVALID_SOCKET) {
+        /* same as clientOutput() */
+        LOCK(cl->updateMutex);
+        updateRegion = sraRgnCreateRgn(cl->modifiedRegion);
+        UNLOCK(cl->updateMutex);
+
+        LOCK(cl->sendMutex);
+        rfbSendFramebufferUpdate(cl, updateRegion);
+        UNLOCK(cl->sendMutex);
+
+        sraRgnDestroy(updateRegion);
+    }
+
+    if ((task->what & POOL_TASK_FILE) && cl->sock != RFB_INVALID_SOCKET)
+        rfbSendFileTransferChunk(cl);
+
+    LOCK(cl->updateMutex);
+    cl->workerBusy = FALSE;
+    UNLOCK(cl->updateMutex);
+
+    if (cl->sock != RFB_INVALID_SOCKET) {
+        rfbPollSetInterest(screen, cl, TRUE);
+        rfbPollMarkClient(screen, cl);
+    } else {
+        /* let the dispatcher reap it */
+        rfbPollScheduleFullScan(screen);
+    }
+
+    rfbDecrClientRef(cl);
+    free(task);
+}
+
+static void
+poolSubmit(rfbClientPtr cl, int what)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+    rfbPoolTask *task;
+
+    LOCK(cl->updateMutex);
+    if (cl->workerBusy) {
+        UNLOCK(cl->updateMutex);
+        return;
+    }
+    cl->workerBusy = TRUE;
+    UNLOCK(cl->updateMutex);
+
+    task = (rfbPoolTask *)malloc(sizeof(rfbPoolTask));
+    if (task) {
+        task->cl = cl;
+        task->what = what;
+        rfbPollSetInterest(screen, cl, FALSE);
+        rfbIncrClientRef(cl);
+        if (rfbWorkerPoolSubmit(screen->backgroundPool->workers, poolClientTask, task))
+            return;
+        rfbDecrClientRef(cl);
+        rfbPollSetInterest(screen, cl, TRUE);
+        free(task);
+    }
+
+    LOCK(cl->updateMutex);
+    cl->workerBusy = FALSE;
+    UNLOCK(cl->updateMutex);
+    rfbPollMarkClient(screen, cl);
+}
+
+/*
+ * Pool mode counterpart of rfbUpdateClient(): queue whatever is due.
+ * Returns TRUE if the client is closed and can be freed.
+ */
+
+static rfbBool
+poolServeClient(rfbClientPtr cl)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+    rfbBool busy;
+    int what = 0, delay;
+
+    /* nothing else writes while no task is in flight; queued output is
+       written right here, it never blocks */
+    LOCK(cl->updateMutex);
+    busy = cl->workerBusy;
+    UNLOCK(cl->updateMutex);
+    if (!busy && screen->sendQueueSize > 0 && cl->sock != RFB_INVALID_SOCKET)
+        rfbFlushSendQueue(cl, 0);
+
+    LOCK(cl->updateMutex);
+    busy = cl->workerBusy;
+    if (!busy && cl->adaptive)
+        rfbScheduleRefinement(cl);
+    if (!busy && cl->sock != RFB_INVALID_SOCKET && !cl->onHold && FB_UPDATE_PENDING(cl) &&
+        !sraRgnEmpty(cl->requestedRegion) && !rfbSendQueueFull(cl)) {
+        delay = rfbUpdateDelay(cl);
+        if (delay == 0)
+            what |= POOL_TASK_UPDATE;
+        else
+            rfbPollWakeup(screen, delay);
+    }
+    UNLOCK(cl->updateMutex);
+
+    if (busy)
+        return FALSE; /* the task re-queues the client when done */
+
+    if (cl->sock == RFB_INVALID_SOCKET)
+        return TRUE;
+
+    if (screen->sendQueueSize > 0)
+        rfbPollSetOutputInterest(screen, cl, rfbSendQueueLength(cl) > 0);
+
+    if (!cl->viewOnly && cl->lastPtrX >= 0) {
+        if (rfbDeferralElapsed(&cl->startPtrDeferring,screen->deferPtrUpdateTime))
+            what |= POOL_TASK_POINTER;
+        else
+            rfbPollWakeup(screen, screen->deferPtrUpdateTime);
+    }
+
+    if (screen->permitFileTransfer && cl->fileTransfer.fd != -1 && cl->fileTransfer.sending == 1)
+        what |= POOL_TASK_FILE;
+
+    if (what)
+        poolSubmit(cl, what);
+    else if (rfbClientHasPendingWork(cl))
+        rfbPollMarkClient(screen, cl);
+
+    return FALSE;
+}
+
+static THREAD_ROUTINE_RETURN_TYPE
+poolDispatcherRun(void *data)
+{
+    rfbScreenInfoPtr screen=(rfbScreenInfoPtr)data;
+    struct rfbBackgroundPool *bg = screen->backgroundPool;
+    rfbClientIteratorPtr i;
+    rfbClientPtr cl,clPrev;
+    rfbClientPtr *pending;
+    rfbPollEvent *events;
+    int n, nfds, pendingCount, wakeup;
+    long usec;
+    extern rfbClientIteratorPtr
+      rfbGetClientIteratorWithClosed(rfbScreenInfoPtr rfbScreen);
+
+    while (!bg->stop) {
+        /* wake up at least every deferUpdateTime to look for damage, and
+           in time for the first deferred update */
+        usec = screen->deferUpdateTime > 0 ? screen->deferUpdateTime*1000 : 1000;
+        wakeup = rfbPollNextWakeup(screen);
+        if (wakeup >= 0 && wakeup*1000L < usec)
+            usec = wakeup*1000L;
+        nfds = rfbPollWait(screen, usec, &events);
+        if (nfds < 0 && errno != EINTR) {
+            rfbLogPerror("poolDispatcherRun: wait");
+            THREAD_SLEEP_MS(100);
+        }
+
+        for (n = 0; n < nfds; n++) {
+            cl = events[n].cl;
+            if (cl == NULL) {
+                if (events[n].sock == screen->listenSock || events[n].sock == screen->listen6Sock)
+                    rfbProcessNewConnection(screen);
+                else
+                    rfbHttpCheckFds(screen);
+                continue;
+            }
+            if (cl->onHold || cl->sock == RFB_INVALID_SOCKET)
+                continue;
+            if (events[n].ready & RFB_POLL_READ)
+                poolSubmit(cl, POOL_TASK_INPUT);
+            else
+                rfbPollMarkClient(screen, cl); /* room for queued output */
+        }
+
+        if (rfbPollBeginSweep(screen,&pending,&pendingCount)) {
+            i = rfbGetClientIteratorWithClosed(screen);
+            cl=rfbClientIteratorHead(i);
+            while(cl) {
+                rfbBool gone = poolServeClient(cl);
+                clPrev=cl;
+                cl=rfbClientIteratorNext(i);
+                if(gone)
+                    rfbClientConnectionGone(clPrev);
+            }
+            rfbReleaseClientIterator(i);
+        } else {
+            for (n = 0; n < pendingCount; n++)
+                if (pending[n] && poolServeClient(pending[n]))
+                    rfbClientConnectionGone(pending[n]);
+        }
+        rfbPollEndSweep(screen);
+    }
+
+    return THREAD_ROUTINE_RETURN_VALUE;
+}
+
+static rfbBool
+rfbStartBackgroundPool(rfbScreenInfoPtr screen)
+{
+    struct rfbBackgroundPool *bg;
+
+    bg = (struct rfbBackgroundPool *)calloc(sizeof(struct rfbBackgroundPool), 1);
+    if (!bg)
+        return FALSE;
+    bg->workers = rfbWorkerPoolCreate(screen->backgroundWorkers);
+    if (!bg->workers) {
+        free(bg);
+        return FALSE;
+    }
+    rfbLog("Serving clients from a pool of %d worker threads\n", rfbWorkerPoolSize(bg->workers));
+
+    screen->backgroundLoop = TRUE;
+    screen->backgroundPool = bg;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    if (pthread_create(&bg->dispatcher, NULL, poolDispatcherRun, screen) != 0) {
+#else
+    if ((bg->dispatcher = _beginthread(poolDispatcherRun, 0, screen)) == (uintptr_t)-1) {
+#endif
+        screen->backgroundPool = NULL;
+        rfbWorkerPoolDestroy(bg->workers);
+        free(bg);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+rfbStopBackgroundPool(rfbScreenInfoPtr screen)
+{
+    struct rfbBackgroundPool *bg = screen->backgroundPool;
+
+    if (!bg)
+        return;
+
+    bg->stop = TRUE;
+    THREAD_JOIN(bg->dispatcher);
+    /* runs the tasks still queued */
+    rfbWorkerPoolDestroy(bg->workers);
+    free(bg);
+    screen->backgroundPool = NULL;
+    /* clients are handled like in the foreground from now on */
+    screen->backgroundLoop = FALSE;
+}
+
+#endif
+
 rfbBool rfbIsActive(rfbScreenInfoPtr screenInfo) {
   return screenInfo->socketState!=RFB_SOCKET_SHUTDOWN || screenInfo->clientHead!=NULL;
 }
@@ -1281,6 +1883,10 @@ rfbBool rfbIsActive(rfbScreenInfoPtr screenInfo) {
 void rfbRunEventLoop(rfbScreenInfoPtr screen, long usec, rfbBool runInBackground)
 {
   if(runInBackground) {
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+       if(screen->backgroundWorkers != 0 && rfbStartBackgroundPool(screen))
+	 return;
+#endif
 #ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
        pthread_t listener_thread;
 
@@ -0,0 +1,445 @@
+/*
+ * parallelrects.c - encode the rectangles of an update on the encode pool.
+ *
+ * Raw, RRE, CoRRE, Hextile and Ultra encode every rectangle on its own,
+ * so with rfbScreenInfo::encodePool the rectangles of an update can be
+ * encoded at the same time. Each task encodes through a shadow of the
+ * client: an rfbClientRec with the client's pixel format and encoding
+ * settings whose rfbSendUpdateBuf() appends to a buffer of the task
+ * instead of writing. The buffers are sent in order once the batch is
+ * done, so the client gets the rectangles the update announced.
+ *
+ * Large rectangles are split into horizontal stripes. CoRRE and Ultra
+ * split rectangles into ones of a few rows anyway, and stripes on those
+ * boundaries encode to the same bytes. Raw and Hextile stripes are the
+ * rows or tiles of one rectangle whose header is sent before the first
+ * of them. RRE rectangles are not split, and neither is anything while
+ * the encoded rectangle cache is in use, whose entries are rectangles.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "private.h"
+#include "parallelrects.h"
+#include "workerpool.h"
+
+/* Tasks per thread in a batch, and about as many stripes per thread for
+   a rectangle large enough. */
+#define PARALLEL_TASKS_PER_THREAD 4
+
+/* Fewer pixels than this are not worth a task of their own. */
+#define PARALLEL_MIN_PIXELS (64 * 64 * 4)
+
+enum {
+    /* a rectangle in the client's preferred encoding */
+    TASK_RECT,
+    /* rows of a Raw rectangle, or tiles of a Hextile one */
+    TASK_RAW_ROWS,
+    TASK_HEXTILES
+};
+
+typedef struct rfbParallelTask {
+    int kind;
+    int x, y, w, h;
+    /* the whole rectangle if its header goes out before this stripe */
+    rfbBool header;
+    int rectW, rectH;
+    rfbClientPtr shadow;
+    char *buf;
+    int len, size;
+    rfbBool result;
+} rfbParallelTask;
+
+typedef struct rfbParallelRects {
+    rfbClientPtr cl;
+    rfbEncodeRectProc encode;
+    rfbParallelTask **tasks;
+    int maxTasks;
+    int nTasks;
+} rfbParallelRects;
+
+static char *
+taskReserve(rfbParallelTask *task, int len)
+{
+    if (task->len + len > task->size) {
+	int size = task->size ? task->size : UPDATE_BUF_SIZE;
+	char *buf;
+	while (size < task->len + len)
+	    size *= 2;
+	buf = (char *)realloc(task->buf, size);
+	if (!buf) {
+	    rfbErr("rfbParallelRects: out of memory\n");
+	    return NULL;
+	}
+	task->buf = buf;
+	task->size = size;
+    }
+    return task->buf + task->len;
+}
+
+rfbBool
+rfbParallelRectsAppend(rfbClientPtr cl, const char *buf, int len)
+{
+    rfbParallelTask *task = cl->parallelTask;
+    char *dst;
+
+    if (len <= 0)
+	return TRUE;
+    if (!(dst = taskReserve(task, len)))
+	return FALSE;
+    memcpy(dst, buf, len);
+    task->len += len;
+    return TRUE;
+}
+
+static rfbBool
+translateRows(rfbParallelTask *task)
+{
+    rfbClientPtr cl = task->shadow;
+    int bytesPerLine = task->w * (cl->format.bitsPerPixel / 8);
+    char *fbptr = (cl->scaledScreen->frameBuffer
+		   + (cl->scaledScreen->paddedWidthInBytes * task->y)
+		   + (task->x * (cl->scaledScreen->bitsPerPixel / 8)));
+    char *dst = taskReserve(task, bytesPerLine * task->h);
+
+    if (!dst)
+	return FALSE;
+    (*cl->translateFn)(cl->translateLookupTable, &(cl->screen->serverFormat),
+		       &cl->format, fbptr, dst,
+		       cl->scaledScreen->paddedWidthInBytes, task->w, task->h);
+    task->len += bytesPerLine * task->h;
+    return TRUE;
+}
+
+static void
+parallelTask(void *data, int index)
+{
+    rfbParallelRects *p = (rfbParallelRects *)data;
+    rfbParallelTask *task = p->tasks[index];
+    rfbClientPtr shadow = task->shadow;
+
+    task->len = 0;
+    shadow->ublen = 0;
+    switch (task->kind) {
+    case TASK_RAW_ROWS:
+	task->result = translateRows(task);
+	return;
+    case TASK_HEXTILES:
+	task->result = rfbSendHextiles(shadow, task->x, task->y, task->w, task->h);
+	break;
+    default:
+	if (shadow->screen->encodeCache)
+	    task->result = rfbEncodeCacheSendRect(shadow, task->x, task->y,
+						  task->w, task->h, p->encode);
+	else
+	    task->result = p->encode(shadow, task->x, task->y, task->w, task->h);
+    }
+    if (task->result)
+	task->result = rfbSendUpdateBuf(shadow);
+}
+
+/* The header of a Raw or Hextile rectangle sent in stripes, with the
+   statistics the encoder would have recorded for it. */
+static rfbBool
+sendHeader(rfbClientPtr cl, rfbParallelTask *task)
+{
+    rfbFramebufferUpdateRectHeader rect;
+    int encoding = task->kind == TASK_HEXTILES ? rfbEncodingHextile : rfbEncodingRaw;
+    int rawBytes = task->rectW * (cl->format.bitsPerPixel / 8) * task->rectH;
+
+    if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE) {
+	if (!rfbSendUpdateBuf(cl))
+	    return FALSE;
+    }
+
+    rect.r.x = Swap16IfLE(task->x);
+    rect.r.y = Swap16IfLE(task->y);
+    rect.r.w = Swap16IfLE(task->rectW);
+    rect.r.h = Swap16IfLE(task->rectH);
+    rect.encoding = Swap32IfLE(encoding);
+
+    memcpy(&cl->updateBuf[cl->ublen], (char *)&rect,
+	   sz_rfbFramebufferUpdateRectHeader);
+    cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+
+    if (encoding == rfbEncodingRaw)
+	rfbStatRecordEncodingSent(cl, rfbEncodingRaw,
+				  sz_rfbFramebufferUpdateRectHeader + rawBytes,
+				  sz_rfbFramebufferUpdateRectHeader + rawBytes);
+    else
+	rfbStatRecordEncodingSent(cl, rfbEncodingHextile,
+				  sz_rfbFramebufferUpdateRectHeader,
+				  sz_rfbFramebufferUpdateRectHeader + rawBytes);
+    return TRUE;
+}
+
+/* Encode the queued tasks, then send their output in order. */
+static rfbBool
+flushTasks(rfbParallelRects *p)
+{
+    rfbClientPtr cl = p->cl;
+    rfbParallelTask *task;
+    rfbBool result = TRUE;
+    int i;
+
+    rfbWorkerPoolRun(p->nTasks > 1 ? cl->screen->encodePool : NULL,
+		     parallelTask, p, p->nTasks);
+
+    for (i = 0; i < p->nTasks; i++) {
+	task = p->tasks[i];
+	rfbStatMoveEncodingsSent(cl, task->shadow);
+	if (!result)
+	    continue;
+	if (!task->result) {
+	    result = FALSE;
+	    continue;
+	}
+	if (task->header && !sendHeader(cl, task)) {
+	    result = FALSE;
+	    continue;
+	}
+	if (cl->ublen + task->len > UPDATE_BUF_SIZE) {
+	    if (!rfbSendUpdateData(cl, task->buf, task->len))
+		result = FALSE;
+	} else {
+	    memcpy(cl->updateBuf + cl->ublen, task->buf, task->len);
+	    cl->ublen += task->len;
+	}
+    }
+    p->nTasks = 0;
+    return result;
+}
+
+static void
+freeShadow(rfbClientPtr shadow)
+{
+    if (!shadow)
+	return;
+    rfbFreeUltraData(shadow);
+    free(shadow->beforeEncBuf);
+    free(shadow->afterEncBuf);
+    rfbResetStats(shadow);
+    free(shadow);
+}
+
+static rfbParallelRects *
+getParallelRects(rfbClientPtr cl)
+{
+    rfbParallelRects *p = cl->parallelRects;
+    rfbParallelTask *task;
+    int i, maxTasks;
+
+    if (p)
+	return p;
+
+    maxTasks = PARALLEL_TASKS_PER_THREAD *
+	(rfbWorkerPoolSize(cl->screen->encodePool) + 1);
+    p = (rfbParallelRects *)calloc(sizeof(rfbParallelRects), 1);
+    if (p)
+	p->tasks = (rfbParallelTask **)calloc(sizeof(rfbParallelTask *), maxTasks);
+    if (!p || !p->tasks) {
+	free(p);
+	return NULL;
+    }
+    p->cl = cl;
+    for (i = 0; i < maxTasks; i++) {
+	task = (rfbParallelTask *)calloc(sizeof(rfbParallelTask), 1);
+	if (task)
+	    task->shadow = (rfbClientPtr)calloc(sizeof(rfbClientRec), 1);
+	if (!task || !task->shadow) {
+	    /* use as many as there are */
+	    free(task);
+	    break;
+	}
+	task->shadow->sock = RFB_INVALID_SOCKET;
+	task->shadow->parallelTask = task;
+	p->tasks[i] = task;
+    }
+    p->maxTasks = i;
+    cl->parallelRects = p;
+    return p;
+}
+
+void
+rfbParallelRectsFree(rfbClientPtr cl)
+{
+    rfbParallelRects *p = cl->parallelRects;
+    int i;
+
+    if (!p)
+	return;
+    for (i = 0; i < p->maxTasks; i++) {
+	freeShadow(p->tasks[i]->shadow);
+	free(p->tasks[i]->buf);
+	free(p->tasks[i]);
+    }
+    free(p->tasks);
+    free(p);
+    cl->parallelRects = NULL;
+}
+
+rfbBool
+rfbParallelRectsBegin(rfbClientPtr cl, sraRegionPtr region,
+		      rfbEncodeRectProc encode)
+{
+    rfbParallelRects *p;
+    rfbClientPtr shadow;
+    sraRectangleIterator *i;
+    sraRect rect;
+    long pixels = 0;
+    int t;
+
+    if (!cl->screen->encodePool)
+	return FALSE;
+
+    switch (cl->preferredEncoding) {
+    case -1:
+    case rfbEncodingRaw:
+	/* sent straight from the framebuffer then */
+	if (cl->translateFn == rfbTranslateNone)
+	    return FALSE;
+	break;
+    case rfbEncodingRRE:
+    case rfbEncodingCoRRE:
+    case rfbEncodingHextile:
+    case rfbEncodingUltra:
+	break;
+    default:
+	return FALSE;
+    }
+
+    i = sraRgnGetIterator(region);
+    while (pixels < 2 * PARALLEL_MIN_PIXELS && sraRgnIteratorNext(i, &rect))
+	pixels += (long)(rect.x2 - rect.x1) * (rect.y2 - rect.y1);
+    sraRgnReleaseIterator(i);
+    if (pixels < 2 * PARALLEL_MIN_PIXELS)
+	return FALSE;
+
+    p = getParallelRects(cl);
+    if (!p || p->maxTasks < 2)
+	return FALSE;
+
+    /* the client's settings as of this update */
+    for (t = 0; t < p->maxTasks; t++) {
+	shadow = p->tasks[t]->shadow;
+	shadow->screen = cl->screen;
+	shadow->scaledScreen = cl->scaledScreen;
+	shadow->host = cl->host;
+	shadow->format = cl->format;
+	shadow->translateFn = cl->translateFn;
+	shadow->translateLookupTable = cl->translateLookupTable;
+	shadow->preferredEncoding = cl->preferredEncoding;
+	shadow->correMaxWidth = cl->correMaxWidth;
+	shadow->correMaxHeight = cl->correMaxHeight;
+	/* the rest of what the encode cache keys on */
+	shadow->enableLastRectEncoding = cl->enableLastRectEncoding;
+#if defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG)
+	shadow->tightQualityLevel = cl->tightQualityLevel;
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+	shadow->tightCompressLevel = cl->tightCompressLevel;
+	shadow->turboQualityLevel = cl->turboQualityLevel;
+	shadow->turboSubsampLevel = cl->turboSubsampLevel;
+#endif
+#endif
+    }
+    p->encode = encode;
+    p->nTasks = 0;
+    return TRUE;
+}
+
+static rfbBool
+queueTask(rfbParallelRects *p, int kind, int x, int y, int w, int h,
+	  rfbBool header, int rectW, int rectH)
+{
+    rfbParallelTask *task = p->tasks[p->nTasks++];
+
+    task->kind = kind;
+    task->x = x;
+    task->y = y;
+    task->w = w;
+    task->h = h;
+    task->header = header;
+    task->rectW = rectW;
+    task->rectH = rectH;
+    if (p->nTasks == p->maxTasks)
+	return flushTasks(p);
+    return TRUE;
+}
+
+rfbBool
+rfbParallelRectsQueue(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    rfbParallelRects *p = cl->parallelRects;
+    int kind = TASK_RECT, unit, rows, sy;
+
+    if (!w || !h)
+	return TRUE;
+
+    /* the rows a stripe has to be a multiple of */
+    switch (cl->preferredEncoding) {
+    case rfbEncodingRRE:
+	unit = 0;
+	break;
+    case rfbEncodingCoRRE:
+	unit = cl->correMaxHeight;
+	break;
+    case rfbEncodingHextile:
+	kind = TASK_HEXTILES;
+	unit = 16;
+	break;
+    case rfbEncodingUltra:
+	unit = ULTRA_MAX_SIZE(w) / w;
+	break;
+    default:
+	kind = TASK_RAW_ROWS;
+	unit = 1;
+    }
+
+    rows = h;
+    if (unit > 0 && !cl->screen->encodeCache &&
+	(long)w * h >= 2 * PARALLEL_MIN_PIXELS) {
+	rows = h / (PARALLEL_TASKS_PER_THREAD *
+		    (rfbWorkerPoolSize(cl->screen->encodePool) + 1));
+	if (rows < (PARALLEL_MIN_PIXELS + w - 1) / w)
+	    rows = (PARALLEL_MIN_PIXELS + w - 1) / w;
+	rows = (rows + unit - 1) / unit * unit;
+    }
+
+    if (rows >= h)
+	return queueTask(p, TASK_RECT, x, y, w, h, FALSE, w, h);
+
+    for (sy = y; sy < y + h; sy += rows) {
+	if (rows > y + h - sy)
+	    rows = y + h - sy;
+	if (!queueTask(p, kind, x, sy, w, rows, kind != TASK_RECT && sy == y, w, h))
+	    return FALSE;
+    }
+    return TRUE;
+}
+
+rfbBool
+rfbParallelRectsEnd(rfbClientPtr cl)
+{
+    rfbParallelRects *p = cl->parallelRects;
+
+    if (!p || p->nTasks == 0)
+	return TRUE;
+    return flushTasks(p);
+}
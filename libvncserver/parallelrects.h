@@ -0,0 +1,48 @@
+/*
+ * parallelrects.h - private interface to encoding the rectangles of an
+ * update on the encode pool.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef RFB_PARALLELRECTS_H
+#define RFB_PARALLELRECTS_H
+
+#include <rfb/rfb.h>
+#include "encodecache.h"
+
+/* Whether the rectangles of an update of region go through
+   rfbParallelRectsQueue(); encode sends one rectangle in the client's
+   preferred encoding. Called by rfbSendFramebufferUpdate(). */
+rfbBool rfbParallelRectsBegin(rfbClientPtr cl, sraRegionPtr region,
+                              rfbEncodeRectProc encode);
+
+/* Queue a rectangle of the update, in the order they are to be sent.
+   Whatever was encoded goes out when the batch is full. */
+rfbBool rfbParallelRectsQueue(rfbClientPtr cl, int x, int y, int w, int h);
+
+/* Encode and send what is still queued. */
+rfbBool rfbParallelRectsEnd(rfbClientPtr cl);
+
+/* Called by rfbSendUpdateBuf() and rfbSendUpdateData() instead of
+   writing, for the clients encoding on behalf of another one. */
+rfbBool rfbParallelRectsAppend(rfbClientPtr cl, const char *buf, int len);
+
+void rfbParallelRectsFree(rfbClientPtr cl);
+
+#endif
@@ -6,16 +6,31 @@
 void rfbShowCursor(rfbClientPtr cl);
 void rfbHideCursor(rfbClientPtr cl);
 void rfbRedrawAfterHideCursor(rfbClientPtr cl,sraRegionPtr updateRegion);
+/* With compositeCursor: composite the cursor into the pixels of the update
+   instead of drawing it, unless FALSE is returned. */
+rfbBool rfbCursorOverlayBegin(rfbClientPtr cl);
+void rfbCursorOverlayEnd(rfbClientPtr cl);
+/* whether encoding the rectangle now composites the cursor into it */
+rfbBool rfbCursorOverlayCovers(rfbClientPtr cl,int x,int y,int w,int h);
+void rfbCursorOverlayFree(rfbClientPtr cl);
 
 /* from main.c */
 
 rfbClientPtr rfbClientIteratorHead(rfbClientIteratorPtr i);
 
+/* from hextile.c */
+
+rfbBool rfbSendHextiles(rfbClientPtr cl, int x, int y, int w, int h);
+
+/* from stats.c */
+
+void rfbStatMoveEncodingsSent(rfbClientPtr cl, rfbClientPtr from);
+
 /* from tight.c */
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
-extern void rfbTightCleanup(rfbScreenInfoPtr screen);
+void rfbFreeTightData(rfbClientPtr cl);
 #endif
 
 /* from zlib.c */
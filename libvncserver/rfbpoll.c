@@ -0,0 +1,641 @@
+/*
+ * rfbpoll.c - socket event backend for rfbCheckFds() and rfbProcessEvents().
+ *
+ * All sockets of a screen are registered here once, when they are created,
+ * instead of being scanned on every call. On Linux the readiness is taken
+ * from an epoll instance, which also makes descriptors beyond FD_SETSIZE
+ * usable; elsewhere, or if epoll_create1() fails at runtime, select() on
+ * allFds is used as before.
+ *
+ * Besides the sockets this keeps the list of clients that have something
+ * left to do (input arrived, update being deferred, file transfer running).
+ * rfbProcessEvents() only visits those, plus all clients whenever something
+ * happened to the screen as a whole (rfbPollScheduleFullScan()).
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+
+#ifdef LIBVNCSERVER_HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+#ifdef LIBVNCSERVER_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef LIBVNCSERVER_HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#include <errno.h>
+#include <time.h>
+
+#include "sockets.h"
+#include "rfbpoll.h"
+
+/* listen, listen6, udp, httpListen, httpListen6, http and some spare */
+#define MAX_SERVER_SOCKS 8
+/* epoll_wait() batch size; level triggered, so the rest comes next time */
+#define MAX_EPOLL_EVENTS 256
+/* visit every client at least this often (seconds), for changes made by
+   poking screen or client fields directly */
+#define FULL_SCAN_INTERVAL 1
+
+/* cl->pollInterest bits */
+#define INTEREST_PAUSED 1
+#define INTEREST_OUTPUT 2
+
+struct rfbPollContext {
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+    int epollFd;
+    struct epoll_event epollEvents[MAX_EPOLL_EVENTS];
+#endif
+    rfbSocket serverSocks[MAX_SERVER_SOCKS];
+    /* clients waiting for output space, select() only */
+    fd_set writeFds;
+
+    rfbPollEvent *events;
+    int eventsMax;
+
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+    MUTEX(pendingMutex);
+    MUTEX(interestMutex);
+#endif
+    rfbClientPtr *pending;
+    int pendingCount, pendingMax;
+    rfbClientPtr *sweep;
+    int sweepCount, sweepMax;
+
+    volatile unsigned long changeSerial;
+    unsigned long sweptSerial;
+    int sweptCursorX, sweptCursorY;
+    time_t lastFullScan;
+    int wakeupMs;
+};
+
+static rfbBool
+growClientArray(rfbClientPtr **array, int *max, int needed)
+{
+    rfbClientPtr *p;
+    int newMax;
+
+    if (needed <= *max)
+	return TRUE;
+    newMax = *max ? *max * 2 : 64;
+    while (newMax < needed)
+	newMax *= 2;
+    p = (rfbClientPtr *)realloc(*array, newMax * sizeof(rfbClientPtr));
+    if (!p)
+	return FALSE;
+    *array = p;
+    *max = newMax;
+    return TRUE;
+}
+
+static rfbBool
+addEvent(struct rfbPollContext *ctx, int n, rfbSocket sock, rfbClientPtr cl, int ready)
+{
+    if (n >= ctx->eventsMax) {
+	int newMax = ctx->eventsMax ? ctx->eventsMax * 2 : 64;
+	rfbPollEvent *p = (rfbPollEvent *)realloc(ctx->events, newMax * sizeof(rfbPollEvent));
+	if (!p)
+	    return FALSE;
+	ctx->events = p;
+	ctx->eventsMax = newMax;
+    }
+    ctx->events[n].sock = sock;
+    ctx->events[n].cl = cl;
+    ctx->events[n].ready = ready;
+    return TRUE;
+}
+
+void
+rfbPollInit(rfbScreenInfoPtr screen)
+{
+    struct rfbPollContext *ctx;
+    int i;
+
+    if (screen->pollContext)
+	return;
+
+    ctx = (struct rfbPollContext *)calloc(sizeof(struct rfbPollContext), 1);
+    if (!ctx)
+	return;
+
+    for (i = 0; i < MAX_SERVER_SOCKS; i++)
+	ctx->serverSocks[i] = RFB_INVALID_SOCKET;
+
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+    ctx->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctx->epollFd < 0)
+	rfbLogPerror("rfbPollInit: epoll_create1 failed, using select()");
+#endif
+
+    FD_ZERO(&ctx->writeFds);
+    INIT_MUTEX(ctx->pendingMutex);
+    INIT_MUTEX(ctx->interestMutex);
+    ctx->sweptCursorX = screen->cursorX;
+    ctx->sweptCursorY = screen->cursorY;
+    ctx->lastFullScan = time(NULL);
+    ctx->wakeupMs = -1;
+
+    screen->pollContext = ctx;
+}
+
+void
+rfbPollCleanup(rfbScreenInfoPtr screen)
+{
+    struct rfbPollContext *ctx = screen->pollContext;
+
+    if (!ctx)
+	return;
+
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+    if (ctx->epollFd >= 0)
+	close(ctx->epollFd);
+#endif
+    TINI_MUTEX(ctx->pendingMutex);
+    TINI_MUTEX(ctx->interestMutex);
+    free(ctx->events);
+    free(ctx->pending);
+    free(ctx->sweep);
+    free(ctx);
+    screen->pollContext = NULL;
+}
+
+rfbBool
+rfbPollAddSocket(rfbScreenInfoPtr screen, rfbSocket sock, rfbClientPtr cl)
+{
+    struct rfbPollContext *ctx = screen->pollContext;
+    int i;
+
+    if (sock == RFB_INVALID_SOCKET)
+	return FALSE;
+
+    /* allFds stays valid for applications doing their own select() */
+    if (sock < FD_SETSIZE) {
+	FD_SET(sock, &(screen->allFds));
+	screen->maxFd = rfbMax((int)sock, screen->maxFd);
+    }
+
+    if (cl)
+	cl->pollInterest = 0;
+
+    if (ctx && !cl) {
+	for (i = 0; i < MAX_SERVER_SOCKS; i++)
+	    if (ctx->serverSocks[i] == sock)
+		break;
+	if (i == MAX_SERVER_SOCKS)
+	    for (i = 0; i < MAX_SERVER_SOCKS; i++)
+		if (ctx->serverSocks[i] == RFB_INVALID_SOCKET) {
+		    ctx->serverSocks[i] = sock;
+		    break;
+		}
+    }
+
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+    if (ctx && ctx->epollFd >= 0) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	/* server sockets point into serverSocks[], clients to themselves */
+	if (cl)
+	    ev.data.ptr = cl;
+	else
+	    for (i = 0; i < MAX_SERVER_SOCKS; i++)
+		if (ctx->serverSocks[i] == sock)
+		    ev.data.ptr = &ctx->serverSocks[i];
+	if (epoll_ctl(ctx->epollFd, EPOLL_CTL_ADD, sock, &ev) < 0
+	    && (errno != EEXIST || epoll_ctl(ctx->epollFd, EPOLL_CTL_MOD, sock, &ev) < 0)) {
+	    rfbLogPerror("rfbPollAddSocket: epoll_ctl");
+	    return FALSE;
+	}
+	return TRUE;
+    }
+#endif
+
+    if (sock >= FD_SETSIZE) {
+	rfbErr("rfbPollAddSocket: socket %d exceeds FD_SETSIZE (%d)\n", (int)sock, FD_SETSIZE);
+	return FALSE;
+    }
+    return TRUE;
+}
+
+void
+rfbPollRemoveSocket(rfbScreenInfoPtr screen, rfbSocket sock)
+{
+    struct rfbPollContext *ctx = screen->pollContext;
+    int i;
+
+    if (sock == RFB_INVALID_SOCKET)
+	return;
+
+    if (sock < FD_SETSIZE) {
+	FD_CLR(sock, &(screen->allFds));
+	if (sock == screen->maxFd)
+	    while (screen->maxFd > 0 && !FD_ISSET(screen->maxFd, &(screen->allFds)))
+		screen->maxFd--;
+    }
+
+    if (!ctx)
+	return;
+
+    if (sock < FD_SETSIZE)
+	FD_CLR(sock, &ctx->writeFds);
+
+    for (i = 0; i < MAX_SERVER_SOCKS; i++)
+	if (ctx->serverSocks[i] == sock)
+	    ctx->serverSocks[i] = RFB_INVALID_SOCKET;
+
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+    if (ctx->epollFd >= 0) {
+	struct epoll_event ev; /* non-NULL for kernels before 2.6.9 */
+	epoll_ctl(ctx->epollFd, EPOLL_CTL_DEL, sock, &ev);
+    }
+#endif
+}
+
+/* Make the backend watch for what cl->pollInterest asks for; called with
+   interestMutex held. */
+static void
+applyInterest(rfbScreenInfoPtr screen, rfbClientPtr cl)
+{
+    struct rfbPollContext *ctx = screen->pollContext;
+    rfbSocket sock = cl->sock;
+    rfbBool paused = (cl->pollInterest & INTEREST_PAUSED) != 0;
+    rfbBool output = !paused && (cl->pollInterest & INTEREST_OUTPUT);
+
+    if (sock == RFB_INVALID_SOCKET)
+	return;
+
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+    if (ctx && ctx->epollFd >= 0) {
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = paused ? 0 : EPOLLIN | (output ? EPOLLOUT : 0);
+	ev.data.ptr = cl;
+	/* fails harmlessly if the socket was closed meanwhile */
+	epoll_ctl(ctx->epollFd, EPOLL_CTL_MOD, sock, &ev);
+	return;
+    }
+#endif
+
+    if (sock >= FD_SETSIZE)
+	return;
+    if (!paused) {
+	FD_SET(sock, &(screen->allFds));
+	screen->maxFd = rfbMax((int)sock, screen->maxFd);
+    } else
+	FD_CLR(sock, &(screen->allFds));
+    if (ctx) {
+	if (output)
+	    FD_SET(sock, &ctx->writeFds);
+	else
+	    FD_CLR(sock, &ctx->writeFds);
+    }
+}
+
+void
+rfbPollSetInterest(rfbScreenInfoPtr screen, rfbClientPtr cl, rfbBool enable)
+{
+    struct rfbPollContext *ctx = screen->pollContext;
+
+    if (ctx)
+	LOCK(ctx->interestMutex);
+    if (enable)
+	cl->pollInterest &= ~INTEREST_PAUSED;
+    else
+	cl->pollInterest |= INTEREST_PAUSED;
+    applyInterest(screen, cl);
+    if (ctx)
+	UNLOCK(ctx->interestMutex);
+}
+
+void
+rfbPollSetOutputInterest(rfbScreenInfoPtr screen, rfbClientPtr cl, rfbBool enable)
+{
+    struct rfbPollContext *ctx = screen->pollContext;
+
+    /* only the thread serving clients changes this bit */
+    if (!(cl->pollInterest & INTEREST_OUTPUT) == !enable)
+	return;
+
+    if (ctx)
+	LOCK(ctx->interestMutex);
+    if (enable)
+	cl->pollInterest |= INTEREST_OUTPUT;
+    else
+	cl->pollInterest &= ~INTEREST_OUTPUT;
+    applyInterest(screen, cl);
+    if (ctx)
+	UNLOCK(ctx->interestMutex);
+}
+
+static int
+pollWaitSelect(rfbScreenInfoPtr screen, long usec)
+{
+    struct rfbPollContext *ctx = screen->pollContext;
+    rfbClientIteratorPtr i;
+    rfbClientPtr cl;
+    fd_set fds, wfds;
+    struct timeval tv;
+    int nfds, n = 0, k, ready;
+
+    memcpy((char *)&fds, (char *)&(screen->allFds), sizeof(fd_set));
+    LOCK(ctx->interestMutex);
+    memcpy((char *)&wfds, (char *)&ctx->writeFds, sizeof(fd_set));
+    UNLOCK(ctx->interestMutex);
+    tv.tv_sec = usec / 1000000;
+    tv.tv_usec = usec % 1000000;
+    nfds = select(screen->maxFd + 1, &fds, &wfds, NULL, &tv);
+    if (nfds <= 0) {
+#ifdef WIN32
+	if (nfds < 0)
+	    errno = WSAGetLastError();
+#endif
+	return nfds;
+    }
+
+    for (k = 0; k < MAX_SERVER_SOCKS; k++) {
+	rfbSocket sock = ctx->serverSocks[k];
+	if (sock != RFB_INVALID_SOCKET && sock < FD_SETSIZE && FD_ISSET(sock, &fds)) {
+	    if (!addEvent(ctx, n, sock, NULL, RFB_POLL_READ))
+		return n;
+	    n++;
+	}
+    }
+
+    i = rfbGetClientIterator(screen);
+    while ((cl = rfbClientIteratorNext(i))) {
+	/* the UDP client shares its socket with the screen */
+	if (cl->sock == screen->udpSock || cl->sock >= FD_SETSIZE)
+	    continue;
+	ready = (FD_ISSET(cl->sock, &fds) ? RFB_POLL_READ : 0)
+	    | (FD_ISSET(cl->sock, &wfds) ? RFB_POLL_WRITE : 0);
+	if (ready) {
+	    if (!addEvent(ctx, n, cl->sock, cl, ready))
+		break;
+	    n++;
+	}
+    }
+    rfbReleaseClientIterator(i);
+
+    return n;
+}
+
+/*
+ * Wait up to usec microseconds for input on any socket of the screen, or
+ * for output space on client sockets asked for by rfbPollSetOutputInterest().
+ * Returns the number of ready sockets, 0 on timeout and -1 on error with
+ * errno set.
+ */
+
+int
+rfbPollWait(rfbScreenInfoPtr screen, long usec, rfbPollEvent **events)
+{
+    struct rfbPollContext *ctx = screen->pollContext;
+
+    if (!ctx) {
+	rfbPollInit(screen);
+	if (!(ctx = screen->pollContext))
+	    return -1;
+    }
+
+#ifdef LIBVNCSERVER_HAVE_SYS_EPOLL_H
+    if (ctx->epollFd >= 0) {
+	int nfds, n = 0, k;
+	/* round up, so a short wait does not turn into busy polling */
+	nfds = epoll_wait(ctx->epollFd, ctx->epollEvents, MAX_EPOLL_EVENTS,
+			  usec > 0 ? (int)((usec + 999) / 1000) : 0);
+	for (k = 0; k < nfds; k++) {
+	    void *ptr = ctx->epollEvents[k].data.ptr;
+	    if (ptr >= (void *)&ctx->serverSocks[0] && ptr < (void *)&ctx->serverSocks[MAX_SERVER_SOCKS]) {
+		rfbSocket sock = *(rfbSocket *)ptr;
+		if (sock == RFB_INVALID_SOCKET)
+		    continue;
+		if (!addEvent(ctx, n, sock, NULL, RFB_POLL_READ))
+		    break;
+	    } else {
+		rfbClientPtr cl = (rfbClientPtr)ptr;
+		uint32_t what = ctx->epollEvents[k].events;
+		if (!addEvent(ctx, n, cl->sock, cl,
+			      ((what & ~EPOLLOUT) ? RFB_POLL_READ : 0)
+			      | ((what & EPOLLOUT) ? RFB_POLL_WRITE : 0)))
+		    break;
+	    }
+	    n++;
+	}
+	*events = ctx->events;
+	return nfds < 0 ? -1 : n;
+    }
+#endif
+
+    *events = ctx->events;
+    return pollWaitSelect(screen, usec);
+}
+
+int
+rfbPollSocket(rfbSocket sock, rfbBool forWrite, int timeout)
+{
+#if defined(LIBVNCSERVER_HAVE_POLL_H) && !defined(WIN32)
+    struct pollfd pfd;
+
+    pfd.fd = sock;
+    pfd.events = forWrite ? POLLOUT : (POLLIN | POLLPRI);
+    pfd.revents = 0;
+    return poll(&pfd, 1, timeout);
+#else
+    fd_set fds;
+    struct timeval tv;
+    int n;
+
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    if (forWrite)
+	n = select(sock+1, NULL, &fds, NULL, &tv);
+    else
+	n = select(sock+1, &fds, NULL, &fds, &tv);
+#ifdef WIN32
+    if (n < 0)
+	errno = WSAGetLastError();
+#endif
+    return n;
+#endif
+}
+
+void
+rfbPollMarkClient(rfbScreenInfoPtr screen, rfbClientPtr cl)
+{
+    struct rfbPollContext *ctx = screen->pollContext;
+
+    if (!ctx || cl->pollPending)
+	return;
+
+    LOCK(ctx->pendingMutex);
+    if (!cl->pollPending && growClientArray(&ctx->pending, &ctx->pendingMax, ctx->pendingCount + 1)) {
+	ctx->pending[ctx->pendingCount++] = cl;
+	cl->pollPending = TRUE;
+    }
+    UNLOCK(ctx->pendingMutex);
+}
+
+void
+rfbPollForgetClient(rfbClientPtr cl)
+{
+    struct rfbPollContext *ctx = cl->screen->pollContext;
+    int i;
+
+    if (!ctx)
+	return;
+
+    LOCK(ctx->pendingMutex);
+    if (cl->pollPending) {
+	for (i = 0; i < ctx->pendingCount; i++)
+	    if (ctx->pending[i] == cl) {
+		ctx->pending[i] = ctx->pending[--ctx->pendingCount];
+		break;
+	    }
+	cl->pollPending = FALSE;
+    }
+    /* the client may also be part of a sweep in progress */
+    for (i = 0; i < ctx->sweepCount; i++)
+	if (ctx->sweep[i] == cl)
+	    ctx->sweep[i] = NULL;
+    UNLOCK(ctx->pendingMutex);
+}
+
+/*
+ * Give clients in the middle of a file download a chance to send the next
+ * chunk. Downloads are started by client input, so they are always on the
+ * pending list.
+ */
+
+void
+rfbPollSendFileTransferChunks(rfbScreenInfoPtr screen)
+{
+    struct rfbPollContext *ctx = screen->pollContext;
+    rfbClientPtr cl;
+    int i;
+
+    if (!ctx || !screen->permitFileTransfer)
+	return;
+
+    LOCK(ctx->pendingMutex);
+    for (i = 0; i < ctx->pendingCount; i++) {
+	cl = ctx->pending[i];
+	if (cl->onHold || cl->sock == RFB_INVALID_SOCKET)
+	    continue;
+	if (cl->fileTransfer.fd != -1 && cl->fileTransfer.sending == 1)
+	    rfbSendFileTransferChunk(cl);
+    }
+    UNLOCK(ctx->pendingMutex);
+}
+
+void
+rfbPollScheduleFullScan(rfbScreenInfoPtr screen)
+{
+    /* no lock: any change of the value is enough for rfbPollBeginSweep() */
+    if (screen->pollContext)
+	screen->pollContext->changeSerial++;
+}
+
+rfbBool
+rfbPollBeginSweep(rfbScreenInfoPtr screen, rfbClientPtr **pending, int *count)
+{
+    struct rfbPollContext *ctx = screen->pollContext;
+    rfbClientPtr *tmp;
+    time_t now;
+    int i, tmpMax;
+
+    *pending = NULL;
+    *count = 0;
+
+    if (!ctx) {
+	rfbPollInit(screen);
+	return TRUE;
+    }
+
+    LOCK(ctx->pendingMutex);
+    /* swap the lists; the clients re-queue themselves while being served */
+    tmp = ctx->sweep;
+    tmpMax = ctx->sweepMax;
+    ctx->sweep = ctx->pending;
+    ctx->sweepMax = ctx->pendingMax;
+    ctx->sweepCount = ctx->pendingCount;
+    ctx->pending = tmp;
+    ctx->pendingMax = tmpMax;
+    ctx->pendingCount = 0;
+    for (i = 0; i < ctx->sweepCount; i++)
+	ctx->sweep[i]->pollPending = FALSE;
+    UNLOCK(ctx->pendingMutex);
+
+    *pending = ctx->sweep;
+    *count = ctx->sweepCount;
+    ctx->wakeupMs = -1;
+
+    now = time(NULL);
+    if (ctx->changeSerial != ctx->sweptSerial
+	|| screen->cursorX != ctx->sweptCursorX
+	|| screen->cursorY != ctx->sweptCursorY
+	|| now - ctx->lastFullScan >= FULL_SCAN_INTERVAL
+	|| now < ctx->lastFullScan) {
+	ctx->sweptSerial = ctx->changeSerial;
+	ctx->sweptCursorX = screen->cursorX;
+	ctx->sweptCursorY = screen->cursorY;
+	ctx->lastFullScan = now;
+	return TRUE;
+    }
+    return FALSE;
+}
+
+void
+rfbPollEndSweep(rfbScreenInfoPtr screen)
+{
+    struct rfbPollContext *ctx = screen->pollContext;
+
+    if (!ctx)
+	return;
+
+    LOCK(ctx->pendingMutex);
+    ctx->sweepCount = 0;
+    UNLOCK(ctx->pendingMutex);
+}
+
+void
+rfbPollWakeup(rfbScreenInfoPtr screen, int ms)
+{
+    struct rfbPollContext *ctx = screen->pollContext;
+
+    if (ms < 1)
+	ms = 1;
+    if (ctx && (ctx->wakeupMs < 0 || ms < ctx->wakeupMs))
+	ctx->wakeupMs = ms;
+}
+
+int
+rfbPollNextWakeup(rfbScreenInfoPtr screen)
+{
+    return screen->pollContext ? screen->pollContext->wakeupMs : -1;
+}
@@ -0,0 +1,78 @@
+/*
+ * rfbpoll.h - private interface to the socket event backend.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef RFB_POLL_H
+#define RFB_POLL_H
+
+#include <rfb/rfb.h>
+
+#define RFB_POLL_READ  1
+#define RFB_POLL_WRITE 2
+
+/* One ready socket as reported by rfbPollWait(). cl is NULL for the
+   listening, UDP and HTTP sockets of the screen; ready tells whether the
+   socket has input (or was closed) and/or can take more output. */
+typedef struct {
+    rfbSocket sock;
+    rfbClientPtr cl;
+    int ready;
+} rfbPollEvent;
+
+void rfbPollInit(rfbScreenInfoPtr screen);
+void rfbPollCleanup(rfbScreenInfoPtr screen);
+
+/* Start and stop watching a socket; these also maintain allFds/maxFd. */
+rfbBool rfbPollAddSocket(rfbScreenInfoPtr screen, rfbSocket sock, rfbClientPtr cl);
+void rfbPollRemoveSocket(rfbScreenInfoPtr screen, rfbSocket sock);
+/* Pause or resume all events for a client socket. */
+void rfbPollSetInterest(rfbScreenInfoPtr screen, rfbClientPtr cl, rfbBool enable);
+/* Also report a client socket once it can take more output, for clients
+   with queued output. */
+void rfbPollSetOutputInterest(rfbScreenInfoPtr screen, rfbClientPtr cl, rfbBool enable);
+
+int rfbPollWait(rfbScreenInfoPtr screen, long usec, rfbPollEvent **events);
+
+/* Wait up to timeout ms for a single socket to become readable
+   (or writable); returns like select(). */
+int rfbPollSocket(rfbSocket sock, rfbBool forWrite, int timeout);
+
+/* The pending list holds the clients rfbProcessEvents() has to look at
+   even if nothing on the screen changed. */
+void rfbPollMarkClient(rfbScreenInfoPtr screen, rfbClientPtr cl);
+void rfbPollForgetClient(rfbClientPtr cl);
+void rfbPollSendFileTransferChunks(rfbScreenInfoPtr screen);
+
+/* Called whenever a change may give clients that are not on the pending
+   list something to send. */
+void rfbPollScheduleFullScan(rfbScreenInfoPtr screen);
+
+/* Detach the pending list for one rfbProcessEvents() pass. Returns TRUE
+   if all clients have to be visited instead. */
+rfbBool rfbPollBeginSweep(rfbScreenInfoPtr screen, rfbClientPtr **pending, int *count);
+void rfbPollEndSweep(rfbScreenInfoPtr screen);
+
+/* A client visited during the sweep wants to be looked at again after ms
+   milliseconds; rfbPollNextWakeup() returns the earliest such time since
+   rfbPollBeginSweep(), or -1. */
+void rfbPollWakeup(rfbScreenInfoPtr screen, int ms);
+int rfbPollNextWakeup(rfbScreenInfoPtr screen);
+
+#endif
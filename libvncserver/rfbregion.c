@@ -3,786 +3,760 @@
  *
  * A general purpose region clipping library
  * Only deals with rectangular regions, though.
+ *
+ * A region is a single array of rectangles in y-x banded order, as in the
+ * X server and pixman: the rectangles of a band share y1 and y2 and are
+ * sorted by x without touching each other, and the bands are sorted by y
+ * and do not overlap. The boolean operations sweep both operands band by
+ * band and coalesce touching bands with equal x spans; union and
+ * subtraction only redo the bands within the y range of the second operand
+ * and splice the result into place, so adding a small damage rectangle to
+ * a large region costs little more than a binary search and a memmove().
  */
 
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
 
-/* -=- Internal Span structure */
-
-struct sraRegion;
+struct sraRegion {
+  sraRect *rects;		/* rects[first] .. rects[first+n-1] */
+  int first;
+  int n;
+  int size;
+};
 
-typedef struct sraSpan {
-  struct sraSpan *_next;
-  struct sraSpan *_prev;
-  int start;
-  int end;
-  struct sraRegion *subspan;
-} sraSpan;
+#define SRA_OR       0
+#define SRA_AND      1
+#define SRA_SUBTRACT 2
 
-typedef struct sraRegion {
-  sraSpan front;
-  sraSpan back;
-} sraSpanList;
+/* -=- Per-thread pool of regions and rectangle arrays
+ *
+ * Regions are created and destroyed for every damage rectangle and every
+ * update, so destroyed regions keep their array and wait here for reuse.
+ * Each thread has its own pool so that no locking is needed.
+ */
 
-/* -=- Span routines */
+#define SRA_POOL_REGIONS 32
+#define SRA_POOL_ARRAYS  16
+#define SRA_MIN_RECTS    16
+#define SRA_MAX_POOLED_RECTS 4096
 
-sraSpanList *sraSpanListDup(const sraSpanList *src);
-void sraSpanListDestroy(sraSpanList *list);
+typedef struct sraPool {
+  sraRegion *regions[SRA_POOL_REGIONS];
+  int nRegions;
+  sraRect *arrays[SRA_POOL_ARRAYS];
+  int arraySizes[SRA_POOL_ARRAYS];
+  int nArrays;
+} sraPool;
 
-static sraSpan *
-sraSpanCreate(int start, int end, const sraSpanList *subspan) {
-  sraSpan *item = (sraSpan*)malloc(sizeof(sraSpan));
-  item->_next = item->_prev = NULL;
-  item->start = start;
-  item->end = end;
-  item->subspan = sraSpanListDup(subspan);
-  return item;
-}
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD)
 
-static sraSpan *
-sraSpanDup(const sraSpan *src) {
-  sraSpan *span;
-  if (!src) return NULL;
-  span = sraSpanCreate(src->start, src->end, src->subspan);
-  return span;
-}
+static pthread_key_t sraPoolKey;
+static pthread_once_t sraPoolOnce = PTHREAD_ONCE_INIT;
+static rfbBool sraPoolKeyValid = FALSE;
 
 static void
-sraSpanInsertAfter(sraSpan *newspan, sraSpan *after) {
-  newspan->_next = after->_next;
-  newspan->_prev = after;
-  after->_next->_prev = newspan;
-  after->_next = newspan;
+sraPoolDestroy(void *data) {
+  sraPool *pool = (sraPool*)data;
+  while (pool->nRegions > 0) {
+    sraRegion *rgn = pool->regions[--pool->nRegions];
+    free(rgn->rects);
+    free(rgn);
+  }
+  while (pool->nArrays > 0)
+    free(pool->arrays[--pool->nArrays]);
+  free(pool);
 }
 
 static void
-sraSpanInsertBefore(sraSpan *newspan, sraSpan *before) {
-  newspan->_next = before;
-  newspan->_prev = before->_prev;
-  before->_prev->_next = newspan;
-  before->_prev = newspan;
+sraPoolCreateKey(void) {
+  sraPoolKeyValid = pthread_key_create(&sraPoolKey, sraPoolDestroy) == 0;
 }
 
-static void
-sraSpanRemove(sraSpan *span) {
-  span->_prev->_next = span->_next;
-  span->_next->_prev = span->_prev;
-}
+static sraPool *
+sraPoolGet(void) {
+  sraPool *pool;
 
-static void
-sraSpanDestroy(sraSpan *span) {
-  if (span->subspan) sraSpanListDestroy(span->subspan);
-  free(span);
-}
-
-#ifdef DEBUG
-static void
-sraSpanCheck(const sraSpan *span, const char *text) {
-  /* Check the span is valid! */
-  if (span->start == span->end) {
-    printf(text); 
-    printf(":%d-%d\n", span->start, span->end);
+  pthread_once(&sraPoolOnce, sraPoolCreateKey);
+  if (!sraPoolKeyValid)
+    return NULL;
+  pool = (sraPool*)pthread_getspecific(sraPoolKey);
+  if (!pool) {
+    pool = (sraPool*)calloc(1, sizeof(sraPool));
+    if (pool && pthread_setspecific(sraPoolKey, pool) != 0) {
+      free(pool);
+      pool = NULL;
+    }
   }
+  return pool;
 }
-#endif
 
-/* -=- SpanList routines */
+#elif defined(LIBVNCSERVER_HAVE_WIN32THREADS)
 
-static void sraSpanPrint(const sraSpan *s);
+/* there is no thread exit hook to give a per-thread pool back */
+#define sraPoolGet() ((sraPool*)NULL)
 
-static void
-sraSpanListPrint(const sraSpanList *l) {
-  sraSpan *curr;
-  if (!l) {
-	  printf("NULL");
-	  return;
-  }
-  curr = l->front._next;
-  printf("[");
-  while (curr != &(l->back)) {
-    sraSpanPrint(curr);
-    curr = curr->_next;
-  }
-  printf("]");
-}
+#else
 
-void
-sraSpanPrint(const sraSpan *s) {
-  printf("(%d-%d)", (s->start), (s->end));
-  if (s->subspan)
-    sraSpanListPrint(s->subspan);
-}
-
-static sraSpanList *
-sraSpanListCreate(void) {
-  sraSpanList *item = (sraSpanList*)malloc(sizeof(sraSpanList));
-  item->front._next = &(item->back);
-  item->front._prev = NULL;
-  item->back._prev = &(item->front);
-  item->back._next = NULL;
-  return item;
-}
-
-sraSpanList *
-sraSpanListDup(const sraSpanList *src) {
-  sraSpanList *newlist;
-  sraSpan *newspan, *curr;
-
-  if (!src) return NULL;
-  newlist = sraSpanListCreate();
-  curr = src->front._next;
-  while (curr != &(src->back)) {
-    newspan = sraSpanDup(curr);
-    sraSpanInsertBefore(newspan, &(newlist->back));
-    curr = curr->_next;
-  }
+static sraPool sraStaticPool;
+#define sraPoolGet() (&sraStaticPool)
 
-  return newlist;
-}
+#endif
 
-void
-sraSpanListDestroy(sraSpanList *list) {
-  sraSpan *curr, *next;
-  while (list->front._next != &(list->back)) {
-    curr = list->front._next;
-    next = curr->_next;
-    sraSpanRemove(curr);
-    sraSpanDestroy(curr);
-    curr = next;
+static sraRect *
+sraRectsAlloc(int need, int *size) {
+  sraPool *pool = sraPoolGet();
+  sraRect *rects;
+  int i;
+
+  if (need < SRA_MIN_RECTS)
+    need = SRA_MIN_RECTS;
+  if (pool) {
+    for (i = pool->nArrays - 1; i >= 0; i--) {
+      if (pool->arraySizes[i] >= need) {
+	rects = pool->arrays[i];
+	*size = pool->arraySizes[i];
+	pool->nArrays--;
+	pool->arrays[i] = pool->arrays[pool->nArrays];
+	pool->arraySizes[i] = pool->arraySizes[pool->nArrays];
+	return rects;
+      }
+    }
   }
-  free(list);
+  rects = (sraRect*)malloc(sizeof(sraRect) * need);
+  *size = rects ? need : 0;
+  return rects;
 }
 
 static void
-sraSpanListMakeEmpty(sraSpanList *list) {
-  sraSpan *curr, *next;
-  while (list->front._next != &(list->back)) {
-    curr = list->front._next;
-    next = curr->_next;
-    sraSpanRemove(curr);
-    sraSpanDestroy(curr);
-    curr = next;
+sraRectsFree(sraRect *rects, int size) {
+  sraPool *pool = sraPoolGet();
+
+  if (pool && rects && size <= SRA_MAX_POOLED_RECTS &&
+      pool->nArrays < SRA_POOL_ARRAYS) {
+    pool->arrays[pool->nArrays] = rects;
+    pool->arraySizes[pool->nArrays] = size;
+    pool->nArrays++;
+    return;
   }
-  list->front._next = &(list->back);
-  list->front._prev = NULL;
-  list->back._prev = &(list->front);
-  list->back._next = NULL;
+  free(rects);
 }
 
-static rfbBool
-sraSpanListEqual(const sraSpanList *s1, const sraSpanList *s2) {
-  sraSpan *sp1, *sp2;
+static sraRegion *
+sraRgnAlloc(int need) {
+  sraPool *pool = sraPoolGet();
+  sraRegion *rgn;
 
-  if (!s1) {
-    if (!s2) {
-      return 1;
-    } else {
-      rfbErr("sraSpanListEqual:incompatible spans (only one NULL!)\n");
-      return FALSE;
-    }
+  if (pool && pool->nRegions > 0) {
+    rgn = pool->regions[--pool->nRegions];
+  } else {
+    rgn = (sraRegion*)malloc(sizeof(sraRegion));
+    if (!rgn)
+      return NULL;
+    rgn->rects = NULL;
+    rgn->size = 0;
   }
-
-  sp1 = s1->front._next;
-  sp2 = s2->front._next;
-  while ((sp1 != &(s1->back)) &&
-	 (sp2 != &(s2->back))) {
-    if ((sp1->start != sp2->start) ||
-	(sp1->end != sp2->end) ||
-	(!sraSpanListEqual(sp1->subspan, sp2->subspan))) {
-      return 0;
-    }
-    sp1 = sp1->_next;
-    sp2 = sp2->_next;
+  rgn->first = 0;
+  rgn->n = 0;
+  if (rgn->size < need) {
+    sraRectsFree(rgn->rects, rgn->size);
+    rgn->rects = sraRectsAlloc(need, &rgn->size);
   }
+  return rgn;
+}
 
-  if ((sp1 == &(s1->back)) && (sp2 == &(s2->back))) {
-    return 1;
-  } else {
-    return 0;
-  }    
+/* Make room for need rectangles; the old contents are lost. */
+static rfbBool
+sraRgnReserve(sraRegion *rgn, int need) {
+  rgn->first = 0;
+  rgn->n = 0;
+  if (rgn->size >= need)
+    return TRUE;
+  sraRectsFree(rgn->rects, rgn->size);
+  rgn->rects = sraRectsAlloc(need, &rgn->size);
+  if (!rgn->rects) {
+    rfbErr("sraRgnReserve: out of memory\n");
+    return FALSE;
+  }
+  return TRUE;
 }
 
+/* -=- Building banded rectangle lists */
+
+typedef struct sraRectList {
+  sraRect *rects;
+  int n;
+  int size;
+  int lastBand;			/* start of the last band, or -1 */
+} sraRectList;
+
 static rfbBool
-sraSpanListEmpty(const sraSpanList *list) {
-  return (list->front._next == &(list->back));
+sraListGrow(sraRectList *list, int more) {
+  sraRect *rects;
+  int size;
+
+  if (list->n + more <= list->size)
+    return TRUE;
+  size = list->size * 2;
+  if (size < list->n + more)
+    size = list->n + more;
+  rects = (sraRect*)realloc(list->rects, sizeof(sraRect) * size);
+  if (!rects)
+    return FALSE;
+  list->rects = rects;
+  list->size = size;
+  return TRUE;
 }
 
-static unsigned long
-sraSpanListCount(const sraSpanList *list) {
-  sraSpan *curr = list->front._next;
-  unsigned long count = 0;
-  while (curr != &(list->back)) {
-    if (curr->subspan) {
-      count += sraSpanListCount(curr->subspan);
-    } else {
-      count += 1;
-    }
-    curr = curr->_next;
-  }
-  return count;
+/* Index just past the band starting at rects[i]. */
+static int
+sraBandEnd(const sraRect *rects, int i, int n) {
+  int y1 = rects[i].y1;
+  while (++i < n && rects[i].y1 == y1)
+    ;
+  return i;
 }
 
 static void
-sraSpanMergePrevious(sraSpan *dest) {
-  sraSpan *prev = dest->_prev;
- 
-  while ((prev->_prev) &&
-	 (prev->end == dest->start) &&
-	 (sraSpanListEqual(prev->subspan, dest->subspan))) {
-    /*
-    printf("merge_prev:");
-    sraSpanPrint(prev);
-    printf(" & ");
-    sraSpanPrint(dest);
-    printf("\n");
-    */
-    dest->start = prev->start;
-    sraSpanRemove(prev);
-    sraSpanDestroy(prev);
-    prev = dest->_prev;
+sraListAddSpan(sraRectList *list, int band, int y1, int y2, int x1, int x2) {
+  sraRect *r = list->rects + list->n;
+
+  if (x1 >= x2)
+    return;
+  if (list->n > band && r[-1].x2 >= x1) {
+    if (x2 > r[-1].x2)
+      r[-1].x2 = x2;
+    return;
   }
-}    
+  r->x1 = x1;
+  r->y1 = y1;
+  r->x2 = x2;
+  r->y2 = y2;
+  list->n++;
+}
 
+/* Finish the band starting at list->rects[band]: drop it into the previous
+   band if that one ends where this one starts and has the same x spans. */
 static void
-sraSpanMergeNext(sraSpan *dest) {
-  sraSpan *next = dest->_next;
-  while ((next->_next) &&
-	 (next->start == dest->end) &&
-	 (sraSpanListEqual(next->subspan, dest->subspan))) {
-/*
-	  printf("merge_next:");
-    sraSpanPrint(dest);
-    printf(" & ");
-    sraSpanPrint(next);
-    printf("\n");
-	*/
-    dest->end = next->end;
-    sraSpanRemove(next);
-    sraSpanDestroy(next);
-    next = dest->_next;
+sraListEndBand(sraRectList *list, int band) {
+  sraRect *prev, *curr;
+  int count = list->n - band, i;
+
+  if (count == 0)
+    return;
+  if (list->lastBand >= 0 && band - list->lastBand == count) {
+    prev = list->rects + list->lastBand;
+    curr = list->rects + band;
+    if (prev->y2 == curr->y1) {
+      for (i = 0; i < count; i++)
+	if (prev[i].x1 != curr[i].x1 || prev[i].x2 != curr[i].x2)
+	  break;
+      if (i == count) {
+	for (i = 0; i < count; i++)
+	  prev[i].y2 = curr->y2;
+	list->n = band;
+	return;
+      }
+    }
   }
+  list->lastBand = band;
 }
 
+/* Append the band [y1,y2) made of the x spans of a and b combined by op;
+   room for na+nb rectangles has to be there. */
 static void
-sraSpanListOr(sraSpanList *dest, const sraSpanList *src) {
-  sraSpan *d_curr, *s_curr;
-  int s_start, s_end;
-
-  if (!dest) {
-    if (!src) {
-      return;
-    } else {
-      rfbErr("sraSpanListOr:incompatible spans (only one NULL!)\n");
-      return;
+sraListAddBand(sraRectList *list, int op, int y1, int y2,
+	       const sraRect *a, int na, const sraRect *b, int nb) {
+  int band = list->n, x1, x2;
+
+  if (y1 >= y2)
+    return;
+
+  switch (op) {
+  case SRA_OR:
+    while (na > 0 || nb > 0) {
+      if (nb == 0 || (na > 0 && a->x1 <= b->x1)) {
+	sraListAddSpan(list, band, y1, y2, a->x1, a->x2);
+	a++; na--;
+      } else {
+	sraListAddSpan(list, band, y1, y2, b->x1, b->x2);
+	b++; nb--;
+      }
     }
-  }
-
-  d_curr = dest->front._next;
-  s_curr = src->front._next;
-  s_start = s_curr->start;
-  s_end = s_curr->end;
-  while (s_curr != &(src->back)) {
-
-    /* - If we are at end of destination list OR
-       If the new span comes before the next destination one */
-    if ((d_curr == &(dest->back)) ||
-		(d_curr->start >= s_end)) {
-      /* - Add the span */
-      sraSpanInsertBefore(sraSpanCreate(s_start, s_end,
-					s_curr->subspan),
-			  d_curr);
-      if (d_curr != &(dest->back))
-	sraSpanMergePrevious(d_curr);
-      s_curr = s_curr->_next;
-      s_start = s_curr->start;
-      s_end = s_curr->end;
-    } else {
-
-      /* - If the new span overlaps the existing one */
-      if ((s_start < d_curr->end) &&
-	  (s_end > d_curr->start)) {
-
-	/* - Insert new span before the existing destination one? */
-	if (s_start < d_curr->start) {
-	  sraSpanInsertBefore(sraSpanCreate(s_start,
-					    d_curr->start,
-					    s_curr->subspan),
-			      d_curr);
-	  sraSpanMergePrevious(d_curr);
-	}
-
-	/* Split the existing span if necessary */
-	if (s_end < d_curr->end) {
-	  sraSpanInsertAfter(sraSpanCreate(s_end,
-					   d_curr->end,
-					   d_curr->subspan),
-			     d_curr);
-	  d_curr->end = s_end;
-	}
-	if (s_start > d_curr->start) {
-	  sraSpanInsertBefore(sraSpanCreate(d_curr->start,
-					    s_start,
-					    d_curr->subspan),
-			      d_curr);
-	  d_curr->start = s_start;
-	}
+    break;
+
+  case SRA_AND:
+    while (na > 0 && nb > 0) {
+      x1 = a->x1 > b->x1 ? a->x1 : b->x1;
+      x2 = a->x2 < b->x2 ? a->x2 : b->x2;
+      sraListAddSpan(list, band, y1, y2, x1, x2);
+      if (a->x2 <= b->x2) {
+	a++; na--;
+      } else {
+	b++; nb--;
+      }
+    }
+    break;
 
-	/* Recursively OR subspans */
-	sraSpanListOr(d_curr->subspan, s_curr->subspan);
-
-	/* Merge this span with previous or next? */
-	if (d_curr->_prev != &(dest->front))
-	  sraSpanMergePrevious(d_curr);
-	if (d_curr->_next != &(dest->back))
-	  sraSpanMergeNext(d_curr);
-
-	/* Move onto the next pair to compare */
-	if (s_end > d_curr->end) {
-	  s_start = d_curr->end;
-	  d_curr = d_curr->_next;
-	} else {
-	  s_curr = s_curr->_next;
-	  s_start = s_curr->start;
-	  s_end = s_curr->end;
+  case SRA_SUBTRACT:
+    for (; na > 0; a++, na--) {
+      x1 = a->x1;
+      while (nb > 0 && b->x2 <= x1) {
+	b++; nb--;
+      }
+      while (nb > 0 && b->x1 < a->x2) {
+	sraListAddSpan(list, band, y1, y2, x1, b->x1);
+	if (b->x2 >= a->x2) {
+	  /* b may still cut into the next span of a */
+	  x1 = a->x2;
+	  break;
 	}
-      } else {
-	/* - No overlap.  Move to the next destination span */
-	d_curr = d_curr->_next;
+	x1 = b->x2;
+	b++; nb--;
       }
+      sraListAddSpan(list, band, y1, y2, x1, a->x2);
     }
+    break;
   }
+
+  sraListEndBand(list, band);
 }
 
+/* Run op over the bands of a and b into out. */
 static rfbBool
-sraSpanListAnd(sraSpanList *dest, const sraSpanList *src) {
-  sraSpan *d_curr, *s_curr, *d_next;
+sraRectsOp(sraRectList *out, int op,
+	   const sraRect *a, int na, const sraRect *b, int nb) {
+  int ia = 0, ib = 0, aEnd = 0, bEnd = 0;
+  int aTop = 0, bTop = 0, y, y2;
+
+  if (na == 0 && nb == 0)
+    return TRUE;
+  if (na > 0)
+    aEnd = sraBandEnd(a, 0, na);
+  if (nb > 0)
+    bEnd = sraBandEnd(b, 0, nb);
+  y = na > 0 && (nb == 0 || a->y1 < b->y1) ? a->y1 : b->y1;
+
+  while (ia < na || ib < nb) {
+    if (ia < na)
+      aTop = a[ia].y1 > y ? a[ia].y1 : y;
+    if (ib < nb)
+      bTop = b[ib].y1 > y ? b[ib].y1 : y;
+
+    if (!sraListGrow(out, (aEnd - ia) + (bEnd - ib)))
+      return FALSE;
 
-  if (!dest) {
-    if (!src) {
-      return 1;
+    if (ib >= nb || (ia < na && aTop < bTop)) {
+      /* only a has something here */
+      if (op == SRA_AND && ib >= nb)
+	break;
+      y2 = a[ia].y2;
+      if (ib < nb && bTop < y2)
+	y2 = bTop;
+      if (op != SRA_AND)
+	sraListAddBand(out, op, aTop, y2, a + ia, aEnd - ia, NULL, 0);
+    } else if (ia >= na || bTop < aTop) {
+      /* only b has something here */
+      if (op != SRA_OR && ia >= na)
+	break;
+      y2 = b[ib].y2;
+      if (ia < na && aTop < y2)
+	y2 = aTop;
+      if (op == SRA_OR)
+	sraListAddBand(out, op, bTop, y2, NULL, 0, b + ib, bEnd - ib);
     } else {
-      rfbErr("sraSpanListAnd:incompatible spans (only one NULL!)\n");
-      return FALSE;
+      y2 = a[ia].y2 < b[ib].y2 ? a[ia].y2 : b[ib].y2;
+      sraListAddBand(out, op, aTop, y2, a + ia, aEnd - ia, b + ib, bEnd - ib);
     }
-  }
+    y = y2;
 
-  d_curr = dest->front._next;
-  s_curr = src->front._next;
-  while ((s_curr != &(src->back)) && (d_curr != &(dest->back))) {
-
-    /* - If we haven't reached a destination span yet then move on */
-    if (d_curr->start >= s_curr->end) {
-      s_curr = s_curr->_next;
-      continue;
+    if (ia < na && a[ia].y2 <= y) {
+      ia = aEnd;
+      if (ia < na)
+	aEnd = sraBandEnd(a, ia, na);
     }
-
-    /* - If we are beyond the current destination span then remove it */
-    if (d_curr->end <= s_curr->start) {
-      sraSpan *next = d_curr->_next;
-      sraSpanRemove(d_curr);
-      sraSpanDestroy(d_curr);
-      d_curr = next;
-      continue;
+    if (ib < nb && b[ib].y2 <= y) {
+      ib = bEnd;
+      if (ib < nb)
+	bEnd = sraBandEnd(b, ib, nb);
     }
+  }
 
-    /* - If we partially overlap a span then split it up or remove bits */
-    if (s_curr->start > d_curr->start) {
-      /* - The top bit of the span does not match */
-      d_curr->start = s_curr->start;
-    }
-    if (s_curr->end < d_curr->end) {
-      /* - The end of the span does not match */
-      sraSpanInsertAfter(sraSpanCreate(s_curr->end,
-				       d_curr->end,
-				       d_curr->subspan),
-			 d_curr);
-      d_curr->end = s_curr->end;
-    }
+  return TRUE;
+}
 
-    /* - Now recursively process the affected span */
-    if (!sraSpanListAnd(d_curr->subspan, s_curr->subspan)) {
-      /* - The destination subspan is now empty, so we should remove it */
-		sraSpan *next = d_curr->_next;
-      sraSpanRemove(d_curr);
-      sraSpanDestroy(d_curr);
-      d_curr = next;
+/* Replace rgn's rectangles lo .. hi-1 with the m rectangles at rects.
+   Whichever of the rectangles before and after that range are fewer get
+   moved; the array is regrown with room on both ends if need be. */
+static rfbBool
+sraRgnSplice(sraRegion *rgn, int lo, int hi, const sraRect *rects, int m) {
+  int delta = m - (hi - lo), head = lo, tail = rgn->n - hi;
+  int front = rgn->first, back = rgn->size - rgn->first - rgn->n;
+  sraRect *base = rgn->rects;
+
+  if (delta > 0 && front < delta && back < delta) {
+    int size = rgn->size * 2, first;
+    sraRect *grown;
+
+    if (size < rgn->n + delta + SRA_MIN_RECTS)
+      size = rgn->n + delta + SRA_MIN_RECTS;
+    grown = (sraRect*)malloc(sizeof(sraRect) * size);
+    if (!grown)
+      return FALSE;
+    first = (size - rgn->n - delta) / 2;
+    memcpy(grown + first, base + rgn->first, sizeof(sraRect) * head);
+    memcpy(grown + first + lo + m, base + rgn->first + hi, sizeof(sraRect) * tail);
+    sraRectsFree(rgn->rects, rgn->size);
+    rgn->rects = base = grown;
+    rgn->size = size;
+    rgn->first = first;
+  } else if (delta > 0) {
+    if (front >= delta && (head <= tail || back < delta)) {
+      memmove(base + rgn->first - delta, base + rgn->first, sizeof(sraRect) * head);
+      rgn->first -= delta;
     } else {
-      /* Merge this span with previous or next? */
-      if (d_curr->_prev != &(dest->front))
-	sraSpanMergePrevious(d_curr);
-
-      /* - Move on to the next span */
-      d_next = d_curr;
-      if (s_curr->end >= d_curr->end) {
-	d_next = d_curr->_next;
-      }
-      if (s_curr->end <= d_curr->end) {
-	s_curr = s_curr->_next;
-      }
-      d_curr = d_next;
+      memmove(base + rgn->first + hi + delta, base + rgn->first + hi, sizeof(sraRect) * tail);
+    }
+  } else if (delta < 0) {
+    if (head < tail) {
+      memmove(base + rgn->first - delta, base + rgn->first, sizeof(sraRect) * head);
+      rgn->first -= delta;
+    } else {
+      memmove(base + rgn->first + hi + delta, base + rgn->first + hi, sizeof(sraRect) * tail);
     }
   }
 
-  while (d_curr != &(dest->back)) {
-    sraSpan *next = d_curr->_next;
-    sraSpanRemove(d_curr);
-    sraSpanDestroy(d_curr);
-    d_curr=next;
+  memcpy(base + rgn->first + lo, rects, sizeof(sraRect) * m);
+  rgn->n += delta;
+  if (rgn->n == 0)
+    rgn->first = 0;
+  return TRUE;
+}
+
+/* First rectangle with y2 > y, or n. */
+static int
+sraFindBelow(const sraRect *rects, int n, int y) {
+  int lo = 0, hi = n, mid;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (rects[mid].y2 > y)
+      hi = mid;
+    else
+      lo = mid + 1;
   }
-
-  return !sraSpanListEmpty(dest);
+  return lo;
+}
+
+/* First rectangle with y1 >= y, or n. */
+static int
+sraFindFrom(const sraRect *rects, int n, int y) {
+  int lo = 0, hi = n, mid;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (rects[mid].y1 >= y)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
 }
 
 static rfbBool
-sraSpanListSubtract(sraSpanList *dest, const sraSpanList *src) {
-  sraSpan *d_curr, *s_curr;
-
-  if (!dest) {
-    if (!src) {
-      return 1;
-    } else {
-      rfbErr("sraSpanListSubtract:incompatible spans (only one NULL!)\n");
-      return FALSE;
-    }
+sraRgnOp(sraRegion *dst, const sraRegion *src, int op) {
+  const sraRect *a = dst->rects + dst->first;
+  const sraRect *b = src->rects + src->first;
+  int na = dst->n, nb = src->n, lo, hi;
+  sraRectList out;
+
+  if (op == SRA_AND) {
+    lo = 0;
+    hi = na;
+  } else {
+    /* Only the bands of dst within the y range of src can change, along
+       with the bands right above and below, which may coalesce now. */
+    lo = sraFindBelow(a, na, b[0].y1);
+    hi = sraFindFrom(a, na, b[nb - 1].y2);
+    if (lo > 0)
+      for (lo--; lo > 0 && a[lo - 1].y1 == a[lo].y1; lo--)
+	;
+    if (hi < na)
+      hi = sraBandEnd(a, hi, na);
   }
 
-  d_curr = dest->front._next;
-  s_curr = src->front._next;
-  while ((s_curr != &(src->back)) && (d_curr != &(dest->back))) {
-
-    /* - If we haven't reached a destination span yet then move on */
-    if (d_curr->start >= s_curr->end) {
-      s_curr = s_curr->_next;
-      continue;
-    }
-
-    /* - If we are beyond the current destination span then skip it */
-    if (d_curr->end <= s_curr->start) {
-      d_curr = d_curr->_next;
-      continue;
-    }
-
-    /* - If we partially overlap the current span then split it up */
-    if (s_curr->start > d_curr->start) {
-      sraSpanInsertBefore(sraSpanCreate(d_curr->start,
-					s_curr->start,
-					d_curr->subspan),
-			  d_curr);
-      d_curr->start = s_curr->start;
-    }
-    if (s_curr->end < d_curr->end) {
-      sraSpanInsertAfter(sraSpanCreate(s_curr->end,
-				       d_curr->end,
-				       d_curr->subspan),
-			 d_curr);
-      d_curr->end = s_curr->end;
-    }
-
-    /* - Now recursively process the affected span */
-    if ((!d_curr->subspan) || !sraSpanListSubtract(d_curr->subspan, s_curr->subspan)) {
-      /* - The destination subspan is now empty, so we should remove it */
-      sraSpan *next = d_curr->_next;
-      sraSpanRemove(d_curr);
-      sraSpanDestroy(d_curr);
-      d_curr = next;
-    } else {
-      /* Merge this span with previous or next? */
-      if (d_curr->_prev != &(dest->front))
-	sraSpanMergePrevious(d_curr);
-      if (d_curr->_next != &(dest->back))
-	sraSpanMergeNext(d_curr);
-
-      /* - Move on to the next span */
-      if (s_curr->end > d_curr->end) {
-	d_curr = d_curr->_next;
-      } else {
-	s_curr = s_curr->_next;
-      }
-    }
+  out.rects = sraRectsAlloc((hi - lo) + nb, &out.size);
+  out.n = 0;
+  out.lastBand = -1;
+  if (!out.rects || !sraRectsOp(&out, op, a + lo, hi - lo, b, nb))
+    goto nomem;
+
+  if (op == SRA_AND) {
+    sraRectsFree(dst->rects, dst->size);
+    dst->rects = out.rects;
+    dst->size = out.size;
+    dst->first = 0;
+    dst->n = out.n;
+    return dst->n > 0;
   }
+  if (!sraRgnSplice(dst, lo, hi, out.rects, out.n))
+    goto nomem;
+  sraRectsFree(out.rects, out.size);
+  return dst->n > 0;
 
-  return !sraSpanListEmpty(dest);
+ nomem:
+  rfbErr("sraRgnOp: out of memory\n");
+  free(out.rects);
+  return dst->n > 0;
 }
 
 /* -=- Region routines */
 
 sraRegion *
 sraRgnCreate(void) {
-  return (sraRegion*)sraSpanListCreate();
+  return sraRgnAlloc(0);
 }
 
 sraRegion *
 sraRgnCreateRect(int x1, int y1, int x2, int y2) {
-  sraSpanList *vlist, *hlist;
-  sraSpan *vspan, *hspan;
+  sraRegion *rgn = sraRgnAlloc(1);
 
-  /* - Build the horizontal portion of the span */
-  hlist = sraSpanListCreate();
-  hspan = sraSpanCreate(x1, x2, NULL);
-  sraSpanInsertAfter(hspan, &(hlist->front));
-
-  /* - Build the vertical portion of the span */
-  vlist = sraSpanListCreate();
-  vspan = sraSpanCreate(y1, y2, hlist);
-  sraSpanInsertAfter(vspan, &(vlist->front));
-
-  sraSpanListDestroy(hlist);
-
-  return (sraRegion*)vlist;
+  if (!rgn || !rgn->rects)
+    return rgn;
+  /* An empty rectangle is kept as well, so that an update request for
+     zero pixels still leaves a non-empty requestedRegion behind. */
+  rgn->rects[0].x1 = x1;
+  rgn->rects[0].y1 = y1;
+  rgn->rects[0].x2 = x2;
+  rgn->rects[0].y2 = y2;
+  rgn->n = 1;
+  return rgn;
 }
 
 sraRegion *
 sraRgnCreateRgn(const sraRegion *src) {
-  return (sraRegion*)sraSpanListDup((sraSpanList*)src);
+  sraRegion *rgn = sraRgnAlloc(src->n);
+
+  if (!rgn || !rgn->rects || src->n == 0)
+    return rgn;
+  memcpy(rgn->rects, src->rects + src->first, sizeof(sraRect) * src->n);
+  rgn->n = src->n;
+  return rgn;
 }
 
 void
 sraRgnDestroy(sraRegion *rgn) {
-  sraSpanListDestroy((sraSpanList*)rgn);
+  sraPool *pool;
+
+  if (!rgn)
+    return;
+  pool = sraPoolGet();
+  if (pool && pool->nRegions < SRA_POOL_REGIONS) {
+    if (rgn->size > SRA_MAX_POOLED_RECTS) {
+      free(rgn->rects);
+      rgn->rects = NULL;
+      rgn->size = 0;
+    }
+    pool->regions[pool->nRegions++] = rgn;
+    return;
+  }
+  sraRectsFree(rgn->rects, rgn->size);
+  free(rgn);
 }
 
 void
 sraRgnMakeEmpty(sraRegion *rgn) {
-  sraSpanListMakeEmpty((sraSpanList*)rgn);
+  rgn->first = 0;
+  rgn->n = 0;
 }
 
 /* -=- Boolean Region ops */
 
 rfbBool
 sraRgnAnd(sraRegion *dst, const sraRegion *src) {
-  return sraSpanListAnd((sraSpanList*)dst, (sraSpanList*)src);
+  if (dst->n == 0)
+    return FALSE;
+  if (src->n == 0 ||
+      src->rects[src->first + src->n - 1].y2 <= dst->rects[dst->first].y1 ||
+      dst->rects[dst->first + dst->n - 1].y2 <= src->rects[src->first].y1) {
+    sraRgnMakeEmpty(dst);
+    return FALSE;
+  }
+  return sraRgnOp(dst, src, SRA_AND);
 }
 
 void
 sraRgnOr(sraRegion *dst, const sraRegion *src) {
-  sraSpanListOr((sraSpanList*)dst, (sraSpanList*)src);
+  if (src->n == 0 || dst == src)
+    return;
+  if (dst->n == 0) {
+    if (sraRgnReserve(dst, src->n)) {
+      memcpy(dst->rects, src->rects + src->first, sizeof(sraRect) * src->n);
+      dst->n = src->n;
+    }
+    return;
+  }
+  sraRgnOp(dst, src, SRA_OR);
 }
 
 rfbBool
 sraRgnSubtract(sraRegion *dst, const sraRegion *src) {
-  return sraSpanListSubtract((sraSpanList*)dst, (sraSpanList*)src);
+  if (dst->n == 0)
+    return FALSE;
+  if (src->n == 0 ||
+      src->rects[src->first + src->n - 1].y2 <= dst->rects[dst->first].y1 ||
+      dst->rects[dst->first + dst->n - 1].y2 <= src->rects[src->first].y1)
+    return TRUE;
+  return sraRgnOp(dst, src, SRA_SUBTRACT);
 }
 
 void
 sraRgnOffset(sraRegion *dst, int dx, int dy) {
-  sraSpan *vcurr, *hcurr;
-
-  vcurr = ((sraSpanList*)dst)->front._next;
-  while (vcurr != &(((sraSpanList*)dst)->back)) {
-    vcurr->start += dy;
-    vcurr->end += dy;
-    
-    hcurr = vcurr->subspan->front._next;
-    while (hcurr != &(vcurr->subspan->back)) {
-      hcurr->start += dx;
-      hcurr->end += dx;
-      hcurr = hcurr->_next;
-    }
+  sraRect *r = dst->rects + dst->first, *end = r + dst->n;
 
-    vcurr = vcurr->_next;
+  for (; r < end; r++) {
+    r->x1 += dx;
+    r->y1 += dy;
+    r->x2 += dx;
+    r->y2 += dy;
   }
 }
 
 sraRegion *sraRgnBBox(const sraRegion *src) {
-  int xmin=((unsigned int)(int)-1)>>1,ymin=xmin,xmax=1-xmin,ymax=xmax;
-  sraSpan *vcurr, *hcurr;
+  const sraRect *r, *end;
+  int xmin, xmax;
 
-  if(!src)
+  if(!src || src->n == 0)
     return sraRgnCreate();
 
-  vcurr = ((sraSpanList*)src)->front._next;
-  while (vcurr != &(((sraSpanList*)src)->back)) {
-    if(vcurr->start<ymin)
-      ymin=vcurr->start;
-    if(vcurr->end>ymax)
-      ymax=vcurr->end;
-    
-    hcurr = vcurr->subspan->front._next;
-    while (hcurr != &(vcurr->subspan->back)) {
-      if(hcurr->start<xmin)
-	xmin=hcurr->start;
-      if(hcurr->end>xmax)
-	xmax=hcurr->end;
-      hcurr = hcurr->_next;
-    }
-
-    vcurr = vcurr->_next;
+  r = src->rects + src->first;
+  end = r + src->n;
+  xmin = r->x1;
+  xmax = r->x2;
+  for (; r < end; r++) {
+    if(r->x1<xmin)
+      xmin=r->x1;
+    if(r->x2>xmax)
+      xmax=r->x2;
   }
 
-  if(xmax<xmin || ymax<ymin)
-    return sraRgnCreate();
-
-  return sraRgnCreateRect(xmin,ymin,xmax,ymax);
+  return sraRgnCreateRect(xmin, src->rects[src->first].y1,
+			  xmax, end[-1].y2);
 }
 
 rfbBool
 sraRgnPopRect(sraRegion *rgn, sraRect *rect, unsigned long flags) {
-  sraSpan *vcurr, *hcurr;
-  sraSpan *vend, *hend;
+  sraRect *rects = rgn->rects + rgn->first;
   rfbBool right2left = (flags & 2) == 2;
   rfbBool bottom2top = (flags & 1) == 1;
+  int i, band;
+
+  if (rgn->n == 0)
+    return 0;
 
-  /* - Pick correct order */
   if (bottom2top) {
-    vcurr = ((sraSpanList*)rgn)->back._prev;
-    vend = &(((sraSpanList*)rgn)->front);
+    band = rgn->n - 1;
+    while (band > 0 && rects[band - 1].y1 == rects[rgn->n - 1].y1)
+      band--;
+    i = right2left ? rgn->n - 1 : band;
+    *rect = rects[i];
+    memmove(rects + i, rects + i + 1, sizeof(sraRect) * (rgn->n - 1 - i));
   } else {
-    vcurr = ((sraSpanList*)rgn)->front._next;
-    vend = &(((sraSpanList*)rgn)->back);
+    i = right2left ? sraBandEnd(rects, 0, rgn->n) - 1 : 0;
+    *rect = rects[i];
+    memmove(rects + 1, rects, sizeof(sraRect) * i);
+    rgn->first++;
   }
 
-  if (vcurr != vend) {
-    rect->y1 = vcurr->start;
-    rect->y2 = vcurr->end;
-
-    /* - Pick correct order */
-    if (right2left) {
-      hcurr = vcurr->subspan->back._prev;
-      hend = &(vcurr->subspan->front);
-    } else {
-      hcurr = vcurr->subspan->front._next;
-      hend = &(vcurr->subspan->back);
-    }
-
-    if (hcurr != hend) {
-      rect->x1 = hcurr->start;
-      rect->x2 = hcurr->end;
-
-      sraSpanRemove(hcurr);
-      sraSpanDestroy(hcurr);
-      
-      if (sraSpanListEmpty(vcurr->subspan)) {
-	sraSpanRemove(vcurr);
-	sraSpanDestroy(vcurr);
-      }
-
-#if 0
-      printf("poprect:(%dx%d)-(%dx%d)\n",
-	     rect->x1, rect->y1, rect->x2, rect->y2);
-#endif
-      return 1;
-    }
-  }
-
-  return 0;
+  if (--rgn->n == 0)
+    rgn->first = 0;
+  return 1;
 }
 
 unsigned long
 sraRgnCountRects(const sraRegion *rgn) {
-  unsigned long count = sraSpanListCount((sraSpanList*)rgn);
-  return count;
+  return rgn->n;
 }
 
 rfbBool
 sraRgnEmpty(const sraRegion *rgn) {
-  return sraSpanListEmpty((sraSpanList*)rgn);
+  return rgn->n == 0;
 }
 
 /* iterator stuff */
+
+struct sraRectangleIterator {
+  rfbBool reverseX,reverseY;
+  int bandStart,bandEnd,pos;
+  const struct sraRegion* region;
+};
+
 sraRectangleIterator *sraRgnGetIterator(sraRegion *s)
 {
-  /* these values have to be multiples of 4 */
-#define DEFSIZE 4
-#define DEFSTEP 8
+  return sraRgnGetReverseIterator(s, FALSE, FALSE);
+}
+
+sraRectangleIterator *sraRgnGetReverseIterator(sraRegion *s,rfbBool reverseX,rfbBool reverseY)
+{
   sraRectangleIterator *i =
     (sraRectangleIterator*)malloc(sizeof(sraRectangleIterator));
   if(!i)
     return NULL;
 
-  /* we have to recurse eventually. So, the first sPtr is the pointer to
-     the sraSpan in the first level. the second sPtr is the pointer to
-     the sraRegion.back. The third and fourth sPtr are for the second
-     recursion level and so on. */
-  i->sPtrs = (sraSpan**)malloc(sizeof(sraSpan*)*DEFSIZE);
-  if(!i->sPtrs) {
-    free(i);
-    return NULL;
-  }
-  i->ptrSize = DEFSIZE;
-  i->sPtrs[0] = &(s->front);
-  i->sPtrs[1] = &(s->back);
-  i->ptrPos = 0;
-  i->reverseX = 0;
-  i->reverseY = 0;
-  return i;
-}
-
-sraRectangleIterator *sraRgnGetReverseIterator(sraRegion *s,rfbBool reverseX,rfbBool reverseY)
-{
-  sraRectangleIterator *i = sraRgnGetIterator(s);
-  if(reverseY) {
-    i->sPtrs[1] = &(s->front);
-    i->sPtrs[0] = &(s->back);
-  }
+  /* start with an exhausted band just before (or after) the first one */
+  i->region = s;
   i->reverseX = reverseX;
   i->reverseY = reverseY;
+  i->bandStart = i->bandEnd = reverseY ? s->n : 0;
+  i->pos = reverseX ? i->bandStart - 1 : i->bandEnd;
   return(i);
 }
 
-static rfbBool sraReverse(sraRectangleIterator *i)
-{
-  return( ((i->ptrPos&2) && i->reverseX) ||
-     (!(i->ptrPos&2) && i->reverseY));
-}
-
-static sraSpan* sraNextSpan(sraRectangleIterator *i)
-{
-  if(sraReverse(i))
-    return(i->sPtrs[i->ptrPos]->_prev);
-  else
-    return(i->sPtrs[i->ptrPos]->_next);
-}
-
 rfbBool sraRgnIteratorNext(sraRectangleIterator* i,sraRect* r)
 {
-  /* is the subspan finished? */
-  while(sraNextSpan(i) == i->sPtrs[i->ptrPos+1]) {
-    i->ptrPos -= 2;
-    if(i->ptrPos < 0) /* the end */
-      return(0);
-  }
-
-  i->sPtrs[i->ptrPos] = sraNextSpan(i);
-
-  /* is this a new subspan? */
-  while(i->sPtrs[i->ptrPos]->subspan) {
-    if(i->ptrPos+2 > i->ptrSize) { /* array is too small */
-      i->ptrSize += DEFSTEP;
-      i->sPtrs = (sraSpan**)realloc(i->sPtrs, sizeof(sraSpan*)*i->ptrSize);
-    }
-    i->ptrPos += 2;
-    if(sraReverse(i)) {
-      i->sPtrs[i->ptrPos]   =   i->sPtrs[i->ptrPos-2]->subspan->back._prev;
-      i->sPtrs[i->ptrPos+1] = &(i->sPtrs[i->ptrPos-2]->subspan->front);
+  const sraRect *rects = i->region->rects + i->region->first;
+  int n = i->region->n;
+
+  /* is the band finished? */
+  if(i->reverseX ? i->pos < i->bandStart : i->pos >= i->bandEnd) {
+    if(i->reverseY) {
+      if(i->bandStart <= 0) /* the end */
+	return(0);
+      i->bandEnd = i->bandStart;
+      i->bandStart--;
+      while(i->bandStart > 0 &&
+	    rects[i->bandStart - 1].y1 == rects[i->bandEnd - 1].y1)
+	i->bandStart--;
     } else {
-      i->sPtrs[i->ptrPos]   =   i->sPtrs[i->ptrPos-2]->subspan->front._next;
-      i->sPtrs[i->ptrPos+1] = &(i->sPtrs[i->ptrPos-2]->subspan->back);
+      if(i->bandEnd >= n) /* the end */
+	return(0);
+      i->bandStart = i->bandEnd;
+      i->bandEnd = sraBandEnd(rects, i->bandStart, n);
     }
+    i->pos = i->reverseX ? i->bandEnd - 1 : i->bandStart;
   }
 
-  if((i->ptrPos%4)!=2) {
-    rfbErr("sraRgnIteratorNext: offset is wrong (%d%%4!=2)\n",i->ptrPos);
-    return FALSE;
-  }
-
-  r->y1 = i->sPtrs[i->ptrPos-2]->start;
-  r->y2 = i->sPtrs[i->ptrPos-2]->end;
-  r->x1 = i->sPtrs[i->ptrPos]->start;
-  r->x2 = i->sPtrs[i->ptrPos]->end;
-
+  *r = rects[i->pos];
+  i->pos += i->reverseX ? -1 : 1;
   return(-1);
 }
 
 void sraRgnReleaseIterator(sraRectangleIterator* i)
 {
-  free(i->sPtrs);
   free(i);
 }
 
 void
 sraRgnPrint(const sraRegion *rgn) {
-	sraSpanListPrint((sraSpanList*)rgn);
+  const sraRect *rects = rgn->rects + rgn->first;
+  int i, end;
+
+  printf("[");
+  for (i = 0; i < rgn->n; i = end) {
+    end = sraBandEnd(rects, i, rgn->n);
+    printf("(%d-%d)[", rects[i].y1, rects[i].y2);
+    for (; i < end; i++)
+      printf("(%d-%d)", rects[i].x1, rects[i].x2);
+    printf("]");
+  }
+  printf("]");
 }
 
 rfbBool
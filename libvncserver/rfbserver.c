@@ -50,6 +50,12 @@
 #endif
 
 #include "sockets.h"
+#include "rfbpoll.h"
+#include "encodecache.h"
+#include "translatecache.h"
+#include "tilehash.h"
+#include "adaptive.h"
+#include "parallelrects.h"
 
 #ifdef DEBUGPROTO
 #undef DEBUGPROTO
@@ -119,6 +125,9 @@ static void rfbProcessClientProtocolVersion(rfbClientPtr cl);
 static void rfbProcessClientNormalMessage(rfbClientPtr cl);
 static void rfbProcessClientInitMessage(rfbClientPtr cl);
 
+/* sockets.c */
+void rfbFreeClientOutput(rfbClientPtr cl);
+
 #if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
 void rfbIncrClientRef(rfbClientPtr cl)
 {
@@ -357,9 +366,6 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
 	rfbLogPerror("setsockopt failed: can't set TCP_NODELAY flag, non TCP socket?");
       }
 
-      FD_SET(sock,&(rfbScreen->allFds));
-		rfbScreen->maxFd = rfbMax(sock,rfbScreen->maxFd);
-
       INIT_MUTEX(cl->outputMutex);
       INIT_MUTEX(cl->refCountMutex);
       INIT_MUTEX(cl->sendMutex);
@@ -458,6 +464,13 @@ rfbNewTCPOrUDPClient(rfbScreenInfoPtr rfbScreen,
       cl->pipe_notify_client_thread[1] = -1;
 #endif
 
+      /* only now, the poll backend may hand out cl as soon as it has it */
+      if(!rfbPollAddSocket(rfbScreen, sock, cl)) {
+        rfbCloseClient(cl);
+        rfbClientConnectionGone(cl);
+        return NULL;
+      }
+
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
       /*
        * Wait a few ms for the client to send WebSockets connection (TLS/SSL or plain)
@@ -544,6 +557,8 @@ rfbClientConnectionGone(rfbClientPtr cl)
 
     UNLOCK(rfbClientListMutex);
 
+    rfbPollForgetClient(cl);
+
 #if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
     if(cl->screen->backgroundLoop != FALSE) {
       int i;
@@ -557,24 +572,35 @@ rfbClientConnectionGone(rfbClientPtr cl)
     }
 #endif
 
-    if(cl->sock != RFB_INVALID_SOCKET)
+    if(cl->sock != RFB_INVALID_SOCKET) {
+	rfbPollRemoveSocket(cl->screen, cl->sock);
 	rfbCloseSocket(cl->sock);
+    }
+
+    rfbFreeClientOutput(cl);
 
     if (cl->scaledScreen!=NULL)
         cl->scaledScreen->scaledScreenRefCount--;
 
 #ifdef LIBVNCSERVER_HAVE_LIBZ
     rfbFreeZrleData(cl);
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+    rfbFreeTightData(cl);
+#endif
 #endif
 
     rfbFreeUltraData(cl);
+    rfbParallelRectsFree(cl);
 
     /* free buffers holding pixel data before and after encoding */
     free(cl->beforeEncBuf);
     free(cl->afterEncBuf);
 
-    if(cl->sock != RFB_INVALID_SOCKET)
-       FD_CLR(cl->sock,&(cl->screen->allFds));
+    if (cl->tileBytesSuppressed > 0)
+	rfbLog("Client %s: %.1f MB of unchanged tiles not sent again\n",
+	       cl->host, cl->tileBytesSuppressed / 1048576.0);
+    rfbTileHashFree(cl);
+    rfbAdaptiveFree(cl);
 
     cl->clientGoneHook(cl);
 
@@ -602,6 +628,8 @@ rfbClientConnectionGone(rfbClientPtr cl)
     sraRgnDestroy(cl->requestedRegion);
     sraRgnDestroy(cl->copyRegion);
 
+    rfbCursorOverlayFree(cl);
+    rfbTranslateCacheDetach(cl);
     if (cl->translateLookupTable) free(cl->translateLookupTable);
 
     TINI_COND(cl->updateCond);
@@ -820,7 +848,11 @@ rfbProcessClientInitMessage(rfbClientPtr cl)
 	extension = next;
     }
 
+    LOCK(cl->updateMutex);
     cl->state = RFB_NORMAL;
+    /* clientOutput() waits for this */
+    TSIGNAL(cl->updateCond);
+    UNLOCK(cl->updateMutex);
 
     if (!cl->reverseConnection &&
                         (cl->screen->neverShared || (!cl->screen->alwaysShared && !ci.shared))) {
@@ -1002,6 +1034,7 @@ rfbSendSupportedEncodings(rfbClientPtr cl)
 	rfbEncodingZlib,
 	rfbEncodingZRLE,
 	rfbEncodingZYWRLE,
+	rfbEncodingTRLE,
 #endif
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
 	rfbEncodingTight,
@@ -1506,8 +1539,6 @@ rfbBool rfbSendFileTransferChunk(rfbClientPtr cl)
     char readBuf[sz_rfbBlockSize];
     int bytesRead=0;
     int retval=0;
-    fd_set wfds;
-    struct timeval tv;
     int n;
 #ifdef LIBVNCSERVER_HAVE_LIBZ
     unsigned char compBuf[sz_rfbBlockSize + 1024];
@@ -1526,21 +1557,17 @@ rfbBool rfbSendFileTransferChunk(rfbClientPtr cl)
 		return TRUE;
     }
 
+    /* let a client with a full send queue catch up first */
+    if (rfbSendQueueFull(cl))
+        return TRUE;
+
     /* If not sending, or no file open...   Return as if we sent something! */
     if ((cl->fileTransfer.fd!=-1) && (cl->fileTransfer.sending==1))
     {
-	FD_ZERO(&wfds);
-        FD_SET(cl->sock, &wfds);
-
         /* return immediately */
-	tv.tv_sec = 0; 
-	tv.tv_usec = 0;
-	n = select(cl->sock + 1, NULL, &wfds, NULL, &tv);
+	n = rfbPollSocket(cl->sock, TRUE, 0);
 
 	if (n<0) {
-#ifdef WIN32
-	    errno=WSAGetLastError();
-#endif
             rfbLog("rfbSendFileTransferChunk() select failed: %s\n", strerror(errno));
 	}
         /* We have space on the transmit queue */
@@ -2050,6 +2077,10 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 	cl->readyForSetColourMapEntries = TRUE;
         cl->screen->setTranslateFunction(cl);
 
+        LOCK(cl->updateMutex);
+        rfbTileHashInvalidate(cl);
+        UNLOCK(cl->updateMutex);
+
         rfbStatRecordMessageRcvd(cl, msg.type, sz_rfbSetPixelFormatMsg, sz_rfbSetPixelFormatMsg);
 
         return;
@@ -2148,6 +2179,7 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 	    case rfbEncodingZlib:
             case rfbEncodingZRLE:
             case rfbEncodingZYWRLE:
+            case rfbEncodingTRLE:
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
 	    case rfbEncodingTight:
 #endif
@@ -2401,6 +2433,7 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 
         LOCK(cl->updateMutex);
 	sraRgnOr(cl->requestedRegion,tmpRegion);
+	rfbAdaptiveRequest(cl);
 
 	if (!cl->readyForSetColourMapEntries) {
 	    /* client hasn't sent a SetPixelFormat so is using server's */
@@ -2418,6 +2451,8 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
        if (!msg.fur.incremental) {
 	    sraRgnOr(cl->modifiedRegion,tmpRegion);
 	    sraRgnSubtract(cl->copyRegion,tmpRegion);
+	    /* the client wants it all, whatever it had */
+	    rfbTileHashInvalidate(cl);
             if (cl->useExtDesktopSize)
                 cl->newFBSizePending = TRUE;
        }
@@ -2805,6 +2840,47 @@ rfbProcessClientNormalMessage(rfbClientPtr cl)
 
 
 
+/*
+ * Send one rectangle of the update in the client's preferred encoding.
+ */
+
+static rfbBool
+rfbSendRectEncoded(rfbClientPtr cl, int x, int y, int w, int h)
+{
+    switch (cl->preferredEncoding) {
+    case -1:
+    case rfbEncodingRaw:
+        return rfbSendRectEncodingRaw(cl, x, y, w, h);
+    case rfbEncodingRRE:
+        return rfbSendRectEncodingRRE(cl, x, y, w, h);
+    case rfbEncodingCoRRE:
+        return rfbSendRectEncodingCoRRE(cl, x, y, w, h);
+    case rfbEncodingHextile:
+        return rfbSendRectEncodingHextile(cl, x, y, w, h);
+    case rfbEncodingUltra:
+        return rfbSendRectEncodingUltra(cl, x, y, w, h);
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+    case rfbEncodingZlib:
+        return rfbSendRectEncodingZlib(cl, x, y, w, h);
+    case rfbEncodingZRLE:
+    case rfbEncodingZYWRLE:
+        return rfbSendRectEncodingZRLE(cl, x, y, w, h);
+    case rfbEncodingTRLE:
+        return rfbSendRectEncodingTRLE(cl, x, y, w, h);
+#endif
+#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
+    case rfbEncodingTight:
+        return rfbSendRectEncodingTight(cl, x, y, w, h);
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+    case rfbEncodingTightPng:
+        return rfbSendRectEncodingTightPng(cl, x, y, w, h);
+#endif
+#endif
+    }
+    return TRUE;
+}
+
+
 /*
  * rfbSendFramebufferUpdate - send the currently pending framebuffer update to
  * the RFB client.
@@ -2827,6 +2903,8 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     rfbBool sendSupportedMessages = FALSE;
     rfbBool sendSupportedEncodings = FALSE;
     rfbBool sendServerIdentity = FALSE;
+    rfbBool parallel = FALSE;
+    rfbBool cursorComposited = FALSE;
     rfbBool result = TRUE;
     
 
@@ -2968,6 +3046,9 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	    cl->progressiveSliceY=y;
     }
 
+    /* leave out the tiles the client already has */
+    rfbTileHashFilter(cl,updateRegion);
+
     sraRgnOr(updateRegion,cl->copyRegion);
     if(!sraRgnAnd(updateRegion,cl->requestedRegion) &&
        sraRgnEmpty(updateRegion) &&
@@ -3023,6 +3104,8 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
      sraRgnMakeEmpty(cl->copyRegion);
      cl->copyDX = 0;
      cl->copyDY = 0;
+
+     rfbAdaptiveBeginUpdate(cl,updateRegion);
    
      UNLOCK(cl->updateMutex);
    
@@ -3035,9 +3118,17 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	UNLOCK(cl->screen->cursorMutex);
 	rfbRedrawAfterHideCursor(cl,updateRegion);
       }
-      rfbShowCursor(cl);
+      cursorComposited = rfbCursorOverlayBegin(cl);
+      if (!cursorComposited)
+        rfbShowCursor(cl);
     }
 
+    /* bring a scaled screen up to date, cursor included */
+    if (cl->screen!=cl->scaledScreen)
+        rfbScaledScreenRefresh(cl->screen, cl->scaledScreen);
+
+    rfbTileHashRecord(cl,updateRegion,updateCopyRegion);
+
     /*
      * Now send the update.
      */
@@ -3170,6 +3261,9 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
     } else {
 	fu->nRects = 0xFFFF;
     }
+
+    /* write the whole update at once, see rfbSendUpdateData() */
+    rfbBeginOutputBatch(cl);
     cl->ublen = sz_rfbFramebufferUpdateMsg;
 
    if (sendCursorShape) {
@@ -3207,6 +3301,8 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
 	        goto updateFailed;
     }
 
+    parallel = rfbParallelRectsBegin(cl, updateRegion, rfbSendRectEncoded);
+
     for(i = sraRgnGetIterator(updateRegion); sraRgnIteratorNext(i,&rect);){
         int x = rect.x1;
         int y = rect.y1;
@@ -3217,58 +3313,23 @@ rfbSendFramebufferUpdate(rfbClientPtr cl,
         if (cl->screen!=cl->scaledScreen)
             rfbScaledCorrection(cl->screen, cl->scaledScreen, &x, &y, &w, &h, "rfbSendFramebufferUpdate");
 
-        switch (cl->preferredEncoding) {
-	case -1:
-        case rfbEncodingRaw:
-            if (!rfbSendRectEncodingRaw(cl, x, y, w, h))
-	        goto updateFailed;
-            break;
-        case rfbEncodingRRE:
-            if (!rfbSendRectEncodingRRE(cl, x, y, w, h))
-	        goto updateFailed;
-            break;
-        case rfbEncodingCoRRE:
-            if (!rfbSendRectEncodingCoRRE(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-        case rfbEncodingHextile:
-            if (!rfbSendRectEncodingHextile(cl, x, y, w, h))
-	        goto updateFailed;
-            break;
-        case rfbEncodingUltra:
-            if (!rfbSendRectEncodingUltra(cl, x, y, w, h))
+        if (parallel) {
+            if (!rfbParallelRectsQueue(cl, x, y, w, h))
                 goto updateFailed;
-            break;
-#ifdef LIBVNCSERVER_HAVE_LIBZ
-	case rfbEncodingZlib:
-	    if (!rfbSendRectEncodingZlib(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-       case rfbEncodingZRLE:
-       case rfbEncodingZYWRLE:
-           if (!rfbSendRectEncodingZRLE(cl, x, y, w, h))
-	       goto updateFailed;
-           break;
-#endif
-#if defined(LIBVNCSERVER_HAVE_LIBJPEG) && (defined(LIBVNCSERVER_HAVE_LIBZ) || defined(LIBVNCSERVER_HAVE_LIBPNG))
-	case rfbEncodingTight:
-	    if (!rfbSendRectEncodingTight(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-#ifdef LIBVNCSERVER_HAVE_LIBPNG
-	case rfbEncodingTightPng:
-	    if (!rfbSendRectEncodingTightPng(cl, x, y, w, h))
-	        goto updateFailed;
-	    break;
-#endif
-#endif
-        }
+        } else if (cl->screen->encodeCache) {
+            if (!rfbEncodeCacheSendRect(cl, x, y, w, h, rfbSendRectEncoded))
+                goto updateFailed;
+        } else if (!rfbSendRectEncoded(cl, x, y, w, h))
+            goto updateFailed;
     }
     if (i) {
         sraRgnReleaseIterator(i);
         i = NULL;
     }
 
+    if (parallel && !rfbParallelRectsEnd(cl))
+        goto updateFailed;
+
     if ( nUpdateRegionRects == 0xFFFF &&
 	 !rfbSendLastRectMarker(cl) )
 	    goto updateFailed;
@@ -3278,10 +3339,23 @@ updateFailed:
 	result = FALSE;
     }
 
-    if (!cl->enableCursorShapeUpdates) {
+    rfbAdaptiveEndUpdate(cl);
+
+    /* before rfbHideCursor(), the batch may point into the framebuffer */
+    if (rfbEndOutputBatch(cl) < 0 && result) {
+        rfbLogPerror("rfbSendFramebufferUpdate: write");
+        rfbCloseClient(cl);
+        result = FALSE;
+    }
+
+    if (cursorComposited)
+      rfbCursorOverlayEnd(cl);
+    else if (!cl->enableCursorShapeUpdates) {
       rfbHideCursor(cl);
     }
 
+    rfbTileHashVerify(cl);
+
     if(i)
         sraRgnReleaseIterator(i);
     sraRgnDestroy(updateRegion);
@@ -3356,6 +3430,9 @@ rfbSendCopyRegion(rfbClientPtr cl,
  * Send a given rectangle in raw encoding (rfbEncodingRaw).
  */
 
+/* shorter framebuffer rows are copied rather than referenced */
+#define RAW_MIN_REF_LINE 512
+
 rfbBool
 rfbSendRectEncodingRaw(rfbClientPtr cl,
                        int x,
@@ -3391,6 +3468,18 @@ rfbSendRectEncodingRaw(rfbClientPtr cl,
     rfbStatRecordEncodingSent(cl, rfbEncodingRaw, sz_rfbFramebufferUpdateRectHeader + bytesPerLine * h,
         sz_rfbFramebufferUpdateRectHeader + bytesPerLine * h);
 
+    /* Nothing to translate: send the framebuffer rows themselves. */
+    if (cl->translateFn == rfbTranslateNone && bytesPerLine * h > UPDATE_BUF_SIZE) {
+        if (bytesPerLine == cl->scaledScreen->paddedWidthInBytes)
+            return rfbSendUpdateDataRef(cl, fbptr, bytesPerLine * h);
+        if (bytesPerLine >= RAW_MIN_REF_LINE) {
+            for (; h > 0; h--, fbptr += cl->scaledScreen->paddedWidthInBytes)
+                if (!rfbSendUpdateDataRef(cl, fbptr, bytesPerLine))
+                    return FALSE;
+            return TRUE;
+        }
+    }
+
     nlines = (UPDATE_BUF_SIZE - cl->ublen) / bytesPerLine;
 
     while (TRUE) {
@@ -3601,10 +3690,17 @@ rfbSendExtDesktopSize(rfbClientPtr cl,
 rfbBool
 rfbSendUpdateBuf(rfbClientPtr cl)
 {
-    if(cl->sock<0)
+    if(cl->sock<0 && !cl->parallelTask)
       return FALSE;
 
-    if (rfbWriteExact(cl, cl->updateBuf, cl->ublen) < 0) {
+    if (cl->encodeCapture)
+      rfbEncodeCacheCapture(cl);
+
+    if (cl->parallelTask) {
+        /* encoding on the encode pool, see parallelrects.c */
+        if (!rfbParallelRectsAppend(cl, cl->updateBuf, cl->ublen))
+            return FALSE;
+    } else if (rfbWriteBatched(cl, cl->updateBuf, cl->ublen, TRUE) < 0) {
         rfbLogPerror("rfbSendUpdateBuf: write");
         rfbCloseClient(cl);
         return FALSE;
@@ -3614,6 +3710,44 @@ rfbSendUpdateBuf(rfbClientPtr cl)
     return TRUE;
 }
 
+/*
+ * Send encoded data that is too big for updateBuf, after what is in there
+ * already. rfbSendUpdateDataRef() does not copy buf while a framebuffer
+ * update is being sent, buf must not change until that is done then.
+ */
+
+static rfbBool
+sendUpdateData(rfbClientPtr cl, const char *buf, int len, rfbBool copy)
+{
+    if (cl->ublen > 0 && !rfbSendUpdateBuf(cl))
+        return FALSE;
+
+    if (cl->encodeCapture)
+      rfbEncodeCacheCaptureData(cl, buf, len);
+
+    if (cl->parallelTask)
+        return rfbParallelRectsAppend(cl, buf, len);
+
+    if (rfbWriteBatched(cl, buf, len, copy) < 0) {
+        rfbLogPerror("rfbSendUpdateData: write");
+        rfbCloseClient(cl);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+rfbBool
+rfbSendUpdateData(rfbClientPtr cl, const char *buf, int len)
+{
+    return sendUpdateData(cl, buf, len, TRUE);
+}
+
+rfbBool
+rfbSendUpdateDataRef(rfbClientPtr cl, const char *buf, int len)
+{
+    return sendUpdateData(cl, buf, len, FALSE);
+}
+
 /*
  * rfbSendSetColourMapEntries sends a SetColourMapEntries message to the
  * client, using values from the currently installed colormap.
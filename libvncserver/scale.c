@@ -32,6 +32,8 @@
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
 #include "private.h"
+#include "simd.h"
+#include "workerpool.h"
 
 #ifdef LIBVNCSERVER_HAVE_FCNTL_H
 #include <fcntl.h>
@@ -132,149 +134,365 @@ void rfbScaledCorrection(rfbScreenInfoPtr from, rfbScreenInfoPtr to, int *x, int
     if (*y+*h > to->height) *h=to->height - *y;
 }
 
+/*
+ * Scaled screens are area averages of the framebuffer: a destination pixel
+ * is the mean of the source pixels it covers, the ones on its edges
+ * weighted by how much of them it covers, so ratios like 1920 to 1366
+ * average as well as 2 to 1 does. The weights are fixed point with
+ * SCALE_WEIGHT_ONE for a whole pixel and sum to it along each axis. Both
+ * axes are separate passes: a row of destination pixels first adds up the
+ * source rows it covers column by column, then the columns each pixel
+ * covers. With 8 bit weights that stays within 32 bits even for 16 bit
+ * channels.
+ */
+#define SCALE_WEIGHT_BITS 8
+#define SCALE_WEIGHT_ONE (1 << SCALE_WEIGHT_BITS)
+
+/* source pixels per task before the rows are spread over encodePool */
+#define SCALE_PARALLEL_PIXELS (128 * 1024)
+
+/* The source pixels destination pixels first..first+count-1 of one axis
+   cover, and their weights. */
+typedef struct {
+    int first;
+    int *start, *count;
+    int *weights;   /* stride per destination pixel */
+    int stride;
+} rfbScaleAxis;
+
+typedef struct {
+    rfbScreenInfoPtr from, to;
+    int x1, y1, x2, y2;     /* the destination rectangle */
+    rfbScaleAxis ax, ay;
+    int srcX1, srcX2;       /* the source columns it covers */
+    int rowsPerTask;
+} rfbScaleJob;
+
+static void scaleAxisFree(rfbScaleAxis *a)
+{
+    free(a->start);
+    free(a->count);
+    free(a->weights);
+}
+
+/* Weights of destination pixels d1..d2-1 on an axis of src source and dst
+   destination pixels. Destination pixel d covers the source from d*src/dst
+   to (d+1)*src/dst; in units of 1/dst pixel, pixel s overlaps it for
+   overlap(s) and all overlaps add up to src. Rounding the running total
+   instead of each weight keeps the sum exact. */
+static rfbBool scaleAxisInit(rfbScaleAxis *a, int src, int dst, int d1, int d2)
+{
+    uint64_t begin, end, lo, hi, covered;
+    int d, s, k, last, sum;
+
+    a->first = d1;
+    a->stride = src / dst + 2;
+    a->start = (int *)malloc((d2 - d1) * sizeof(int));
+    a->count = (int *)malloc((d2 - d1) * sizeof(int));
+    a->weights = (int *)malloc((size_t)(d2 - d1) * a->stride * sizeof(int));
+    if (!a->start || !a->count || !a->weights) {
+        scaleAxisFree(a);
+        return FALSE;
+    }
+
+    for (d = d1; d < d2; d++) {
+        k = d - d1;
+        begin = (uint64_t)d * src;
+        end = begin + src;
+        a->start[k] = (int)(begin / dst);
+        a->count[k] = (int)((end - 1) / dst) - a->start[k] + 1;
+        covered = 0;
+        last = 0;
+        for (s = 0; s < a->count[k]; s++) {
+            lo = (uint64_t)(a->start[k] + s) * dst;
+            hi = lo + dst;
+            covered += (hi < end ? hi : end) - (lo > begin ? lo : begin);
+            sum = (int)((covered * SCALE_WEIGHT_ONE + src / 2) / src);
+            a->weights[k * a->stride + s] = sum - last;
+            last = sum;
+        }
+    }
+    return TRUE;
+}
+
+static InlineX uint32_t scaleGetPixel(const unsigned char *p, int bytesPerPixel)
+{
+    uint32_t value = 0;
+    int z;
+
+    switch (bytesPerPixel) {
+    case 4: return *((const uint32_t *)p);
+    case 2: return *((const uint16_t *)p);
+    case 1: return *p;
+    default:
+        /* fixme: endianness problem? */
+        for (z = 0; z < bytesPerPixel; z++)
+            value |= (uint32_t)p[z] << (8 * z);
+        return value;
+    }
+}
+
+static InlineX void scalePutPixel(unsigned char *p, int bytesPerPixel, uint32_t value)
+{
+    int z;
+
+    switch (bytesPerPixel) {
+    case 4: *((uint32_t *)p) = value; break;
+    case 2: *((uint16_t *)p) = (uint16_t)value; break;
+    case 1: *p = (unsigned char)value; break;
+    default:
+        /* fixme: endianness problem? */
+        for (z = 0; z < bytesPerPixel; z++)
+            p[z] = (unsigned char)(value >> (8 * z));
+        break;
+    }
+}
+
+/* Not truecolour, so we can't blend. Just use the top-left pixel instead */
+static void scaleRowsNearest(rfbScaleJob *job, int y1, int y2)
+{
+    rfbScreenInfoPtr from = job->from, to = job->to;
+    int bytesPerPixel = from->bitsPerPixel / 8;
+    const unsigned char *src;
+    unsigned char *dst;
+    int x, y;
+
+    for (y = y1; y < y2; y++) {
+        src = (const unsigned char *)from->frameBuffer +
+            (size_t)job->ay.start[y - job->ay.first] * from->paddedWidthInBytes;
+        dst = (unsigned char *)to->frameBuffer +
+            (size_t)y * to->paddedWidthInBytes + job->x1 * bytesPerPixel;
+        for (x = job->x1; x < job->x2; x++, dst += bytesPerPixel)
+            memcpy(dst, src + job->ax.start[x - job->ax.first] * bytesPerPixel,
+                   bytesPerPixel);
+    }
+}
+
+/* Blend neighbouring pixels together */
+static void scaleRowsAverage(rfbScaleJob *job, int y1, int y2, uint32_t *sums)
+{
+    rfbScreenInfoPtr from = job->from, to = job->to;
+    const rfbPixelFormat *format = &from->serverFormat;
+    int bytesPerPixel = from->bitsPerPixel / 8;
+    int width = job->srcX2 - job->srcX1;
+    uint32_t *red = sums, *green = sums + width, *blue = sums + 2 * width;
+    uint32_t redMax = format->redMax, greenMax = format->greenMax;
+    uint32_t blueMax = format->blueMax;
+    uint32_t pixel, r, g, b, w;
+    rfbBool kernel;
+    int shift[3];
+    const unsigned char *src;
+    const int *weights;
+    unsigned char *dst;
+    int x, y, i, j, k, n;
+
+    shift[0] = format->redShift;
+    shift[1] = format->greenShift;
+    shift[2] = format->blueShift;
+    kernel = from->bitsPerPixel == 32 &&
+        redMax == 255 && greenMax == 255 && blueMax == 255;
+
+    for (y = y1; y < y2; y++) {
+        /* the source rows, column by column */
+        memset(sums, 0, 3 * width * sizeof(uint32_t));
+        k = y - job->ay.first;
+        weights = job->ay.weights + k * job->ay.stride;
+        for (j = 0; j < job->ay.count[k]; j++) {
+            src = (const unsigned char *)from->frameBuffer +
+                (size_t)(job->ay.start[k] + j) * from->paddedWidthInBytes +
+                job->srcX1 * bytesPerPixel;
+            w = weights[j];
+            if (kernel) {
+                rfbSimd()->scaleAccumulate32((const uint32_t *)src, width,
+                                             shift, (int)w, red, green, blue);
+                continue;
+            }
+            for (i = 0; i < width; i++, src += bytesPerPixel) {
+                pixel = scaleGetPixel(src, bytesPerPixel);
+                red[i] += ((pixel >> shift[0]) & redMax) * w;
+                green[i] += ((pixel >> shift[1]) & greenMax) * w;
+                blue[i] += ((pixel >> shift[2]) & blueMax) * w;
+            }
+        }
+
+        /* then the columns of each pixel */
+        dst = (unsigned char *)to->frameBuffer +
+            (size_t)y * to->paddedWidthInBytes + job->x1 * bytesPerPixel;
+        for (x = job->x1; x < job->x2; x++, dst += bytesPerPixel) {
+            k = x - job->ax.first;
+            weights = job->ax.weights + k * job->ax.stride;
+            i = job->ax.start[k] - job->srcX1;
+            r = g = b = 0;
+            for (n = 0; n < job->ax.count[k]; n++, i++) {
+                r += red[i] * weights[n];
+                g += green[i] * weights[n];
+                b += blue[i] * weights[n];
+            }
+            r = (r + SCALE_WEIGHT_ONE * SCALE_WEIGHT_ONE / 2) >> (2 * SCALE_WEIGHT_BITS);
+            g = (g + SCALE_WEIGHT_ONE * SCALE_WEIGHT_ONE / 2) >> (2 * SCALE_WEIGHT_BITS);
+            b = (b + SCALE_WEIGHT_ONE * SCALE_WEIGHT_ONE / 2) >> (2 * SCALE_WEIGHT_BITS);
+            scalePutPixel(dst, bytesPerPixel,
+                          r << shift[0] | g << shift[1] | b << shift[2]);
+        }
+    }
+}
+
+static void scaleRowsTask(void *data, int index)
+{
+    rfbScaleJob *job = (rfbScaleJob *)data;
+    int y1 = job->y1 + index * job->rowsPerTask;
+    int y2 = y1 + job->rowsPerTask;
+    uint32_t *sums;
+
+    if (y2 > job->y2)
+        y2 = job->y2;
+    if (!job->from->serverFormat.trueColour) {
+        scaleRowsNearest(job, y1, y2);
+        return;
+    }
+    sums = (uint32_t *)malloc(3 * (size_t)(job->srcX2 - job->srcX1) * sizeof(uint32_t));
+    if (!sums) {
+        rfbErr("rfbScaledScreenUpdateRect: out of memory\n");
+        return;
+    }
+    scaleRowsAverage(job, y1, y2, sums);
+    free(sums);
+}
+
+/* Rescale the part of ptr the rectangle x0,y0,w0,h0 of screen maps to,
+ * spreading the rows over screen->encodePool if there are many. */
 void rfbScaledScreenUpdateRect(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, int x0, int y0, int w0, int h0)
 {
-    int x,y,w,v,z;
-    int x1, y1, w1, h1;
-    int bitsPerPixel, bytesPerPixel, bytesPerLine, areaX, areaY, area2;
-    unsigned char *srcptr, *dstptr;
+    rfbScaleJob job;
+    uint64_t pixels;
+    int tasks, last;
 
     /* Nothing to do!!! */
     if (screen==ptr) return;
-
-    x1 = x0;
-    y1 = y0;
-    w1 = w0;
-    h1 = h0;
-
-    rfbScaledCorrection(screen, ptr, &x1, &y1, &w1, &h1, "rfbScaledScreenUpdateRect");
-    x0 = ScaleX(ptr, screen, x1);
-    y0 = ScaleY(ptr, screen, y1);
-    w0 = ScaleX(ptr, screen, w1);
-    h0 = ScaleY(ptr, screen, h1);
-
-    bitsPerPixel = screen->bitsPerPixel;
-    bytesPerPixel = bitsPerPixel / 8;
-    bytesPerLine = w1 * bytesPerPixel;
-    srcptr = (unsigned char *)(screen->frameBuffer +
-     (y0 * screen->paddedWidthInBytes + x0 * bytesPerPixel));
-    dstptr = (unsigned char *)(ptr->frameBuffer +
-     ( y1 * ptr->paddedWidthInBytes + x1 * bytesPerPixel));
-    /* The area of the source framebuffer for each destination pixel */
-    areaX = ScaleX(ptr,screen,1);
-    areaY = ScaleY(ptr,screen,1);
-    area2 = areaX*areaY;
-
-
-    /* Ensure that we do not go out of bounds */
-    if ((x1+w1) > (ptr->width))
-    {
-      if (x1==0) w1=ptr->width; else x1 = ptr->width - w1;
+    /* rfbNewFramebuffer() changed the format under the scaled screen */
+    if (ptr->bitsPerPixel != screen->bitsPerPixel) return;
+
+    if (x0 < 0) { w0 += x0; x0 = 0; }
+    if (y0 < 0) { h0 += y0; y0 = 0; }
+    if (x0 + w0 > screen->width) w0 = screen->width - x0;
+    if (y0 + h0 > screen->height) h0 = screen->height - y0;
+    if (w0 <= 0 || h0 <= 0 || ptr->width <= 0 || ptr->height <= 0)
+        return;
+
+    /* every destination pixel that covers part of the rectangle */
+    job.from = screen;
+    job.to = ptr;
+    job.x1 = (int)((uint64_t)x0 * ptr->width / screen->width);
+    job.y1 = (int)((uint64_t)y0 * ptr->height / screen->height);
+    job.x2 = (int)(((uint64_t)(x0 + w0) * ptr->width + screen->width - 1) / screen->width);
+    job.y2 = (int)(((uint64_t)(y0 + h0) * ptr->height + screen->height - 1) / screen->height);
+    if (job.x2 > ptr->width) job.x2 = ptr->width;
+    if (job.y2 > ptr->height) job.y2 = ptr->height;
+
+    if (!scaleAxisInit(&job.ax, screen->width, ptr->width, job.x1, job.x2))
+        goto nomem;
+    if (!scaleAxisInit(&job.ay, screen->height, ptr->height, job.y1, job.y2)) {
+        scaleAxisFree(&job.ax);
+        goto nomem;
     }
-    if ((y1+h1) > (ptr->height))
-    {
-      if (y1==0) h1=ptr->height; else y1 = ptr->height - h1;
+    last = job.x2 - 1 - job.x1;
+    job.srcX1 = job.ax.start[0];
+    job.srcX2 = job.ax.start[last] + job.ax.count[last];
+
+    tasks = 1;
+    pixels = (uint64_t)(job.srcX2 - job.srcX1) * h0;
+    if (screen->encodePool && pixels >= 2 * SCALE_PARALLEL_PIXELS) {
+        tasks = (int)(pixels / SCALE_PARALLEL_PIXELS);
+        if (tasks > 4 * (rfbWorkerPoolSize(screen->encodePool) + 1))
+            tasks = 4 * (rfbWorkerPoolSize(screen->encodePool) + 1);
+        if (tasks > job.y2 - job.y1)
+            tasks = job.y2 - job.y1;
     }
-    /*
-     * rfbLog("rfbScaledScreenUpdateRect(%dXx%dY-%dWx%dH  ->  %dXx%dY-%dWx%dH <%dx%d>) {%dWx%dH -> %dWx%dH} 0x%p\n",
-     *    x0, y0, w0, h0, x1, y1, w1, h1, areaX, areaY,
-     *    screen->width, screen->height, ptr->width, ptr->height, ptr->frameBuffer);
-     */
+    job.rowsPerTask = (job.y2 - job.y1 + tasks - 1) / tasks;
+    tasks = (job.y2 - job.y1 + job.rowsPerTask - 1) / job.rowsPerTask;
+    rfbWorkerPoolRun(tasks > 1 ? screen->encodePool : NULL, scaleRowsTask, &job, tasks);
+
+    scaleAxisFree(&job.ax);
+    scaleAxisFree(&job.ay);
+    return;
 
-    if (screen->serverFormat.trueColour) { /* Blend neighbouring pixels together */
-      unsigned char *srcptr2;
-      unsigned long pixel_value, red, green, blue;
-      unsigned int redShift = screen->serverFormat.redShift;
-      unsigned int greenShift = screen->serverFormat.greenShift;
-      unsigned int blueShift = screen->serverFormat.blueShift;
-      unsigned long redMax = screen->serverFormat.redMax;
-      unsigned long greenMax = screen->serverFormat.greenMax;
-      unsigned long blueMax = screen->serverFormat.blueMax;
-
-     /* for each *destination* pixel... */
-     for (y = 0; y < h1; y++) {
-       for (x = 0; x < w1; x++) {
-         red = green = blue = 0;
-         /* Get the totals for rgb from the source grid... */
-         for (w = 0; w < areaX; w++) {
-           for (v = 0; v < areaY; v++) {
-             srcptr2 = &srcptr[(((x * areaX) + w) * bytesPerPixel) +
-                               (v * screen->paddedWidthInBytes)];
-             pixel_value = 0;
-
-
-             switch (bytesPerPixel) {
-             case 4: pixel_value = *((unsigned int *)srcptr2);   break;
-             case 2: pixel_value = *((unsigned short *)srcptr2); break;
-             case 1: pixel_value = *((unsigned char *)srcptr2);  break;
-             default:
-               /* fixme: endianness problem? */
-               for (z = 0; z < bytesPerPixel; z++)
-                 pixel_value += (srcptr2[z] << (8 * z));
-                break;
-              }
-              /*
-              srcptr2 += bytesPerPixel;
-              */
-
-            red += ((pixel_value >> redShift) & redMax);
-            green += ((pixel_value >> greenShift) & greenMax);
-            blue += ((pixel_value >> blueShift) & blueMax);
-
-           }
-         }
-         /* We now have a total for all of the colors, find the average! */
-         red /= area2;
-         green /= area2;
-         blue /= area2;
-          /* Stuff the new value back into memory */
-         pixel_value = ((red & redMax) << redShift) | ((green & greenMax) << greenShift) | ((blue & blueMax) << blueShift);
-
-         switch (bytesPerPixel) {
-         case 4: *((unsigned int *)dstptr)   = (unsigned int)   pixel_value; break;
-         case 2: *((unsigned short *)dstptr) = (unsigned short) pixel_value; break;
-         case 1: *((unsigned char *)dstptr)  = (unsigned char)  pixel_value; break;
-         default:
-           /* fixme: endianness problem? */
-           for (z = 0; z < bytesPerPixel; z++)
-             dstptr[z]=(pixel_value >> (8 * z)) & 0xff;
-            break;
-          }
-          dstptr += bytesPerPixel;
-       }
-       srcptr += (screen->paddedWidthInBytes * areaY);
-       dstptr += (ptr->paddedWidthInBytes - bytesPerLine);
-     }
-   } else
-   { /* Not truecolour, so we can't blend. Just use the top-left pixel instead */
-     for (y = y1; y < (y1+h1); y++) {
-       for (x = x1; x < (x1+w1); x++)
-         memcpy (&ptr->frameBuffer[(y *ptr->paddedWidthInBytes) + (x * bytesPerPixel)],
-                 &screen->frameBuffer[(y * areaY * screen->paddedWidthInBytes) + (x *areaX * bytesPerPixel)], bytesPerPixel);
-     }
-  }
+nomem:
+    rfbErr("rfbScaledScreenUpdateRect: out of memory\n");
 }
 
-void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2)
+/*
+ * Scaled screens are brought up to date lazily: a change of the framebuffer
+ * only adds to the scaledDirtyRegion of every scaled screen in use, and
+ * rfbSendFramebufferUpdate() rescales that with rfbScaledScreenRefresh()
+ * before it encodes for a client of one. Changes that come faster than the
+ * clients ask for updates are scaled once.
+ */
+static void rfbScaledScreenMark(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr, sraRegionPtr region)
+{
+    LOCK(ptr->scaledDirtyMutex);
+    if (region)
+        sraRgnOr(ptr->scaledDirtyRegion, region);
+    else
+    {
+        sraRgnDestroy(ptr->scaledDirtyRegion);
+        ptr->scaledDirtyRegion = sraRgnCreateRect(0, 0, screen->width, screen->height);
+    }
+    UNLOCK(ptr->scaledDirtyMutex);
+}
+
+/* A NULL region marks all of the framebuffer */
+void rfbScaledScreenInvalidate(rfbScreenInfoPtr screen, sraRegionPtr region)
 {
-    /* ok, now the task is to update each and every scaled version of the framebuffer
-     * and we only have to do this for this specific changed rectangle!
-     */
     rfbScreenInfoPtr ptr;
-    int count=0;
 
     /* We don't point to cl->screen as it is the original */
     for (ptr=screen->scaledScreenNext;ptr!=NULL;ptr=ptr->scaledScreenNext)
     {
         /* Only update if it has active clients... */
         if (ptr->scaledScreenRefCount>0)
-        {
-          rfbScaledScreenUpdateRect(screen, ptr, x1, y1, x2-x1, y2-y1);
-          count++;
-        }
+            rfbScaledScreenMark(screen, ptr, region);
     }
 }
 
+void rfbScaledScreenUpdate(rfbScreenInfoPtr screen, int x1, int y1, int x2, int y2)
+{
+    sraRegionPtr region;
+
+    if (screen->scaledScreenNext==NULL) return;
+    region = sraRgnCreateRect(x1, y1, x2, y2);
+    rfbScaledScreenInvalidate(screen, region);
+    sraRgnDestroy(region);
+}
+
+/* Rescale what changed since ptr was last scaled. Holding the lock while
+ * scaling keeps other clients of ptr from encoding it half done. */
+void rfbScaledScreenRefresh(rfbScreenInfoPtr screen, rfbScreenInfoPtr ptr)
+{
+    sraRectangleIterator *i;
+    sraRect rect;
+
+    if (screen==ptr) return;
+
+    LOCK(ptr->scaledDirtyMutex);
+    if (!sraRgnEmpty(ptr->scaledDirtyRegion))
+    {
+        i = sraRgnGetIterator(ptr->scaledDirtyRegion);
+        while (sraRgnIteratorNext(i, &rect))
+            rfbScaledScreenUpdateRect(screen, ptr, rect.x1, rect.y1, rect.x2-rect.x1, rect.y2-rect.y1);
+        sraRgnReleaseIterator(i);
+        sraRgnMakeEmpty(ptr->scaledDirtyRegion);
+    }
+    UNLOCK(ptr->scaledDirtyMutex);
+}
+
+void rfbScaledScreenFree(rfbScreenInfoPtr ptr)
+{
+    sraRgnDestroy(ptr->scaledDirtyRegion);
+    TINI_MUTEX(ptr->scaledDirtyMutex);
+    free(ptr->frameBuffer);
+    free(ptr);
+}
+
 /* Create a new scaled version of the framebuffer */
 rfbScreenInfoPtr rfbScaledScreenAllocate(rfbClientPtr cl, int width, int height)
 {
@@ -315,8 +533,10 @@ rfbScreenInfoPtr rfbScaledScreenAllocate(rfbClientPtr cl, int width, int height)
         ptr->frameBuffer = malloc(ptr->sizeInBytes);
         if (ptr->frameBuffer!=NULL)
         {
-            /* Reset to a known condition: scale the entire framebuffer */
-            rfbScaledScreenUpdateRect(cl->screen, ptr, 0, 0, cl->screen->width, cl->screen->height);
+            /* Reset to a known condition: scale the entire framebuffer
+             * before the first update */
+            ptr->scaledDirtyRegion = sraRgnCreateRect(0, 0, cl->screen->width, cl->screen->height);
+            INIT_MUTEX(ptr->scaledDirtyMutex);
             /* Now, insert into the chain */
             LOCK(cl->updateMutex);
             ptr->scaledScreenNext = cl->screen->scaledScreenNext;
@@ -360,9 +580,9 @@ void rfbScalingSetup(rfbClientPtr cl, int width, int height)
     /* Now, there is a new screen available (if ptr is not NULL) */
     if (ptr!=NULL)
     {
-        /* Update it! */
-        if (ptr->scaledScreenRefCount<1)
-            rfbScaledScreenUpdateRect(cl->screen, ptr, 0, 0, cl->screen->width, cl->screen->height);
+        /* Update it! Unused scaled screens are not kept up to date */
+        if (ptr!=cl->screen && ptr->scaledScreenRefCount<1)
+            rfbScaledScreenMark(cl->screen, ptr, NULL);
         /*
          * rfbLog("Taking one from %dx%d-%d and adding it to %dx%d-%d\n",
          *    cl->scaledScreen->width, cl->scaledScreen->height,
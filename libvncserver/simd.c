@@ -0,0 +1,1221 @@
+/*
+ * simd.c - vector kernels for the encoders, picked at run time.
+ *
+ * The encoders spend much of their time looking for runs of equal pixels
+ * and counting colours, ZYWRLE in its wavelet transform as well, and
+ * clients with another pixel format than the server's in translating
+ * the pixels, scaled screens in averaging them. The kernels here do that
+ * with SSE2, AVX2 or NEON where the compiler and CPU have them; the plain
+ * C loops they replace stay as the portable implementation and handle
+ * what is left over at the end of a row. SSE2 and NEON are part of the
+ * x86-64 and AArch64 baselines and are compiled in whenever the compiler
+ * targets them, AVX2 is compiled in separately and only used when the CPU
+ * reports it. SSE2 is used by default; NEON only with WITH_NEON, as it has
+ * not been run on AArch64 hardware yet, but rfbSimdList() always offers it
+ * so that the benchmarks in test/ compare it with the portable kernels.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include "simd.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SIMD_AVX2
+#include <immintrin.h>
+/* every CPU with AVX2 has POPCNT as well */
+#define SIMD_AVX2_TARGET __attribute__((target("avx2,popcnt")))
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+/* Index of the lowest bit set in x, which must not be 0. */
+static int
+lowestBit(unsigned int x)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(x);
+#else
+    int n = 0;
+
+    while (!(x & 1)) {
+	x >>= 1;
+	n++;
+    }
+    return n;
+#endif
+}
+
+static int
+countBits(unsigned int x)
+{
+#ifdef __GNUC__
+    return __builtin_popcount(x);
+#else
+    int n = 0;
+
+    for (; x; x &= x - 1)
+	n++;
+    return n;
+#endif
+}
+
+
+/*
+ * The portable kernels.
+ */
+
+#define DEFINE_SCALAR_KERNELS(bpp)                                            \
+                                                                              \
+static int                                                                    \
+spanEqual##bpp##Scalar(const uint##bpp##_t *p, int n, uint##bpp##_t value,    \
+                       uint##bpp##_t mask)                                    \
+{                                                                             \
+    int i;                                                                    \
+                                                                              \
+    for (i = 0; i < n && (p[i] & mask) == value; i++);                        \
+    return i;                                                                 \
+}                                                                             \
+                                                                              \
+static int                                                                    \
+spanTwo##bpp##Scalar(const uint##bpp##_t *p, int n, uint##bpp##_t a,          \
+                     uint##bpp##_t b, uint##bpp##_t mask, int *na)            \
+{                                                                             \
+    uint##bpp##_t c;                                                          \
+    int i, count = 0;                                                         \
+                                                                              \
+    for (i = 0; i < n; i++) {                                                 \
+        c = p[i] & mask;                                                      \
+        if (c == a)                                                           \
+            count++;                                                          \
+        else if (c != b)                                                      \
+            break;                                                            \
+    }                                                                         \
+    *na = count;                                                              \
+    return i;                                                                 \
+}
+
+DEFINE_SCALAR_KERNELS(8)
+DEFINE_SCALAR_KERNELS(16)
+DEFINE_SCALAR_KERNELS(32)
+
+/* Count the runs marked in bits and those of one pixel, which are the
+   ones the next pixel starts a run after as well. */
+static int
+countStarts(const uint32_t *bits, int n, int *singles)
+{
+    int words = (n + 31) / 32, i, starts = 0, ones = 0;
+    uint32_t ends;
+
+    for (i = 0; i < words; i++) {
+	if (i + 1 < words)
+	    ends = bits[i] >> 1 | (bits[i + 1] & 1) << 31;
+	else
+	    ends = bits[i] >> 1 | 1u << ((n - 1) & 31);
+	starts += countBits(bits[i]);
+	ones += countBits(bits[i] & ends);
+    }
+    *singles = ones;
+    return starts;
+}
+
+/*
+ * runStarts compares 32 pixels at a time with the ones before them;
+ * equalMask returns a bit per pixel of p[0..32) that is equal to the one
+ * before it. The first 32 pixels, which have none before the first, and
+ * what is left at the end go through startBits.
+ */
+
+#define DEFINE_SCALAR_RUN_STARTS(bpp)                                         \
+                                                                              \
+static void                                                                   \
+startBits##bpp(const uint##bpp##_t *p, int i, int n, uint32_t *bits)          \
+{                                                                             \
+    uint32_t word = 0;                                                        \
+                                                                              \
+    for (; i < n; i++) {                                                      \
+        if (i == 0 || p[i] != p[i - 1])                                       \
+            word |= 1u << (i & 31);                                           \
+        if ((i & 31) == 31 || i == n - 1) {                                   \
+            bits[i / 32] = word;                                              \
+            word = 0;                                                         \
+        }                                                                     \
+    }                                                                         \
+}                                                                             \
+                                                                              \
+static uint32_t                                                               \
+equalMask##bpp##Scalar(const uint##bpp##_t *p)                                \
+{                                                                             \
+    uint32_t mask = 0;                                                        \
+    int i;                                                                    \
+                                                                              \
+    for (i = 0; i < 32; i++)                                                  \
+        mask |= (uint32_t)(p[i] == p[i - 1]) << i;                            \
+    return mask;                                                              \
+}
+
+#define DEFINE_RUN_STARTS(bpp, isa, target)                                   \
+                                                                              \
+static target int                                                             \
+runStarts##bpp##isa(const uint##bpp##_t *p, int n, uint32_t *bits,            \
+                    int *singles)                                             \
+{                                                                             \
+    int i;                                                                    \
+                                                                              \
+    startBits##bpp(p, 0, n < 32 ? n : 32, bits);                              \
+    for (i = 32; i + 32 <= n; i += 32)                                        \
+        bits[i / 32] = ~equalMask##bpp##isa(p + i);                           \
+    startBits##bpp(p, i, n, bits);                                            \
+    return countStarts(bits, n, singles);                                     \
+}
+
+DEFINE_SCALAR_RUN_STARTS(8)
+DEFINE_SCALAR_RUN_STARTS(16)
+DEFINE_SCALAR_RUN_STARTS(32)
+DEFINE_RUN_STARTS(8, Scalar, )
+DEFINE_RUN_STARTS(16, Scalar, )
+DEFINE_RUN_STARTS(32, Scalar, )
+
+/* Harr() of common/zywrletemplate.c on one coefficient byte. */
+static void
+plHarr(signed char *pX0, signed char *pX1)
+{
+    int X0 = (int)*pX0, X1 = (int)*pX1;
+    int orgX0 = X0, orgX1 = X1;
+
+    if ((X0 ^ X1) & 0x80) {
+	/* differ sign */
+	X1 += X0;
+	if (((X1 ^ orgX1) & 0x80) == 0)
+	    X0 -= X1;
+    } else {
+	/* same sign */
+	X0 -= X1;
+	if (((X0 ^ orgX0) & 0x80) == 0)
+	    X1 += X0;
+    }
+    *pX0 = (signed char)X1;
+    *pX1 = (signed char)X0;
+}
+
+static void
+zywrleHarrScalar(int *x0, int *x1, int n, int stride)
+{
+    signed char *p0, *p1;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	p0 = (signed char *)(x0 + i * stride);
+	p1 = (signed char *)(x1 + i * stride);
+	plHarr(p0, p1);
+	plHarr(p0 + 1, p1 + 1);
+	plHarr(p0 + 2, p1 + 2);
+    }
+}
+
+/* A pixel translated to f; (v + (v >> 8)) >> 8 with v = c * max + 128 is
+   (c * max + 127) / 255 for all c and max up to 255. */
+static uint32_t
+translatePixel(uint32_t p, const rfbSimdPixelFormat *f)
+{
+    uint32_t v, out = 0;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+	v = ((p >> f->inShift[i]) & 255) * f->outMax[i] + 128;
+	out |= ((v + (v >> 8)) >> 8) << f->outShift[i];
+    }
+    return out;
+}
+
+static void
+translate8Scalar(const uint32_t *src, uint8_t *dst, int n,
+		 const rfbSimdPixelFormat *f)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+	dst[i] = (uint8_t)translatePixel(src[i], f);
+}
+
+static void
+translate16Scalar(const uint32_t *src, uint16_t *dst, int n,
+		  const rfbSimdPixelFormat *f)
+{
+    uint16_t v;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	v = (uint16_t)translatePixel(src[i], f);
+	dst[i] = f->swap ? Swap16(v) : v;
+    }
+}
+
+static void
+translate24Scalar(const uint32_t *src, uint8_t *dst, int n,
+		  const rfbSimdPixelFormat *f)
+{
+    uint32_t v;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	v = translatePixel(src[i], f);
+	if (f->swap)
+	    v = Swap24(v);
+	dst[3 * i] = (uint8_t)v;
+	dst[3 * i + 1] = (uint8_t)(v >> 8);
+	dst[3 * i + 2] = (uint8_t)(v >> 16);
+    }
+}
+
+static void
+translate32Scalar(const uint32_t *src, uint32_t *dst, int n,
+		  const rfbSimdPixelFormat *f)
+{
+    uint32_t v;
+    int i;
+
+    for (i = 0; i < n; i++) {
+	v = translatePixel(src[i], f);
+	dst[i] = f->swap ? Swap32(v) : v;
+    }
+}
+
+static void
+scaleAccumulate32Scalar(const uint32_t *src, int n, const int *shift,
+			int weight, uint32_t *red, uint32_t *green,
+			uint32_t *blue)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+	red[i] += ((src[i] >> shift[0]) & 255) * weight;
+	green[i] += ((src[i] >> shift[1]) & 255) * weight;
+	blue[i] += ((src[i] >> shift[2]) & 255) * weight;
+    }
+}
+
+static const rfbSimdKernels scalarKernels = {
+    "scalar",
+    spanEqual8Scalar, spanEqual16Scalar, spanEqual32Scalar,
+    spanTwo8Scalar, spanTwo16Scalar, spanTwo32Scalar,
+    runStarts8Scalar, runStarts16Scalar, runStarts32Scalar,
+    zywrleHarrScalar,
+    translate8Scalar, translate16Scalar, translate24Scalar, translate32Scalar,
+    scaleAccumulate32Scalar
+};
+
+
+/*
+ * SSE2 and AVX2. The compare results are turned into one bit per byte, so
+ * a pixel of bpp bits has bpp/8 bits there.
+ */
+
+#define DEFINE_X86_KERNELS(bpp, isa, target, vec, bytes, all, load, set1,     \
+                           cmpeq, and, or, movemask)                          \
+                                                                              \
+static target int                                                             \
+spanEqual##bpp##isa(const uint##bpp##_t *p, int n, uint##bpp##_t value,       \
+                    uint##bpp##_t mask)                                       \
+{                                                                             \
+    const int lanes = bytes / (bpp / 8);                                      \
+    vec v = set1(value), m = set1(mask), eq;                                  \
+    unsigned int bits;                                                        \
+    int i;                                                                    \
+                                                                              \
+    /* short runs are not worth setting up the vectors for */                 \
+    for (i = 0; i < 4; i++)                                                   \
+        if (i == n || (p[i] & mask) != value)                                 \
+            return i;                                                         \
+    /* long runs are the common case; look at four vectors at a time */       \
+    for (; i + 4 * lanes <= n; i += 4 * lanes) {                              \
+        eq = cmpeq(and(load((const vec *)(p + i)), m), v);                    \
+        eq = and(eq, cmpeq(and(load((const vec *)(p + i + lanes)), m), v));   \
+        eq = and(eq, cmpeq(and(load((const vec *)(p + i + 2 * lanes)), m),    \
+                           v));                                               \
+        eq = and(eq, cmpeq(and(load((const vec *)(p + i + 3 * lanes)), m),    \
+                           v));                                               \
+        if ((unsigned int)movemask(eq) != all)                                \
+            break;                                                            \
+    }                                                                         \
+    for (; i + lanes <= n; i += lanes) {                                      \
+        bits = (unsigned int)movemask(cmpeq(and(load((const vec *)(p + i)),   \
+                                                m), v));                      \
+        if (bits != all)                                                      \
+            return i + lowestBit(~bits) / (bpp / 8);                          \
+    }                                                                         \
+    return i + spanEqual##bpp##Scalar(p + i, n - i, value, mask);             \
+}                                                                             \
+                                                                              \
+static target int                                                             \
+spanTwo##bpp##isa(const uint##bpp##_t *p, int n, uint##bpp##_t a,             \
+                  uint##bpp##_t b, uint##bpp##_t mask, int *na)               \
+{                                                                             \
+    const int lanes = bytes / (bpp / 8);                                      \
+    vec va = set1(a), vb = set1(b), m = set1(mask), x, ea;                    \
+    unsigned int bitsA, bitsAB;                                               \
+    int i = 0, count = 0, k;                                                  \
+                                                                              \
+    for (; i + lanes <= n; i += lanes) {                                      \
+        x = and(load((const vec *)(p + i)), m);                               \
+        ea = cmpeq(x, va);                                                    \
+        bitsA = (unsigned int)movemask(ea);                                   \
+        bitsAB = (unsigned int)movemask(or(ea, cmpeq(x, vb)));                \
+        if (bitsAB != all) {                                                  \
+            k = lowestBit(~bitsAB);                                           \
+            *na = count + countBits(bitsA & ((1u << k) - 1)) / (bpp / 8);     \
+            return i + k / (bpp / 8);                                         \
+        }                                                                     \
+        count += countBits(bitsA) / (bpp / 8);                                \
+    }                                                                         \
+    i += spanTwo##bpp##Scalar(p + i, n - i, a, b, mask, &k);                  \
+    *na = count + k;                                                          \
+    return i;                                                                 \
+}
+
+/*
+ * The Haar step of ZYWRLE works on every byte of a vector at once: both
+ * branches of Harr() are computed and the sign tests pick one per byte.
+ * The sums wrap the way the (signed char) casts there do. Pairs that are
+ * two ints apart are split into a vector of the first and one of the
+ * second ints of each pair, within 128 bit lanes, and merged afterwards.
+ */
+
+#define X86_BLEND(pfx, si, m, a, b)                                           \
+    pfx##_or_##si(pfx##_and_##si(m, a), pfx##_andnot_##si(m, b))
+
+#define X86_SPLIT(pfx, si, vec, p, even, odd) do {                            \
+    vec lo_ = pfx##_shuffle_epi32(pfx##_loadu_##si((const vec *)(p)),         \
+                                  _MM_SHUFFLE(3, 1, 2, 0));                   \
+    vec hi_ = pfx##_shuffle_epi32(pfx##_loadu_##si((const vec *)(p) + 1),     \
+                                  _MM_SHUFFLE(3, 1, 2, 0));                   \
+    even = pfx##_unpacklo_epi64(lo_, hi_);                                    \
+    odd = pfx##_unpackhi_epi64(lo_, hi_);                                     \
+} while (0)
+
+#define X86_MERGE(pfx, si, vec, p, even, odd) do {                            \
+    pfx##_storeu_##si((vec *)(p), pfx##_unpacklo_epi32(even, odd));           \
+    pfx##_storeu_##si((vec *)(p) + 1, pfx##_unpackhi_epi32(even, odd));       \
+} while (0)
+
+#define DEFINE_X86_HARR(isa, target, vec, pfx, si)                            \
+                                                                              \
+static target void                                                            \
+harr##isa(vec *p0, vec *p1)                                                   \
+{                                                                             \
+    const vec zero = pfx##_setzero_##si();                                    \
+    const vec coef = pfx##_set1_epi32(0xffffff);                              \
+    vec x0 = *p0, x1 = *p1, a0, a1, b0, b1, m;                                \
+                                                                              \
+    /* differ sign: X1 += X0, then X0 -= X1 unless X1 changed sign */         \
+    a1 = pfx##_add_epi8(x1, x0);                                              \
+    m = pfx##_cmpgt_epi8(zero, pfx##_xor_##si(a1, x1));                       \
+    a0 = X86_BLEND(pfx, si, m, x0, pfx##_sub_epi8(x0, a1));                   \
+    /* same sign: X0 -= X1, then X1 += X0 unless X0 changed sign */           \
+    b0 = pfx##_sub_epi8(x0, x1);                                              \
+    m = pfx##_cmpgt_epi8(zero, pfx##_xor_##si(b0, x0));                       \
+    b1 = X86_BLEND(pfx, si, m, x1, pfx##_add_epi8(x1, b0));                   \
+    /* the fourth byte of an int is no coefficient and stays */               \
+    m = pfx##_cmpgt_epi8(zero, pfx##_xor_##si(x0, x1));                       \
+    *p0 = X86_BLEND(pfx, si, coef, X86_BLEND(pfx, si, m, a1, b1), x0);        \
+    *p1 = X86_BLEND(pfx, si, coef, X86_BLEND(pfx, si, m, a0, b0), x1);        \
+}                                                                             \
+                                                                              \
+static target void                                                            \
+zywrleHarr##isa(int *x0, int *x1, int n, int stride)                          \
+{                                                                             \
+    const int ints = (int)(sizeof(vec) / sizeof(int));                        \
+    vec e0, e1, o0, o1;                                                       \
+    int i = 0;                                                                \
+                                                                              \
+    if (stride == 1) {                                                        \
+        for (; i + ints <= n; i += ints) {                                    \
+            e0 = pfx##_loadu_##si((const vec *)(x0 + i));                     \
+            e1 = pfx##_loadu_##si((const vec *)(x1 + i));                     \
+            harr##isa(&e0, &e1);                                              \
+            pfx##_storeu_##si((vec *)(x0 + i), e0);                           \
+            pfx##_storeu_##si((vec *)(x1 + i), e1);                           \
+        }                                                                     \
+    } else if (stride == 2 && x1 == x0 + 1) {                                 \
+        /* neighbours, as in the rows at level 0 */                           \
+        for (; i + ints <= n; i += ints) {                                    \
+            X86_SPLIT(pfx, si, vec, x0 + 2 * i, e0, e1);                      \
+            harr##isa(&e0, &e1);                                              \
+            X86_MERGE(pfx, si, vec, x0 + 2 * i, e0, e1);                      \
+        }                                                                     \
+    } else if (stride == 2) {                                                 \
+        for (; i + ints <= n; i += ints) {                                    \
+            X86_SPLIT(pfx, si, vec, x0 + 2 * i, e0, o0);                      \
+            X86_SPLIT(pfx, si, vec, x1 + 2 * i, e1, o1);                      \
+            harr##isa(&e0, &e1);                                              \
+            X86_MERGE(pfx, si, vec, x0 + 2 * i, e0, o0);                      \
+            X86_MERGE(pfx, si, vec, x1 + 2 * i, e1, o1);                      \
+        }                                                                     \
+    }                                                                         \
+    zywrleHarrScalar(x0 + i * stride, x1 + i * stride, n - i, stride);        \
+}
+
+/* The translate kernels compute the channels in 32 bit lanes; the
+   multiplication fits 16 bits. The saturating packs narrow 16 and 8 bit
+   pixels once they are sign extended or masked, fixPack puts the lanes of
+   the packed pixels back in order. pack24 stores the low three bytes of
+   the lanes. */
+#define X86_SWAP16(pfx, si, v)                                                \
+    pfx##_or_##si(pfx##_slli_epi16(v, 8), pfx##_srli_epi16(v, 8))
+#define X86_SWAP32(pfx, si, v)                                                \
+    X86_SWAP16(pfx, si, pfx##_or_##si(pfx##_slli_epi32(v, 16),                \
+                                      pfx##_srli_epi32(v, 16)))
+
+#define DEFINE_X86_TRANSLATE(isa, target, vec, pfx, si, lanes, fixPack16,     \
+                             fixPack8)                                        \
+                                                                              \
+typedef struct {                                                              \
+    __m128i inShift[3], outShift[3];                                          \
+    vec max[3];                                                               \
+    rfbBool swap;                                                             \
+} translateSetup##isa;                                                        \
+                                                                              \
+static target void                                                            \
+initTranslate##isa(translateSetup##isa *s, const rfbSimdPixelFormat *f)       \
+{                                                                             \
+    int i;                                                                    \
+                                                                              \
+    for (i = 0; i < 3; i++) {                                                 \
+        s->inShift[i] = _mm_cvtsi32_si128(f->inShift[i]);                     \
+        s->outShift[i] = _mm_cvtsi32_si128(f->outShift[i]);                   \
+        s->max[i] = pfx##_set1_epi32(f->outMax[i]);                           \
+    }                                                                         \
+    s->swap = f->swap;                                                        \
+}                                                                             \
+                                                                              \
+static target vec                                                             \
+translatePixels##isa(const uint32_t *p, const translateSetup##isa *s)         \
+{                                                                             \
+    const vec byte = pfx##_set1_epi32(255), half = pfx##_set1_epi32(128);     \
+    vec px = pfx##_loadu_##si((const vec *)p), v, out;                        \
+    int i;                                                                    \
+                                                                              \
+    out = pfx##_setzero_##si();                                               \
+    for (i = 0; i < 3; i++) {                                                 \
+        v = pfx##_and_##si(pfx##_srl_epi32(px, s->inShift[i]), byte);         \
+        v = pfx##_add_epi32(pfx##_mullo_epi16(v, s->max[i]), half);           \
+        v = pfx##_srli_epi32(pfx##_add_epi32(v, pfx##_srli_epi32(v, 8)), 8);  \
+        out = pfx##_or_##si(out, pfx##_sll_epi32(v, s->outShift[i]));         \
+    }                                                                         \
+    return out;                                                               \
+}                                                                             \
+                                                                              \
+static target void                                                            \
+translate8##isa(const uint32_t *src, uint8_t *dst, int n,                     \
+                const rfbSimdPixelFormat *f)                                  \
+{                                                                             \
+    const vec byte = pfx##_set1_epi32(255);                                   \
+    translateSetup##isa s;                                                    \
+    vec a, b, c, d;                                                           \
+    int i = 0;                                                                \
+                                                                              \
+    initTranslate##isa(&s, f);                                                \
+    for (; i + 4 * lanes <= n; i += 4 * lanes) {                              \
+        a = pfx##_and_##si(translatePixels##isa(src + i, &s), byte);          \
+        b = pfx##_and_##si(translatePixels##isa(src + i + lanes, &s), byte);  \
+        c = pfx##_and_##si(translatePixels##isa(src + i + 2 * lanes, &s),     \
+                           byte);                                             \
+        d = pfx##_and_##si(translatePixels##isa(src + i + 3 * lanes, &s),     \
+                           byte);                                             \
+        a = pfx##_packus_epi16(pfx##_packs_epi32(a, b),                       \
+                               pfx##_packs_epi32(c, d));                      \
+        pfx##_storeu_##si((vec *)(dst + i), fixPack8(a));                     \
+    }                                                                         \
+    translate8Scalar(src + i, dst + i, n - i, f);                             \
+}                                                                             \
+                                                                              \
+static target void                                                            \
+translate16##isa(const uint32_t *src, uint16_t *dst, int n,                   \
+                 const rfbSimdPixelFormat *f)                                 \
+{                                                                             \
+    translateSetup##isa s;                                                    \
+    vec a, b;                                                                 \
+    int i = 0;                                                                \
+                                                                              \
+    initTranslate##isa(&s, f);                                                \
+    for (; i + 2 * lanes <= n; i += 2 * lanes) {                              \
+        a = pfx##_slli_epi32(translatePixels##isa(src + i, &s), 16);          \
+        b = pfx##_slli_epi32(translatePixels##isa(src + i + lanes, &s), 16);  \
+        a = fixPack16(pfx##_packs_epi32(pfx##_srai_epi32(a, 16),              \
+                                        pfx##_srai_epi32(b, 16)));            \
+        if (s.swap)                                                           \
+            a = X86_SWAP16(pfx, si, a);                                       \
+        pfx##_storeu_##si((vec *)(dst + i), a);                               \
+    }                                                                         \
+    translate16Scalar(src + i, dst + i, n - i, f);                            \
+}                                                                             \
+                                                                              \
+static target void                                                            \
+translate24##isa(const uint32_t *src, uint8_t *dst, int n,                    \
+                 const rfbSimdPixelFormat *f)                                 \
+{                                                                             \
+    const vec low = pfx##_set1_epi32(0xffffff);                               \
+    translateSetup##isa s;                                                    \
+    vec v;                                                                    \
+    int i = 0;                                                                \
+                                                                              \
+    initTranslate##isa(&s, f);                                                \
+    for (; i + lanes <= n; i += lanes) {                                      \
+        v = translatePixels##isa(src + i, &s);                                \
+        if (s.swap)                                                           \
+            v = pfx##_srli_epi32(X86_SWAP32(pfx, si, v), 8);                  \
+        else                                                                  \
+            v = pfx##_and_##si(v, low);                                       \
+        pack24##isa(v, dst + 3 * i);                                          \
+    }                                                                         \
+    translate24Scalar(src + i, dst + 3 * i, n - i, f);                        \
+}                                                                             \
+                                                                              \
+static target void                                                            \
+translate32##isa(const uint32_t *src, uint32_t *dst, int n,                   \
+                 const rfbSimdPixelFormat *f)                                 \
+{                                                                             \
+    translateSetup##isa s;                                                    \
+    vec v;                                                                    \
+    int i = 0;                                                                \
+                                                                              \
+    initTranslate##isa(&s, f);                                                \
+    for (; i + lanes <= n; i += lanes) {                                      \
+        v = translatePixels##isa(src + i, &s);                                \
+        if (s.swap)                                                           \
+            v = X86_SWAP32(pfx, si, v);                                       \
+        pfx##_storeu_##si((vec *)(dst + i), v);                               \
+    }                                                                         \
+    translate32Scalar(src + i, dst + i, n - i, f);                            \
+}                                                                             \
+                                                                              \
+static target void                                                            \
+scaleAccumulate32##isa(const uint32_t *src, int n, const int *shift,          \
+                       int weight, uint32_t *red, uint32_t *green,            \
+                       uint32_t *blue)                                        \
+{                                                                             \
+    const vec byte = pfx##_set1_epi32(255), w = pfx##_set1_epi32(weight);     \
+    __m128i count[3];                                                         \
+    uint32_t *sums[3];                                                        \
+    vec px, v;                                                                \
+    int i = 0, c;                                                             \
+                                                                              \
+    sums[0] = red;                                                            \
+    sums[1] = green;                                                          \
+    sums[2] = blue;                                                           \
+    for (c = 0; c < 3; c++)                                                   \
+        count[c] = _mm_cvtsi32_si128(shift[c]);                               \
+    for (; i + lanes <= n; i += lanes) {                                      \
+        px = pfx##_loadu_##si((const vec *)(src + i));                        \
+        for (c = 0; c < 3; c++) {                                             \
+            v = pfx##_and_##si(pfx##_srl_epi32(px, count[c]), byte);          \
+            v = pfx##_add_epi32(pfx##_loadu_##si((const vec *)(sums[c] + i)), \
+                                pfx##_mullo_epi16(v, w));                     \
+            pfx##_storeu_##si((vec *)(sums[c] + i), v);                       \
+        }                                                                     \
+    }                                                                         \
+    scaleAccumulate32Scalar(src + i, n - i, shift, weight, red + i,           \
+                            green + i, blue + i);                             \
+}
+
+#ifdef __SSE2__
+
+#define SSE2_SET1_8(x)  _mm_set1_epi8((char)(x))
+#define SSE2_SET1_16(x) _mm_set1_epi16((short)(x))
+#define SSE2_SET1_32(x) _mm_set1_epi32((int)(x))
+
+DEFINE_X86_KERNELS(8, Sse2, , __m128i, 16, 0xffffu, _mm_loadu_si128,
+                   SSE2_SET1_8, _mm_cmpeq_epi8, _mm_and_si128, _mm_or_si128,
+                   _mm_movemask_epi8)
+DEFINE_X86_KERNELS(16, Sse2, , __m128i, 16, 0xffffu, _mm_loadu_si128,
+                   SSE2_SET1_16, _mm_cmpeq_epi16, _mm_and_si128, _mm_or_si128,
+                   _mm_movemask_epi8)
+DEFINE_X86_KERNELS(32, Sse2, , __m128i, 16, 0xffffu, _mm_loadu_si128,
+                   SSE2_SET1_32, _mm_cmpeq_epi32, _mm_and_si128, _mm_or_si128,
+                   _mm_movemask_epi8)
+DEFINE_X86_HARR(Sse2, , __m128i, _mm, si128)
+
+#define SSE2_EQ(bpp, p) _mm_cmpeq_epi##bpp(                                  \
+    _mm_loadu_si128((const __m128i *)(p)),                                    \
+    _mm_loadu_si128((const __m128i *)((p) - 1)))
+
+static uint32_t
+equalMask8Sse2(const uint8_t *p)
+{
+    return (uint32_t)_mm_movemask_epi8(SSE2_EQ(8, p)) |
+	(uint32_t)_mm_movemask_epi8(SSE2_EQ(8, p + 16)) << 16;
+}
+
+static uint32_t
+equalMask16Sse2(const uint16_t *p)
+{
+    /* the saturating pack keeps 0 and -1, a byte per pixel */
+    return (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(SSE2_EQ(16, p),
+						       SSE2_EQ(16, p + 8))) |
+	(uint32_t)_mm_movemask_epi8(_mm_packs_epi16(SSE2_EQ(16, p + 16),
+						    SSE2_EQ(16, p + 24))) << 16;
+}
+
+static uint32_t
+equalMask32Sse2(const uint32_t *p)
+{
+    uint32_t mask = 0;
+    int i;
+
+    for (i = 0; i < 32; i += 4)
+	mask |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(SSE2_EQ(32, p + i))) << i;
+    return mask;
+}
+
+DEFINE_RUN_STARTS(8, Sse2, )
+DEFINE_RUN_STARTS(16, Sse2, )
+DEFINE_RUN_STARTS(32, Sse2, )
+
+/* The even lanes go to the low 48 bits of each half, the odd ones right
+   above them. */
+static void
+pack24Sse2(__m128i v, uint8_t *dst)
+{
+    const __m128i even = _mm_set_epi32(0, -1, 0, -1);
+    __m128i pairs, high;
+    uint32_t last;
+
+    pairs = _mm_or_si128(_mm_and_si128(v, even),
+			 _mm_srli_epi64(_mm_andnot_si128(even, v), 8));
+    high = _mm_srli_si128(pairs, 8);
+    _mm_storel_epi64((__m128i *)dst,
+		     _mm_or_si128(pairs, _mm_slli_epi64(high, 48)));
+    last = (uint32_t)_mm_cvtsi128_si32(_mm_srli_epi64(high, 16));
+    memcpy(dst + 8, &last, 4);
+}
+
+#define SSE2_FIX_PACK(x) (x)
+
+DEFINE_X86_TRANSLATE(Sse2, , __m128i, _mm, si128, 4, SSE2_FIX_PACK,
+                     SSE2_FIX_PACK)
+
+static const rfbSimdKernels sse2Kernels = {
+    "sse2",
+    spanEqual8Sse2, spanEqual16Sse2, spanEqual32Sse2,
+    spanTwo8Sse2, spanTwo16Sse2, spanTwo32Sse2,
+    runStarts8Sse2, runStarts16Sse2, runStarts32Sse2,
+    zywrleHarrSse2,
+    translate8Sse2, translate16Sse2, translate24Sse2, translate32Sse2,
+    scaleAccumulate32Sse2
+};
+
+#endif
+
+#ifdef SIMD_AVX2
+
+#define AVX2_SET1_8(x)  _mm256_set1_epi8((char)(x))
+#define AVX2_SET1_16(x) _mm256_set1_epi16((short)(x))
+#define AVX2_SET1_32(x) _mm256_set1_epi32((int)(x))
+
+DEFINE_X86_KERNELS(8, Avx2, SIMD_AVX2_TARGET, __m256i, 32, 0xffffffffu,
+                   _mm256_loadu_si256, AVX2_SET1_8, _mm256_cmpeq_epi8,
+                   _mm256_and_si256, _mm256_or_si256, _mm256_movemask_epi8)
+DEFINE_X86_KERNELS(16, Avx2, SIMD_AVX2_TARGET, __m256i, 32, 0xffffffffu,
+                   _mm256_loadu_si256, AVX2_SET1_16, _mm256_cmpeq_epi16,
+                   _mm256_and_si256, _mm256_or_si256, _mm256_movemask_epi8)
+DEFINE_X86_KERNELS(32, Avx2, SIMD_AVX2_TARGET, __m256i, 32, 0xffffffffu,
+                   _mm256_loadu_si256, AVX2_SET1_32, _mm256_cmpeq_epi32,
+                   _mm256_and_si256, _mm256_or_si256, _mm256_movemask_epi8)
+DEFINE_X86_HARR(Avx2, SIMD_AVX2_TARGET, __m256i, _mm256, si256)
+
+#define AVX2_EQ(bpp, p) _mm256_cmpeq_epi##bpp(                                \
+    _mm256_loadu_si256((const __m256i *)(p)),                                 \
+    _mm256_loadu_si256((const __m256i *)((p) - 1)))
+
+static SIMD_AVX2_TARGET uint32_t
+equalMask8Avx2(const uint8_t *p)
+{
+    return (uint32_t)_mm256_movemask_epi8(AVX2_EQ(8, p));
+}
+
+static SIMD_AVX2_TARGET uint32_t
+equalMask16Avx2(const uint16_t *p)
+{
+    /* the pack interleaves the 128 bit lanes, the permute undoes that */
+    return (uint32_t)_mm256_movemask_epi8(_mm256_permute4x64_epi64(
+	_mm256_packs_epi16(AVX2_EQ(16, p), AVX2_EQ(16, p + 16)), 0xd8));
+}
+
+static SIMD_AVX2_TARGET uint32_t
+equalMask32Avx2(const uint32_t *p)
+{
+    uint32_t mask = 0;
+    int i;
+
+    for (i = 0; i < 32; i += 8)
+	mask |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(AVX2_EQ(32, p + i))) << i;
+    return mask;
+}
+
+DEFINE_RUN_STARTS(8, Avx2, SIMD_AVX2_TARGET)
+DEFINE_RUN_STARTS(16, Avx2, SIMD_AVX2_TARGET)
+DEFINE_RUN_STARTS(32, Avx2, SIMD_AVX2_TARGET)
+
+static SIMD_AVX2_TARGET void
+pack24Avx2(__m256i v, uint8_t *dst)
+{
+    const __m256i bytes = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12,
+					   13, 14, -1, -1, -1, -1,
+					   0, 1, 2, 4, 5, 6, 8, 9, 10, 12,
+					   13, 14, -1, -1, -1, -1);
+
+    v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, bytes),
+				    _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+    _mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(v));
+    _mm_storel_epi64((__m128i *)(dst + 16), _mm256_extracti128_si256(v, 1));
+}
+
+/* the packs work within the 128 bit halves */
+#define AVX2_FIX_PACK16(x) _mm256_permute4x64_epi64(x, 0xd8)
+#define AVX2_FIX_PACK8(x)                                                     \
+    _mm256_permutevar8x32_epi32(x, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7))
+
+DEFINE_X86_TRANSLATE(Avx2, SIMD_AVX2_TARGET, __m256i, _mm256, si256, 8,
+                     AVX2_FIX_PACK16, AVX2_FIX_PACK8)
+
+static const rfbSimdKernels avx2Kernels = {
+    "avx2",
+    spanEqual8Avx2, spanEqual16Avx2, spanEqual32Avx2,
+    spanTwo8Avx2, spanTwo16Avx2, spanTwo32Avx2,
+    runStarts8Avx2, runStarts16Avx2, runStarts32Avx2,
+    zywrleHarrAvx2,
+    translate8Avx2, translate16Avx2, translate24Avx2, translate32Avx2,
+    scaleAccumulate32Avx2
+};
+
+static rfbBool
+haveAvx2(void)
+{
+    /* this checks that the OS saves the AVX registers, too */
+    return __builtin_cpu_supports("avx2") != 0;
+}
+
+#endif
+
+
+/*
+ * NEON. There is no movemask; whole vectors are checked with a horizontal
+ * minimum, and the scalar code finds the pixel in the vector that ended
+ * the span.
+ */
+
+#ifdef SIMD_NEON
+
+/* all ones in the lanes of the vector at q whose pixels are v under m */
+#define NEON_EQ(sfx, q, m, v) vceqq_##sfx(vandq_##sfx(vld1q_##sfx(q), m), v)
+
+#define DEFINE_NEON_KERNELS(bpp, lanes, sfx)                                  \
+                                                                              \
+static int                                                                    \
+spanEqual##bpp##Neon(const uint##bpp##_t *p, int n, uint##bpp##_t value,      \
+                     uint##bpp##_t mask)                                      \
+{                                                                             \
+    uint##bpp##x##lanes##_t v = vdupq_n_##sfx(value);                         \
+    uint##bpp##x##lanes##_t m = vdupq_n_##sfx(mask), eq;                      \
+    int i = 0;                                                                \
+                                                                              \
+    for (; i + 4 * lanes <= n; i += 4 * lanes) {                              \
+        eq = NEON_EQ(sfx, p + i, m, v);                                       \
+        eq = vandq_##sfx(eq, NEON_EQ(sfx, p + i + lanes, m, v));              \
+        eq = vandq_##sfx(eq, NEON_EQ(sfx, p + i + 2 * lanes, m, v));          \
+        eq = vandq_##sfx(eq, NEON_EQ(sfx, p + i + 3 * lanes, m, v));          \
+        if (vminvq_##sfx(eq) == 0)                                            \
+            break;                                                            \
+    }                                                                         \
+    for (; i + lanes <= n; i += lanes) {                                      \
+        if (vminvq_##sfx(NEON_EQ(sfx, p + i, m, v)) == 0)                     \
+            break;                                                            \
+    }                                                                         \
+    return i + spanEqual##bpp##Scalar(p + i, n - i, value, mask);             \
+}                                                                             \
+                                                                              \
+static int                                                                    \
+spanTwo##bpp##Neon(const uint##bpp##_t *p, int n, uint##bpp##_t a,            \
+                   uint##bpp##_t b, uint##bpp##_t mask, int *na)              \
+{                                                                             \
+    uint##bpp##x##lanes##_t va = vdupq_n_##sfx(a), vb = vdupq_n_##sfx(b);     \
+    uint##bpp##x##lanes##_t m = vdupq_n_##sfx(mask), x, ea;                   \
+    int i = 0, count = 0, k;                                                  \
+                                                                              \
+    for (; i + lanes <= n; i += lanes) {                                      \
+        x = vandq_##sfx(vld1q_##sfx(p + i), m);                               \
+        ea = vceqq_##sfx(x, va);                                              \
+        if (vminvq_##sfx(vorrq_##sfx(ea, vceqq_##sfx(x, vb))) == 0)           \
+            break;                                                            \
+        count += vaddvq_##sfx(vshrq_n_##sfx(ea, bpp - 1));                    \
+    }                                                                         \
+    i += spanTwo##bpp##Scalar(p + i, n - i, a, b, mask, &k);                  \
+    *na = count + k;                                                          \
+    return i;                                                                 \
+}
+
+DEFINE_NEON_KERNELS(8, 16, u8)
+DEFINE_NEON_KERNELS(16, 8, u16)
+DEFINE_NEON_KERNELS(32, 4, u32)
+
+/* A bit per lane of eq, for the equalMask functions. */
+static uint32_t
+neonBits(uint8x8_t eq)
+{
+    static const uint8_t weights[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+
+    return vaddv_u8(vand_u8(eq, vld1_u8(weights)));
+}
+
+static uint32_t
+equalMask8Neon(const uint8_t *p)
+{
+    uint8x16_t eq;
+    uint32_t mask = 0;
+    int i;
+
+    for (i = 0; i < 32; i += 16) {
+	eq = vceqq_u8(vld1q_u8(p + i), vld1q_u8(p + i - 1));
+	mask |= neonBits(vget_low_u8(eq)) << i |
+	    neonBits(vget_high_u8(eq)) << (i + 8);
+    }
+    return mask;
+}
+
+static uint32_t
+equalMask16Neon(const uint16_t *p)
+{
+    uint32_t mask = 0;
+    int i;
+
+    for (i = 0; i < 32; i += 8)
+	mask |= neonBits(vmovn_u16(vceqq_u16(vld1q_u16(p + i),
+					     vld1q_u16(p + i - 1)))) << i;
+    return mask;
+}
+
+static uint32_t
+equalMask32Neon(const uint32_t *p)
+{
+    uint16x4_t lo, hi;
+    uint32_t mask = 0;
+    int i;
+
+    for (i = 0; i < 32; i += 8) {
+	lo = vmovn_u32(vceqq_u32(vld1q_u32(p + i), vld1q_u32(p + i - 1)));
+	hi = vmovn_u32(vceqq_u32(vld1q_u32(p + i + 4), vld1q_u32(p + i + 3)));
+	mask |= neonBits(vmovn_u16(vcombine_u16(lo, hi))) << i;
+    }
+    return mask;
+}
+
+DEFINE_RUN_STARTS(8, Neon, )
+DEFINE_RUN_STARTS(16, Neon, )
+DEFINE_RUN_STARTS(32, Neon, )
+
+/* The Haar step as harrSse2(); vld2q splits pairs that are two ints
+   apart. The coefficient bytes are picked in memory order, which the
+   int lanes of vld2q only keep on little endian. */
+#ifndef __AARCH64EB__
+
+static void
+harrNeon(int8x16_t *p0, int8x16_t *p1)
+{
+    static const uint8_t coefBytes[16] = {
+	0xff, 0xff, 0xff, 0, 0xff, 0xff, 0xff, 0,
+	0xff, 0xff, 0xff, 0, 0xff, 0xff, 0xff, 0
+    };
+    const uint8x16_t coef = vld1q_u8(coefBytes);
+    int8x16_t x0 = *p0, x1 = *p1, a0, a1, b0, b1;
+    uint8x16_t m;
+
+    a1 = vaddq_s8(x1, x0);
+    m = vcltzq_s8(veorq_s8(a1, x1));
+    a0 = vbslq_s8(m, x0, vsubq_s8(x0, a1));
+    b0 = vsubq_s8(x0, x1);
+    m = vcltzq_s8(veorq_s8(b0, x0));
+    b1 = vbslq_s8(m, x1, vaddq_s8(x1, b0));
+    m = vcltzq_s8(veorq_s8(x0, x1));
+    *p0 = vbslq_s8(coef, vbslq_s8(m, a1, b1), x0);
+    *p1 = vbslq_s8(coef, vbslq_s8(m, a0, b0), x1);
+}
+
+static void
+zywrleHarrNeon(int *x0, int *x1, int n, int stride)
+{
+    int8x16_t e0, e1;
+    int32x4x2_t v0, v1;
+    int i = 0;
+
+    if (stride == 1) {
+	for (; i + 4 <= n; i += 4) {
+	    e0 = vld1q_s8((const int8_t *)(x0 + i));
+	    e1 = vld1q_s8((const int8_t *)(x1 + i));
+	    harrNeon(&e0, &e1);
+	    vst1q_s8((int8_t *)(x0 + i), e0);
+	    vst1q_s8((int8_t *)(x1 + i), e1);
+	}
+    } else if (stride == 2 && x1 == x0 + 1) {
+	for (; i + 4 <= n; i += 4) {
+	    v0 = vld2q_s32(x0 + 2 * i);
+	    e0 = vreinterpretq_s8_s32(v0.val[0]);
+	    e1 = vreinterpretq_s8_s32(v0.val[1]);
+	    harrNeon(&e0, &e1);
+	    v0.val[0] = vreinterpretq_s32_s8(e0);
+	    v0.val[1] = vreinterpretq_s32_s8(e1);
+	    vst2q_s32(x0 + 2 * i, v0);
+	}
+    } else if (stride == 2) {
+	for (; i + 4 <= n; i += 4) {
+	    v0 = vld2q_s32(x0 + 2 * i);
+	    v1 = vld2q_s32(x1 + 2 * i);
+	    e0 = vreinterpretq_s8_s32(v0.val[0]);
+	    e1 = vreinterpretq_s8_s32(v1.val[0]);
+	    harrNeon(&e0, &e1);
+	    v0.val[0] = vreinterpretq_s32_s8(e0);
+	    v1.val[0] = vreinterpretq_s32_s8(e1);
+	    vst2q_s32(x0 + 2 * i, v0);
+	    vst2q_s32(x1 + 2 * i, v1);
+	}
+    }
+    zywrleHarrScalar(x0 + i * stride, x1 + i * stride, n - i, stride);
+}
+
+#else
+#define zywrleHarrNeon zywrleHarrScalar
+#endif
+
+typedef struct {
+    int32x4_t inShift[3], outShift[3];
+    uint32x4_t max[3];
+    rfbBool swap;
+} translateSetupNeon;
+
+static void
+initTranslateNeon(translateSetupNeon *s, const rfbSimdPixelFormat *f)
+{
+    int i;
+
+    /* vshlq shifts right by negative counts */
+    for (i = 0; i < 3; i++) {
+	s->inShift[i] = vdupq_n_s32(-f->inShift[i]);
+	s->outShift[i] = vdupq_n_s32(f->outShift[i]);
+	s->max[i] = vdupq_n_u32((uint32_t)f->outMax[i]);
+    }
+    s->swap = f->swap;
+}
+
+static uint32x4_t
+translatePixelsNeon(const uint32_t *p, const translateSetupNeon *s)
+{
+    const uint32x4_t byte = vdupq_n_u32(255), half = vdupq_n_u32(128);
+    uint32x4_t px = vld1q_u32(p), v, out = vdupq_n_u32(0);
+    int i;
+
+    for (i = 0; i < 3; i++) {
+	v = vandq_u32(vshlq_u32(px, s->inShift[i]), byte);
+	v = vmlaq_u32(half, v, s->max[i]);
+	v = vshrq_n_u32(vaddq_u32(v, vshrq_n_u32(v, 8)), 8);
+	out = vorrq_u32(out, vshlq_u32(v, s->outShift[i]));
+    }
+    return out;
+}
+
+/* The low bytes of the lanes of a, b, c and d. */
+static uint8x16_t
+narrowNeon(uint32x4_t a, uint32x4_t b, uint32x4_t c, uint32x4_t d)
+{
+    return vcombine_u8(vmovn_u16(vcombine_u16(vmovn_u32(a), vmovn_u32(b))),
+		       vmovn_u16(vcombine_u16(vmovn_u32(c), vmovn_u32(d))));
+}
+
+static void
+translate8Neon(const uint32_t *src, uint8_t *dst, int n,
+	       const rfbSimdPixelFormat *f)
+{
+    translateSetupNeon s;
+    int i = 0;
+
+    initTranslateNeon(&s, f);
+    for (; i + 16 <= n; i += 16)
+	vst1q_u8(dst + i, narrowNeon(translatePixelsNeon(src + i, &s),
+				     translatePixelsNeon(src + i + 4, &s),
+				     translatePixelsNeon(src + i + 8, &s),
+				     translatePixelsNeon(src + i + 12, &s)));
+    translate8Scalar(src + i, dst + i, n - i, f);
+}
+
+static void
+translate16Neon(const uint32_t *src, uint16_t *dst, int n,
+		const rfbSimdPixelFormat *f)
+{
+    translateSetupNeon s;
+    uint16x8_t v;
+    int i = 0;
+
+    initTranslateNeon(&s, f);
+    for (; i + 8 <= n; i += 8) {
+	v = vcombine_u16(vmovn_u32(translatePixelsNeon(src + i, &s)),
+			 vmovn_u32(translatePixelsNeon(src + i + 4, &s)));
+	if (s.swap)
+	    v = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(v)));
+	vst1q_u16(dst + i, v);
+    }
+    translate16Scalar(src + i, dst + i, n - i, f);
+}
+
+static void
+translate24Neon(const uint32_t *src, uint8_t *dst, int n,
+		const rfbSimdPixelFormat *f)
+{
+    translateSetupNeon s;
+    uint32x4_t v[4];
+    uint8x16x3_t bytes;
+    int i = 0, j;
+
+    initTranslateNeon(&s, f);
+    for (; i + 16 <= n; i += 16) {
+	for (j = 0; j < 4; j++) {
+	    v[j] = translatePixelsNeon(src + i + 4 * j, &s);
+	    if (s.swap)
+		v[j] = vshrq_n_u32(vreinterpretq_u32_u8(
+		    vrev32q_u8(vreinterpretq_u8_u32(v[j]))), 8);
+	}
+	bytes.val[0] = narrowNeon(v[0], v[1], v[2], v[3]);
+	bytes.val[1] = narrowNeon(vshrq_n_u32(v[0], 8), vshrq_n_u32(v[1], 8),
+				  vshrq_n_u32(v[2], 8), vshrq_n_u32(v[3], 8));
+	bytes.val[2] = narrowNeon(vshrq_n_u32(v[0], 16), vshrq_n_u32(v[1], 16),
+				  vshrq_n_u32(v[2], 16), vshrq_n_u32(v[3], 16));
+	vst3q_u8(dst + 3 * i, bytes);
+    }
+    translate24Scalar(src + i, dst + 3 * i, n - i, f);
+}
+
+static void
+translate32Neon(const uint32_t *src, uint32_t *dst, int n,
+		const rfbSimdPixelFormat *f)
+{
+    translateSetupNeon s;
+    uint32x4_t v;
+    int i = 0;
+
+    initTranslateNeon(&s, f);
+    for (; i + 4 <= n; i += 4) {
+	v = translatePixelsNeon(src + i, &s);
+	if (s.swap)
+	    v = vreinterpretq_u32_u8(vrev32q_u8(vreinterpretq_u8_u32(v)));
+	vst1q_u32(dst + i, v);
+    }
+    translate32Scalar(src + i, dst + i, n - i, f);
+}
+
+static void
+scaleAccumulate32Neon(const uint32_t *src, int n, const int *shift,
+		      int weight, uint32_t *red, uint32_t *green,
+		      uint32_t *blue)
+{
+    const uint32x4_t byte = vdupq_n_u32(255);
+    const uint32x4_t w = vdupq_n_u32((uint32_t)weight);
+    int32x4_t count[3];
+    uint32_t *sums[3];
+    uint32x4_t px;
+    int i = 0, c;
+
+    sums[0] = red;
+    sums[1] = green;
+    sums[2] = blue;
+    for (c = 0; c < 3; c++)
+	count[c] = vdupq_n_s32(-shift[c]);
+    for (; i + 4 <= n; i += 4) {
+	px = vld1q_u32(src + i);
+	for (c = 0; c < 3; c++)
+	    vst1q_u32(sums[c] + i,
+		      vmlaq_u32(vld1q_u32(sums[c] + i),
+				vandq_u32(vshlq_u32(px, count[c]), byte), w));
+    }
+    scaleAccumulate32Scalar(src + i, n - i, shift, weight, red + i,
+			    green + i, blue + i);
+}
+
+static const rfbSimdKernels neonKernels = {
+    "neon",
+    spanEqual8Neon, spanEqual16Neon, spanEqual32Neon,
+    spanTwo8Neon, spanTwo16Neon, spanTwo32Neon,
+    runStarts8Neon, runStarts16Neon, runStarts32Neon,
+    zywrleHarrNeon,
+    translate8Neon, translate16Neon, translate24Neon, translate32Neon,
+    scaleAccumulate32Neon
+};
+
+#endif
+
+
+#ifndef __GNUC__
+int
+rfbSimdLowestBit(uint32_t x)
+{
+    return lowestBit(x);
+}
+#endif
+
+const rfbSimdKernels *
+rfbSimd(void)
+{
+#ifdef SIMD_AVX2
+    if (haveAvx2())
+	return &avx2Kernels;
+#endif
+#ifdef __SSE2__
+    return &sse2Kernels;
+#elif defined(SIMD_NEON) && defined(LIBVNCSERVER_WITH_NEON)
+    return &neonKernels;
+#else
+    return &scalarKernels;
+#endif
+}
+
+int
+rfbSimdList(const rfbSimdKernels **list, int max)
+{
+    const rfbSimdKernels *all[4];
+    int n = 0, i;
+
+    all[n++] = &scalarKernels;
+#ifdef __SSE2__
+    all[n++] = &sse2Kernels;
+#endif
+#ifdef SIMD_AVX2
+    if (haveAvx2())
+	all[n++] = &avx2Kernels;
+#endif
+#ifdef SIMD_NEON
+    all[n++] = &neonKernels;
+#endif
+
+    for (i = 0; i < n && i < max; i++)
+	list[i] = all[i];
+    return n;
+}
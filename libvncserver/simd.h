@@ -0,0 +1,113 @@
+/*
+ * simd.h - private interface to the vector kernels of the encoders, of
+ * pixel format translation and of scaling.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef RFB_SIMD_H
+#define RFB_SIMD_H
+
+#include <rfb/rfb.h>
+
+/* A true colour format with at most 8 bits per channel that the
+   translate kernels turn pixels with 8 bit channels into. The arrays are
+   red, green and blue; outMax is at most 255, outShift less than the
+   bits per pixel of the format. */
+typedef struct rfbSimdPixelFormat {
+    int inShift[3];
+    int outMax[3];
+    int outShift[3];
+    /* the output bytes go the other way round */
+    rfbBool swap;
+} rfbSimdPixelFormat;
+
+/* One implementation of every kernel. Pixels are compared in the bits of
+   mask only; value, a and b have to be masked already. */
+typedef struct rfbSimdKernels {
+    const char *name;
+
+    /* Number of leading pixels of p[0..n) equal to value. */
+    int (*spanEqual8)(const uint8_t *p, int n, uint8_t value, uint8_t mask);
+    int (*spanEqual16)(const uint16_t *p, int n, uint16_t value, uint16_t mask);
+    int (*spanEqual32)(const uint32_t *p, int n, uint32_t value, uint32_t mask);
+
+    /* Number of leading pixels of p[0..n) that are a or b; *na returns
+       how many of them are a. */
+    int (*spanTwo8)(const uint8_t *p, int n, uint8_t a, uint8_t b,
+                    uint8_t mask, int *na);
+    int (*spanTwo16)(const uint16_t *p, int n, uint16_t a, uint16_t b,
+                     uint16_t mask, int *na);
+    int (*spanTwo32)(const uint32_t *p, int n, uint32_t a, uint32_t b,
+                     uint32_t mask, int *na);
+
+    /* Set the bits of the pixels of p[0..n) that start a run of equal
+       pixels in bits[0..(n + 31) / 32), from the lowest bit of bits[0]
+       up. Returns the number of runs; *singles returns how many of them
+       are one pixel long. */
+    int (*runStarts8)(const uint8_t *p, int n, uint32_t *bits, int *singles);
+    int (*runStarts16)(const uint16_t *p, int n, uint32_t *bits,
+                       int *singles);
+    int (*runStarts32)(const uint32_t *p, int n, uint32_t *bits,
+                       int *singles);
+
+    /* The piecewise-linear Haar step of ZYWRLE on the pairs of wavelet
+       coefficients x0[i * stride], x1[i * stride] for i < n, which must
+       not share ints. Only the three coefficient bytes of each int
+       change. */
+    void (*zywrleHarr)(int *x0, int *x1, int n, int stride);
+
+    /* Translate the pixels of src[0..n) to format f the way the RGB
+       lookup tables of translate.c do: a channel c becomes
+       (c * outMax + 127) / 255. translate24 writes the low three bytes
+       of each pixel, least significant first unless f->swap is set, and
+       may write over src. */
+    void (*translate8)(const uint32_t *src, uint8_t *dst, int n,
+                       const rfbSimdPixelFormat *f);
+    void (*translate16)(const uint32_t *src, uint16_t *dst, int n,
+                        const rfbSimdPixelFormat *f);
+    void (*translate24)(const uint32_t *src, uint8_t *dst, int n,
+                        const rfbSimdPixelFormat *f);
+    void (*translate32)(const uint32_t *src, uint32_t *dst, int n,
+                        const rfbSimdPixelFormat *f);
+
+    /* Add weight times the 8 bit channels at shift[0..3) of the pixels of
+       src[0..n) to red[i], green[i] and blue[i]; weight is at most 256.
+       The vertical pass of the scaler in scale.c. */
+    void (*scaleAccumulate32)(const uint32_t *src, int n, const int *shift,
+                              int weight, uint32_t *red, uint32_t *green,
+                              uint32_t *blue);
+} rfbSimdKernels;
+
+/* Index of the lowest bit set in x, which must not be 0; for going
+   through the bits runStarts sets. */
+#ifdef __GNUC__
+#define rfbSimdLowestBit(x) __builtin_ctz(x)
+#else
+int rfbSimdLowestBit(uint32_t x);
+#endif
+
+/* The fastest kernels the CPU running us supports. */
+const rfbSimdKernels *rfbSimd(void);
+
+/* Fill list with up to max of the implementations the CPU supports, the
+   portable one first, and return how many there are. For benchmarks and
+   tests. */
+int rfbSimdList(const rfbSimdKernels **list, int max);
+
+#endif
@@ -66,6 +66,10 @@
 #ifdef LIBVNCSERVER_HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef LIBVNCSERVER_HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#include <limits.h>
 
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
 #include "rfbssl.h"
@@ -97,6 +101,7 @@ int deny_severity=LOG_WARNING;
 #endif
 
 #include "sockets.h"
+#include "rfbpoll.h"
 
 int rfbMaxClientWait = 20000;   /* time (ms) after which we decide client has
                                    gone away - needed to stop us hanging */
@@ -226,8 +231,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
         }
 
         rfbLog("Autoprobing selected TCP port %d\n", rfbScreen->port);
-        FD_SET(rfbScreen->listenSock, &(rfbScreen->allFds));
-        rfbScreen->maxFd = rfbScreen->listenSock;
+        rfbPollAddSocket(rfbScreen, rfbScreen->listenSock, NULL);
     }
 
 #ifdef LIBVNCSERVER_IPv6
@@ -247,8 +251,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
         }
 
         rfbLog("Autoprobing selected TCP6 port %d\n", rfbScreen->ipv6port);
-	FD_SET(rfbScreen->listen6Sock, &(rfbScreen->allFds));
-	rfbScreen->maxFd = rfbMax((int)rfbScreen->listen6Sock,rfbScreen->maxFd);
+	rfbPollAddSocket(rfbScreen, rfbScreen->listen6Sock, NULL);
     }
 #endif
 
@@ -261,8 +264,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
       }
       rfbLog("Listening for VNC connections on TCP port %d\n", rfbScreen->port);  
   
-      FD_SET(rfbScreen->listenSock, &(rfbScreen->allFds));
-      rfbScreen->maxFd = rfbScreen->listenSock;
+      rfbPollAddSocket(rfbScreen, rfbScreen->listenSock, NULL);
 	    }
 
 #ifdef LIBVNCSERVER_IPv6
@@ -273,8 +275,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
       }
       rfbLog("Listening for VNC connections on TCP6 port %d\n", rfbScreen->ipv6port);  
 	
-      FD_SET(rfbScreen->listen6Sock, &(rfbScreen->allFds));
-      rfbScreen->maxFd = rfbMax((int)rfbScreen->listen6Sock,rfbScreen->maxFd);
+      rfbPollAddSocket(rfbScreen, rfbScreen->listen6Sock, NULL);
 	    }
 #endif
 
@@ -289,8 +290,7 @@ rfbInitSockets(rfbScreenInfoPtr rfbScreen)
 	}
 	rfbLog("Listening for VNC connections on TCP port %d\n", rfbScreen->port);  
 
-	FD_SET(rfbScreen->udpSock, &(rfbScreen->allFds));
-	rfbScreen->maxFd = rfbMax((int)rfbScreen->udpSock,rfbScreen->maxFd);
+	rfbPollAddSocket(rfbScreen, rfbScreen->udpSock, NULL);
     }
 }
 
@@ -302,26 +302,26 @@ void rfbShutdownSockets(rfbScreenInfoPtr rfbScreen)
     rfbScreen->socketState = RFB_SOCKET_SHUTDOWN;
 
     if(rfbScreen->inetdSock!=RFB_INVALID_SOCKET) {
+	rfbPollRemoveSocket(rfbScreen, rfbScreen->inetdSock);
 	rfbCloseSocket(rfbScreen->inetdSock);
-	FD_CLR(rfbScreen->inetdSock,&rfbScreen->allFds);
 	rfbScreen->inetdSock=RFB_INVALID_SOCKET;
     }
 
     if(rfbScreen->listenSock!=RFB_INVALID_SOCKET) {
+	rfbPollRemoveSocket(rfbScreen, rfbScreen->listenSock);
 	rfbCloseSocket(rfbScreen->listenSock);
-	FD_CLR(rfbScreen->listenSock,&rfbScreen->allFds);
 	rfbScreen->listenSock=RFB_INVALID_SOCKET;
     }
 
     if(rfbScreen->listen6Sock!=RFB_INVALID_SOCKET) {
+	rfbPollRemoveSocket(rfbScreen, rfbScreen->listen6Sock);
 	rfbCloseSocket(rfbScreen->listen6Sock);
-	FD_CLR(rfbScreen->listen6Sock,&rfbScreen->allFds);
 	rfbScreen->listen6Sock=RFB_INVALID_SOCKET;
     }
 
     if(rfbScreen->udpSock!=RFB_INVALID_SOCKET) {
+	rfbPollRemoveSocket(rfbScreen, rfbScreen->udpSock);
 	rfbCloseSocket(rfbScreen->udpSock);
-	FD_CLR(rfbScreen->udpSock,&rfbScreen->allFds);
 	rfbScreen->udpSock=RFB_INVALID_SOCKET;
     }
 
@@ -343,13 +343,12 @@ void rfbShutdownSockets(rfbScreenInfoPtr rfbScreen)
 int
 rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 {
-    int nfds;
-    fd_set fds;
-    struct timeval tv;
+    int nfds, n;
+    rfbPollEvent *events;
+    rfbSocket sock;
     struct sockaddr_in addr;
     socklen_t addrlen = sizeof(addr);
     char buf[6];
-    rfbClientIteratorPtr i;
     rfbClientPtr cl;
     int result = 0;
 
@@ -359,27 +358,14 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
     }
 
     do {
-	memcpy((char *)&fds, (char *)&(rfbScreen->allFds), sizeof(fd_set));
-	tv.tv_sec = 0;
-	tv.tv_usec = usec;
-	nfds = select(rfbScreen->maxFd + 1, &fds, NULL, NULL /* &fds */, &tv);
+	nfds = rfbPollWait(rfbScreen, usec, &events);
 	if (nfds == 0) {
 	    /* timed out, check for async events */
-            i = rfbGetClientIterator(rfbScreen);
-            while((cl = rfbClientIteratorNext(i))) {
-                if (cl->onHold)
-                    continue;
-                if (FD_ISSET(cl->sock, &(rfbScreen->allFds)))
-                    rfbSendFileTransferChunk(cl);
-            }
-            rfbReleaseClientIterator(i);
+	    rfbPollSendFileTransferChunks(rfbScreen);
 	    return result;
 	}
 
 	if (nfds < 0) {
-#ifdef WIN32
-	    errno = WSAGetLastError();
-#endif
 	    if (errno != EINTR)
 		rfbLogPerror("rfbCheckFds: select");
 	    return -1;
@@ -387,85 +373,70 @@ rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec)
 
 	result += nfds;
 
-	if (rfbScreen->listenSock != RFB_INVALID_SOCKET && FD_ISSET(rfbScreen->listenSock, &fds)) {
-
-	    if (!rfbProcessNewConnection(rfbScreen))
-                return -1;
-
-	    FD_CLR(rfbScreen->listenSock, &fds);
-	    if (--nfds == 0)
-		return result;
-	}
-
-	if (rfbScreen->listen6Sock != RFB_INVALID_SOCKET && FD_ISSET(rfbScreen->listen6Sock, &fds)) {
-
-	    if (!rfbProcessNewConnection(rfbScreen))
-                return -1;
-
-	    FD_CLR(rfbScreen->listen6Sock, &fds);
-	    if (--nfds == 0)
-		return result;
-	}
+	for (n = 0; n < nfds; n++) {
+	    sock = events[n].sock;
+	    cl = events[n].cl;
 
-	if ((rfbScreen->udpSock != RFB_INVALID_SOCKET) && FD_ISSET(rfbScreen->udpSock, &fds)) {
-	    if(!rfbScreen->udpClient)
-		rfbNewUDPClient(rfbScreen);
-	    if (recvfrom(rfbScreen->udpSock, buf, 1, MSG_PEEK,
-			(struct sockaddr *)&addr, &addrlen) < 0) {
-		rfbLogPerror("rfbCheckFds: UDP: recvfrom");
-		rfbDisconnectUDPSock(rfbScreen);
-		rfbScreen->udpSockConnected = FALSE;
-	    } else {
-		if (!rfbScreen->udpSockConnected ||
-			(memcmp(&addr, &rfbScreen->udpRemoteAddr, addrlen) != 0))
-		{
-		    /* new remote end */
-		    rfbLog("rfbCheckFds: UDP: got connection\n");
-
-		    memcpy(&rfbScreen->udpRemoteAddr, &addr, addrlen);
-		    rfbScreen->udpSockConnected = TRUE;
-
-		    if (connect(rfbScreen->udpSock,
-				(struct sockaddr *)&addr, addrlen) < 0) {
-			rfbLogPerror("rfbCheckFds: UDP: connect");
-			rfbDisconnectUDPSock(rfbScreen);
+	    if (cl == NULL) {
+		if (sock == rfbScreen->listenSock || sock == rfbScreen->listen6Sock) {
+		    if (!rfbProcessNewConnection(rfbScreen))
 			return -1;
+		} else if (sock == rfbScreen->udpSock) {
+		    if(!rfbScreen->udpClient)
+			rfbNewUDPClient(rfbScreen);
+		    if (recvfrom(rfbScreen->udpSock, buf, 1, MSG_PEEK,
+				(struct sockaddr *)&addr, &addrlen) < 0) {
+			rfbLogPerror("rfbCheckFds: UDP: recvfrom");
+			rfbDisconnectUDPSock(rfbScreen);
+			rfbScreen->udpSockConnected = FALSE;
+		    } else {
+			if (!rfbScreen->udpSockConnected ||
+				(memcmp(&addr, &rfbScreen->udpRemoteAddr, addrlen) != 0))
+			{
+			    /* new remote end */
+			    rfbLog("rfbCheckFds: UDP: got connection\n");
+
+			    memcpy(&rfbScreen->udpRemoteAddr, &addr, addrlen);
+			    rfbScreen->udpSockConnected = TRUE;
+
+			    if (connect(rfbScreen->udpSock,
+					(struct sockaddr *)&addr, addrlen) < 0) {
+				rfbLogPerror("rfbCheckFds: UDP: connect");
+				rfbDisconnectUDPSock(rfbScreen);
+				return -1;
+			    }
+
+			    rfbNewUDPConnection(rfbScreen,rfbScreen->udpSock);
+			}
+
+			rfbProcessUDPInput(rfbScreen);
 		    }
-
-		    rfbNewUDPConnection(rfbScreen,rfbScreen->udpSock);
 		}
-
-		rfbProcessUDPInput(rfbScreen);
+		/* HTTP sockets are only watched to wake us up, they are
+		   serviced by rfbHttpCheckFds() */
+		continue;
 	    }
 
-	    FD_CLR(rfbScreen->udpSock, &fds);
-	    if (--nfds == 0)
-		return result;
-	}
-
-	i = rfbGetClientIterator(rfbScreen);
-	while((cl = rfbClientIteratorNext(i))) {
+	    if (cl->onHold || cl->sock == RFB_INVALID_SOCKET)
+		continue;
 
-	    if (cl->onHold)
+	    if (!(events[n].ready & RFB_POLL_READ)) {
+		/* room for queued output, rfbUpdateClient() writes it */
+		rfbPollMarkClient(rfbScreen, cl);
 		continue;
+	    }
 
-            if (FD_ISSET(cl->sock, &(rfbScreen->allFds)))
-            {
-                if (FD_ISSET(cl->sock, &fds))
-                {
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
-                    do {
-                        rfbProcessClientMessage(cl);
-                    } while (cl->sock != RFB_INVALID_SOCKET && webSocketsHasDataInBuffer(cl));
+	    do {
+		rfbProcessClientMessage(cl);
+	    } while (cl->sock != RFB_INVALID_SOCKET && webSocketsHasDataInBuffer(cl));
 #else
-                    rfbProcessClientMessage(cl);
+	    rfbProcessClientMessage(cl);
 #endif
-                }
-                else
-                    rfbSendFileTransferChunk(cl);
-            }
+	    rfbPollMarkClient(rfbScreen, cl);
 	}
-	rfbReleaseClientIterator(i);
+
+	rfbPollSendFileTransferChunks(rfbScreen);
     } while(rfbScreen->handleEventsEagerly);
     return result;
 }
@@ -545,6 +516,7 @@ rfbDisconnectUDPSock(rfbScreenInfoPtr rfbScreen)
 void
 rfbCloseClient(rfbClientPtr cl)
 {
+    rfbScreenInfoPtr screen = cl->screen;
     rfbExtensionData* extension;
 
     for(extension=cl->extensions; extension; extension=extension->next)
@@ -556,11 +528,7 @@ rfbCloseClient(rfbClientPtr cl)
     if (cl->sock != RFB_INVALID_SOCKET)
 #endif
       {
-	FD_CLR(cl->sock,&(cl->screen->allFds));
-	if(cl->sock==cl->screen->maxFd)
-	  while(cl->screen->maxFd>0
-		&& !FD_ISSET(cl->screen->maxFd,&(cl->screen->allFds)))
-	    cl->screen->maxFd--;
+	rfbPollRemoveSocket(cl->screen, cl->sock);
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
 	if (cl->sslctx)
 	    rfbssl_destroy(cl);
@@ -574,6 +542,10 @@ rfbCloseClient(rfbClientPtr cl)
       }
     TSIGNAL(cl->updateCond);
     UNLOCK(cl->updateMutex);
+
+    /* Let rfbProcessEvents() pick up the closed client. cl itself may be
+       gone already if its own thread noticed the closed socket. */
+    rfbPollScheduleFullScan(screen);
 }
 
 
@@ -608,8 +580,10 @@ rfbConnect(rfbScreenInfoPtr rfbScreen,
     }
 
     /* AddEnabledDevice(sock); */
-    FD_SET(sock, &rfbScreen->allFds);
-    rfbScreen->maxFd = rfbMax(sock,rfbScreen->maxFd);
+    if (sock < FD_SETSIZE) {
+        FD_SET(sock, &rfbScreen->allFds);
+        rfbScreen->maxFd = rfbMax(sock,rfbScreen->maxFd);
+    }
 
     return sock;
 }
@@ -625,8 +599,6 @@ rfbReadExactTimeout(rfbClientPtr cl, char* buf, int len, int timeout)
 {
     rfbSocket sock = cl->sock;
     int n;
-    fd_set fds;
-    struct timeval tv;
 
     while (len > 0) {
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
@@ -670,11 +642,7 @@ rfbReadExactTimeout(rfbClientPtr cl, char* buf, int len, int timeout)
 		    continue;
 	    }
 #endif
-            FD_ZERO(&fds);
-            FD_SET(sock, &fds);
-            tv.tv_sec = timeout / 1000;
-            tv.tv_usec = (timeout % 1000) * 1000;
-            n = select(sock+1, &fds, NULL, &fds, &tv);
+            n = rfbPollSocket(sock, FALSE, timeout);
             if (n < 0) {
                 rfbLogPerror("ReadExact: select");
                 return n;
@@ -717,8 +685,6 @@ rfbPeekExactTimeout(rfbClientPtr cl, char* buf, int len, int timeout)
 {
     rfbSocket sock = cl->sock;
     int n;
-    fd_set fds;
-    struct timeval tv;
 
     while (len > 0) {
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
@@ -756,11 +722,7 @@ rfbPeekExactTimeout(rfbClientPtr cl, char* buf, int len, int timeout)
 		    continue;
 	    }
 #endif
-            FD_ZERO(&fds);
-            FD_SET(sock, &fds);
-            tv.tv_sec = timeout / 1000;
-            tv.tv_usec = (timeout % 1000) * 1000;
-            n = select(sock+1, &fds, NULL, &fds, &tv);
+            n = rfbPollSocket(sock, FALSE, timeout);
             if (n < 0) {
                 rfbLogPerror("PeekExact: select");
                 return n;
@@ -782,10 +744,241 @@ rfbPeekExactTimeout(rfbClientPtr cl, char* buf, int len, int timeout)
     return 1;
 }
 
+/*
+ * With screen->sendQueueSize set, writes to clients never block: what the
+ * socket does not take right away is kept in cl->sendQueue and written by
+ * rfbFlushSendQueue() once the socket drains. All output goes through the
+ * queue while it is not empty, so the byte order is preserved.
+ */
+
+struct rfbSendQueue {
+    char *buf;
+    int start, len, size;
+    /* when the client last took some bytes, for maxClientWait */
+    struct timeval lastProgress;
+};
+
+static int
+clientWaitTime(rfbClientPtr cl)
+{
+    return (cl->screen && cl->screen->maxClientWait) ? cl->screen->maxClientWait : rfbMaxClientWait;
+}
+
+static rfbBool
+useSendQueue(rfbClientPtr cl)
+{
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+    /* TLS records have to be retried with the same arguments, which a
+       queue cannot guarantee */
+    if (cl->sslctx)
+	return FALSE;
+#endif
+    return cl->screen && cl->screen->sendQueueSize > 0;
+}
+
+/* Write as much as the socket takes without blocking; returns the number
+   of bytes written or -1 on error. */
+static int
+writeNonBlocking(rfbSocket sock, const char *buf, int len)
+{
+    int n, written = 0;
+
+    while (written < len) {
+	n = write(sock, buf + written, len - written);
+	if (n > 0) {
+	    written += n;
+	    continue;
+	}
+	if (n == 0)
+	    break;
+#ifdef WIN32
+	errno = WSAGetLastError();
+#endif
+	if (errno == EINTR)
+	    continue;
+	if (errno == EWOULDBLOCK || errno == EAGAIN)
+	    break;
+	return -1;
+    }
+    return written;
+}
+
+/* Called with outputMutex held. Returns the number of bytes still queued,
+   or -1 with errno set if the client is gone or took nothing for too long. */
+static int
+flushSendQueueLocked(rfbClientPtr cl)
+{
+    struct rfbSendQueue *q = cl->sendQueue;
+    struct timeval now;
+    int n;
+
+    if (!q || q->len == 0)
+	return 0;
+
+    n = writeNonBlocking(cl->sock, q->buf + q->start, q->len);
+    if (n < 0)
+	return -1;
+
+    gettimeofday(&now, NULL);
+    if (n > 0) {
+	q->start += n;
+	q->len -= n;
+	q->lastProgress = now;
+	if (q->len == 0) {
+	    q->start = 0;
+	    /* do not keep the memory of a burst around */
+	    if (q->size > 2 * cl->screen->sendQueueSize) {
+		free(q->buf);
+		q->buf = NULL;
+		q->size = 0;
+	    }
+	}
+    } else if ((now.tv_sec - q->lastProgress.tv_sec) * 1000
+	       + (now.tv_usec - q->lastProgress.tv_usec) / 1000 >= clientWaitTime(cl)) {
+	errno = ETIMEDOUT;
+	return -1;
+    }
+
+    return q->len;
+}
+
+static rfbBool
+appendSendQueueLocked(rfbClientPtr cl, const char *buf, int len)
+{
+    struct rfbSendQueue *q = cl->sendQueue;
+
+    if (!q) {
+	if (!(q = (struct rfbSendQueue *)calloc(sizeof(struct rfbSendQueue), 1)))
+	    return FALSE;
+	cl->sendQueue = q;
+    }
+
+    if (q->start + q->len + len > q->size) {
+	if (q->start > 0) {
+	    memmove(q->buf, q->buf + q->start, q->len);
+	    q->start = 0;
+	}
+	if (q->len + len > q->size) {
+	    int newSize = q->size ? q->size : 64 * 1024;
+	    char *p;
+	    while (newSize < q->len + len)
+		newSize *= 2;
+	    if (!(p = (char *)realloc(q->buf, newSize)))
+		return FALSE;
+	    q->buf = p;
+	    q->size = newSize;
+	}
+    }
+
+    if (q->len == 0)
+	gettimeofday(&q->lastProgress, NULL);
+    memcpy(q->buf + q->start + q->len, buf, len);
+    q->len += len;
+    return TRUE;
+}
+
+/* The queue just started, make sure somebody flushes it. */
+static void
+sendQueueStarted(rfbClientPtr cl)
+{
+    TSIGNAL(cl->updateCond);
+    rfbPollMarkClient(cl->screen, cl);
+}
+
+static int
+writeQueued(rfbClientPtr cl, const char *buf, int len)
+{
+    int n, queued;
+
+    LOCK(cl->outputMutex);
+    queued = flushSendQueueLocked(cl);
+    if (queued == 0) {
+	n = writeNonBlocking(cl->sock, buf, len);
+	if (n < 0) {
+	    UNLOCK(cl->outputMutex);
+	    return -1;
+	}
+	buf += n;
+	len -= n;
+    }
+    if (queued < 0 || (len > 0 && !appendSendQueueLocked(cl, buf, len))) {
+	if (queued >= 0) {
+	    rfbErr("WriteExact: could not queue %d bytes\n", len);
+	    errno = ENOMEM;
+	}
+	UNLOCK(cl->outputMutex);
+	return -1;
+    }
+    UNLOCK(cl->outputMutex);
+
+    if (queued == 0 && len > 0)
+	sendQueueStarted(cl);
+    return 1;
+}
+
+/*
+ * Number of bytes waiting in the send queue of a client.
+ */
+
+int
+rfbSendQueueLength(rfbClientPtr cl)
+{
+    int len;
+
+    LOCK(cl->outputMutex);
+    len = cl->sendQueue ? cl->sendQueue->len : 0;
+    UNLOCK(cl->outputMutex);
+    return len;
+}
+
+/*
+ * TRUE if the send queue of a client is at or over screen->sendQueueSize;
+ * no new framebuffer updates should be encoded for it then.
+ */
+
+rfbBool
+rfbSendQueueFull(rfbClientPtr cl)
+{
+    return cl->screen->sendQueueSize > 0 && rfbSendQueueLength(cl) >= cl->screen->sendQueueSize;
+}
+
+/*
+ * Write queued output of a client, waiting up to timeout ms for the socket
+ * to take some if it is full. Returns the number of bytes still queued; on
+ * error the client is closed and -1 returned.
+ */
+
+int
+rfbFlushSendQueue(rfbClientPtr cl, int timeout)
+{
+    int queued;
+
+    LOCK(cl->outputMutex);
+    queued = flushSendQueueLocked(cl);
+    UNLOCK(cl->outputMutex);
+
+    if (queued > 0 && timeout > 0 && rfbPollSocket(cl->sock, TRUE, timeout) > 0) {
+	LOCK(cl->outputMutex);
+	queued = flushSendQueueLocked(cl);
+	UNLOCK(cl->outputMutex);
+    }
+
+    if (queued < 0) {
+	if (errno == ETIMEDOUT)
+	    rfbErr("rfbFlushSendQueue: client stopped reading, closing\n");
+	else
+	    rfbLogPerror("rfbFlushSendQueue: write");
+	rfbCloseClient(cl);
+    }
+    return queued;
+}
+
+
 /*
  * WriteExact writes an exact number of bytes to a client.  Returns 1 if
  * those bytes have been written, or -1 if an error occurred (errno is set to
- * ETIMEDOUT if it timed out).
+ * ETIMEDOUT if it timed out). If screen->sendQueueSize is set, bytes the
+ * socket does not take right away are queued instead of waited for.
  */
 
 int
@@ -795,10 +988,8 @@ rfbWriteExact(rfbClientPtr cl,
 {
     rfbSocket sock = cl->sock;
     int n;
-    fd_set fds;
-    struct timeval tv;
     int totalTimeWaited = 0;
-    const int timeout = (cl->screen && cl->screen->maxClientWait) ? cl->screen->maxClientWait : rfbMaxClientWait;
+    const int timeout = clientWaitTime(cl);
 
 #undef DEBUG_WRITE_EXACT
 #ifdef DEBUG_WRITE_EXACT
@@ -819,6 +1010,9 @@ rfbWriteExact(rfbClientPtr cl,
     }
 #endif
 
+    if (useSendQueue(cl))
+	return writeQueued(cl, buf, len);
+
     LOCK(cl->outputMutex);
     while (len > 0) {
 #ifdef LIBVNCSERVER_WITH_WEBSOCKETS
@@ -854,15 +1048,8 @@ rfbWriteExact(rfbClientPtr cl,
                need to do this because select doesn't necessarily return
                immediately when the other end has gone away */
 
-            FD_ZERO(&fds);
-            FD_SET(sock, &fds);
-            tv.tv_sec = 5;
-            tv.tv_usec = 0;
-            n = select(sock+1, NULL, &fds, NULL /* &fds */, &tv);
+            n = rfbPollSocket(sock, TRUE, 5000);
 	    if (n < 0) {
-#ifdef WIN32
-                errno=WSAGetLastError();
-#endif
        	        if(errno==EINTR)
 		    continue;
                 rfbLogPerror("WriteExact: select");
@@ -885,6 +1072,336 @@ rfbWriteExact(rfbClientPtr cl,
     return 1;
 }
 
+/*
+ * Output batches collect everything a framebuffer update consists of and
+ * write it with as few system calls as possible, instead of one write()
+ * per filled updateBuf. Bytes are either copied into the batch buffer or,
+ * for data the encoder keeps unchanged until the batch is written (like
+ * framebuffer rows), just referenced.
+ */
+
+/* write the batch early once this much has been copied into it */
+#define BATCH_FLUSH_BYTES (1024*1024)
+#define BATCH_MAX_SEGMENTS 4096
+/* batch buffer kept between updates */
+#define BATCH_KEEP_BYTES (256*1024)
+
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define BATCH_IOV IOV_MAX
+#else
+#define BATCH_IOV 1024
+#endif
+
+typedef struct {
+    const char *ref;   /* NULL: bytes at off in the batch buffer */
+    int off, len;
+} rfbBatchSegment;
+
+struct rfbOutputBatch {
+    rfbBool active;
+    rfbBatchSegment *segs;
+    int nSegs, maxSegs;
+    char *buf;
+    int bufLen, bufSize;
+};
+
+static const char *
+segmentData(struct rfbOutputBatch *b, rfbBatchSegment *seg)
+{
+    return seg->ref ? seg->ref : b->buf + seg->off;
+}
+
+#if defined(LIBVNCSERVER_HAVE_SYS_UIO_H) && !defined(WIN32)
+#define BATCH_WRITEV
+
+/* WebSockets frame every write, these go through rfbWriteExact() */
+static rfbBool
+framedOutput(rfbClientPtr cl)
+{
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+    return cl->wsctx != NULL;
+#else
+    return FALSE;
+#endif
+}
+
+/* Like writeNonBlocking(), for the segments from *seg on, the first of
+   which has *off bytes written already; advances *seg and *off. */
+static int
+writeSegments(rfbSocket sock, struct rfbOutputBatch *b, int *seg, int *off)
+{
+    struct iovec iov[BATCH_IOV];
+    struct msghdr msg;
+    int i, n, left, flags, written = 0;
+
+    while (*seg < b->nSegs) {
+	for (i = 0; i < BATCH_IOV && *seg + i < b->nSegs; i++) {
+	    rfbBatchSegment *s = &b->segs[*seg + i];
+	    int skip = i == 0 ? *off : 0;
+	    iov[i].iov_base = (char *)segmentData(b, s) + skip;
+	    iov[i].iov_len = s->len - skip;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = i;
+	flags = 0;
+#ifdef MSG_MORE
+	/* more is coming right away, do not push out a short packet */
+	if (*seg + i < b->nSegs)
+	    flags |= MSG_MORE;
+#endif
+	n = sendmsg(sock, &msg, flags);
+	if (n < 0 && errno == ENOTSOCK)
+	    n = writev(sock, iov, i);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EWOULDBLOCK || errno == EAGAIN)
+		break;
+	    return -1;
+	}
+	if (n == 0)
+	    break;
+	written += n;
+	while (n > 0) {
+	    left = b->segs[*seg].len - *off;
+	    if (n < left) {
+		*off += n;
+		break;
+	    }
+	    n -= left;
+	    (*seg)++;
+	    *off = 0;
+	}
+    }
+    return written;
+}
+
+/* rfbWriteExact() for a whole batch */
+static int
+writeBatchVector(rfbClientPtr cl, struct rfbOutputBatch *b)
+{
+    const int timeout = clientWaitTime(cl);
+    rfbBool queue = useSendQueue(cl);
+    int seg = 0, off = 0, n, queued = 0, totalTimeWaited = 0;
+    rfbBool started;
+
+    LOCK(cl->outputMutex);
+    if (queue)
+	queued = flushSendQueueLocked(cl);
+    while (queued == 0 && seg < b->nSegs) {
+	n = writeSegments(cl->sock, b, &seg, &off);
+	if (n < 0) {
+	    UNLOCK(cl->outputMutex);
+	    return -1;
+	}
+	if (seg == b->nSegs || queue)
+	    break;
+	if (n > 0)
+	    totalTimeWaited = 0;
+
+	/* same as rfbWriteExact() */
+	n = rfbPollSocket(cl->sock, TRUE, 5000);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    rfbLogPerror("WriteExact: select");
+	    UNLOCK(cl->outputMutex);
+	    return n;
+	}
+	if (n == 0) {
+	    totalTimeWaited += 5000;
+	    if (totalTimeWaited >= timeout) {
+		errno = ETIMEDOUT;
+		UNLOCK(cl->outputMutex);
+		return -1;
+	    }
+	} else
+	    totalTimeWaited = 0;
+    }
+    if (queued < 0) {
+	UNLOCK(cl->outputMutex);
+	return -1;
+    }
+    /* only with a send queue: keep what the socket did not take */
+    for (; seg < b->nSegs; seg++, off = 0)
+	if (!appendSendQueueLocked(cl, segmentData(b, &b->segs[seg]) + off,
+				   b->segs[seg].len - off)) {
+	    rfbErr("WriteExact: could not queue %d bytes\n", b->segs[seg].len - off);
+	    errno = ENOMEM;
+	    UNLOCK(cl->outputMutex);
+	    return -1;
+	}
+    started = queued == 0 && cl->sendQueue && cl->sendQueue->len > 0;
+    UNLOCK(cl->outputMutex);
+
+    if (started)
+	sendQueueStarted(cl);
+    return 1;
+}
+
+#endif
+
+static int
+writeBatch(rfbClientPtr cl, struct rfbOutputBatch *b)
+{
+    int i, result = 1;
+
+#ifdef BATCH_WRITEV
+    if (!framedOutput(cl))
+	result = writeBatchVector(cl, b);
+    else
+#endif
+    for (i = 0; i < b->nSegs && result > 0; i++)
+	result = rfbWriteExact(cl, segmentData(b, &b->segs[i]), b->segs[i].len);
+
+    b->nSegs = 0;
+    b->bufLen = 0;
+    return result;
+}
+
+static rfbBool
+addSegment(struct rfbOutputBatch *b, const char *ref, int off, int len)
+{
+    if (b->nSegs == b->maxSegs) {
+	int newMax = b->maxSegs ? b->maxSegs * 2 : 64;
+	rfbBatchSegment *p = (rfbBatchSegment *)realloc(b->segs, newMax * sizeof(rfbBatchSegment));
+	if (!p)
+	    return FALSE;
+	b->segs = p;
+	b->maxSegs = newMax;
+    }
+    b->segs[b->nSegs].ref = ref;
+    b->segs[b->nSegs].off = off;
+    b->segs[b->nSegs].len = len;
+    b->nSegs++;
+    return TRUE;
+}
+
+/*
+ * From now on, rfbWriteBatched() collects output instead of writing it,
+ * until rfbEndOutputBatch().
+ */
+
+void
+rfbBeginOutputBatch(rfbClientPtr cl)
+{
+    if (!cl->outputBatch)
+	cl->outputBatch = (struct rfbOutputBatch *)calloc(sizeof(struct rfbOutputBatch), 1);
+    if (cl->outputBatch)
+	cl->outputBatch->active = TRUE;
+}
+
+/*
+ * Add len bytes to the batch of a client, or write them right away if
+ * there is none. Unless copy is set, buf has to stay unchanged until the
+ * batch is written. Returns like rfbWriteExact().
+ */
+
+int
+rfbWriteBatched(rfbClientPtr cl, const char *buf, int len, rfbBool copy)
+{
+    struct rfbOutputBatch *b = cl->outputBatch;
+    rfbBatchSegment *last;
+
+    if (!b || !b->active)
+	return rfbWriteExact(cl, buf, len);
+    if (len <= 0)
+	return 1;
+
+    if (b->nSegs >= BATCH_MAX_SEGMENTS && writeBatch(cl, b) < 0)
+	return -1;
+
+    if (copy && len >= BATCH_FLUSH_BYTES / 2) {
+	/* written before this returns anyway, no need to copy */
+	if (!addSegment(b, buf, 0, len)) {
+	    if (writeBatch(cl, b) < 0)
+		return -1;
+	    return rfbWriteExact(cl, buf, len);
+	}
+	return writeBatch(cl, b);
+    }
+
+    if (copy) {
+	if (b->bufLen + len > b->bufSize) {
+	    int newSize = b->bufSize ? b->bufSize : 64 * 1024;
+	    char *p;
+	    while (newSize < b->bufLen + len)
+		newSize *= 2;
+	    if (!(p = (char *)realloc(b->buf, newSize))) {
+		if (writeBatch(cl, b) < 0)
+		    return -1;
+		return rfbWriteExact(cl, buf, len);
+	    }
+	    b->buf = p;
+	    b->bufSize = newSize;
+	}
+	memcpy(b->buf + b->bufLen, buf, len);
+	last = b->nSegs ? &b->segs[b->nSegs - 1] : NULL;
+	if (last && !last->ref && last->off + last->len == b->bufLen)
+	    last->len += len;
+	else if (!addSegment(b, NULL, b->bufLen, len)) {
+	    if (writeBatch(cl, b) < 0)
+		return -1;
+	    return rfbWriteExact(cl, buf, len);
+	}
+	b->bufLen += len;
+	if (b->bufLen >= BATCH_FLUSH_BYTES)
+	    return writeBatch(cl, b);
+	return 1;
+    }
+
+    if (!addSegment(b, buf, 0, len)) {
+	if (writeBatch(cl, b) < 0)
+	    return -1;
+	return rfbWriteExact(cl, buf, len);
+    }
+    return 1;
+}
+
+/*
+ * Write what was collected since rfbBeginOutputBatch(). Returns like
+ * rfbWriteExact().
+ */
+
+int
+rfbEndOutputBatch(rfbClientPtr cl)
+{
+    struct rfbOutputBatch *b = cl->outputBatch;
+    int result = 1;
+
+    if (!b || !b->active)
+	return 1;
+    b->active = FALSE;
+    if (b->nSegs > 0)
+	result = writeBatch(cl, b);
+    b->nSegs = 0;
+    b->bufLen = 0;
+    if (b->bufSize > BATCH_KEEP_BYTES) {
+	free(b->buf);
+	b->buf = NULL;
+	b->bufSize = 0;
+    }
+    return result;
+}
+
+/* currently private, called by rfbClientConnectionGone() */
+void
+rfbFreeClientOutput(rfbClientPtr cl)
+{
+    if (cl->sendQueue) {
+	free(cl->sendQueue->buf);
+	free(cl->sendQueue);
+	cl->sendQueue = NULL;
+    }
+    if (cl->outputBatch) {
+	free(cl->outputBatch->segs);
+	free(cl->outputBatch->buf);
+	free(cl->outputBatch);
+	cl->outputBatch = NULL;
+    }
+}
+
 /* currently private, called by rfbProcessArguments() */
 int
 rfbStringToAddr(char *str, in_addr_t *addr)  {
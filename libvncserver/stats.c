@@ -25,6 +25,7 @@
  */
 
 #include <rfb/rfb.h>
+#include "private.h"
 
 char *messageNameServer2Client(uint32_t type, char *buf, int len);
 char *messageNameClient2Server(uint32_t type, char *buf, int len);
@@ -106,6 +107,7 @@ char *encodingName(uint32_t type, char *buf, int len) {
     case rfbEncodingUltra:              snprintf(buf, len, "ultra");       break;
     case rfbEncodingZRLE:               snprintf(buf, len, "ZRLE");        break;
     case rfbEncodingZYWRLE:             snprintf(buf, len, "ZYWRLE");      break;
+    case rfbEncodingTRLE:               snprintf(buf, len, "TRLE");        break;
     case rfbEncodingCache:              snprintf(buf, len, "cache");       break;
     case rfbEncodingCacheEnable:        snprintf(buf, len, "cacheEnable"); break;
     case rfbEncodingXOR_Zlib:           snprintf(buf, len, "xorZlib");     break;
@@ -230,6 +232,28 @@ void  rfbStatRecordEncodingSent(rfbClientPtr cl, uint32_t type, int byteCount, i
     }
 }
 
+
+/* Add the encodings another rfbClientRec sent on behalf of cl to the
+   statistics of cl, and start those of the other one over. */
+void rfbStatMoveEncodingsSent(rfbClientPtr cl, rfbClientPtr from)
+{
+    rfbStatList *ptr, *to;
+
+    for (ptr = from->statEncList; ptr!=NULL; ptr=ptr->Next)
+    {
+        if (ptr->sentCount == 0 && ptr->bytesSent == 0)
+            continue;
+        to = rfbStatLookupEncoding(cl, ptr->type);
+        if (to!=NULL)
+        {
+            to->sentCount      += ptr->sentCount;
+            to->bytesSent      += ptr->bytesSent;
+            to->bytesSentIfRaw += ptr->bytesSentIfRaw;
+        }
+        ptr->sentCount = ptr->bytesSent = ptr->bytesSentIfRaw = 0;
+    }
+}
+
 void  rfbStatRecordEncodingRcvd(rfbClientPtr cl, uint32_t type, int byteCount, int byteIfRaw)
 {
     rfbStatList *ptr;
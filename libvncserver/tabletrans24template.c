@@ -59,18 +59,13 @@ rfbTranslateWithSingleTable24to24 (char *table, rfbPixelFormat *in,
     uint8_t *opLineEnd;
     uint8_t *t = (uint8_t *)table;
     int shift = rfbEndianTest?0:8;
-    uint8_t c;
 
     while (height > 0) {
         opLineEnd = op + width*3;
 
         while (op < opLineEnd) {
-	    *(uint32_t*)op = t[((*(uint32_t *)ip)>>shift)&0x00ffffff];
-	    if(!rfbEndianTest)
-	      memmove(op,op+1,3);
-	    if (out->bigEndian != in->bigEndian) {
-	      c = op[0]; op[0] = op[2]; op[2] = c;
-	    }
+	    /* the entries hold the three bytes in the client's order */
+	    memcpy(op,&t[3*(((*(uint32_t *)ip)>>shift)&0x00ffffff)],3);
 	    op += 3;
 	    ip += 3;
         }
@@ -99,7 +94,8 @@ rfbTranslateWithRGBTables24to24 (char *table, rfbPixelFormat *in,
     uint8_t *redTable = (uint8_t *)table;
     uint8_t *greenTable = redTable + 3*(in->redMax + 1);
     uint8_t *blueTable = greenTable + 3*(in->greenMax + 1);
-    uint32_t outValue,inValue;
+    uint8_t *r, *g, *b;
+    uint32_t inValue;
     int shift = rfbEndianTest?0:8;
 
     while (height > 0) {
@@ -107,10 +103,13 @@ rfbTranslateWithRGBTables24to24 (char *table, rfbPixelFormat *in,
 
         while (op < opLineEnd) {
 	    inValue = ((*(uint32_t *)ip)>>shift)&0x00ffffff;
-            outValue = (redTable[(inValue >> in->redShift) & in->redMax] |
-                       greenTable[(inValue >> in->greenShift) & in->greenMax] |
-                       blueTable[(inValue >> in->blueShift) & in->blueMax]);
-	    memcpy(op,&outValue,3);
+	    /* the entries are three bytes each, in the client's order */
+	    r = &redTable[3*((inValue >> in->redShift) & in->redMax)];
+	    g = &greenTable[3*((inValue >> in->greenShift) & in->greenMax)];
+	    b = &blueTable[3*((inValue >> in->blueShift) & in->blueMax)];
+	    op[0] = r[0] | g[0] | b[0];
+	    op[1] = r[1] | g[1] | b[1];
+	    op[2] = r[2] | g[2] | b[2];
 	    op += 3;
             ip+=3;
         }
@@ -253,16 +252,19 @@ rfbTranslateWithRGBTablesINto24 (char *table, rfbPixelFormat *in,
     uint8_t *redTable = (uint8_t *)table;
     uint8_t *greenTable = redTable + 3*(in->redMax + 1);
     uint8_t *blueTable = greenTable + 3*(in->greenMax + 1);
-    uint32_t outValue;
+    uint8_t *r, *g, *b;
 
     while (height > 0) {
         opLineEnd = op+3*width;
 
         while (op < opLineEnd) {
-            outValue = (redTable[(*ip >> in->redShift) & in->redMax] |
-                       greenTable[(*ip >> in->greenShift) & in->greenMax] |
-                       blueTable[(*ip >> in->blueShift) & in->blueMax]);
-	    memcpy(op,&outValue,3);
+	    /* the entries are three bytes each, in the client's order */
+	    r = &redTable[3*((*ip >> in->redShift) & in->redMax)];
+	    g = &greenTable[3*((*ip >> in->greenShift) & in->greenMax)];
+	    b = &blueTable[3*((*ip >> in->blueShift) & in->blueMax)];
+	    op[0] = r[0] | g[0] | b[0];
+	    op[1] = r[1] | g[1] | b[1];
+	    op[2] = r[2] | g[2] | b[2];
 	    op += 3;
             ip++;
         }
@@ -37,10 +37,10 @@
 
 #include <rfb/rfb.h>
 #include "private.h"
+#include "workerpool.h"
+#include "simd.h"
+#include "adaptive.h"
 
-#ifdef LIBVNCSERVER_HAVE_LIBPNG
-#include <png.h>
-#endif
 #include "turbojpeg.h"
 
 
@@ -52,21 +52,15 @@
 #define MIN_SOLID_SUBRECT_SIZE  2048
 #define MAX_SPLIT_TILE_SIZE       16
 
-/*
- * There is so much access of the Tight encoding static data buffers
- * that we resort to using thread local storage instead of having
- * per-client data.
- */
-#if defined(__GNUC__)
-#define TLS __thread
-#elif defined(_MSC_VER)
-#define TLS __declspec(thread)
-#else
-#define TLS
-#endif
+/* With rfbScreenInfo::encodePool, subrectangles are queued and encoded in
+   batches of this many per thread. */
+#define TIGHT_TASKS_PER_THREAD     2
 
-/* This variable is set on every rfbSendRectEncodingTight() call. */
-static TLS rfbBool usePixelFormat24 = FALSE;
+/* Compression control bits asking the client to reset a zlib stream before
+   decoding; set on every rectangle when the encoded rectangle cache may
+   send the same bytes to other clients. */
+#define TIGHT_STREAM_RESET(cl, streamId) \
+    ((cl)->tightResetStreams ? 1 << (streamId) : 0)
 
 
 /* Compression level stuff. The following array contains various
@@ -89,28 +83,27 @@ static TIGHT_CONF tightConf[4] = {
 };
 
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
+/* png_filters: pick a filter for every row, or send them unfiltered;
+   filtering does not pay off if the rows are not compressed anyway */
 typedef struct TIGHT_PNG_CONF_s {
-    int png_zlib_level, png_filters;
+    int png_zlib_level;
+    rfbBool png_filters;
 } TIGHT_PNG_CONF;
 
 static TIGHT_PNG_CONF tightPngConf[10] = {
-    { 0, PNG_NO_FILTERS },
-    { 1, PNG_NO_FILTERS },
-    { 2, PNG_NO_FILTERS },
-    { 3, PNG_NO_FILTERS },
-    { 4, PNG_NO_FILTERS },
-    { 5, PNG_ALL_FILTERS },
-    { 6, PNG_ALL_FILTERS },
-    { 7, PNG_ALL_FILTERS },
-    { 8, PNG_ALL_FILTERS },
-    { 9, PNG_ALL_FILTERS },
+    { 0, FALSE },
+    { 1, TRUE },
+    { 2, TRUE },
+    { 3, TRUE },
+    { 4, TRUE },
+    { 5, TRUE },
+    { 6, TRUE },
+    { 7, TRUE },
+    { 8, TRUE },
+    { 9, TRUE },
 };
 #endif
 
-static TLS int compressLevel = 1;
-static TLS int qualityLevel = 95;
-static TLS int subsampLevel = TJ_444;
-
 static const int subsampLevel2tjsubsamp[4] = {
     TJ_444, TJ_420, TJ_422, TJ_GRAYSCALE
 };
@@ -118,63 +111,134 @@ static const int subsampLevel2tjsubsamp[4] = {
 
 /* Stuff dealing with palettes. */
 
-typedef struct COLOR_LIST_s {
-    struct COLOR_LIST_s *next;
-    int idx;
-    uint32_t rgb;
-} COLOR_LIST;
+/* The colours are kept in an open-addressing hash table with twice as
+   many slots as a palette can have entries, so probe sequences stay short. */
+#define PALETTE_SLOTS 512
+#define PALETTE_HASH(rgb) ((int)(((uint32_t)(rgb) * 0x9E3779B1u) >> 23))
 
 typedef struct PALETTE_ENTRY_s {
-    COLOR_LIST *listNode;
+    uint32_t rgb;
     int numPixels;
+    int slot;
 } PALETTE_ENTRY;
 
 typedef struct PALETTE_s {
+    /* sorted by decreasing pixel count */
     PALETTE_ENTRY entry[256];
-    COLOR_LIST *hash[256];
-    COLOR_LIST list[256];
+    /* index + 1 of the entry whose colour is in a slot, 0 if free */
+    uint16_t slot[PALETTE_SLOTS];
 } PALETTE;
 
-/* TODO: move into rfbScreen struct */
-static TLS int paletteNumColors = 0;
-static TLS int paletteMaxColors = 0;
-static TLS uint32_t monoBackground = 0;
-static TLS uint32_t monoForeground = 0;
-static TLS PALETTE palette;
 
-/* Pointers to dynamically-allocated buffers. */
+/*
+ * Everything needed to encode one subrectangle. The solid-area search
+ * queues subrectangles in these contexts; their palette analysis and JPEG
+ * compression may then run on the threads of rfbScreenInfo::encodePool
+ * while the zlib streams, which belong to the client, are fed in order.
+ */
 
-static TLS int tightBeforeBufSize = 0;
-static TLS char *tightBeforeBuf = NULL;
+typedef struct rfbTightContext {
+    rfbClientPtr cl;
+
+    /* Copied from the rfbTightEncoder when the subrectangle is queued. */
+    rfbBool usePixelFormat24;
+    int compressLevel;
+    int qualityLevel;
+    int subsampLevel;
+    rfbBool adaptive;
+
+    int paletteNumColors;
+    int paletteMaxColors;
+    uint32_t monoBackground;
+    uint32_t monoForeground;
+    PALETTE palette;
+
+    /* Pointers to dynamically-allocated buffers. */
+    int tightBeforeBufSize;
+    char *tightBeforeBuf;
+    int tightAfterBufSize;
+    char *tightAfterBuf;
+
+    tjhandle j;
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+    /* The PNG writer's deflate stream, reset for every image, and its
+       rows: the previous and current one as RGB, and the filtered one. */
+    z_stream pngStream;
+    rfbBool pngStreamActive;
+    int pngStreamLevel;
+    int pngRowsSize;
+    char *pngRows;
+#endif
 
-static TLS int tightAfterBufSize = 0;
-static TLS char *tightAfterBuf = NULL;
+    /* The subrectangle; solid is set when the solid-area search found it. */
+    int x, y, w, h;
+    rfbBool solid;
+
+    /* What follows the rectangle header: headerLen bytes of subencoding
+       header and palette, then dataLen bytes of data, which are compressed
+       on zlib stream streamId first unless that is -1, and preceded by
+       their length if sendLength is set. */
+    char header[3 + 256 * 4];
+    int headerLen;
+    int streamId, zlibLevel;
+    char *data;
+    int dataLen;
+    rfbBool sendLength;
+    rfbBool ok;
+    /* Set when the data is JPEG. */
+    rfbBool lossy;
+} rfbTightContext;
+
+/* The contexts of a client, and how many of them are queued. */
+typedef struct rfbTightEncoder {
+    rfbClientPtr cl;
+
+    /* These are set on every rfbSendRectEncodingTight() call. */
+    rfbBool usePixelFormat24;
+    int compressLevel;
+    int qualityLevel;
+    int subsampLevel;
+    /* JPEG is only used where it pays off, see rfbAdaptiveJpeg(). */
+    rfbBool adaptive;
+
+    rfbTightContext **contexts;
+    int maxContexts;
+    int nQueued;
+} rfbTightEncoder;
+
+void rfbFreeTightData(rfbClientPtr cl)
+{
+    rfbTightEncoder *enc = cl->tightEncoder;
+    rfbTightContext *ctx;
+    int i;
 
-static TLS tjhandle j = NULL;
+    if (!enc)
+        return;
 
-void rfbTightCleanup (rfbScreenInfoPtr screen)
-{
-    if (tightBeforeBufSize) {
-        free (tightBeforeBuf);
-        tightBeforeBufSize = 0;
-        tightBeforeBuf = NULL;
-    }
-    if (tightAfterBufSize) {
-        free (tightAfterBuf);
-        tightAfterBufSize = 0;
-        tightAfterBuf = NULL;
+    for (i = 0; i < enc->maxContexts; i++) {
+        if ((ctx = enc->contexts[i]) == NULL)
+            continue;
+        free(ctx->tightBeforeBuf);
+        free(ctx->tightAfterBuf);
+        if (ctx->j)
+            tjDestroy(ctx->j);
+#ifdef LIBVNCSERVER_HAVE_LIBPNG
+        if (ctx->pngStreamActive)
+            deflateEnd(&ctx->pngStream);
+        free(ctx->pngRows);
+#endif
+        free(ctx);
     }
-	if (j) {
-		tjDestroy(j);
-		/* Set freed resource handle to 0! */
-		j = 0;
-	}
+    free(enc->contexts);
+    free(enc);
+    cl->tightEncoder = NULL;
 }
 
 
 /* Prototypes for static functions. */
 
-static rfbBool SendRectEncodingTight(rfbClientPtr cl, int x, int y,
+static rfbBool SendRect(rfbClientPtr cl, int x, int y, int w, int h);
+static rfbBool SendRectEncodingTight(rfbTightEncoder *enc, int x, int y,
                                      int w, int h);
 static void FindBestSolidArea (rfbClientPtr cl, int x, int y, int w, int h,
                                uint32_t colorValue, int *w_ptr, int *h_ptr);
@@ -190,39 +254,52 @@ static rfbBool CheckSolidTile16  (rfbClientPtr cl, int x, int y, int w, int h,
 static rfbBool CheckSolidTile32  (rfbClientPtr cl, int x, int y, int w, int h,
                                   uint32_t *colorPtr, rfbBool needSameColor);
 
-static rfbBool SendRectSimple    (rfbClientPtr cl, int x, int y, int w, int h);
-static rfbBool SendSubrect       (rfbClientPtr cl, int x, int y, int w, int h);
-
-static rfbBool SendSolidRect     (rfbClientPtr cl);
-static rfbBool SendMonoRect      (rfbClientPtr cl, int x, int y, int w, int h);
-static rfbBool SendIndexedRect   (rfbClientPtr cl, int x, int y, int w, int h);
-static rfbBool SendFullColorRect (rfbClientPtr cl, int x, int y, int w, int h);
-
-static rfbBool CompressData (rfbClientPtr cl, int streamId, int dataLen,
-                             int zlibLevel, int zlibStrategy);
-
-static void FillPalette8 (int count);
-static void FillPalette16 (int count);
-static void FillPalette32 (int count);
-static void FastFillPalette16 (rfbClientPtr cl, uint16_t *data, int w,
+static rfbBool SendRectSimple    (rfbTightEncoder *enc, int x, int y, int w,
+                                  int h);
+static rfbBool QueueSubrect      (rfbTightEncoder *enc, int x, int y, int w,
+                                  int h, rfbBool solid);
+static rfbBool FlushSubrects     (rfbTightEncoder *enc);
+static rfbBool SendSubrect       (rfbTightContext *ctx);
+static rfbBool WriteSubrect      (rfbTightContext *ctx);
+
+static rfbBool SendSolidRect     (rfbTightContext *ctx);
+static rfbBool SendMonoRect      (rfbTightContext *ctx, int x, int y, int w,
+                                  int h);
+static rfbBool SendIndexedRect   (rfbTightContext *ctx, int x, int y, int w,
+                                  int h);
+static rfbBool SendFullColorRect (rfbTightContext *ctx, int x, int y, int w,
+                                  int h);
+
+static void PrepareData (rfbTightContext *ctx, int streamId, int dataLen,
+                         int zlibLevel);
+static rfbBool CompressData (rfbTightContext *ctx);
+
+static void FillPalette8 (rfbTightContext *ctx, int count);
+static void FillPalette16 (rfbTightContext *ctx, int count);
+static void FillPalette32 (rfbTightContext *ctx, int count);
+static void FastFillPalette16 (rfbTightContext *ctx, uint16_t *data, int w,
                                int pitch, int h);
-static void FastFillPalette32 (rfbClientPtr cl, uint32_t *data, int w,
+static void FastFillPalette32 (rfbTightContext *ctx, uint32_t *data, int w,
                                int pitch, int h);
 
-static void PaletteReset (void);
-static int PaletteInsert (uint32_t rgb, int numPixels, int bpp);
+static void PaletteReset (rfbTightContext *ctx);
+static int PaletteFind (rfbTightContext *ctx, uint32_t rgb, int *slot);
+static int PaletteInsert (rfbTightContext *ctx, uint32_t rgb, int numPixels,
+                          int bpp);
 
 static void Pack24 (rfbClientPtr cl, char *buf, rfbPixelFormat *fmt,
                     int count);
 
-static void EncodeIndexedRect16 (uint8_t *buf, int count);
-static void EncodeIndexedRect32 (uint8_t *buf, int count);
+static void EncodeIndexedRect16 (rfbTightContext *ctx, uint8_t *buf,
+                                 int count);
+static void EncodeIndexedRect32 (rfbTightContext *ctx, uint8_t *buf,
+                                 int count);
 
-static void EncodeMonoRect8 (uint8_t *buf, int w, int h);
-static void EncodeMonoRect16 (uint8_t *buf, int w, int h);
-static void EncodeMonoRect32 (uint8_t *buf, int w, int h);
+static void EncodeMonoRect8 (rfbTightContext *ctx, uint8_t *buf, int w, int h);
+static void EncodeMonoRect16 (rfbTightContext *ctx, uint8_t *buf, int w, int h);
+static void EncodeMonoRect32 (rfbTightContext *ctx, uint8_t *buf, int w, int h);
 
-static rfbBool SendJpegRect (rfbClientPtr cl, int x, int y, int w, int h,
+static rfbBool SendJpegRect (rfbTightContext *ctx, int x, int y, int w, int h,
                              int quality);
 static void PrepareRowForImg(rfbClientPtr cl, uint8_t *dst, int x, int y, int count);
 static void PrepareRowForImg24(rfbClientPtr cl, uint8_t *dst, int x, int y, int count);
@@ -230,7 +307,7 @@ static void PrepareRowForImg16(rfbClientPtr cl, uint8_t *dst, int x, int y, int
 static void PrepareRowForImg32(rfbClientPtr cl, uint8_t *dst, int x, int y, int count);
 
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
-static rfbBool SendPngRect(rfbClientPtr cl, int x, int y, int w, int h);
+static rfbBool SendPngRect(rfbTightContext *ctx, int x, int y, int w, int h);
 static rfbBool CanSendPngRect(rfbClientPtr cl, int w, int h);
 #endif
 
@@ -238,6 +315,40 @@ static rfbBool CanSendPngRect(rfbClientPtr cl, int w, int h);
  * Tight encoding implementation.
  */
 
+static int
+TightCompressLevel(rfbClientPtr cl)
+{
+    int compressLevel = cl->tightCompressLevel;
+
+    /* We only allow compression levels that have a demonstrable performance
+       benefit.  CL 0 with JPEG reduces CPU usage for workloads that have low
+       numbers of unique colors, but the same thing can be accomplished by
+       using CL 0 without JPEG (AKA "Lossless Tight.")  For those same
+       low-color workloads, CL 2 can provide typically 20-40% better
+       compression than CL 1 (with a commensurate increase in CPU usage.)  For
+       high-color workloads, CL 1 should always be used, as higher compression
+       levels increase CPU usage for these workloads without providing any
+       significant reduction in bandwidth. */
+    if (cl->turboQualityLevel != -1) {
+        if (compressLevel < 1) compressLevel = 1;
+        if (compressLevel > 2) compressLevel = 2;
+    }
+
+    /* With JPEG disabled, CL 2 offers no significant bandwidth savings over
+       CL 1, so we don't include it. */
+    else if (compressLevel > 1) compressLevel = 1;
+
+    /* CL 9 (which maps internally to CL 3) is included mainly for backward
+       compatibility with TightVNC Compression Levels 5-9.  It should be used
+       only in extremely low-bandwidth cases in which it can be shown to have a
+       benefit.  For low-color workloads, it provides typically only 10-20%
+       better compression than CL 2 with JPEG and CL 1 without JPEG, and it
+       uses, on average, twice as much CPU time. */
+    if (cl->tightCompressLevel == 9) compressLevel = 3;
+
+    return compressLevel;
+}
+
 int
 rfbNumCodedRectsTight(rfbClientPtr cl,
                       int x,
@@ -253,8 +364,8 @@ rfbNumCodedRectsTight(rfbClientPtr cl,
     if (cl->enableLastRectEncoding && w * h >= MIN_SPLIT_RECT_SIZE)
         return 0;
 
-    maxRectSize = tightConf[compressLevel].maxRectSize;
-    maxRectWidth = tightConf[compressLevel].maxRectWidth;
+    maxRectSize = tightConf[TightCompressLevel(cl)].maxRectSize;
+    maxRectWidth = tightConf[TightCompressLevel(cl)].maxRectWidth;
 
     if (w > maxRectWidth || w * h > maxRectSize) {
         subrectMaxWidth = (w > maxRectWidth) ? maxRectWidth : w;
@@ -274,7 +385,7 @@ rfbSendRectEncodingTight(rfbClientPtr cl,
                          int h)
 {
     cl->tightEncoding = rfbEncodingTight;
-    return SendRectEncodingTight(cl, x, y, w, h);
+    return SendRect(cl, x, y, w, h);
 }
 
 rfbBool
@@ -285,83 +396,84 @@ rfbSendRectEncodingTightPng(rfbClientPtr cl,
                          int h)
 {
     cl->tightEncoding = rfbEncodingTightPng;
-    return SendRectEncodingTight(cl, x, y, w, h);
+    return SendRect(cl, x, y, w, h);
 }
 
 
-rfbBool
-SendRectEncodingTight(rfbClientPtr cl,
-                         int x,
-                         int y,
-                         int w,
-                         int h)
+static rfbBool
+SendRect(rfbClientPtr cl,
+         int x,
+         int y,
+         int w,
+         int h)
 {
-    int nMaxRows;
-    uint32_t colorValue;
-    int dx, dy, dw, dh;
-    int x_best, y_best, w_best, h_best;
-    char *fbptr;
-
-    rfbSendUpdateBuf(cl);
-
-    compressLevel = cl->tightCompressLevel;
-    qualityLevel = cl->turboQualityLevel;
-    subsampLevel = cl->turboSubsampLevel;
-
-    /* We only allow compression levels that have a demonstrable performance
-       benefit.  CL 0 with JPEG reduces CPU usage for workloads that have low
-       numbers of unique colors, but the same thing can be accomplished by
-       using CL 0 without JPEG (AKA "Lossless Tight.")  For those same
-       low-color workloads, CL 2 can provide typically 20-40% better
-       compression than CL 1 (with a commensurate increase in CPU usage.)  For
-       high-color workloads, CL 1 should always be used, as higher compression
-       levels increase CPU usage for these workloads without providing any
-       significant reduction in bandwidth. */
-    if (qualityLevel != -1) {
-        if (compressLevel < 1) compressLevel = 1;
-        if (compressLevel > 2) compressLevel = 2;
+    rfbTightEncoder *enc = cl->tightEncoder;
+    int maxContexts = 1;
+
+    if (enc == NULL) {
+        if (cl->screen->encodePool)
+            maxContexts = TIGHT_TASKS_PER_THREAD *
+                (rfbWorkerPoolSize(cl->screen->encodePool) + 1);
+        enc = (rfbTightEncoder *)calloc(sizeof(rfbTightEncoder), 1);
+        if (enc)
+            enc->contexts = (rfbTightContext **)
+                calloc(sizeof(rfbTightContext *), maxContexts);
+        if (enc == NULL || enc->contexts == NULL) {
+            rfbErr("rfbSendRectEncodingTight: out of memory\n");
+            free(enc);
+            return FALSE;
+        }
+        enc->cl = cl;
+        enc->maxContexts = maxContexts;
+        cl->tightEncoder = enc;
     }
 
-    /* With JPEG disabled, CL 2 offers no significant bandwidth savings over
-       CL 1, so we don't include it. */
-    else if (compressLevel > 1) compressLevel = 1;
+    rfbSendUpdateBuf(cl);
 
-    /* CL 9 (which maps internally to CL 3) is included mainly for backward
-       compatibility with TightVNC Compression Levels 5-9.  It should be used
-       only in extremely low-bandwidth cases in which it can be shown to have a
-       benefit.  For low-color workloads, it provides typically only 10-20%
-       better compression than CL 2 with JPEG and CL 1 without JPEG, and it
-       uses, on average, twice as much CPU time. */
-    if (cl->tightCompressLevel == 9) compressLevel = 3;
+    enc->compressLevel = TightCompressLevel(cl);
+    enc->qualityLevel = cl->turboQualityLevel;
+    enc->subsampLevel = cl->turboSubsampLevel;
+    enc->adaptive = rfbAdaptiveJpeg(cl, &enc->qualityLevel, &enc->subsampLevel);
 
     if ( cl->format.depth == 24 && cl->format.redMax == 0xFF &&
          cl->format.greenMax == 0xFF && cl->format.blueMax == 0xFF ) {
-        usePixelFormat24 = TRUE;
+        enc->usePixelFormat24 = TRUE;
     } else {
-        usePixelFormat24 = FALSE;
+        enc->usePixelFormat24 = FALSE;
     }
 
-    if (!cl->enableLastRectEncoding || w * h < MIN_SPLIT_RECT_SIZE)
-        return SendRectSimple(cl, x, y, w, h);
+    enc->nQueued = 0;
+    if (!SendRectEncodingTight(enc, x, y, w, h) || !FlushSubrects(enc)) {
+        enc->nQueued = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
 
-    /* Make sure we can write at least one pixel into tightBeforeBuf. */
 
-    if (tightBeforeBufSize < 4) {
-        tightBeforeBufSize = 4;
-        if (tightBeforeBuf == NULL)
-            tightBeforeBuf = (char *)malloc(tightBeforeBufSize);
-        else
-            tightBeforeBuf = (char *)realloc(tightBeforeBuf,
-                                             tightBeforeBufSize);
-    }
+static rfbBool
+SendRectEncodingTight(rfbTightEncoder *enc,
+                      int x,
+                      int y,
+                      int w,
+                      int h)
+{
+    rfbClientPtr cl = enc->cl;
+    int nMaxRows;
+    uint32_t colorValue;
+    int dx, dy, dw, dh;
+    int x_best, y_best, w_best, h_best;
+
+    if (!cl->enableLastRectEncoding || w * h < MIN_SPLIT_RECT_SIZE)
+        return SendRectSimple(enc, x, y, w, h);
 
     /* Calculate maximum number of rows in one non-solid rectangle. */
 
     {
         int maxRectSize, maxRectWidth, nMaxWidth;
 
-        maxRectSize = tightConf[compressLevel].maxRectSize;
-        maxRectWidth = tightConf[compressLevel].maxRectWidth;
+        maxRectSize = tightConf[enc->compressLevel].maxRectSize;
+        maxRectWidth = tightConf[enc->compressLevel].maxRectWidth;
         nMaxWidth = (w > maxRectWidth) ? maxRectWidth : w;
         nMaxRows = maxRectSize / nMaxWidth;
     }
@@ -373,7 +485,7 @@ SendRectEncodingTight(rfbClientPtr cl,
         /* If a rectangle becomes too large, send its upper part now. */
 
         if (dy - y >= nMaxRows) {
-            if (!SendRectSimple(cl, x, y, w, nMaxRows))
+            if (!SendRectSimple(enc, x, y, w, nMaxRows))
                 return 0;
             y += nMaxRows;
             h -= nMaxRows;
@@ -389,7 +501,8 @@ SendRectEncodingTight(rfbClientPtr cl,
 
             if (CheckSolidTile(cl, dx, dy, dw, dh, &colorValue, FALSE)) {
 
-                if (subsampLevel == TJ_GRAYSCALE && qualityLevel != -1) {
+                if (enc->subsampLevel == TJ_GRAYSCALE &&
+                    enc->qualityLevel != -1) {
                     uint32_t r = (colorValue >> 16) & 0xFF;
                     uint32_t g = (colorValue >> 8) & 0xFF;
                     uint32_t b = (colorValue) & 0xFF;
@@ -419,37 +532,26 @@ SendRectEncodingTight(rfbClientPtr cl,
                 /* Send rectangles at top and left to solid-color area. */
 
                 if ( y_best != y &&
-                     !SendRectSimple(cl, x, y, w, y_best-y) )
+                     !SendRectSimple(enc, x, y, w, y_best-y) )
                     return FALSE;
                 if ( x_best != x &&
-                     !SendRectEncodingTight(cl, x, y_best,
+                     !SendRectEncodingTight(enc, x, y_best,
                                                x_best-x, h_best) )
                     return FALSE;
 
                 /* Send solid-color rectangle. */
 
-                if (!rfbSendTightHeader(cl, x_best, y_best, w_best, h_best))
-                    return FALSE;
-
-                fbptr = (cl->scaledScreen->frameBuffer +
-                         (cl->scaledScreen->paddedWidthInBytes * y_best) +
-                         (x_best * (cl->scaledScreen->bitsPerPixel / 8)));
-
-                (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
-                                   &cl->format, fbptr, tightBeforeBuf,
-                                   cl->scaledScreen->paddedWidthInBytes, 1, 1);
-
-                if (!SendSolidRect(cl))
+                if (!QueueSubrect(enc, x_best, y_best, w_best, h_best, TRUE))
                     return FALSE;
 
                 /* Send remaining rectangles (at right and bottom). */
 
                 if ( x_best + w_best != x + w &&
-                     !SendRectEncodingTight(cl, x_best + w_best, y_best,
+                     !SendRectEncodingTight(enc, x_best + w_best, y_best,
                                                w - (x_best-x) - w_best, h_best) )
                     return FALSE;
                 if ( y_best + h_best != y + h &&
-                     !SendRectEncodingTight(cl, x, y_best + h_best,
+                     !SendRectEncodingTight(enc, x, y_best + h_best,
                                                w, h - (y_best-y) - h_best) )
                     return FALSE;
 
@@ -464,7 +566,7 @@ SendRectEncodingTight(rfbClientPtr cl,
 
     /* No suitable solid-color rectangles found. */
 
-    return SendRectSimple(cl, x, y, w, h);
+    return SendRectSimple(enc, x, y, w, h);
 }
 
 
@@ -584,9 +686,10 @@ static rfbBool                                                                \
 CheckSolidTile##bpp(rfbClientPtr cl, int x, int y, int w, int h,              \
 		uint32_t* colorPtr, rfbBool needSameColor)                    \
 {                                                                             \
+    const rfbSimdKernels *simd = rfbSimd();                                   \
     uint##bpp##_t *fbptr;                                                     \
     uint##bpp##_t colorValue;                                                 \
-    int dx, dy;                                                               \
+    int dy;                                                                   \
                                                                               \
     fbptr = (uint##bpp##_t *)&cl->scaledScreen->frameBuffer                   \
         [y * cl->scaledScreen->paddedWidthInBytes + x * (bpp/8)];             \
@@ -596,10 +699,9 @@ CheckSolidTile##bpp(rfbClientPtr cl, int x, int y, int w, int h,              \
         return FALSE;                                                         \
                                                                               \
     for (dy = 0; dy < h; dy++) {                                              \
-        for (dx = 0; dx < w; dx++) {                                          \
-            if (colorValue != fbptr[dx])                                      \
-                return FALSE;                                                 \
-        }                                                                     \
+        if (simd->spanEqual##bpp(fbptr, w, colorValue,                        \
+                                 (uint##bpp##_t)~0) != w)                     \
+            return FALSE;                                                     \
         fbptr = (uint##bpp##_t *)((uint8_t *)fbptr                            \
                  + cl->scaledScreen->paddedWidthInBytes);                     \
     }                                                                         \
@@ -613,37 +715,15 @@ DEFINE_CHECK_SOLID_FUNCTION(16)
 DEFINE_CHECK_SOLID_FUNCTION(32)
 
 static rfbBool
-SendRectSimple(rfbClientPtr cl, int x, int y, int w, int h)
+SendRectSimple(rfbTightEncoder *enc, int x, int y, int w, int h)
 {
-    int maxBeforeSize, maxAfterSize;
     int maxRectSize, maxRectWidth;
     int subrectMaxWidth, subrectMaxHeight;
     int dx, dy;
     int rw, rh;
 
-    maxRectSize = tightConf[compressLevel].maxRectSize;
-    maxRectWidth = tightConf[compressLevel].maxRectWidth;
-
-    maxBeforeSize = maxRectSize * (cl->format.bitsPerPixel / 8);
-    maxAfterSize = maxBeforeSize + (maxBeforeSize + 99) / 100 + 12;
-
-    if (tightBeforeBufSize < maxBeforeSize) {
-        tightBeforeBufSize = maxBeforeSize;
-        if (tightBeforeBuf == NULL)
-            tightBeforeBuf = (char *)malloc(tightBeforeBufSize);
-        else
-            tightBeforeBuf = (char *)realloc(tightBeforeBuf,
-                                             tightBeforeBufSize);
-    }
-
-    if (tightAfterBufSize < maxAfterSize) {
-        tightAfterBufSize = maxAfterSize;
-        if (tightAfterBuf == NULL)
-            tightAfterBuf = (char *)malloc(tightAfterBufSize);
-        else
-            tightAfterBuf = (char *)realloc(tightAfterBuf,
-                                            tightAfterBufSize);
-    }
+    maxRectSize = tightConf[enc->compressLevel].maxRectSize;
+    maxRectWidth = tightConf[enc->compressLevel].maxRectWidth;
 
     if (w > maxRectWidth || w * h > maxRectSize) {
         subrectMaxWidth = (w > maxRectWidth) ? maxRectWidth : w;
@@ -653,12 +733,12 @@ SendRectSimple(rfbClientPtr cl, int x, int y, int w, int h)
             for (dx = 0; dx < w; dx += maxRectWidth) {
                 rw = (dx + maxRectWidth < w) ? maxRectWidth : w - dx;
                 rh = (dy + subrectMaxHeight < h) ? subrectMaxHeight : h - dy;
-                if (!SendSubrect(cl, x + dx, y + dy, rw, rh))
+                if (!QueueSubrect(enc, x + dx, y + dy, rw, rh, FALSE))
                     return FALSE;
             }
         }
     } else {
-        if (!SendSubrect(cl, x, y, w, h))
+        if (!QueueSubrect(enc, x, y, w, h, FALSE))
             return FALSE;
     }
 
@@ -666,37 +746,256 @@ SendRectSimple(rfbClientPtr cl, int x, int y, int w, int h)
 }
 
 static rfbBool
-SendSubrect(rfbClientPtr cl,
-            int x,
-            int y,
-            int w,
-            int h)
+ReserveBuffer(char **buf, int *bufSize, int size)
 {
-    char *fbptr;
-    rfbBool success = FALSE;
+    char *newBuf;
 
-    /* Send pending data if there is more than 128 bytes. */
-    if (cl->ublen > 128) {
-        if (!rfbSendUpdateBuf(cl))
+    if (*bufSize >= size)
+        return TRUE;
+
+    if (*buf == NULL)
+        newBuf = (char *)malloc(size);
+    else
+        newBuf = (char *)realloc(*buf, size);
+    if (newBuf == NULL) {
+        rfbLog("Memory allocation failure!\n");
+        return FALSE;
+    }
+    *buf = newBuf;
+    *bufSize = size;
+    return TRUE;
+}
+
+/*
+ * Subrectangles are encoded in the order the solid-area search finds
+ * them. Without an encode pool they are sent one by one as before; with
+ * one, up to maxContexts are queued and then encoded all at once.
+ */
+
+static rfbBool
+QueueSubrect(rfbTightEncoder *enc,
+             int x,
+             int y,
+             int w,
+             int h,
+             rfbBool solid)
+{
+    rfbClientPtr cl = enc->cl;
+    rfbTightContext *ctx = enc->contexts[enc->nQueued];
+    int maxBeforeSize, maxAfterSize;
+
+    if (ctx == NULL) {
+        ctx = (rfbTightContext *)calloc(sizeof(rfbTightContext), 1);
+        if (ctx == NULL) {
+            rfbErr("rfbSendRectEncodingTight: out of memory\n");
             return FALSE;
+        }
+        enc->contexts[enc->nQueued] = ctx;
     }
 
-    if (!rfbSendTightHeader(cl, x, y, w, h))
+    maxBeforeSize = tightConf[enc->compressLevel].maxRectSize *
+        (cl->format.bitsPerPixel / 8);
+    maxAfterSize = maxBeforeSize + (maxBeforeSize + 99) / 100 + 12;
+
+    if (!ReserveBuffer(&ctx->tightBeforeBuf, &ctx->tightBeforeBufSize,
+                       maxBeforeSize) ||
+        !ReserveBuffer(&ctx->tightAfterBuf, &ctx->tightAfterBufSize,
+                       maxAfterSize))
         return FALSE;
 
+    ctx->cl = cl;
+    ctx->usePixelFormat24 = enc->usePixelFormat24;
+    ctx->compressLevel = enc->compressLevel;
+    ctx->qualityLevel = enc->qualityLevel;
+    ctx->subsampLevel = enc->subsampLevel;
+    ctx->adaptive = enc->adaptive;
+    ctx->x = x;
+    ctx->y = y;
+    ctx->w = w;
+    ctx->h = h;
+    ctx->solid = solid;
+
+    if (++enc->nQueued == enc->maxContexts)
+        return FlushSubrects(enc);
+    return TRUE;
+}
+
+static void
+SendSubrectTask(void *data, int index)
+{
+    rfbTightEncoder *enc = (rfbTightEncoder *)data;
+    rfbTightContext *ctx = enc->contexts[index];
+
+    ctx->ok = SendSubrect(ctx);
+}
+
+static void
+CompressStreamTask(void *data, int streamId)
+{
+    rfbTightEncoder *enc = (rfbTightEncoder *)data;
+    rfbTightContext *ctx;
+    int i;
+
+    /* The client inflates a stream in the order the rectangles arrive. */
+    for (i = 0; i < enc->nQueued; i++) {
+        ctx = enc->contexts[i];
+        if (ctx->ok && ctx->streamId == streamId)
+            ctx->ok = CompressData(ctx);
+    }
+}
+
+static rfbBool
+FlushSubrects(rfbTightEncoder *enc)
+{
+    rfbWorkerPool *pool = enc->nQueued > 1 ? enc->cl->screen->encodePool : NULL;
+    rfbTightContext *ctx;
+    int i, n = enc->nQueued;
+
+    if (n == 0)
+        return TRUE;
+
+    /* Palette analysis and JPEG compression of one subrectangle do not
+       depend on the others, and the four zlib streams do not depend on
+       each other either. */
+    rfbWorkerPoolRun(pool, SendSubrectTask, enc, n);
+    rfbWorkerPoolRun(pool, CompressStreamTask, enc, 4);
+
+    enc->nQueued = 0;
+    for (i = 0; i < n; i++) {
+        ctx = enc->contexts[i];
+        if (!WriteSubrect(ctx))
+            return FALSE;
+        if (ctx->lossy)
+            rfbAdaptiveLossy(enc->cl, ctx->x, ctx->y, ctx->w, ctx->h);
+    }
+    return TRUE;
+}
+
+/*
+ * Whether JPEG pays off for a truecolor subrectangle of the framebuffer,
+ * for adaptive clients only. Every other row is sampled: text, icons and
+ * window borders have long runs of one colour and sharp steps between
+ * them, which JPEG blurs and compresses worse than zlib does. Photos and
+ * video have neither.
+ */
+
+#define JPEG_EDGE_STEP 48       /* of 255 */
+
+#define DEFINE_LOOKS_LIKE_PHOTO_FUNCTION(bpp)                                 \
+                                                                              \
+static rfbBool                                                                \
+LooksLikePhoto##bpp(rfbClientPtr cl, uint##bpp##_t *fbptr, int w, int h)      \
+{                                                                             \
+    const rfbSimdKernels *simd = rfbSimd();                                   \
+    const rfbPixelFormat *fmt = &cl->screen->serverFormat;                    \
+    rfbBool swap = fmt->bigEndian == rfbEndianTest;                           \
+    uint##bpp##_t mask, p0, p1, *row;                                         \
+    int pitch = cl->scaledScreen->paddedWidthInBytes / (bpp/8);               \
+    long flat = 0, edges = 0, samples = 0;                                    \
+    int dy, pos, span, d;                                                     \
+                                                                              \
+    if (w < 2)                                                                \
+        return TRUE;                                                          \
+    mask = (uint##bpp##_t)(((uint32_t)fmt->redMax << fmt->redShift) |         \
+                           ((uint32_t)fmt->greenMax << fmt->greenShift) |     \
+                           ((uint32_t)fmt->blueMax << fmt->blueShift));       \
+    if (swap)                                                                 \
+        mask = (uint##bpp##_t)Swap##bpp(mask);                                \
+                                                                              \
+    for (dy = 0; dy < h; dy += 2) {                                           \
+        row = fbptr + dy * pitch;                                             \
+        samples += w - 1;                                                     \
+        for (pos = 0; pos < w - 1; pos++) {                                   \
+            span = simd->spanEqual##bpp(row + pos + 1, w - pos - 1,           \
+                                        row[pos] & mask, mask);               \
+            flat += span;                                                     \
+            pos += span;                                                      \
+            if (pos >= w - 1)                                                 \
+                break;                                                        \
+            p0 = row[pos];                                                    \
+            p1 = row[pos + 1];                                                \
+            if (swap) {                                                       \
+                p0 = (uint##bpp##_t)Swap##bpp(p0);                            \
+                p1 = (uint##bpp##_t)Swap##bpp(p1);                            \
+            }                                                                 \
+            d = (int)((p1 >> fmt->redShift) & fmt->redMax) -                  \
+                (int)((p0 >> fmt->redShift) & fmt->redMax);                   \
+            if (abs(d) * 255 >= JPEG_EDGE_STEP * fmt->redMax) {               \
+                edges++;                                                      \
+                continue;                                                     \
+            }                                                                 \
+            d = (int)((p1 >> fmt->greenShift) & fmt->greenMax) -              \
+                (int)((p0 >> fmt->greenShift) & fmt->greenMax);               \
+            if (abs(d) * 255 >= JPEG_EDGE_STEP * fmt->greenMax) {             \
+                edges++;                                                      \
+                continue;                                                     \
+            }                                                                 \
+            d = (int)((p1 >> fmt->blueShift) & fmt->blueMax) -                \
+                (int)((p0 >> fmt->blueShift) & fmt->blueMax);                 \
+            if (abs(d) * 255 >= JPEG_EDGE_STEP * fmt->blueMax)                \
+                edges++;                                                      \
+        }                                                                     \
+    }                                                                         \
+                                                                              \
+    return flat * 2 < samples && edges * 10 < samples;                        \
+}
+
+DEFINE_LOOKS_LIKE_PHOTO_FUNCTION(16)
+DEFINE_LOOKS_LIKE_PHOTO_FUNCTION(32)
+
+static rfbBool
+LooksLikePhoto(rfbClientPtr cl, char *fbptr, int w, int h)
+{
+    switch (cl->screen->serverFormat.bitsPerPixel) {
+    case 32:
+        return LooksLikePhoto32(cl, (uint32_t *)fbptr, w, h);
+    case 16:
+        return LooksLikePhoto16(cl, (uint16_t *)fbptr, w, h);
+    default:
+        return TRUE;
+    }
+}
+
+/*
+ * Analyse a subrectangle and encode it into ctx; anything but the zlib
+ * compression, which is left to CompressData(). May run on any thread.
+ */
+
+static rfbBool
+SendSubrect(rfbTightContext *ctx)
+{
+    rfbClientPtr cl = ctx->cl;
+    int x = ctx->x, y = ctx->y, w = ctx->w, h = ctx->h;
+    char *fbptr;
+    rfbBool success = FALSE, translated = TRUE;
+
+    ctx->headerLen = 0;
+    ctx->streamId = -1;
+    ctx->data = NULL;
+    ctx->dataLen = 0;
+    ctx->sendLength = FALSE;
+    ctx->lossy = FALSE;
+
     fbptr = (cl->scaledScreen->frameBuffer
              + (cl->scaledScreen->paddedWidthInBytes * y)
              + (x * (cl->scaledScreen->bitsPerPixel / 8)));
 
-    if (subsampLevel == TJ_GRAYSCALE && qualityLevel != -1)
-        return SendJpegRect(cl, x, y, w, h, qualityLevel);
+    if (ctx->solid) {
+        (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
+                           &cl->format, fbptr, ctx->tightBeforeBuf,
+                           cl->scaledScreen->paddedWidthInBytes, 1, 1);
+        return SendSolidRect(ctx);
+    }
+
+    if (ctx->subsampLevel == TJ_GRAYSCALE && ctx->qualityLevel != -1)
+        return SendJpegRect(ctx, x, y, w, h, ctx->qualityLevel);
 
-    paletteMaxColors = w * h / tightConf[compressLevel].idxMaxColorsDivisor;
-    if(qualityLevel != -1)
-        paletteMaxColors = tightConf[compressLevel].palMaxColorsWithJPEG;
-    if ( paletteMaxColors < 2 &&
-         w * h >= tightConf[compressLevel].monoMinRectSize ) {
-        paletteMaxColors = 2;
+    ctx->paletteMaxColors = w * h / tightConf[ctx->compressLevel].idxMaxColorsDivisor;
+    if(ctx->qualityLevel != -1)
+        ctx->paletteMaxColors = tightConf[ctx->compressLevel].palMaxColorsWithJPEG;
+    if ( ctx->paletteMaxColors < 2 &&
+         w * h >= tightConf[ctx->compressLevel].monoMinRectSize ) {
+        ctx->paletteMaxColors = 2;
     }
 
     if (cl->format.bitsPerPixel == cl->screen->serverFormat.bitsPerPixel &&
@@ -709,62 +1008,109 @@ SendSubrect(rfbClientPtr cl,
            with JPEG, since it is unnecessary */
         switch (cl->format.bitsPerPixel) {
         case 16:
-            FastFillPalette16(cl, (uint16_t *)fbptr, w,
+            FastFillPalette16(ctx, (uint16_t *)fbptr, w,
                               cl->scaledScreen->paddedWidthInBytes / 2, h);
             break;
         default:
-            FastFillPalette32(cl, (uint32_t *)fbptr, w,
+            FastFillPalette32(ctx, (uint32_t *)fbptr, w,
                               cl->scaledScreen->paddedWidthInBytes / 4, h);
         }
 
-        if(paletteNumColors != 0 || qualityLevel == -1) {
+        if(ctx->paletteNumColors != 0 || ctx->qualityLevel == -1) {
             (*cl->translateFn)(cl->translateLookupTable,
                                &cl->screen->serverFormat, &cl->format, fbptr,
-                               tightBeforeBuf,
+                               ctx->tightBeforeBuf,
                                cl->scaledScreen->paddedWidthInBytes, w, h);
+        } else {
+            translated = FALSE;
         }
     }
     else {
         (*cl->translateFn)(cl->translateLookupTable, &cl->screen->serverFormat,
-                           &cl->format, fbptr, tightBeforeBuf,
+                           &cl->format, fbptr, ctx->tightBeforeBuf,
                            cl->scaledScreen->paddedWidthInBytes, w, h);
 
         switch (cl->format.bitsPerPixel) {
         case 8:
-            FillPalette8(w * h);
+            FillPalette8(ctx, w * h);
             break;
         case 16:
-            FillPalette16(w * h);
+            FillPalette16(ctx, w * h);
             break;
         default:
-            FillPalette32(w * h);
+            FillPalette32(ctx, w * h);
         }
     }
 
-    switch (paletteNumColors) {
+    switch (ctx->paletteNumColors) {
     case 0:
         /* Truecolor image */
-        if (qualityLevel != -1) {
-            success = SendJpegRect(cl, x, y, w, h, qualityLevel);
+        if (ctx->qualityLevel != -1 &&
+            (!ctx->adaptive || LooksLikePhoto(cl, fbptr, w, h))) {
+            success = SendJpegRect(ctx, x, y, w, h, ctx->qualityLevel);
         } else {
-            success = SendFullColorRect(cl, x, y, w, h);
+            if (!translated)
+                (*cl->translateFn)(cl->translateLookupTable,
+                                   &cl->screen->serverFormat, &cl->format,
+                                   fbptr, ctx->tightBeforeBuf,
+                                   cl->scaledScreen->paddedWidthInBytes, w, h);
+            success = SendFullColorRect(ctx, x, y, w, h);
         }
         break;
     case 1:
         /* Solid rectangle */
-        success = SendSolidRect(cl);
+        success = SendSolidRect(ctx);
         break;
     case 2:
         /* Two-color rectangle */
-        success = SendMonoRect(cl, x, y, w, h);
+        success = SendMonoRect(ctx, x, y, w, h);
         break;
     default:
         /* Up to 256 different colors */
-        success = SendIndexedRect(cl, x, y, w, h);
+        success = SendIndexedRect(ctx, x, y, w, h);
     }
     return success;
 }
 
+/* Send an encoded subrectangle to the client, in order. */
+
+static rfbBool
+WriteSubrect(rfbTightContext *ctx)
+{
+    rfbClientPtr cl = ctx->cl;
+
+    if (!ctx->ok)
+        return FALSE;
+
+    /* Send pending data if there is more than 128 bytes. */
+    if (cl->ublen > 128) {
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+    }
+
+    if (!rfbSendTightHeader(cl, ctx->x, ctx->y, ctx->w, ctx->h))
+        return FALSE;
+
+    if (cl->ublen + ctx->headerLen + TIGHT_MIN_TO_COMPRESS + 3 > UPDATE_BUF_SIZE) {
+        if (!rfbSendUpdateBuf(cl))
+            return FALSE;
+    }
+
+    memcpy(&cl->updateBuf[cl->ublen], ctx->header, ctx->headerLen);
+    cl->ublen += ctx->headerLen;
+    rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, ctx->headerLen);
+
+    if (ctx->sendLength)
+        return rfbSendCompressedDataTight(cl, ctx->data, ctx->dataLen);
+
+    if (ctx->dataLen > 0) {
+        memcpy(&cl->updateBuf[cl->ublen], ctx->data, ctx->dataLen);
+        cl->ublen += ctx->dataLen;
+        rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, ctx->dataLen);
+    }
+    return TRUE;
+}
+
 rfbBool
 rfbSendTightHeader(rfbClientPtr cl,
                 int x,
@@ -802,248 +1148,228 @@ rfbSendTightHeader(rfbClientPtr cl,
  */
 
 static rfbBool
-SendSolidRect(rfbClientPtr cl)
+SendSolidRect(rfbTightContext *ctx)
 {
+    rfbClientPtr cl = ctx->cl;
     int len;
 
-    if (usePixelFormat24) {
-        Pack24(cl, tightBeforeBuf, &cl->format, 1);
+    if (ctx->usePixelFormat24) {
+        Pack24(cl, ctx->tightBeforeBuf, &cl->format, 1);
         len = 3;
     } else
         len = cl->format.bitsPerPixel / 8;
 
-    if (cl->ublen + 1 + len > UPDATE_BUF_SIZE) {
-        if (!rfbSendUpdateBuf(cl))
-            return FALSE;
-    }
-
-    cl->updateBuf[cl->ublen++] = (char)(rfbTightFill << 4);
-    memcpy (&cl->updateBuf[cl->ublen], tightBeforeBuf, len);
-    cl->ublen += len;
-
-    rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, len + 1);
+    ctx->header[0] = (char)(rfbTightFill << 4);
+    memcpy (&ctx->header[1], ctx->tightBeforeBuf, len);
+    ctx->headerLen = 1 + len;
 
     return TRUE;
 }
 
 static rfbBool
-SendMonoRect(rfbClientPtr cl,
+SendMonoRect(rfbTightContext *ctx,
              int x,
              int y,
              int w,
              int h)
 {
+    rfbClientPtr cl = ctx->cl;
     int streamId = 1;
     int paletteLen, dataLen;
 
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
     if (CanSendPngRect(cl, w, h)) {
         /* TODO: setup palette maybe */
-        return SendPngRect(cl, x, y, w, h);
+        return SendPngRect(ctx, x, y, w, h);
         /* TODO: destroy palette maybe */
     }
 #endif
 
-    if ( cl->ublen + TIGHT_MIN_TO_COMPRESS + 6 +
-	 2 * cl->format.bitsPerPixel / 8 > UPDATE_BUF_SIZE ) {
-        if (!rfbSendUpdateBuf(cl))
-            return FALSE;
-    }
-
     /* Prepare tight encoding header. */
     dataLen = (w + 7) / 8;
     dataLen *= h;
 
-    if (tightConf[compressLevel].monoZlibLevel == 0 &&
+    if (tightConf[ctx->compressLevel].monoZlibLevel == 0 &&
         cl->tightEncoding != rfbEncodingTightPng)
-        cl->updateBuf[cl->ublen++] =
-            (char)((rfbTightNoZlib | rfbTightExplicitFilter) << 4);
+        ctx->header[0] = (char)((rfbTightNoZlib | rfbTightExplicitFilter) << 4);
     else
-        cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4;
-    cl->updateBuf[cl->ublen++] = rfbTightFilterPalette;
-    cl->updateBuf[cl->ublen++] = 1;
+        ctx->header[0] = (streamId | rfbTightExplicitFilter) << 4 |
+                         TIGHT_STREAM_RESET(cl, streamId);
+    ctx->header[1] = rfbTightFilterPalette;
+    ctx->header[2] = 1;
 
     /* Prepare palette, convert image. */
     switch (cl->format.bitsPerPixel) {
 
     case 32:
-        EncodeMonoRect32((uint8_t *)tightBeforeBuf, w, h);
+        EncodeMonoRect32(ctx, (uint8_t *)ctx->tightBeforeBuf, w, h);
 
-        ((uint32_t *)tightAfterBuf)[0] = monoBackground;
-        ((uint32_t *)tightAfterBuf)[1] = monoForeground;
-        if (usePixelFormat24) {
-            Pack24(cl, tightAfterBuf, &cl->format, 2);
+        ((uint32_t *)ctx->tightAfterBuf)[0] = ctx->monoBackground;
+        ((uint32_t *)ctx->tightAfterBuf)[1] = ctx->monoForeground;
+        if (ctx->usePixelFormat24) {
+            Pack24(cl, ctx->tightAfterBuf, &cl->format, 2);
             paletteLen = 6;
         } else
             paletteLen = 8;
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, paletteLen);
-        cl->ublen += paletteLen;
-        rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 3 + paletteLen);
+        memcpy(&ctx->header[3], ctx->tightAfterBuf, paletteLen);
+        ctx->headerLen = 3 + paletteLen;
         break;
 
     case 16:
-        EncodeMonoRect16((uint8_t *)tightBeforeBuf, w, h);
+        EncodeMonoRect16(ctx, (uint8_t *)ctx->tightBeforeBuf, w, h);
 
-        ((uint16_t *)tightAfterBuf)[0] = (uint16_t)monoBackground;
-        ((uint16_t *)tightAfterBuf)[1] = (uint16_t)monoForeground;
+        ((uint16_t *)ctx->tightAfterBuf)[0] = (uint16_t)ctx->monoBackground;
+        ((uint16_t *)ctx->tightAfterBuf)[1] = (uint16_t)ctx->monoForeground;
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, 4);
-        cl->ublen += 4;
-        rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 7);
+        memcpy(&ctx->header[3], ctx->tightAfterBuf, 4);
+        ctx->headerLen = 7;
         break;
 
     default:
-        EncodeMonoRect8((uint8_t *)tightBeforeBuf, w, h);
+        EncodeMonoRect8(ctx, (uint8_t *)ctx->tightBeforeBuf, w, h);
 
-        cl->updateBuf[cl->ublen++] = (char)monoBackground;
-        cl->updateBuf[cl->ublen++] = (char)monoForeground;
-        rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 5);
+        ctx->header[3] = (char)ctx->monoBackground;
+        ctx->header[4] = (char)ctx->monoForeground;
+        ctx->headerLen = 5;
     }
 
-    return CompressData(cl, streamId, dataLen,
-                        tightConf[compressLevel].monoZlibLevel,
-                        Z_DEFAULT_STRATEGY);
+    PrepareData(ctx, streamId, dataLen,
+                tightConf[ctx->compressLevel].monoZlibLevel);
+    return TRUE;
 }
 
 static rfbBool
-SendIndexedRect(rfbClientPtr cl,
+SendIndexedRect(rfbTightContext *ctx,
                 int x,
                 int y,
                 int w,
                 int h)
 {
+    rfbClientPtr cl = ctx->cl;
     int streamId = 2;
     int i, entryLen;
 
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
     if (CanSendPngRect(cl, w, h)) {
-        return SendPngRect(cl, x, y, w, h);
+        return SendPngRect(ctx, x, y, w, h);
     }
 #endif
 
-    if ( cl->ublen + TIGHT_MIN_TO_COMPRESS + 6 +
-	 paletteNumColors * cl->format.bitsPerPixel / 8 >
-         UPDATE_BUF_SIZE ) {
-        if (!rfbSendUpdateBuf(cl))
-            return FALSE;
-    }
-
     /* Prepare tight encoding header. */
-    if (tightConf[compressLevel].idxZlibLevel == 0 &&
+    if (tightConf[ctx->compressLevel].idxZlibLevel == 0 &&
         cl->tightEncoding != rfbEncodingTightPng)
-        cl->updateBuf[cl->ublen++] =
-            (char)((rfbTightNoZlib | rfbTightExplicitFilter) << 4);
+        ctx->header[0] = (char)((rfbTightNoZlib | rfbTightExplicitFilter) << 4);
     else
-        cl->updateBuf[cl->ublen++] = (streamId | rfbTightExplicitFilter) << 4;
-    cl->updateBuf[cl->ublen++] = rfbTightFilterPalette;
-    cl->updateBuf[cl->ublen++] = (char)(paletteNumColors - 1);
+        ctx->header[0] = (streamId | rfbTightExplicitFilter) << 4 |
+                         TIGHT_STREAM_RESET(cl, streamId);
+    ctx->header[1] = rfbTightFilterPalette;
+    ctx->header[2] = (char)(ctx->paletteNumColors - 1);
 
     /* Prepare palette, convert image. */
     switch (cl->format.bitsPerPixel) {
 
     case 32:
-        EncodeIndexedRect32((uint8_t *)tightBeforeBuf, w * h);
+        EncodeIndexedRect32(ctx, (uint8_t *)ctx->tightBeforeBuf, w * h);
 
-        for (i = 0; i < paletteNumColors; i++) {
-            ((uint32_t *)tightAfterBuf)[i] =
-                palette.entry[i].listNode->rgb;
+        for (i = 0; i < ctx->paletteNumColors; i++) {
+            ((uint32_t *)ctx->tightAfterBuf)[i] =
+                ctx->palette.entry[i].rgb;
         }
-        if (usePixelFormat24) {
-            Pack24(cl, tightAfterBuf, &cl->format, paletteNumColors);
+        if (ctx->usePixelFormat24) {
+            Pack24(cl, ctx->tightAfterBuf, &cl->format, ctx->paletteNumColors);
             entryLen = 3;
         } else
             entryLen = 4;
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf,
-               paletteNumColors * entryLen);
-        cl->ublen += paletteNumColors * entryLen;
-        rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding,
-                                     3 + paletteNumColors * entryLen);
+        memcpy(&ctx->header[3], ctx->tightAfterBuf,
+               ctx->paletteNumColors * entryLen);
+        ctx->headerLen = 3 + ctx->paletteNumColors * entryLen;
         break;
 
     case 16:
-        EncodeIndexedRect16((uint8_t *)tightBeforeBuf, w * h);
+        EncodeIndexedRect16(ctx, (uint8_t *)ctx->tightBeforeBuf, w * h);
 
-        for (i = 0; i < paletteNumColors; i++) {
-            ((uint16_t *)tightAfterBuf)[i] =
-                (uint16_t)palette.entry[i].listNode->rgb;
+        for (i = 0; i < ctx->paletteNumColors; i++) {
+            ((uint16_t *)ctx->tightAfterBuf)[i] =
+                (uint16_t)ctx->palette.entry[i].rgb;
         }
 
-        memcpy(&cl->updateBuf[cl->ublen], tightAfterBuf, paletteNumColors * 2);
-        cl->ublen += paletteNumColors * 2;
-        rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding,
-                                     3 + paletteNumColors * 2);
+        memcpy(&ctx->header[3], ctx->tightAfterBuf, ctx->paletteNumColors * 2);
+        ctx->headerLen = 3 + ctx->paletteNumColors * 2;
         break;
 
     default:
         return FALSE;           /* Should never happen. */
     }
 
-    return CompressData(cl, streamId, w * h,
-                        tightConf[compressLevel].idxZlibLevel,
-                        Z_DEFAULT_STRATEGY);
+    PrepareData(ctx, streamId, w * h,
+                tightConf[ctx->compressLevel].idxZlibLevel);
+    return TRUE;
 }
 
 static rfbBool
-SendFullColorRect(rfbClientPtr cl,
+SendFullColorRect(rfbTightContext *ctx,
                   int x,
                   int y,
                   int w,
                   int h)
 {
+    rfbClientPtr cl = ctx->cl;
     int streamId = 0;
     int len;
 
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
     if (CanSendPngRect(cl, w, h)) {
-        return SendPngRect(cl, x, y, w, h);
+        return SendPngRect(ctx, x, y, w, h);
     }
 #endif
 
-    if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 1 > UPDATE_BUF_SIZE) {
-        if (!rfbSendUpdateBuf(cl))
-            return FALSE;
-    }
-
-    if (tightConf[compressLevel].rawZlibLevel == 0 &&
+    if (tightConf[ctx->compressLevel].rawZlibLevel == 0 &&
         cl->tightEncoding != rfbEncodingTightPng)
-        cl->updateBuf[cl->ublen++] = (char)(rfbTightNoZlib << 4);
+        ctx->header[0] = (char)(rfbTightNoZlib << 4);
     else
-        cl->updateBuf[cl->ublen++] = 0x00;  /* stream id = 0, no flushing, no filter */
-    rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
+        /* stream id = 0, no filter */
+        ctx->header[0] = (char)TIGHT_STREAM_RESET(cl, streamId);
+    ctx->headerLen = 1;
 
-    if (usePixelFormat24) {
-        Pack24(cl, tightBeforeBuf, &cl->format, w * h);
+    if (ctx->usePixelFormat24) {
+        Pack24(cl, ctx->tightBeforeBuf, &cl->format, w * h);
         len = 3;
     } else
         len = cl->format.bitsPerPixel / 8;
 
-    return CompressData(cl, streamId, w * h * len,
-                        tightConf[compressLevel].rawZlibLevel,
-                        Z_DEFAULT_STRATEGY);
+    PrepareData(ctx, streamId, w * h * len,
+                tightConf[ctx->compressLevel].rawZlibLevel);
+    return TRUE;
+}
+
+/* The data in tightBeforeBuf is sent as it is if it is too short to be
+   compressed, and with its length but uncompressed for zlib level 0. */
+
+static void
+PrepareData(rfbTightContext *ctx,
+            int streamId,
+            int dataLen,
+            int zlibLevel)
+{
+    ctx->data = ctx->tightBeforeBuf;
+    ctx->dataLen = dataLen;
+    ctx->sendLength = (dataLen >= TIGHT_MIN_TO_COMPRESS);
+    ctx->streamId = (ctx->sendLength && zlibLevel != 0) ? streamId : -1;
+    ctx->zlibLevel = zlibLevel;
 }
 
 static rfbBool
-CompressData(rfbClientPtr cl,
-             int streamId,
-             int dataLen,
-             int zlibLevel,
-             int zlibStrategy)
+CompressData(rfbTightContext *ctx)
 {
+    rfbClientPtr cl = ctx->cl;
+    int streamId = ctx->streamId;
+    int zlibLevel = ctx->zlibLevel;
+    int zlibStrategy = Z_DEFAULT_STRATEGY;
     z_streamp pz;
     int err;
 
-    if (dataLen < TIGHT_MIN_TO_COMPRESS) {
-        memcpy(&cl->updateBuf[cl->ublen], tightBeforeBuf, dataLen);
-        cl->ublen += dataLen;
-        rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, dataLen);
-        return TRUE;
-    }
-
-    if (zlibLevel == 0)
-        return rfbSendCompressedDataTight(cl, tightBeforeBuf, dataLen);
-
     pz = &cl->zsStruct[streamId];
 
     /* Initialize compression stream if needed. */
@@ -1059,13 +1385,17 @@ CompressData(rfbClientPtr cl,
 
         cl->zsActive[streamId] = TRUE;
         cl->zsLevel[streamId] = zlibLevel;
+    } else if (cl->tightResetStreams) {
+        /* the client was told to reset its stream for this rectangle */
+        if (deflateReset(pz) != Z_OK)
+            return FALSE;
     }
 
     /* Prepare buffer pointers. */
-    pz->next_in = (Bytef *)tightBeforeBuf;
-    pz->avail_in = dataLen;
-    pz->next_out = (Bytef *)tightAfterBuf;
-    pz->avail_out = tightAfterBufSize;
+    pz->next_in = (Bytef *)ctx->tightBeforeBuf;
+    pz->avail_in = ctx->dataLen;
+    pz->next_out = (Bytef *)ctx->tightAfterBuf;
+    pz->avail_out = ctx->tightAfterBufSize;
 
     /* Change compression parameters if needed. */
     if (zlibLevel != cl->zsLevel[streamId]) {
@@ -1081,15 +1411,14 @@ CompressData(rfbClientPtr cl,
         return FALSE;
     }
 
-    return rfbSendCompressedDataTight(cl, tightAfterBuf,
-                                      tightAfterBufSize - pz->avail_out);
+    ctx->data = ctx->tightAfterBuf;
+    ctx->dataLen = ctx->tightAfterBufSize - pz->avail_out;
+    return TRUE;
 }
 
 rfbBool rfbSendCompressedDataTight(rfbClientPtr cl, char *buf,
                                    int compressedLen)
 {
-    int i, portionLen;
-
     cl->updateBuf[cl->ublen++] = compressedLen & 0x7F;
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
     if (compressedLen > 0x7F) {
@@ -1103,17 +1432,12 @@ rfbBool rfbSendCompressedDataTight(rfbClientPtr cl, char *buf,
         }
     }
 
-    portionLen = UPDATE_BUF_SIZE;
-    for (i = 0; i < compressedLen; i += portionLen) {
-        if (i + portionLen > compressedLen) {
-            portionLen = compressedLen - i;
-        }
-        if (cl->ublen + portionLen > UPDATE_BUF_SIZE) {
-            if (!rfbSendUpdateBuf(cl))
-                return FALSE;
-        }
-        memcpy(&cl->updateBuf[cl->ublen], &buf[i], portionLen);
-        cl->ublen += portionLen;
+    if (cl->ublen + compressedLen > UPDATE_BUF_SIZE) {
+        if (!rfbSendUpdateData(cl, buf, compressedLen))
+            return FALSE;
+    } else {
+        memcpy(&cl->updateBuf[cl->ublen], buf, compressedLen);
+        cl->ublen += compressedLen;
     }
     rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, compressedLen);
 
@@ -1126,44 +1450,41 @@ rfbBool rfbSendCompressedDataTight(rfbClientPtr cl, char *buf,
  */
 
 static void
-FillPalette8(int count)
+FillPalette8(rfbTightContext *ctx, int count)
 {
-    uint8_t *data = (uint8_t *)tightBeforeBuf;
+    const rfbSimdKernels *simd = rfbSimd();
+    uint8_t *data = (uint8_t *)ctx->tightBeforeBuf;
     uint8_t c0, c1;
-    int i, n0, n1;
+    int i, n0, n1, span;
 
-    paletteNumColors = 0;
+    ctx->paletteNumColors = 0;
 
     c0 = data[0];
-    for (i = 1; i < count && data[i] == c0; i++);
+    i = 1 + simd->spanEqual8(data + 1, count - 1, c0, 0xFF);
     if (i == count) {
-        paletteNumColors = 1;
+        ctx->paletteNumColors = 1;
         return;                 /* Solid rectangle */
     }
 
-    if (paletteMaxColors < 2)
+    if (ctx->paletteMaxColors < 2)
         return;
 
     n0 = i;
     c1 = data[i];
-    n1 = 0;
-    for (i++; i < count; i++) {
-        if (data[i] == c0) {
-            n0++;
-        } else if (data[i] == c1) {
-            n1++;
-        } else
-            break;
-    }
+    i++;
+    span = simd->spanTwo8(data + i, count - i, c0, c1, 0xFF, &n1);
+    n0 += n1;
+    n1 = span - n1;
+    i += span;
     if (i == count) {
         if (n0 > n1) {
-            monoBackground = (uint32_t)c0;
-            monoForeground = (uint32_t)c1;
+            ctx->monoBackground = (uint32_t)c0;
+            ctx->monoForeground = (uint32_t)c1;
         } else {
-            monoBackground = (uint32_t)c1;
-            monoForeground = (uint32_t)c0;
+            ctx->monoBackground = (uint32_t)c1;
+            ctx->monoForeground = (uint32_t)c0;
         }
-        paletteNumColors = 2;   /* Two colors */
+        ctx->paletteNumColors = 2;   /* Two colors */
     }
 }
 
@@ -1171,63 +1492,62 @@ FillPalette8(int count)
 #define DEFINE_FILL_PALETTE_FUNCTION(bpp)                               \
                                                                         \
 static void                                                             \
-FillPalette##bpp(int count) {                                           \
-    uint##bpp##_t *data = (uint##bpp##_t *)tightBeforeBuf;              \
+FillPalette##bpp(rfbTightContext *ctx, int count) {                     \
+    const rfbSimdKernels *simd = rfbSimd();                             \
+    uint##bpp##_t *data = (uint##bpp##_t *)ctx->tightBeforeBuf;         \
     uint##bpp##_t c0, c1, ci;                                           \
-    int i, n0, n1, ni;                                                  \
+    int i, n0, n1, ni, span;                                            \
                                                                         \
     c0 = data[0];                                                       \
-    for (i = 1; i < count && data[i] == c0; i++);                       \
+    i = 1 + simd->spanEqual##bpp(data + 1, count - 1, c0,               \
+                                 (uint##bpp##_t)~0);                    \
     if (i >= count) {                                                   \
-        paletteNumColors = 1;   /* Solid rectangle */                   \
+        ctx->paletteNumColors = 1;   /* Solid rectangle */              \
         return;                                                         \
     }                                                                   \
                                                                         \
-    if (paletteMaxColors < 2) {                                         \
-        paletteNumColors = 0;   /* Full-color encoding preferred */     \
+    if (ctx->paletteMaxColors < 2) {                                    \
+        ctx->paletteNumColors = 0; /* Full-color encoding preferred */  \
         return;                                                         \
     }                                                                   \
                                                                         \
     n0 = i;                                                             \
     c1 = data[i];                                                       \
-    n1 = 0;                                                             \
-    for (i++; i < count; i++) {                                         \
-        ci = data[i];                                                   \
-        if (ci == c0) {                                                 \
-            n0++;                                                       \
-        } else if (ci == c1) {                                          \
-            n1++;                                                       \
-        } else                                                          \
-            break;                                                      \
-    }                                                                   \
+    i++;                                                                \
+    span = simd->spanTwo##bpp(data + i, count - i, c0, c1,              \
+                              (uint##bpp##_t)~0, &n1);                  \
+    n0 += n1;                                                           \
+    n1 = span - n1;                                                     \
+    i += span;                                                          \
     if (i >= count) {                                                   \
         if (n0 > n1) {                                                  \
-            monoBackground = (uint32_t)c0;                              \
-            monoForeground = (uint32_t)c1;                              \
+            ctx->monoBackground = (uint32_t)c0;                         \
+            ctx->monoForeground = (uint32_t)c1;                         \
         } else {                                                        \
-            monoBackground = (uint32_t)c1;                              \
-            monoForeground = (uint32_t)c0;                              \
+            ctx->monoBackground = (uint32_t)c1;                         \
+            ctx->monoForeground = (uint32_t)c0;                         \
         }                                                               \
-        paletteNumColors = 2;   /* Two colors */                        \
+        ctx->paletteNumColors = 2;   /* Two colors */                   \
         return;                                                         \
     }                                                                   \
                                                                         \
-    PaletteReset();                                                     \
-    PaletteInsert (c0, (uint32_t)n0, bpp);                              \
-    PaletteInsert (c1, (uint32_t)n1, bpp);                              \
+    PaletteReset(ctx);                                                  \
+    PaletteInsert (ctx, c0, (uint32_t)n0, bpp);                         \
+    PaletteInsert (ctx, c1, (uint32_t)n1, bpp);                         \
                                                                         \
-    ni = 1;                                                             \
-    for (i++; i < count; i++) {                                         \
-        if (data[i] == ci) {                                            \
-            ni++;                                                       \
-        } else {                                                        \
-            if (!PaletteInsert (ci, (uint32_t)ni, bpp))                 \
-                return;                                                 \
-            ci = data[i];                                               \
-            ni = 1;                                                     \
-        }                                                               \
+    /* count runs of the same colour */                                 \
+    ci = data[i];                                                       \
+    for (;;) {                                                          \
+        ni = 1 + simd->spanEqual##bpp(data + i + 1, count - i - 1, ci,  \
+                                      (uint##bpp##_t)~0);               \
+        i += ni;                                                        \
+        if (i >= count)                                                 \
+            break;                                                      \
+        if (!PaletteInsert (ctx, ci, (uint32_t)ni, bpp))                \
+            return;                                                     \
+        ci = data[i];                                                   \
     }                                                                   \
-    PaletteInsert (ci, (uint32_t)ni, bpp);                              \
+    PaletteInsert (ctx, ci, (uint32_t)ni, bpp);                         \
 }
 
 DEFINE_FILL_PALETTE_FUNCTION(16)
@@ -1236,11 +1556,13 @@ DEFINE_FILL_PALETTE_FUNCTION(32)
 #define DEFINE_FAST_FILL_PALETTE_FUNCTION(bpp)                          \
                                                                         \
 static void                                                             \
-FastFillPalette##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w,       \
+FastFillPalette##bpp(rfbTightContext *ctx, uint##bpp##_t *data, int w,  \
                      int pitch, int h)                                  \
 {                                                                       \
+    rfbClientPtr cl = ctx->cl;                                          \
+    const rfbSimdKernels *simd = rfbSimd();                             \
     uint##bpp##_t c0, c1, ci, mask, c0t, c1t, cit;                      \
-    int i, j, i2 = 0, j2, n0, n1, ni;                                   \
+    int i, j, i2 = 0, j2, n0, n1, ni, span, na;                         \
                                                                         \
     if (cl->translateFn != rfbTranslateNone) {                          \
         mask = cl->screen->serverFormat.redMax                          \
@@ -1252,19 +1574,17 @@ FastFillPalette##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w,       \
     } else mask = ~0;                                                   \
                                                                         \
     c0 = data[0] & mask;                                                \
-    for (j = 0; j < h; j++) {                                           \
-        for (i = 0; i < w; i++) {                                       \
-            if ((data[j * pitch + i] & mask) != c0)                     \
-                goto done;                                              \
-        }                                                               \
+    for (j = 0, i = w; j < h; j++) {                                    \
+        i = simd->spanEqual##bpp(data + j * pitch, w, c0, mask);        \
+        if (i < w)                                                      \
+            break;                                                      \
     }                                                                   \
-    done:                                                               \
     if (j >= h) {                                                       \
-        paletteNumColors = 1;   /* Solid rectangle */                   \
+        ctx->paletteNumColors = 1;   /* Solid rectangle */              \
         return;                                                         \
     }                                                                   \
-    if (paletteMaxColors < 2) {                                         \
-        paletteNumColors = 0;   /* Full-color encoding preferred */     \
+    if (ctx->paletteMaxColors < 2) {                                    \
+        ctx->paletteNumColors = 0; /* Full-color encoding preferred */  \
         return;                                                         \
     }                                                                   \
                                                                         \
@@ -1273,18 +1593,17 @@ FastFillPalette##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w,       \
     n1 = 0;                                                             \
     i++;  if (i >= w) {i = 0;  j++;}                                    \
     for (j2 = j; j2 < h; j2++) {                                        \
-        for (i2 = i; i2 < w; i2++) {                                    \
+        span = simd->spanTwo##bpp(data + j2 * pitch + i, w - i, c0, c1, \
+                                  mask, &na);                           \
+        n0 += na;                                                       \
+        n1 += span - na;                                                \
+        i2 = i + span;                                                  \
+        if (i2 < w) {                                                   \
             ci = data[j2 * pitch + i2] & mask;                          \
-            if (ci == c0) {                                             \
-                n0++;                                                   \
-            } else if (ci == c1) {                                      \
-                n1++;                                                   \
-            } else                                                      \
-                goto done2;                                             \
+            break;                                                      \
         }                                                               \
         i = 0;                                                          \
     }                                                                   \
-    done2:                                                              \
     (*cl->translateFn)(cl->translateLookupTable,                        \
                        &cl->screen->serverFormat, &cl->format,          \
                        (char *)&c0, (char *)&c0t, bpp/8, 1, 1);         \
@@ -1293,36 +1612,39 @@ FastFillPalette##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w,       \
                        (char *)&c1, (char *)&c1t, bpp/8, 1, 1);         \
     if (j2 >= h) {                                                      \
         if (n0 > n1) {                                                  \
-            monoBackground = (uint32_t)c0t;                             \
-            monoForeground = (uint32_t)c1t;                             \
+            ctx->monoBackground = (uint32_t)c0t;                        \
+            ctx->monoForeground = (uint32_t)c1t;                        \
         } else {                                                        \
-            monoBackground = (uint32_t)c1t;                             \
-            monoForeground = (uint32_t)c0t;                             \
+            ctx->monoBackground = (uint32_t)c1t;                        \
+            ctx->monoForeground = (uint32_t)c0t;                        \
         }                                                               \
-        paletteNumColors = 2;   /* Two colors */                        \
+        ctx->paletteNumColors = 2;   /* Two colors */                   \
         return;                                                         \
     }                                                                   \
                                                                         \
-    PaletteReset();                                                     \
-    PaletteInsert (c0t, (uint32_t)n0, bpp);                             \
-    PaletteInsert (c1t, (uint32_t)n1, bpp);                             \
+    PaletteReset(ctx);                                                  \
+    PaletteInsert (ctx, c0t, (uint32_t)n0, bpp);                        \
+    PaletteInsert (ctx, c1t, (uint32_t)n1, bpp);                        \
                                                                         \
+    /* count runs of the same colour; they continue across rows */      \
     ni = 1;                                                             \
     i2++;  if (i2 >= w) {i2 = 0;  j2++;}                                \
     for (j = j2; j < h; j++) {                                          \
         for (i = i2; i < w; i++) {                                      \
-            if ((data[j * pitch + i] & mask) == ci) {                   \
-                ni++;                                                   \
-            } else {                                                    \
-                (*cl->translateFn)(cl->translateLookupTable,            \
-                                   &cl->screen->serverFormat,           \
-                                   &cl->format, (char *)&ci,            \
-                                   (char *)&cit, bpp/8, 1, 1);          \
-                if (!PaletteInsert (cit, (uint32_t)ni, bpp))            \
-                    return;                                             \
-                ci = data[j * pitch + i] & mask;                        \
-                ni = 1;                                                 \
-            }                                                           \
+            span = simd->spanEqual##bpp(data + j * pitch + i, w - i,    \
+                                        ci, mask);                      \
+            ni += span;                                                 \
+            i += span;                                                  \
+            if (i >= w)                                                 \
+                break;                                                  \
+            (*cl->translateFn)(cl->translateLookupTable,                \
+                               &cl->screen->serverFormat,               \
+                               &cl->format, (char *)&ci,                \
+                               (char *)&cit, bpp/8, 1, 1);              \
+            if (!PaletteInsert (ctx, cit, (uint32_t)ni, bpp))           \
+                return;                                                 \
+            ci = data[j * pitch + i] & mask;                            \
+            ni = 1;                                                     \
         }                                                               \
         i2 = 0;                                                         \
     }                                                                   \
@@ -1330,7 +1652,7 @@ FastFillPalette##bpp(rfbClientPtr cl, uint##bpp##_t *data, int w,       \
     (*cl->translateFn)(cl->translateLookupTable,                        \
                        &cl->screen->serverFormat, &cl->format,          \
                        (char *)&ci, (char *)&cit, bpp/8, 1, 1);         \
-    PaletteInsert (cit, (uint32_t)ni, bpp);                             \
+    PaletteInsert (ctx, cit, (uint32_t)ni, bpp);                        \
 }
 
 DEFINE_FAST_FILL_PALETTE_FUNCTION(16)
@@ -1341,81 +1663,86 @@ DEFINE_FAST_FILL_PALETTE_FUNCTION(32)
  * Functions to operate with palette structures.
  */
 
-#define HASH_FUNC16(rgb) ((int)((((rgb) >> 8) + (rgb)) & 0xFF))
-#define HASH_FUNC32(rgb) ((int)((((rgb) >> 16) + ((rgb) >> 8)) & 0xFF))
+static void
+PaletteReset(rfbTightContext *ctx)
+{
+    ctx->paletteNumColors = 0;
+    memset(ctx->palette.slot, 0, sizeof(ctx->palette.slot));
+}
 
 
-static void
-PaletteReset(void)
+/*
+ * Return the palette index of rgb, or -1 if it is not in the palette.
+ * *slot returns where rgb is in the hash table, or where it would go.
+ */
+
+static int
+PaletteFind(rfbTightContext *ctx, uint32_t rgb, int *slot)
 {
-    paletteNumColors = 0;
-    memset(palette.hash, 0, 256 * sizeof(COLOR_LIST *));
+    int h = PALETTE_HASH(rgb), idx;
+
+    while ((idx = ctx->palette.slot[h]) != 0) {
+        if (ctx->palette.entry[idx - 1].rgb == rgb) {
+            *slot = h;
+            return idx - 1;
+        }
+        h = (h + 1) & (PALETTE_SLOTS - 1);
+    }
+    *slot = h;
+    return -1;
 }
 
 
 static int
-PaletteInsert(uint32_t rgb,
+PaletteInsert(rfbTightContext *ctx,
+              uint32_t rgb,
               int numPixels,
               int bpp)
 {
-    COLOR_LIST *pnode;
-    COLOR_LIST *prev_pnode = NULL;
-    int hash_key, idx, new_idx, count;
-
-    hash_key = (bpp == 16) ? HASH_FUNC16(rgb) : HASH_FUNC32(rgb);
-
-    pnode = palette.hash[hash_key];
-
-    while (pnode != NULL) {
-        if (pnode->rgb == rgb) {
-            /* Such palette entry already exists. */
-            new_idx = idx = pnode->idx;
-            count = palette.entry[idx].numPixels + numPixels;
-            if (new_idx && palette.entry[new_idx-1].numPixels < count) {
-                do {
-                    palette.entry[new_idx] = palette.entry[new_idx-1];
-                    palette.entry[new_idx].listNode->idx = new_idx;
-                    new_idx--;
-                }
-                while (new_idx && palette.entry[new_idx-1].numPixels < count);
-                palette.entry[new_idx].listNode = pnode;
-                pnode->idx = new_idx;
+    PALETTE *pal = &ctx->palette;
+    int slot, idx, new_idx, count;
+
+    idx = PaletteFind(ctx, rgb, &slot);
+    if (idx >= 0) {
+        /* Such palette entry already exists. */
+        new_idx = idx;
+        count = pal->entry[idx].numPixels + numPixels;
+        if (new_idx && pal->entry[new_idx-1].numPixels < count) {
+            do {
+                pal->entry[new_idx] = pal->entry[new_idx-1];
+                pal->slot[pal->entry[new_idx].slot] = new_idx + 1;
+                new_idx--;
             }
-            palette.entry[new_idx].numPixels = count;
-            return paletteNumColors;
+            while (new_idx && pal->entry[new_idx-1].numPixels < count);
+            pal->entry[new_idx].rgb = rgb;
+            pal->entry[new_idx].slot = slot;
+            pal->slot[slot] = new_idx + 1;
         }
-        prev_pnode = pnode;
-        pnode = pnode->next;
+        pal->entry[new_idx].numPixels = count;
+        return ctx->paletteNumColors;
     }
 
     /* Check if palette is full. */
-    if (paletteNumColors == 256 || paletteNumColors == paletteMaxColors) {
-        paletteNumColors = 0;
+    if (ctx->paletteNumColors == 256 || ctx->paletteNumColors == ctx->paletteMaxColors) {
+        ctx->paletteNumColors = 0;
         return 0;
     }
 
     /* Move palette entries with lesser pixel counts. */
-    for ( idx = paletteNumColors;
-          idx > 0 && palette.entry[idx-1].numPixels < numPixels;
+    for ( idx = ctx->paletteNumColors;
+          idx > 0 && pal->entry[idx-1].numPixels < numPixels;
           idx-- ) {
-        palette.entry[idx] = palette.entry[idx-1];
-        palette.entry[idx].listNode->idx = idx;
+        pal->entry[idx] = pal->entry[idx-1];
+        pal->slot[pal->entry[idx].slot] = idx + 1;
     }
 
     /* Add new palette entry into the freed slot. */
-    pnode = &palette.list[paletteNumColors];
-    if (prev_pnode != NULL) {
-        prev_pnode->next = pnode;
-    } else {
-        palette.hash[hash_key] = pnode;
-    }
-    pnode->next = NULL;
-    pnode->idx = idx;
-    pnode->rgb = rgb;
-    palette.entry[idx].listNode = pnode;
-    palette.entry[idx].numPixels = numPixels;
+    pal->entry[idx].rgb = rgb;
+    pal->entry[idx].numPixels = numPixels;
+    pal->entry[idx].slot = slot;
+    pal->slot[slot] = idx + 1;
 
-    return (++paletteNumColors);
+    return (++ctx->paletteNumColors);
 }
 
 
@@ -1430,28 +1757,25 @@ static void Pack24(rfbClientPtr cl,
                    rfbPixelFormat *fmt,
                    int count)
 {
-    uint32_t *buf32;
-    uint32_t pix;
-    int r_shift, g_shift, b_shift;
-
-    buf32 = (uint32_t *)buf;
+    rfbSimdPixelFormat packed;
 
     if (!cl->screen->serverFormat.bigEndian == !fmt->bigEndian) {
-        r_shift = fmt->redShift;
-        g_shift = fmt->greenShift;
-        b_shift = fmt->blueShift;
+        packed.inShift[0] = fmt->redShift;
+        packed.inShift[1] = fmt->greenShift;
+        packed.inShift[2] = fmt->blueShift;
     } else {
-        r_shift = 24 - fmt->redShift;
-        g_shift = 24 - fmt->greenShift;
-        b_shift = 24 - fmt->blueShift;
+        packed.inShift[0] = 24 - fmt->redShift;
+        packed.inShift[1] = 24 - fmt->greenShift;
+        packed.inShift[2] = 24 - fmt->blueShift;
     }
 
-    while (count--) {
-        pix = *buf32++;
-        *buf++ = (char)(pix >> r_shift);
-        *buf++ = (char)(pix >> g_shift);
-        *buf++ = (char)(pix >> b_shift);
-    }
+    /* red, green and blue bytes, in place */
+    packed.outMax[0] = packed.outMax[1] = packed.outMax[2] = 255;
+    packed.outShift[0] = 0;
+    packed.outShift[1] = 8;
+    packed.outShift[2] = 16;
+    packed.swap = FALSE;
+    rfbSimd()->translate24((uint32_t *)buf, (uint8_t *)buf, count, &packed);
 }
 
 
@@ -1462,31 +1786,27 @@ static void Pack24(rfbClientPtr cl,
 #define DEFINE_IDX_ENCODE_FUNCTION(bpp)                                 \
                                                                         \
 static void                                                             \
-EncodeIndexedRect##bpp(uint8_t *buf, int count) {                       \
-    COLOR_LIST *pnode;                                                  \
+EncodeIndexedRect##bpp(rfbTightContext *ctx, uint8_t *buf, int count) { \
+    const rfbSimdKernels *simd = rfbSimd();                             \
     uint##bpp##_t *src;                                                 \
     uint##bpp##_t rgb;                                                  \
-    int rep = 0;                                                        \
+    int idx, slot, rep;                                                 \
                                                                         \
     src = (uint##bpp##_t *) buf;                                        \
                                                                         \
-    while (count--) {                                                   \
-        rgb = *src++;                                                   \
-        while (count && *src == rgb) {                                  \
-            rep++, src++, count--;                                      \
-        }                                                               \
-        pnode = palette.hash[HASH_FUNC##bpp(rgb)];                      \
-        while (pnode != NULL) {                                         \
-            if ((uint##bpp##_t)pnode->rgb == rgb) {                     \
-                *buf++ = (uint8_t)pnode->idx;                           \
-                while (rep) {                                           \
-                    *buf++ = (uint8_t)pnode->idx;                       \
-                    rep--;                                              \
-                }                                                       \
-                break;                                                  \
-            }                                                           \
-            pnode = pnode->next;                                        \
-        }                                                               \
+    /* buf is overwritten as it is read; a run is only written once it  \
+       has been looked at */                                            \
+    while (count) {                                                     \
+        rgb = *src;                                                     \
+        rep = 1 + simd->spanEqual##bpp(src + 1, count - 1, rgb,         \
+                                       (uint##bpp##_t)~0);              \
+        src += rep;                                                     \
+        count -= rep;                                                   \
+        /* a colour drawn after the palette was made still takes up its \
+           pixels, or the rest of the rectangle would be shifted */     \
+        idx = PaletteFind(ctx, rgb, &slot);                             \
+        memset(buf, idx >= 0 ? idx : 0, rep);                           \
+        buf += rep;                                                     \
     }                                                                   \
 }
 
@@ -1497,7 +1817,7 @@ DEFINE_IDX_ENCODE_FUNCTION(32)
 #define DEFINE_MONO_ENCODE_FUNCTION(bpp)                                \
                                                                         \
 static void                                                             \
-EncodeMonoRect##bpp(uint8_t *buf, int w, int h) {                       \
+EncodeMonoRect##bpp(rfbTightContext *ctx, uint8_t *buf, int w, int h) { \
     uint##bpp##_t *ptr;                                                 \
     uint##bpp##_t bg;                                                   \
     unsigned int value, mask;                                           \
@@ -1505,7 +1825,7 @@ EncodeMonoRect##bpp(uint8_t *buf, int w, int h) {                       \
     int x, y, bg_bits;                                                  \
                                                                         \
     ptr = (uint##bpp##_t *) buf;                                        \
-    bg = (uint##bpp##_t) monoBackground;                                \
+    bg = (uint##bpp##_t) ctx->monoBackground;                           \
     aligned_width = w - w % 8;                                          \
                                                                         \
     for (y = 0; y < h; y++) {                                           \
@@ -1553,117 +1873,116 @@ DEFINE_MONO_ENCODE_FUNCTION(32)
  * JPEG compression stuff.
  */
 
+/*
+ * If the pixels of fmt can be handed to tjCompress() as they are in the
+ * framebuffer, return their size in bytes and set *flags to describe their
+ * layout; otherwise return 0. That is the case when every channel has 8
+ * bits and is stored in a byte of its own, red, green and blue next to each
+ * other in either order.
+ */
+
+static int
+JpegPixelSize(const rfbPixelFormat *fmt, int *flags)
+{
+    int ps = fmt->bitsPerPixel / 8, r, g, b, first;
+
+    if ((ps != 3 && ps != 4) || fmt->redMax != 0xFF ||
+        fmt->greenMax != 0xFF || fmt->blueMax != 0xFF ||
+        fmt->redShift % 8 != 0 || fmt->greenShift % 8 != 0 ||
+        fmt->blueShift % 8 != 0)
+        return 0;
+
+    /* Byte offsets of the channels in memory. */
+    r = fmt->redShift / 8;
+    g = fmt->greenShift / 8;
+    b = fmt->blueShift / 8;
+    if (fmt->bigEndian) {
+        r = ps - 1 - r;
+        g = ps - 1 - g;
+        b = ps - 1 - b;
+    }
+
+    if (g == r + 1 && b == g + 1) {
+        *flags = 0;
+        first = r;
+    } else if (g == b + 1 && r == g + 1) {
+        *flags = TJ_BGR;
+        first = b;
+    } else {
+        return 0;
+    }
+
+    if (first == 1 && ps == 4)
+        *flags |= TJ_ALPHAFIRST;
+    else if (first != 0)
+        return 0;
+    return ps;
+}
+
 static rfbBool
-SendJpegRect(rfbClientPtr cl, int x, int y, int w, int h, int quality)
+SendJpegRect(rfbTightContext *ctx, int x, int y, int w, int h, int quality)
 {
+    rfbClientPtr cl = ctx->cl;
     unsigned char *srcbuf;
-    int ps = cl->screen->serverFormat.bitsPerPixel / 8;
-    int subsamp = subsampLevel2tjsubsamp[subsampLevel];
+    int ps;
+    int subsamp = subsampLevel2tjsubsamp[ctx->subsampLevel];
     unsigned long size = 0;
-    int flags = 0, pitch;
-    unsigned char *tmpbuf = NULL;
+    int flags = 0, pitch, dy;
 
     if (cl->screen->serverFormat.bitsPerPixel == 8)
-        return SendFullColorRect(cl, x, y, w, h);
+        return SendFullColorRect(ctx, x, y, w, h);
 
-    if (ps < 2) {
-        rfbLog("Error: JPEG requires 16-bit, 24-bit, or 32-bit pixel format.\n");
-        return 0;
-    }
-    if (!j) {
-        if ((j = tjInitCompress()) == NULL) {
+    if (!ctx->j) {
+        if ((ctx->j = tjInitCompress()) == NULL) {
             rfbLog("JPEG Error: %s\n", tjGetErrorStr());
             return 0;
         }
     }
 
-    if (tightAfterBufSize < TJBUFSIZE(w, h)) {
-        if (tightAfterBuf == NULL)
-            tightAfterBuf = (char *)malloc(TJBUFSIZE(w, h));
-        else
-            tightAfterBuf = (char *)realloc(tightAfterBuf,
-                                            TJBUFSIZE(w, h));
-        if (!tightAfterBuf) {
-            rfbLog("Memory allocation failure!\n");
+    if (!ReserveBuffer(&ctx->tightAfterBuf, &ctx->tightAfterBufSize,
+                       TJBUFSIZE(w, h)))
+        return 0;
+
+    if ((ps = JpegPixelSize(&cl->screen->serverFormat, &flags)) != 0) {
+        /* Compress straight from the framebuffer. */
+        pitch = cl->scaledScreen->paddedWidthInBytes;
+        srcbuf = (unsigned char *)&cl->scaledScreen->frameBuffer
+            [y * pitch + x * ps];
+    } else {
+        if (cl->screen->serverFormat.bitsPerPixel != 16 &&
+            cl->screen->serverFormat.bitsPerPixel != 32) {
+            rfbLog("Error: JPEG requires 16-bit or 32-bit pixels, or 24-bit pixels with byte-aligned 8-bit channels.\n");
             return 0;
         }
-        tightAfterBufSize = TJBUFSIZE(w, h);
-    }
 
-    if (ps == 2) {
-        uint16_t *srcptr, pix;
-        unsigned char *dst;
-        int inRed, inGreen, inBlue, i, j;
-
-        if((tmpbuf = (unsigned char *)malloc(w * h * 3)) == NULL)
-            rfbLog("Memory allocation failure!\n");
-        srcptr = (uint16_t *)&cl->scaledScreen->frameBuffer
-            [y * cl->scaledScreen->paddedWidthInBytes + x * ps];
-        dst = tmpbuf;
-        for(j = 0; j < h; j++) {
-            uint16_t *srcptr2 = srcptr;
-            unsigned char *dst2 = dst;
-            for (i = 0; i < w; i++) {
-                pix = *srcptr2++;
-                inRed = (int) (pix >> cl->screen->serverFormat.redShift
-                               & cl->screen->serverFormat.redMax);
-                inGreen = (int) (pix >> cl->screen->serverFormat.greenShift
-                                 & cl->screen->serverFormat.greenMax);
-                inBlue  = (int) (pix >> cl->screen->serverFormat.blueShift
-                                 & cl->screen->serverFormat.blueMax);
-                *dst2++ = (uint8_t)((inRed * 255
-                                     + cl->screen->serverFormat.redMax / 2)
-                                    / cl->screen->serverFormat.redMax);
-               	*dst2++ = (uint8_t)((inGreen * 255
-                                     + cl->screen->serverFormat.greenMax / 2)
-                                    / cl->screen->serverFormat.greenMax);
-                *dst2++ = (uint8_t)((inBlue * 255
-                                     + cl->screen->serverFormat.blueMax / 2)
-                                    / cl->screen->serverFormat.blueMax);
-            }
-            srcptr += cl->scaledScreen->paddedWidthInBytes / ps;
-            dst += w * 3;
-        }
-        srcbuf = tmpbuf;
+        /* The pixels before translation are not needed any more, so their
+           buffer holds the rectangle converted to RGB. */
+        if (!ReserveBuffer(&ctx->tightBeforeBuf, &ctx->tightBeforeBufSize,
+                           w * h * 3))
+            return 0;
+        srcbuf = (unsigned char *)ctx->tightBeforeBuf;
+        for (dy = 0; dy < h; dy++)
+            PrepareRowForImg(cl, srcbuf + dy * w * 3, x, y + dy, w);
         pitch = w * 3;
         ps = 3;
-    } else {
-        if (cl->screen->serverFormat.bigEndian && ps == 4)
-            flags |= TJ_ALPHAFIRST;
-        if (cl->screen->serverFormat.redShift == 16
-            && cl->screen->serverFormat.blueShift == 0)
-            flags |= TJ_BGR;
-        if (cl->screen->serverFormat.bigEndian)
-            flags ^= TJ_BGR;
-        pitch = cl->scaledScreen->paddedWidthInBytes;
-        srcbuf = (unsigned char *)&cl->scaledScreen->frameBuffer
-            [y * pitch + x * ps];
+        flags = 0;
     }
 
-    if (tjCompress(j, srcbuf, w, pitch, h, ps, (unsigned char *)tightAfterBuf,
+    if (tjCompress(ctx->j, srcbuf, w, pitch, h, ps,
+                   (unsigned char *)ctx->tightAfterBuf,
                    &size, subsamp, quality, flags) == -1) {
         rfbLog("JPEG Error: %s\n", tjGetErrorStr());
-        if (tmpbuf) {
-            free(tmpbuf);
-            tmpbuf = NULL;
-        }
         return 0;
     }
 
-    if (tmpbuf) {
-        free(tmpbuf);
-        tmpbuf = NULL;
-    }
-
-    if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 1 > UPDATE_BUF_SIZE) {
-        if (!rfbSendUpdateBuf(cl))
-            return FALSE;
-    }
-
-    cl->updateBuf[cl->ublen++] = (char)(rfbTightJpeg << 4);
-    rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
+    ctx->header[0] = (char)(rfbTightJpeg << 4);
+    ctx->headerLen = 1;
+    ctx->data = ctx->tightAfterBuf;
+    ctx->dataLen = (int)size;
+    ctx->sendLength = TRUE;
+    ctx->lossy = TRUE;
 
-    return rfbSendCompressedDataTight(cl, tightAfterBuf, (int)size);
+    return TRUE;
 }
 
 static void
@@ -1748,8 +2067,6 @@ DEFINE_JPEG_GET_ROW_FUNCTION(32)
 
 #ifdef LIBVNCSERVER_HAVE_LIBPNG
 
-static TLS int pngDstDataLen = 0;
-
 static rfbBool CanSendPngRect(rfbClientPtr cl, int w, int h) {
     if (cl->tightEncoding != rfbEncodingTightPng) {
         return FALSE;
@@ -1763,140 +2080,190 @@ static rfbBool CanSendPngRect(rfbClientPtr cl, int w, int h) {
     return TRUE;
 }
 
-static void pngWriteData(png_structp png_ptr, png_bytep data,
-                           png_size_t length)
-{
-#if 0
-    rfbClientPtr cl = png_get_io_ptr(png_ptr);
+/*
+ * TightPng rectangles are written here rather than with libpng, which
+ * allocates and sets up its writer and deflate stream for every
+ * rectangle. There is only one kind of image to write: 8-bit RGB, not
+ * interlaced, with an IHDR, a single IDAT and an IEND chunk.
+ */
 
-    buffer_reserve(&vs->tight.png, vs->tight.png.offset + length);
-    memcpy(vs->tight.png.buffer + vs->tight.png.offset, data, length);
-#endif
-    memcpy(tightAfterBuf + pngDstDataLen, data, length);
+#define PNG_CHUNK_OVERHEAD 12   /* length, type and CRC */
 
-    pngDstDataLen += length;
-}
+static const uint8_t pngSignature[8] = {
+    0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+};
 
-static void pngFlushData(png_structp png_ptr)
+static void
+PngPut32(uint8_t *p, uint32_t v)
 {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
 }
 
-
-static void *pngMalloc(png_structp png_ptr, png_size_t size)
+/* Fill in the length and CRC of the chunk starting at p with len bytes of
+   data; returns where the next chunk starts. */
+static uint8_t *
+PngFinishChunk(uint8_t *p, const char *type, uint32_t len)
 {
-    return malloc(size);
+    PngPut32(p, len);
+    memcpy(p + 4, type, 4);
+    PngPut32(p + 8 + len, (uint32_t)crc32(crc32(0, Z_NULL, 0), p + 4, len + 4));
+    return p + len + PNG_CHUNK_OVERHEAD;
 }
 
-static void pngFree(png_structp png_ptr, png_voidp ptr)
+static int
+PngPaeth(int a, int b, int c)
 {
-    free(ptr);
-}
+    int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
 
-static rfbBool SendPngRect(rfbClientPtr cl, int x, int y, int w, int h) {
-    /* rfbLog(">> SendPngRect x:%d, y:%d, w:%d, h:%d\n", x, y, w, h); */
-
-    png_byte color_type;
-    png_structp png_ptr;
-    png_infop info_ptr;
-    png_colorp png_palette = NULL;
-    int level = tightPngConf[cl->tightCompressLevel].png_zlib_level;
-    int filters = tightPngConf[cl->tightCompressLevel].png_filters;
-    uint8_t *buf;
-    int dy;
-
-    pngDstDataLen = 0;
-
-    png_ptr = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
-                                        NULL, pngMalloc, pngFree);
-
-    if (png_ptr == NULL)
-        return FALSE;
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
 
-    info_ptr = png_create_info_struct(png_ptr);
+/*
+ * Filter a row of len bytes against the previous one into out, preceded by
+ * the filter type. The filter is the one whose output has the smallest sum
+ * of absolute values as signed bytes, the heuristic the PNG specification
+ * suggests; Average rarely wins and is not tried.
+ */
 
-    if (info_ptr == NULL) {
-        png_destroy_write_struct(&png_ptr, NULL);
-        return FALSE;
+static void
+PngFilterRow(uint8_t *out, const uint8_t *row, const uint8_t *prev, int len)
+{
+    unsigned long sumNone = 0, sumSub = 0, sumUp = 0, sumPaeth = 0, best;
+    int i, a, b, c, filter = 0;
+
+    for (i = 0; i < len; i++) {
+        a = i >= 3 ? row[i - 3] : 0;
+        b = prev[i];
+        c = i >= 3 ? prev[i - 3] : 0;
+        sumNone += abs((signed char)row[i]);
+        sumSub += abs((signed char)(row[i] - a));
+        sumUp += abs((signed char)(row[i] - b));
+        sumPaeth += abs((signed char)(row[i] - PngPaeth(a, b, c)));
     }
 
-    png_set_write_fn(png_ptr, (void *) cl, pngWriteData, pngFlushData);
-    png_set_compression_level(png_ptr, level);
-    png_set_filter(png_ptr, PNG_FILTER_TYPE_DEFAULT, filters);
-
-#if 0
-    /* TODO: */
-    if (palette) {
-        color_type = PNG_COLOR_TYPE_PALETTE;
-    } else {
-        color_type = PNG_COLOR_TYPE_RGB;
+    best = sumNone;
+    if (sumSub < best) {
+        best = sumSub;
+        filter = 1;
     }
-#else
-    color_type = PNG_COLOR_TYPE_RGB;
-#endif
-    png_set_IHDR(png_ptr, info_ptr, w, h,
-                 8, color_type, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-
-#if 0
-    if (color_type == PNG_COLOR_TYPE_PALETTE) {
-        struct palette_cb_priv priv;
-
-        png_palette = pngMalloc(png_ptr, sizeof(*png_palette) *
-                                 palette_size(palette));
+    if (sumUp < best) {
+        best = sumUp;
+        filter = 2;
+    }
+    if (sumPaeth < best)
+        filter = 4;
 
-        priv.vs = vs;
-        priv.png_palette = png_palette;
-        palette_iter(palette, write_png_palette, &priv);
+    out[0] = (uint8_t)filter;
+    out++;
+    switch (filter) {
+    case 0:
+        memcpy(out, row, len);
+        break;
+    case 1:
+        for (i = 0; i < len; i++)
+            out[i] = (uint8_t)(row[i] - (i >= 3 ? row[i - 3] : 0));
+        break;
+    case 2:
+        for (i = 0; i < len; i++)
+            out[i] = (uint8_t)(row[i] - prev[i]);
+        break;
+    default:
+        for (i = 0; i < len; i++)
+            out[i] = (uint8_t)(row[i] - (i >= 3 ?
+                PngPaeth(row[i - 3], prev[i], prev[i - 3]) :
+                PngPaeth(0, prev[i], 0)));
+    }
+}
 
-        png_set_PLTE(png_ptr, info_ptr, png_palette, palette_size(palette));
+static rfbBool SendPngRect(rfbTightContext *ctx, int x, int y, int w, int h) {
+    rfbClientPtr cl = ctx->cl;
+    int level = tightPngConf[cl->tightCompressLevel].png_zlib_level;
+    rfbBool filters = tightPngConf[cl->tightCompressLevel].png_filters;
+    z_streamp pz = &ctx->pngStream;
+    int rowLen = w * 3, maxSize, dy;
+    uint8_t *out, *idat, *prev, *row, *filtered, *tmp;
 
-        offset = vs->tight.tight.offset;
-        if (vs->clientds.pf.bytes_per_pixel == 4) {
-            tight_encode_indexed_rect32(vs->tight.tight.buffer, w * h, palette);
-        } else {
-            tight_encode_indexed_rect16(vs->tight.tight.buffer, w * h, palette);
+    if (!ctx->pngStreamActive) {
+        pz->zalloc = Z_NULL;
+        pz->zfree = Z_NULL;
+        pz->opaque = Z_NULL;
+        if (deflateInit(pz, level) != Z_OK)
+            return FALSE;
+        ctx->pngStreamActive = TRUE;
+        ctx->pngStreamLevel = level;
+    } else {
+        if (deflateReset(pz) != Z_OK)
+            return FALSE;
+        if (level != ctx->pngStreamLevel) {
+            if (deflateParams(pz, level, Z_DEFAULT_STRATEGY) != Z_OK)
+                return FALSE;
+            ctx->pngStreamLevel = level;
         }
     }
 
-    buffer_reserve(&vs->tight.png, 2048);
-#endif
+    maxSize = sizeof(pngSignature) + 3 * PNG_CHUNK_OVERHEAD + 13 +
+        (int)deflateBound(pz, (uLong)(rowLen + 1) * h);
+    if (!ReserveBuffer(&ctx->tightAfterBuf, &ctx->tightAfterBufSize,
+                       maxSize) ||
+        !ReserveBuffer(&ctx->pngRows, &ctx->pngRowsSize, 3 * rowLen + 1))
+        return FALSE;
 
-    png_write_info(png_ptr, info_ptr);
-    buf = malloc(w * 3);
-    for (dy = 0; dy < h; dy++)
-    {
-#if 0
-        if (color_type == PNG_COLOR_TYPE_PALETTE) {
-            memcpy(buf, vs->tight.tight.buffer + (dy * w), w);
+    out = (uint8_t *)ctx->tightAfterBuf;
+    memcpy(out, pngSignature, sizeof(pngSignature));
+    out += sizeof(pngSignature);
+
+    PngPut32(out + 8, (uint32_t)w);
+    PngPut32(out + 12, (uint32_t)h);
+    out[16] = 8;                /* bits per sample */
+    out[17] = 2;                /* RGB */
+    out[18] = 0;                /* deflate */
+    out[19] = 0;                /* adaptive filtering */
+    out[20] = 0;                /* not interlaced */
+    out = PngFinishChunk(out, "IHDR", 13);
+
+    idat = out;
+    pz->next_out = idat + 8;
+    pz->avail_out = (uInt)(ctx->tightAfterBufSize -
+                           (idat + 8 - (uint8_t *)ctx->tightAfterBuf));
+
+    prev = (uint8_t *)ctx->pngRows;
+    row = prev + rowLen;
+    filtered = row + rowLen;
+    memset(prev, 0, rowLen);
+    for (dy = 0; dy < h; dy++) {
+        if (filters) {
+            PrepareRowForImg(cl, row, x, y + dy, w);
+            PngFilterRow(filtered, row, prev, rowLen);
+            tmp = prev;
+            prev = row;
+            row = tmp;
         } else {
-            PrepareRowForImg(cl, buf, x, y + dy, w);
+            filtered[0] = 0;
+            PrepareRowForImg(cl, filtered + 1, x, y + dy, w);
         }
-#else
-        PrepareRowForImg(cl, buf, x, y + dy, w);
-#endif
-        png_write_row(png_ptr, buf);
-    }
-    free(buf);
-
-    png_write_end(png_ptr, NULL);
-
-    if (color_type == PNG_COLOR_TYPE_PALETTE) {
-        pngFree(png_ptr, png_palette);
-    }
-
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-
-    /* done v */
-
-    if (cl->ublen + TIGHT_MIN_TO_COMPRESS + 1 > UPDATE_BUF_SIZE) {
-        if (!rfbSendUpdateBuf(cl))
+        pz->next_in = filtered;
+        pz->avail_in = rowLen + 1;
+        /* the output buffer is large enough for all of it */
+        if (deflate(pz, dy == h - 1 ? Z_FINISH : Z_NO_FLUSH) !=
+            (dy == h - 1 ? Z_STREAM_END : Z_OK))
             return FALSE;
     }
 
-    cl->updateBuf[cl->ublen++] = (char)(rfbTightPng << 4);
-    rfbStatRecordEncodingSentAdd(cl, cl->tightEncoding, 1);
+    out = PngFinishChunk(idat, "IDAT",
+                         (uint32_t)((uint8_t *)pz->next_out - (idat + 8)));
+    out = PngFinishChunk(out, "IEND", 0);
+
+    ctx->header[0] = (char)(rfbTightPng << 4);
+    ctx->headerLen = 1;
+    ctx->data = ctx->tightAfterBuf;
+    ctx->dataLen = (int)(out - (uint8_t *)ctx->tightAfterBuf);
+    ctx->sendLength = TRUE;
 
-    /* rfbLog("<< SendPngRect\n"); */
-    return rfbSendCompressedDataTight(cl, tightAfterBuf, pngDstDataLen);
+    return TRUE;
 }
 #endif
@@ -356,7 +356,10 @@ rfbSendInteractionCaps(rfbClientPtr cl)
     }
 
     /* Dispatch client input to rfbProcessClientNormalMessage(). */
+    LOCK(cl->updateMutex);
     cl->state = RFB_NORMAL;
+    TSIGNAL(cl->updateCond);
+    UNLOCK(cl->updateMutex);
 }
 
 
@@ -0,0 +1,355 @@
+/*
+ * tilehash.c - don't send clients tiles they already have.
+ *
+ * Applications often repaint pixels that did not change: a blinking widget
+ * toggles back, or the whole screen is redrawn with the same contents. With
+ * rfbScreenInfo::clientTileHashes set, every client keeps a hash of each
+ * TILEHASH_SIZE x TILEHASH_SIZE tile as it was last sent to it, and tiles
+ * whose framebuffer contents hash the same are dropped from the update
+ * before any encoder sees them. Only the hashes are kept, not the pixels.
+ *
+ * A tile's hash is only known when the whole tile went out in one update;
+ * tiles sent in part, or overwritten by a copy, are unknown until the next
+ * time they are sent whole. As the framebuffer may change while an update
+ * is encoded, a recorded tile is hashed again once the update is out and
+ * forgotten if it does not match any more or was marked as modified since.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "damage.h"
+#include "tilehash.h"
+
+#define TILEHASH_SIZE 32
+
+typedef struct rfbTileHashes {
+    /* the framebuffer the table is for */
+    int width, height, bpp;
+    int columns, rows;
+    /* hash of the tile the client has, 0 if unknown */
+    uint64_t *sent;
+    /* pixels of each tile in the update being recorded, or just whether
+       the filter looked at it already */
+    int *covered;
+    /* tiles recorded for the update being sent */
+    int *pending;
+    int nPending;
+} rfbTileHashes;
+
+static rfbTileHashes *
+tileHashesFor(rfbClientPtr cl)
+{
+    rfbScreenInfoPtr screen = cl->screen;
+    rfbTileHashes *t = cl->tileHashes;
+    int bpp = screen->serverFormat.bitsPerPixel / 8, tiles;
+
+    if (t && t->width == screen->width && t->height == screen->height && t->bpp == bpp)
+	return t;
+
+    rfbTileHashFree(cl);
+    if (!screen->frameBuffer || bpp == 0)
+	return NULL;
+    t = (rfbTileHashes *)calloc(sizeof(rfbTileHashes), 1);
+    if (!t)
+	return NULL;
+    t->width = screen->width;
+    t->height = screen->height;
+    t->bpp = bpp;
+    t->columns = (screen->width + TILEHASH_SIZE - 1) / TILEHASH_SIZE;
+    t->rows = (screen->height + TILEHASH_SIZE - 1) / TILEHASH_SIZE;
+    tiles = t->columns * t->rows;
+    t->sent = (uint64_t *)calloc(sizeof(uint64_t), tiles);
+    t->covered = (int *)calloc(sizeof(int), tiles);
+    t->pending = (int *)malloc(sizeof(int) * tiles);
+    cl->tileHashes = t;
+    if (!t->sent || !t->covered || !t->pending) {
+	rfbErr("rfbTileHashFilter: out of memory\n");
+	rfbTileHashFree(cl);
+	return NULL;
+    }
+    return t;
+}
+
+static void
+tileRect(rfbTileHashes *t, int tx, int ty, sraRect *rect)
+{
+    rect->x1 = tx * TILEHASH_SIZE;
+    rect->y1 = ty * TILEHASH_SIZE;
+    rect->x2 = rect->x1 + TILEHASH_SIZE;
+    rect->y2 = rect->y1 + TILEHASH_SIZE;
+    if (rect->x2 > t->width)
+	rect->x2 = t->width;
+    if (rect->y2 > t->height)
+	rect->y2 = t->height;
+}
+
+static uint64_t
+tileHash(rfbClientPtr cl, rfbTileHashes *t, int tx, int ty)
+{
+    sraRect rect;
+    uint64_t h = 0;
+    int y;
+
+    tileRect(t, tx, ty, &rect);
+    for (y = rect.y1; y < rect.y2; y++)
+	h = rfbDamageHash(cl->screen->frameBuffer + y * cl->screen->paddedWidthInBytes +
+			  rect.x1 * t->bpp, (rect.x2 - rect.x1) * t->bpp, h);
+    /* 0 means unknown */
+    return h ? h : 1;
+}
+
+/* Clip rect to the screen and return the range of tiles it touches. */
+static rfbBool
+tileRange(rfbTileHashes *t, sraRect *rect, int *tx1, int *ty1, int *tx2, int *ty2)
+{
+    if (rect->x1 < 0)
+	rect->x1 = 0;
+    if (rect->y1 < 0)
+	rect->y1 = 0;
+    if (rect->x2 > t->width)
+	rect->x2 = t->width;
+    if (rect->y2 > t->height)
+	rect->y2 = t->height;
+    if (rect->x1 >= rect->x2 || rect->y1 >= rect->y2)
+	return FALSE;
+    *tx1 = rect->x1 / TILEHASH_SIZE;
+    *ty1 = rect->y1 / TILEHASH_SIZE;
+    *tx2 = (rect->x2 - 1) / TILEHASH_SIZE + 1;
+    *ty2 = (rect->y2 - 1) / TILEHASH_SIZE + 1;
+    return TRUE;
+}
+
+static void
+tileClearCovered(rfbTileHashes *t, sraRegionPtr region)
+{
+    sraRectangleIterator *i = sraRgnGetIterator(region);
+    sraRect rect;
+    int tx, ty, tx1, ty1, tx2, ty2;
+
+    while (sraRgnIteratorNext(i, &rect))
+	if (tileRange(t, &rect, &tx1, &ty1, &tx2, &ty2))
+	    for (ty = ty1; ty < ty2; ty++)
+		for (tx = tx1; tx < tx2; tx++)
+		    t->covered[ty * t->columns + tx] = 0;
+    sraRgnReleaseIterator(i);
+}
+
+static unsigned long
+regionArea(sraRegionPtr region)
+{
+    sraRectangleIterator *i = sraRgnGetIterator(region);
+    sraRect rect;
+    unsigned long area = 0;
+
+    while (sraRgnIteratorNext(i, &rect))
+	area += (unsigned long)(rect.x2 - rect.x1) * (rect.y2 - rect.y1);
+    sraRgnReleaseIterator(i);
+    return area;
+}
+
+void
+rfbTileHashFilter(rfbClientPtr cl, sraRegionPtr region)
+{
+    rfbTileHashes *t;
+    sraRectangleIterator *i;
+    sraRect rect, tile;
+    sraRegionPtr suppressed = NULL, tileRegion;
+    int tx, ty, tx1, ty1, tx2, ty2, idx;
+
+    if (!cl->screen->clientTileHashes || cl->screen != cl->scaledScreen) {
+	/* a scaled client gets scaled tiles; nothing to compare with */
+	rfbTileHashFree(cl);
+	return;
+    }
+    if (!(t = tileHashesFor(cl)))
+	return;
+
+    i = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(i, &rect)) {
+	if (!tileRange(t, &rect, &tx1, &ty1, &tx2, &ty2))
+	    continue;
+	for (ty = ty1; ty < ty2; ty++)
+	    for (tx = tx1; tx < tx2; tx++) {
+		/* several rectangles of the region can share a tile */
+		idx = ty * t->columns + tx;
+		if (t->covered[idx])
+		    continue;
+		t->covered[idx] = 1;
+		if (!t->sent[idx] || tileHash(cl, t, tx, ty) != t->sent[idx])
+		    continue;
+		tileRect(t, tx, ty, &tile);
+		tileRegion = sraRgnCreateRect(tile.x1, tile.y1, tile.x2, tile.y2);
+		if (!suppressed) {
+		    suppressed = tileRegion;
+		} else {
+		    sraRgnOr(suppressed, tileRegion);
+		    sraRgnDestroy(tileRegion);
+		}
+	    }
+    }
+    sraRgnReleaseIterator(i);
+    tileClearCovered(t, region);
+
+    if (!suppressed)
+	return;
+    sraRgnAnd(suppressed, region);
+    cl->tileBytesSuppressed += (uint64_t)regionArea(suppressed) * (cl->format.bitsPerPixel / 8);
+    sraRgnSubtract(region, suppressed);
+    sraRgnSubtract(cl->modifiedRegion, suppressed);
+    sraRgnDestroy(suppressed);
+}
+
+void
+rfbTileHashRecord(rfbClientPtr cl, sraRegionPtr updateRegion, sraRegionPtr copyRegion)
+{
+    rfbTileHashes *t = cl->tileHashes;
+    sraRectangleIterator *i;
+    sraRect rect, tile, part;
+    int tx, ty, tx1, ty1, tx2, ty2, idx;
+
+    if (!t)
+	return;
+
+    LOCK(cl->updateMutex);
+    t->nPending = 0;
+
+    /* what the client has there now depends on the copy's source */
+    i = sraRgnGetIterator(copyRegion);
+    while (sraRgnIteratorNext(i, &rect))
+	if (tileRange(t, &rect, &tx1, &ty1, &tx2, &ty2))
+	    for (ty = ty1; ty < ty2; ty++)
+		for (tx = tx1; tx < tx2; tx++)
+		    t->sent[ty * t->columns + tx] = 0;
+    sraRgnReleaseIterator(i);
+
+    /* the rectangles of a region don't overlap, so a tile went out whole
+       when the parts of it add up to its size */
+    i = sraRgnGetIterator(updateRegion);
+    while (sraRgnIteratorNext(i, &rect)) {
+	if (!tileRange(t, &rect, &tx1, &ty1, &tx2, &ty2))
+	    continue;
+	for (ty = ty1; ty < ty2; ty++)
+	    for (tx = tx1; tx < tx2; tx++) {
+		idx = ty * t->columns + tx;
+		tileRect(t, tx, ty, &tile);
+		part = tile;
+		if (part.x1 < rect.x1)
+		    part.x1 = rect.x1;
+		if (part.y1 < rect.y1)
+		    part.y1 = rect.y1;
+		if (part.x2 > rect.x2)
+		    part.x2 = rect.x2;
+		if (part.y2 > rect.y2)
+		    part.y2 = rect.y2;
+		if (t->covered[idx] == 0)
+		    t->sent[idx] = 0;
+		t->covered[idx] += (part.x2 - part.x1) * (part.y2 - part.y1);
+		if (t->covered[idx] == (tile.x2 - tile.x1) * (tile.y2 - tile.y1)) {
+		    t->sent[idx] = tileHash(cl, t, tx, ty);
+		    t->pending[t->nPending++] = idx;
+		}
+	    }
+    }
+    sraRgnReleaseIterator(i);
+
+    tileClearCovered(t, updateRegion);
+
+    UNLOCK(cl->updateMutex);
+}
+
+void
+rfbTileHashVerify(rfbClientPtr cl)
+{
+    rfbTileHashes *t = cl->tileHashes;
+    sraRectangleIterator *i;
+    sraRect rect;
+    int j, idx, tx, ty, tx1, ty1, tx2, ty2;
+
+    if (!t)
+	return;
+
+    LOCK(cl->updateMutex);
+
+    /* A tile may have been changed and changed back while the update was
+       encoded, so the same hash does not mean the client got what it
+       hashes to. Anything marked as modified since it was recorded is
+       forgotten, whatever its contents are now. */
+    i = sraRgnGetIterator(cl->modifiedRegion);
+    while (sraRgnIteratorNext(i, &rect))
+	if (tileRange(t, &rect, &tx1, &ty1, &tx2, &ty2))
+	    for (ty = ty1; ty < ty2; ty++)
+		for (tx = tx1; tx < tx2; tx++)
+		    t->covered[ty * t->columns + tx] = 1;
+    sraRgnReleaseIterator(i);
+
+    for (j = 0; j < t->nPending; j++) {
+	idx = t->pending[j];
+	if (t->sent[idx] && (t->covered[idx] ||
+			     tileHash(cl, t, idx % t->columns, idx / t->columns) != t->sent[idx]))
+	    t->sent[idx] = 0;
+    }
+    t->nPending = 0;
+    tileClearCovered(t, cl->modifiedRegion);
+    UNLOCK(cl->updateMutex);
+}
+
+void
+rfbTileHashForget(rfbClientPtr cl, sraRegionPtr region)
+{
+    rfbTileHashes *t = cl->tileHashes;
+    sraRectangleIterator *i;
+    sraRect rect;
+    int tx, ty, tx1, ty1, tx2, ty2;
+
+    if (!t)
+	return;
+    i = sraRgnGetIterator(region);
+    while (sraRgnIteratorNext(i, &rect))
+	if (tileRange(t, &rect, &tx1, &ty1, &tx2, &ty2))
+	    for (ty = ty1; ty < ty2; ty++)
+		for (tx = tx1; tx < tx2; tx++)
+		    t->sent[ty * t->columns + tx] = 0;
+    sraRgnReleaseIterator(i);
+}
+
+void
+rfbTileHashInvalidate(rfbClientPtr cl)
+{
+    rfbTileHashes *t = cl->tileHashes;
+
+    if (!t)
+	return;
+    memset(t->sent, 0, sizeof(uint64_t) * t->columns * t->rows);
+    t->nPending = 0;
+}
+
+void
+rfbTileHashFree(rfbClientPtr cl)
+{
+    rfbTileHashes *t = cl->tileHashes;
+
+    if (!t)
+	return;
+    free(t->sent);
+    free(t->covered);
+    free(t->pending);
+    free(t);
+    cl->tileHashes = NULL;
+}
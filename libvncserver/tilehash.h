@@ -0,0 +1,51 @@
+/*
+ * tilehash.h - private interface to the per-client tile hashes.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef RFB_TILEHASH_H
+#define RFB_TILEHASH_H
+
+#include <rfb/rfb.h>
+
+/* Drop the tiles of region the client already has from region and from
+   cl->modifiedRegion. Called by rfbSendFramebufferUpdate() with
+   cl->updateMutex held, before it looks at the copy and requested regions. */
+void rfbTileHashFilter(rfbClientPtr cl, sraRegionPtr region);
+
+/* Note what the update about to be sent does to the client's tiles; called
+   with cl->updateMutex held. */
+void rfbTileHashRecord(rfbClientPtr cl, sraRegionPtr updateRegion,
+                       sraRegionPtr copyRegion);
+
+/* Once the update is out, forget the tiles that changed while they were
+   encoded. */
+void rfbTileHashVerify(rfbClientPtr cl);
+
+/* The client was sent something other than the framebuffer contents in
+   region, e.g. a lossy JPEG; called with cl->updateMutex held. */
+void rfbTileHashForget(rfbClientPtr cl, sraRegionPtr region);
+
+/* The client's framebuffer contents are unknown, e.g. after a pixel format
+   change or a full update request; called with cl->updateMutex held. */
+void rfbTileHashInvalidate(rfbClientPtr cl);
+
+void rfbTileHashFree(rfbClientPtr cl);
+
+#endif
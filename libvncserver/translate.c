@@ -25,6 +25,8 @@
 
 #include <rfb/rfb.h>
 #include <rfb/rfbregion.h>
+#include "simd.h"
+#include "translatecache.h"
 
 static void PrintPixelFormat(rfbPixelFormat *pf);
 static rfbBool rfbSetClientColourMapBGR233(rfbClientPtr cl);
@@ -237,6 +239,90 @@ rfbTranslateNone(char *table, rfbPixelFormat *in, rfbPixelFormat *out,
 }
 
 
+/*
+ * rfbCanTranslateWithKernels checks that rfbTranslateWithKernels32 can
+ * translate from in to out: 32 bit pixels with 8 bit channels to a true
+ * colour format with at most 8 bit channels.
+ */
+
+static rfbBool
+rfbCanTranslateWithKernels(rfbPixelFormat *in, rfbPixelFormat *out)
+{
+    const rfbSimdKernels *portable;
+
+    /* without vector instructions the tables are faster */
+    rfbSimdList(&portable, 1);
+    if (rfbSimd() == portable)
+        return FALSE;
+
+    return (in->bitsPerPixel == 32 && in->trueColour &&
+            in->redMax == 255 && in->greenMax == 255 && in->blueMax == 255 &&
+            in->redShift <= 24 && in->greenShift <= 24 &&
+            in->blueShift <= 24 &&
+            out->trueColour &&
+            out->redMax <= 255 && out->greenMax <= 255 &&
+            out->blueMax <= 255 &&
+            out->redShift < out->bitsPerPixel &&
+            out->greenShift < out->bitsPerPixel &&
+            out->blueShift < out->bitsPerPixel);
+}
+
+
+/*
+ * rfbTranslateWithKernels32 translates a rectangle of pixel data using the
+ * vector kernels in simd.c, which compute what the RGB tables would hold.
+ */
+
+static void
+rfbTranslateWithKernels32(char *table, rfbPixelFormat *in,
+                          rfbPixelFormat *out,
+                          char *iptr, char *optr,
+                          int bytesBetweenInputLines,
+                          int width, int height)
+{
+    const rfbSimdKernels *simd = rfbSimd();
+    rfbSimdPixelFormat f;
+    int bytesPerOutputLine = width * (out->bitsPerPixel / 8);
+
+    f.inShift[0] = in->redShift;
+    f.inShift[1] = in->greenShift;
+    f.inShift[2] = in->blueShift;
+    f.outMax[0] = out->redMax;
+    f.outMax[1] = out->greenMax;
+    f.outMax[2] = out->blueMax;
+    f.outShift[0] = out->redShift;
+    f.outShift[1] = out->greenShift;
+    f.outShift[2] = out->blueShift;
+    f.swap = (out->bigEndian != in->bigEndian);
+#ifdef LIBVNCSERVER_ALLOW24BPP
+    /* the 24 bit kernel writes the least significant byte first */
+    if (out->bitsPerPixel == 24 && !rfbEndianTest)
+        f.swap = !f.swap;
+#endif
+
+    while (height > 0) {
+        switch (out->bitsPerPixel) {
+        case 8:
+            simd->translate8((uint32_t *)iptr, (uint8_t *)optr, width, &f);
+            break;
+        case 16:
+            simd->translate16((uint32_t *)iptr, (uint16_t *)optr, width, &f);
+            break;
+#ifdef LIBVNCSERVER_ALLOW24BPP
+        case 24:
+            simd->translate24((uint32_t *)iptr, (uint8_t *)optr, width, &f);
+            break;
+#endif
+        default:
+            simd->translate32((uint32_t *)iptr, (uint32_t *)optr, width, &f);
+        }
+        iptr += bytesBetweenInputLines;
+        optr += bytesPerOutputLine;
+        height--;
+    }
+}
+
+
 /*
  * rfbSetTranslateFunction sets the translation function.
  */
@@ -247,6 +333,9 @@ rfbSetTranslateFunction(rfbClientPtr cl)
     rfbLog("Pixel format for client %s:\n",cl->host);
     PrintPixelFormat(&cl->format);
 
+    /* the table may be a shared one */
+    rfbTranslateCacheDetach(cl);
+
     /*
      * Check that bits per pixel values are valid
      */
@@ -334,6 +423,13 @@ rfbSetTranslateFunction(rfbClientPtr cl)
 	   [BPP2OFFSET(cl->format.bitsPerPixel)]) (&cl->translateLookupTable,
 						   &(cl->screen->serverFormat), &cl->format,&cl->screen->colourMap);
 
+    } else if (rfbCanTranslateWithKernels(&cl->screen->serverFormat,
+                                          &cl->format)) {
+
+        /* the usual 32 bpp server computes the pixels without tables */
+
+        cl->translateFn = rfbTranslateWithKernels32;
+
     } else {
 
         /* otherwise we use three separate tables for red, green and blue */
@@ -347,6 +443,8 @@ rfbSetTranslateFunction(rfbClientPtr cl)
                                              &(cl->screen->serverFormat), &cl->format);
     }
 
+    rfbTranslateCacheAttach(cl);
+
     return TRUE;
 }
 
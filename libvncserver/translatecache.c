@@ -0,0 +1,314 @@
+/*
+ * translatecache.c - share translated pixels between clients.
+ *
+ * Every client whose pixel format differs from the server's translates
+ * the pixels it sends, so twenty 16 bit viewers translate each changed
+ * pixel twenty times. With shareTranslation, the clients of one format
+ * read from a translated copy of the framebuffer instead. The copy
+ * remembers where the framebuffer changed since and translates those
+ * parts the first time one of its clients needs them.
+ *
+ * The encoders call translateFn with translateLookupTable, so a client
+ * sharing a copy gets translateFromCache() as its translateFn and the
+ * copy as its "table"; the copy keeps the translateFn and table of the
+ * format for translating. Pixels that are not part of the unscaled
+ * framebuffer, like cursor shapes, single colours of Tight or the
+ * framebuffer of a scaled screen, are translated directly. So is
+ * everything while a copy has one client only, which would gain nothing
+ * from it.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+#include "translatecache.h"
+
+typedef struct rfbTranslateCache rfbTranslateCache;
+
+struct rfbTranslateCache {
+    rfbScreenInfoPtr screen;
+    rfbPixelFormat in, out;
+    rfbTranslateFnType translateFn;
+    char *table;
+    /* clients sharing this copy; changed with the list mutex held */
+    int refCount;
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+    MUTEX(mutex);
+#endif
+    /* width * bytesPerPixel per line; NULL until first used */
+    char *frameBuffer;
+    int width, height, bytesPerPixel;
+    /* where the framebuffer changed since it was translated */
+    sraRegionPtr stale;
+    rfbTranslateCache *next;
+};
+
+struct rfbTranslateCaches {
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+    MUTEX(mutex);
+#endif
+    rfbTranslateCache *head;
+};
+
+void
+rfbTranslateCacheInit(rfbScreenInfoPtr screen)
+{
+    struct rfbTranslateCaches *caches;
+
+    if (!screen->shareTranslation || screen->translateCaches)
+	return;
+
+    caches = (struct rfbTranslateCaches *)calloc(sizeof(*caches), 1);
+    if (!caches) {
+	rfbErr("rfbTranslateCacheInit: out of memory\n");
+	return;
+    }
+    INIT_MUTEX(caches->mutex);
+    screen->translateCaches = caches;
+}
+
+static void
+cacheFree(rfbTranslateCache *cache)
+{
+    free(cache->table);
+    free(cache->frameBuffer);
+    sraRgnDestroy(cache->stale);
+    TINI_MUTEX(cache->mutex);
+    free(cache);
+}
+
+void
+rfbTranslateCacheCleanup(rfbScreenInfoPtr screen)
+{
+    struct rfbTranslateCaches *caches = screen->translateCaches;
+    rfbTranslateCache *cache;
+
+    if (!caches)
+	return;
+
+    while ((cache = caches->head)) {
+	caches->head = cache->next;
+	cacheFree(cache);
+    }
+    TINI_MUTEX(caches->mutex);
+    free(caches);
+    screen->translateCaches = NULL;
+}
+
+/* Translate what changed in the rectangle; called with the mutex held.
+   Returns FALSE if there is no memory for the copy. */
+static rfbBool
+cacheRefresh(rfbTranslateCache *cache, int x, int y, int w, int h)
+{
+    rfbScreenInfoPtr screen = cache->screen;
+    int inBytes = screen->serverFormat.bitsPerPixel / 8;
+    sraRegionPtr region;
+    sraRectangleIterator *i;
+    sraRect rect;
+    int row;
+
+    if (!cache->frameBuffer || cache->width != screen->width ||
+	cache->height != screen->height) {
+	free(cache->frameBuffer);
+	cache->frameBuffer = (char *)malloc((size_t)screen->width *
+					    screen->height *
+					    cache->bytesPerPixel);
+	if (!cache->frameBuffer) {
+	    rfbErr("cacheRefresh: out of memory\n");
+	    return FALSE;
+	}
+	cache->width = screen->width;
+	cache->height = screen->height;
+	sraRgnDestroy(cache->stale);
+	cache->stale = sraRgnCreateRect(0, 0, cache->width, cache->height);
+    }
+
+    if (sraRgnEmpty(cache->stale))
+	return TRUE;
+
+    region = sraRgnCreateRect(x, y, x + w, y + h);
+    sraRgnAnd(region, cache->stale);
+    if (!sraRgnEmpty(region)) {
+	i = sraRgnGetIterator(region);
+	while (sraRgnIteratorNext(i, &rect))
+	    for (row = rect.y1; row < rect.y2; row++)
+		(*cache->translateFn)(cache->table, &cache->in, &cache->out,
+				      screen->frameBuffer +
+				      row * screen->paddedWidthInBytes +
+				      rect.x1 * inBytes,
+				      cache->frameBuffer +
+				      ((size_t)row * cache->width + rect.x1) *
+				      cache->bytesPerPixel,
+				      screen->paddedWidthInBytes,
+				      rect.x2 - rect.x1, 1);
+	sraRgnReleaseIterator(i);
+	sraRgnSubtract(cache->stale, region);
+    }
+    sraRgnDestroy(region);
+    return TRUE;
+}
+
+/* The translateFn of the clients sharing a copy, which table is. */
+static void
+translateFromCache(char *table, rfbPixelFormat *in, rfbPixelFormat *out,
+                   char *iptr, char *optr, int bytesBetweenInputLines,
+                   int width, int height)
+{
+    rfbTranslateCache *cache = (rfbTranslateCache *)table;
+    rfbScreenInfoPtr screen = cache->screen;
+    int inBytes = screen->serverFormat.bitsPerPixel / 8;
+    int lineBytes = width * cache->bytesPerPixel;
+    long offset = (long)(iptr - screen->frameBuffer);
+    int x, y;
+    char *p;
+
+    if (cache->refCount > 1 &&
+	bytesBetweenInputLines == screen->paddedWidthInBytes &&
+	offset >= 0 &&
+	offset < (long)screen->paddedWidthInBytes * screen->height &&
+	offset % screen->paddedWidthInBytes % inBytes == 0) {
+	y = (int)(offset / screen->paddedWidthInBytes);
+	x = (int)(offset % screen->paddedWidthInBytes / inBytes);
+	if (x + width <= screen->width && y + height <= screen->height) {
+	    LOCK(cache->mutex);
+	    if (cacheRefresh(cache, x, y, width, height)) {
+		p = cache->frameBuffer +
+		    ((size_t)y * cache->width + x) * cache->bytesPerPixel;
+		for (; height > 0; height--) {
+		    memcpy(optr, p, lineBytes);
+		    optr += lineBytes;
+		    p += cache->width * cache->bytesPerPixel;
+		}
+		UNLOCK(cache->mutex);
+		return;
+	    }
+	    UNLOCK(cache->mutex);
+	}
+    }
+
+    (*cache->translateFn)(cache->table, in, out, iptr, optr,
+			  bytesBetweenInputLines, width, height);
+}
+
+void
+rfbTranslateCacheAttach(rfbClientPtr cl)
+{
+    struct rfbTranslateCaches *caches = cl->screen->translateCaches;
+    rfbTranslateCache *cache;
+
+    /* colour maps change the tables under the clients */
+    if (!caches || cl->translateCache ||
+	cl->translateFn == rfbTranslateNone ||
+	!cl->screen->serverFormat.trueColour)
+	return;
+
+    LOCK(caches->mutex);
+    for (cache = caches->head; cache; cache = cache->next)
+	if (memcmp(&cache->in, &cl->screen->serverFormat,
+		   sizeof(rfbPixelFormat)) == 0 &&
+	    memcmp(&cache->out, &cl->format, sizeof(rfbPixelFormat)) == 0)
+	    break;
+
+    if (cache) {
+	free(cl->translateLookupTable);
+    } else {
+	cache = (rfbTranslateCache *)calloc(sizeof(rfbTranslateCache), 1);
+	if (!cache) {
+	    UNLOCK(caches->mutex);
+	    rfbErr("rfbTranslateCacheAttach: out of memory\n");
+	    return;
+	}
+	cache->screen = cl->screen;
+	cache->in = cl->screen->serverFormat;
+	cache->out = cl->format;
+	cache->translateFn = cl->translateFn;
+	cache->table = cl->translateLookupTable;
+	cache->bytesPerPixel = cl->format.bitsPerPixel / 8;
+	cache->stale = sraRgnCreate();
+	INIT_MUTEX(cache->mutex);
+	cache->next = caches->head;
+	caches->head = cache;
+    }
+    cache->refCount++;
+    UNLOCK(caches->mutex);
+
+    cl->translateCache = cache;
+    cl->translateLookupTable = (char *)cache;
+    cl->translateFn = translateFromCache;
+}
+
+void
+rfbTranslateCacheDetach(rfbClientPtr cl)
+{
+    struct rfbTranslateCaches *caches = cl->screen->translateCaches;
+    rfbTranslateCache *cache = cl->translateCache, **p;
+
+    if (!cache)
+	return;
+
+    cl->translateCache = NULL;
+    cl->translateLookupTable = NULL;
+    cl->translateFn = rfbTranslateNone;
+
+    LOCK(caches->mutex);
+    if (--cache->refCount == 0) {
+	for (p = &caches->head; *p != cache; p = &(*p)->next);
+	*p = cache->next;
+	cacheFree(cache);
+    }
+    UNLOCK(caches->mutex);
+}
+
+void
+rfbTranslateCacheInvalidate(rfbScreenInfoPtr screen, sraRegionPtr region)
+{
+    struct rfbTranslateCaches *caches = screen->translateCaches;
+    rfbTranslateCache *cache;
+
+    if (!caches)
+	return;
+
+    LOCK(caches->mutex);
+    for (cache = caches->head; cache; cache = cache->next) {
+	LOCK(cache->mutex);
+	if (region) {
+	    sraRgnOr(cache->stale, region);
+	} else {
+	    sraRgnDestroy(cache->stale);
+	    cache->stale = sraRgnCreateRect(0, 0, screen->width,
+					    screen->height);
+	}
+	UNLOCK(cache->mutex);
+    }
+    UNLOCK(caches->mutex);
+}
+
+void
+rfbTranslateCacheInvalidateRect(rfbScreenInfoPtr screen,
+                                int x1, int y1, int x2, int y2)
+{
+    sraRegionPtr region;
+
+    if (!screen->translateCaches)
+	return;
+
+    region = sraRgnCreateRect(x1, y1, x2, y2);
+    rfbTranslateCacheInvalidate(screen, region);
+    sraRgnDestroy(region);
+}
@@ -0,0 +1,47 @@
+/*
+ * translatecache.h - private interface to the translated framebuffers
+ * shared by clients with the same pixel format.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef RFB_TRANSLATECACHE_H
+#define RFB_TRANSLATECACHE_H
+
+#include <rfb/rfb.h>
+
+/* Set up screen->translateCaches if screen->shareTranslation asks for it. */
+void rfbTranslateCacheInit(rfbScreenInfoPtr screen);
+void rfbTranslateCacheCleanup(rfbScreenInfoPtr screen);
+
+/* Called by rfbSetTranslateFunction() once translateFn and
+   translateLookupTable are set up: the client reads its pixels from the
+   translated framebuffer of its format from now on, which takes over the
+   function and table if it is the first one with that format. */
+void rfbTranslateCacheAttach(rfbClientPtr cl);
+
+/* Stop sharing; the last client of a format frees its framebuffer. */
+void rfbTranslateCacheDetach(rfbClientPtr cl);
+
+/* Mark a change of the framebuffer; a NULL region marks all of it, after
+   which the translated framebuffers follow a change of size as well. */
+void rfbTranslateCacheInvalidate(rfbScreenInfoPtr screen, sraRegionPtr region);
+void rfbTranslateCacheInvalidateRect(rfbScreenInfoPtr screen,
+                                     int x1, int y1, int x2, int y2);
+
+#endif
@@ -0,0 +1,338 @@
+/*
+ * workerpool.c - a fixed number of threads working off a shared task queue.
+ *
+ * Used by the worker pool background mode (see rfbRunEventLoop()), where
+ * all per-client work is queued here instead of running on two dedicated
+ * threads per client.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#include <rfb/rfb.h>
+
+#ifdef LIBVNCSERVER_HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "workerpool.h"
+
+int
+rfbWorkerPoolDefaultSize(void)
+{
+    int n = 1;
+#ifdef WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    n = (int)info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return n > 0 ? n : 1;
+}
+
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+
+typedef struct rfbWorkerTask {
+    rfbWorkerProc proc;
+    void *data;
+    struct rfbWorkerTask *next;
+} rfbWorkerTask;
+
+struct rfbWorkerPool {
+    MUTEX(mutex);
+    COND(cond);
+    rfbWorkerTask *head, *tail;
+    rfbWorkerTask *freeTasks;
+    rfbBool stopping;
+    int threadCount;
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+    pthread_t *threads;
+#else
+    uintptr_t *threads;
+#endif
+};
+
+static THREAD_ROUTINE_RETURN_TYPE
+workerRun(void *data)
+{
+    rfbWorkerPool *pool = (rfbWorkerPool *)data;
+    rfbWorkerTask *task;
+    rfbWorkerProc proc;
+    void *arg;
+
+    while (1) {
+	LOCK(pool->mutex);
+	while (!pool->head && !pool->stopping)
+	    WAIT(pool->cond, pool->mutex);
+	task = pool->head;
+	if (!task) {
+	    /* stopping and nothing left to do */
+	    UNLOCK(pool->mutex);
+	    break;
+	}
+	pool->head = task->next;
+	if (!pool->head)
+	    pool->tail = NULL;
+	proc = task->proc;
+	arg = task->data;
+	task->next = pool->freeTasks;
+	pool->freeTasks = task;
+	UNLOCK(pool->mutex);
+
+	proc(arg);
+    }
+
+    return THREAD_ROUTINE_RETURN_VALUE;
+}
+
+rfbWorkerPool *
+rfbWorkerPoolCreate(int threads)
+{
+    rfbWorkerPool *pool;
+    int i;
+
+    if (threads <= 0)
+	threads = rfbWorkerPoolDefaultSize();
+
+    pool = (rfbWorkerPool *)calloc(sizeof(rfbWorkerPool), 1);
+    if (!pool)
+	return NULL;
+    pool->threads = calloc(sizeof(*pool->threads), threads);
+    if (!pool->threads) {
+	free(pool);
+	return NULL;
+    }
+
+    INIT_MUTEX(pool->mutex);
+    INIT_COND(pool->cond);
+
+    for (i = 0; i < threads; i++) {
+#ifdef LIBVNCSERVER_HAVE_LIBPTHREAD
+	if (pthread_create(&pool->threads[i], NULL, workerRun, pool) != 0)
+	    break;
+#else
+	pool->threads[i] = _beginthread(workerRun, 0, pool);
+	if (pool->threads[i] == (uintptr_t)-1)
+	    break;
+#endif
+    }
+    pool->threadCount = i;
+
+    if (pool->threadCount == 0) {
+	rfbErr("rfbWorkerPoolCreate: could not start any worker thread\n");
+	rfbWorkerPoolDestroy(pool);
+	return NULL;
+    }
+
+    return pool;
+}
+
+int
+rfbWorkerPoolSize(rfbWorkerPool *pool)
+{
+    return pool->threadCount;
+}
+
+rfbBool
+rfbWorkerPoolSubmit(rfbWorkerPool *pool, rfbWorkerProc proc, void *data)
+{
+    rfbWorkerTask *task;
+
+    LOCK(pool->mutex);
+    if (pool->stopping) {
+	UNLOCK(pool->mutex);
+	return FALSE;
+    }
+    task = pool->freeTasks;
+    if (task)
+	pool->freeTasks = task->next;
+    else if (!(task = (rfbWorkerTask *)malloc(sizeof(rfbWorkerTask)))) {
+	UNLOCK(pool->mutex);
+	return FALSE;
+    }
+    task->proc = proc;
+    task->data = data;
+    task->next = NULL;
+    if (pool->tail)
+	pool->tail->next = task;
+    else
+	pool->head = task;
+    pool->tail = task;
+    TSIGNAL(pool->cond);
+    UNLOCK(pool->mutex);
+
+    return TRUE;
+}
+
+/* One rfbWorkerPoolRun() call; freed by whoever drops the last reference,
+   since helper tasks may only get to run after the caller returned. */
+typedef struct rfbWorkerJob {
+    MUTEX(mutex);
+    COND(cond);
+    rfbWorkerIndexProc proc;
+    void *data;
+    int next, count, done;
+    int refs;
+} rfbWorkerJob;
+
+static void
+jobRelease(rfbWorkerJob *job)
+{
+    rfbBool last;
+
+    LOCK(job->mutex);
+    last = --job->refs == 0;
+    UNLOCK(job->mutex);
+    if (last) {
+	TINI_COND(job->cond);
+	TINI_MUTEX(job->mutex);
+	free(job);
+    }
+}
+
+static void
+jobWork(rfbWorkerJob *job)
+{
+    int i;
+
+    while (1) {
+	LOCK(job->mutex);
+	if (job->next >= job->count) {
+	    UNLOCK(job->mutex);
+	    return;
+	}
+	i = job->next++;
+	UNLOCK(job->mutex);
+
+	job->proc(job->data, i);
+
+	LOCK(job->mutex);
+	if (++job->done == job->count)
+	    TSIGNAL(job->cond);
+	UNLOCK(job->mutex);
+    }
+}
+
+static void
+jobHelper(void *data)
+{
+    rfbWorkerJob *job = (rfbWorkerJob *)data;
+
+    jobWork(job);
+    jobRelease(job);
+}
+
+void
+rfbWorkerPoolRun(rfbWorkerPool *pool, rfbWorkerIndexProc proc, void *data, int count)
+{
+    rfbWorkerJob *job;
+    int i, helpers;
+
+    if (!pool || count <= 1 ||
+	!(job = (rfbWorkerJob *)calloc(sizeof(rfbWorkerJob), 1))) {
+	for (i = 0; i < count; i++)
+	    proc(data, i);
+	return;
+    }
+
+    INIT_MUTEX(job->mutex);
+    INIT_COND(job->cond);
+    job->proc = proc;
+    job->data = data;
+    job->count = count;
+
+    helpers = count - 1 < pool->threadCount ? count - 1 : pool->threadCount;
+    job->refs = 1 + helpers;
+    for (i = 0; i < helpers; i++)
+	if (!rfbWorkerPoolSubmit(pool, jobHelper, job))
+	    jobRelease(job);
+
+    jobWork(job);
+
+    LOCK(job->mutex);
+    while (job->done < job->count)
+	WAIT(job->cond, job->mutex);
+    UNLOCK(job->mutex);
+    jobRelease(job);
+}
+
+void
+rfbWorkerPoolDestroy(rfbWorkerPool *pool)
+{
+    rfbWorkerTask *task;
+    int i;
+
+    if (!pool)
+	return;
+
+    LOCK(pool->mutex);
+    pool->stopping = TRUE;
+    /* TSIGNAL wakes a single waiter with pthreads */
+    for (i = 0; i < pool->threadCount; i++)
+	TSIGNAL(pool->cond);
+    UNLOCK(pool->mutex);
+
+    for (i = 0; i < pool->threadCount; i++)
+	THREAD_JOIN(pool->threads[i]);
+
+    while ((task = pool->freeTasks)) {
+	pool->freeTasks = task->next;
+	free(task);
+    }
+
+    TINI_COND(pool->cond);
+    TINI_MUTEX(pool->mutex);
+    free(pool->threads);
+    free(pool);
+}
+
+#else
+
+rfbWorkerPool *
+rfbWorkerPoolCreate(int threads)
+{
+    return NULL;
+}
+
+int
+rfbWorkerPoolSize(rfbWorkerPool *pool)
+{
+    return 0;
+}
+
+rfbBool
+rfbWorkerPoolSubmit(rfbWorkerPool *pool, rfbWorkerProc proc, void *data)
+{
+    return FALSE;
+}
+
+void
+rfbWorkerPoolRun(rfbWorkerPool *pool, rfbWorkerIndexProc proc, void *data, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+	proc(data, i);
+}
+
+void
+rfbWorkerPoolDestroy(rfbWorkerPool *pool)
+{
+}
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * workerpool.h - private interface to the shared worker thread pool.
+ */
+
+/*
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307,
+ *  USA.
+ */
+
+#ifndef RFB_WORKERPOOL_H
+#define RFB_WORKERPOOL_H
+
+#include <rfb/rfb.h>
+
+typedef void (*rfbWorkerProc)(void *data);
+
+typedef struct rfbWorkerPool rfbWorkerPool;
+
+/* number of online CPU cores, at least 1 */
+int rfbWorkerPoolDefaultSize(void);
+
+/* Returns NULL if threads are not available. threads <= 0 means one
+   worker per core. */
+rfbWorkerPool *rfbWorkerPoolCreate(int threads);
+int rfbWorkerPoolSize(rfbWorkerPool *pool);
+
+/* Queue proc(data) to run on one of the workers, in FIFO order. */
+rfbBool rfbWorkerPoolSubmit(rfbWorkerPool *pool, rfbWorkerProc proc, void *data);
+
+typedef void (*rfbWorkerIndexProc)(void *data, int index);
+
+/* Call proc(data, i) for every i from 0 to count-1, spread over the
+   workers and the calling thread, and return once all calls are done.
+   The caller works through whatever the workers have not picked up, so
+   this is safe to use from a worker thread as well. A NULL pool runs
+   everything on the calling thread. */
+void rfbWorkerPoolRun(rfbWorkerPool *pool, rfbWorkerIndexProc proc, void *data, int count);
+
+/* Runs the tasks still queued, then stops and frees the pool. */
+void rfbWorkerPoolDestroy(rfbWorkerPool *pool);
+
+#endif
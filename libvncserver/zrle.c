@@ -21,12 +21,19 @@
 /*
  * zrle.c
  *
- * Routines to implement Zlib Run-length Encoding (ZRLE).
+ * Routines to implement Zlib Run-length Encoding (ZRLE), and Tiled
+ * Run-length Encoding (TRLE), which sends the same tiles uncompressed.
  */
 
 #include "rfb/rfb.h"
 #include "private.h"
 #include "zrleoutstream.h"
+#include "zrlepalettehelper.h"
+#include "workerpool.h"
+
+/* With rfbScreenInfo::encodePool, the tiles of a rectangle are analysed
+   and run-length encoded in batches of this many per thread. */
+#define ZRLE_TILES_PER_THREAD 4
 
 
 #define GET_IMAGE_INTO_BUF(tx,ty,tw,th,buf)                                \
@@ -40,6 +47,14 @@
 
 #define EXTRA_ARGS , rfbClientPtr cl
 
+/* Encodes the tile at x, y into os; buf holds the tile's pixels in the
+   client's format on the way, zywrleBuf and paletteHelper its scratch
+   space. One per pixel format, from zrleencodetemplate.c. */
+typedef void (*zrleEncodeTileProc)(int x, int y, int w, int h,
+                                   zrleOutStream *os, void *buf,
+                                   int *zywrleBuf, void *paletteHelper,
+                                   rfbClientPtr cl);
+
 #define ENDIAN_LITTLE 0
 #define ENDIAN_BIG 1
 #define ENDIAN_NO 2
@@ -96,62 +111,202 @@
  * data.
  */
 
+#define ZRLE_BEFORE_BUF_SIZE (rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4)
+
 
 /*
- * rfbSendRectEncodingZRLE - send a given rectangle using ZRLE encoding.
+ * A tile encoded on the encode pool: its own pixel buffer, scratch space
+ * and output, which is compressed after all tiles of the batch are done.
  */
 
-rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
+typedef struct rfbZrleTile {
+  int x, y, w, h;
+  char beforeBuf[ZRLE_BEFORE_BUF_SIZE];
+  int zywrleBuf[rfbZRLETileWidth * rfbZRLETileHeight];
+  zrlePaletteHelper paletteHelper;
+  zrleOutStream *os;
+} rfbZrleTile;
+
+typedef struct rfbZrleEncoder {
+  rfbClientPtr cl;
+  zrleEncodeTileProc encodeTile;
+  int tileWidth;
+  rfbZrleTile **tiles;
+  int maxTiles;
+  int nTiles;
+} rfbZrleEncoder;
+
+static void
+zrleEncodeTileTask(void *data, int index)
+{
+  rfbZrleEncoder *enc = (rfbZrleEncoder *)data;
+  rfbZrleTile *tile = enc->tiles[index];
+  int tx, tw;
+
+  /* a ZRLE tile, or a row of TRLE tiles as wide as one */
+  tile->os->in.ptr = tile->os->in.start;
+  for (tx = tile->x; tx < tile->x + tile->w; tx += enc->tileWidth) {
+    tw = enc->tileWidth;
+    if (tw > tile->x + tile->w - tx) tw = tile->x + tile->w - tx;
+    enc->encodeTile(tx, tile->y, tw, tile->h, tile->os,
+                    tile->beforeBuf, tile->zywrleBuf, &tile->paletteHelper,
+                    enc->cl);
+  }
+}
+
+/* Encode the queued tiles, then feed them to the client's stream in
+   order. zlib's output does not depend on how its input is split up, so
+   the result is the same as when the tiles are encoded one by one. */
+
+static void
+zrleFlushTiles(rfbZrleEncoder *enc, zrleOutStream *zos)
 {
-  zrleOutStream* zos;
-  rfbFramebufferUpdateRectHeader rect;
-  rfbZRLEHeader hdr;
   int i;
-  char *zrleBeforeBuf;
 
-  if (cl->zrleBeforeBuf == NULL) {
-	cl->zrleBeforeBuf = (char *) malloc(rfbZRLETileWidth * rfbZRLETileHeight * 4 + 4);
+  rfbWorkerPoolRun(enc->nTiles > 1 ? enc->cl->screen->encodePool : NULL,
+                   zrleEncodeTileTask, enc, enc->nTiles);
+  for (i = 0; i < enc->nTiles; i++)
+    zrleOutStreamWriteBytes(zos, enc->tiles[i]->os->in.start,
+                            ZRLE_BUFFER_LENGTH(&enc->tiles[i]->os->in));
+  enc->nTiles = 0;
+}
+
+static rfbZrleEncoder *
+zrleGetEncoder(rfbClientPtr cl)
+{
+  rfbZrleEncoder *enc = cl->zrleEncoder;
+  int i, maxTiles;
+
+  if (enc)
+    return enc;
+
+  maxTiles = ZRLE_TILES_PER_THREAD *
+    (rfbWorkerPoolSize(cl->screen->encodePool) + 1);
+  enc = (rfbZrleEncoder *)calloc(sizeof(rfbZrleEncoder), 1);
+  if (enc)
+    enc->tiles = (rfbZrleTile **)calloc(sizeof(rfbZrleTile *), maxTiles);
+  if (!enc || !enc->tiles) {
+    free(enc);
+    return NULL;
+  }
+  enc->cl = cl;
+  enc->maxTiles = maxTiles;
+  for (i = 0; i < maxTiles; i++) {
+    enc->tiles[i] = (rfbZrleTile *)calloc(sizeof(rfbZrleTile), 1);
+    if (!enc->tiles[i] || !(enc->tiles[i]->os = zrleOutStreamNewBuffer())) {
+      /* use as many as there are */
+      free(enc->tiles[i]);
+      enc->tiles[i] = NULL;
+      enc->maxTiles = i;
+      break;
+    }
   }
-  zrleBeforeBuf = cl->zrleBeforeBuf;
+  cl->zrleEncoder = enc;
+  return enc;
+}
 
-  if (cl->preferredEncoding == rfbEncodingZYWRLE) {
-	  if (cl->tightQualityLevel < 0) {
-		  cl->zywrleLevel = 1;
-	  } else if (cl->tightQualityLevel < 3) {
-		  cl->zywrleLevel = 3;
-	  } else if (cl->tightQualityLevel < 6) {
-		  cl->zywrleLevel = 2;
-	  } else {
-		  cl->zywrleLevel = 1;
-	  }
-  } else
-	  cl->zywrleLevel = 0;
+static void
+zrleFreeEncoder(rfbClientPtr cl)
+{
+  rfbZrleEncoder *enc = cl->zrleEncoder;
+  int i;
+
+  if (!enc)
+    return;
+  for (i = 0; i < enc->maxTiles; i++) {
+    zrleOutStreamFree(enc->tiles[i]->os);
+    free(enc->tiles[i]);
+  }
+  free(enc->tiles);
+  free(enc);
+  cl->zrleEncoder = NULL;
+}
+
+/*
+ * Encode the tiles of a rectangle into zos, tileWidth by tileHeight
+ * pixels each. Without an encode pool they are encoded one by one; with
+ * one, the tiles are encoded in batches, each into a buffer of its own.
+ * Tiles smaller than ZRLE's are batched by the row of as many as fit
+ * into one of ZRLE's, so that each task still has enough to do.
+ */
+
+static void
+zrleEncodeRect(rfbClientPtr cl, int x, int y, int w, int h,
+               zrleOutStream *zos, zrleEncodeTileProc encodeTile,
+               int tileWidth, int tileHeight)
+{
+  rfbZrleEncoder *enc = NULL;
+  rfbZrleTile *tile;
+  int tx, ty, tw, th, taskWidth;
+
+  if (cl->screen->encodePool && (w > tileWidth || h > tileHeight))
+    enc = zrleGetEncoder(cl);
+  if (enc && enc->maxTiles < 2)
+    enc = NULL;
+
+  if (!enc && cl->paletteHelper == NULL)
+    cl->paletteHelper = (void *) calloc(sizeof(zrlePaletteHelper), 1);
+
+  taskWidth = enc ? rfbZRLETileWidth / tileWidth * tileWidth : tileWidth;
+
+  for (ty = y; ty < y+h; ty += tileHeight) {
+    th = tileHeight;
+    if (th > y+h-ty) th = y+h-ty;
+    for (tx = x; tx < x+w; tx += taskWidth) {
+      tw = taskWidth;
+      if (tw > x+w-tx) tw = x+w-tx;
+
+      if (!enc) {
+        encodeTile(tx, ty, tw, th, zos, cl->zrleBeforeBuf, cl->zywrleBuf,
+                   cl->paletteHelper, cl);
+        continue;
+      }
+
+      tile = enc->tiles[enc->nTiles++];
+      tile->x = tx;
+      tile->y = ty;
+      tile->w = tw;
+      tile->h = th;
+      if (enc->nTiles == enc->maxTiles) {
+        enc->encodeTile = encodeTile;
+        enc->tileWidth = tileWidth;
+        zrleFlushTiles(enc, zos);
+      }
+    }
+  }
+
+  if (enc && enc->nTiles > 0) {
+    enc->encodeTile = encodeTile;
+    enc->tileWidth = tileWidth;
+    zrleFlushTiles(enc, zos);
+  }
+}
 
-  if (!cl->zrleData)
-    cl->zrleData = zrleOutStreamNew();
-  zos = cl->zrleData;
-  zos->in.ptr = zos->in.start;
-  zos->out.ptr = zos->out.start;
 
+/*
+ * The tile encoder for the client's pixel format, NULL if there is none.
+ */
+
+static zrleEncodeTileProc
+zrleTileProc(rfbClientPtr cl)
+{
   switch (cl->format.bitsPerPixel) {
 
   case 8:
-    zrleEncode8NE(x, y, w, h, zos, zrleBeforeBuf, cl);
-    break;
+    return zrleEncode8NE;
 
   case 16:
 	if (cl->format.greenMax > 0x1F) {
 		if (cl->format.bigEndian)
-		  zrleEncode16BE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		  return zrleEncode16BE;
 		else
-		  zrleEncode16LE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		  return zrleEncode16LE;
 	} else {
 		if (cl->format.bigEndian)
-		  zrleEncode15BE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		  return zrleEncode15BE;
 		else
-		  zrleEncode15LE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		  return zrleEncode15LE;
 	}
-    break;
 
   case 32: {
     rfbBool fitsInLS3Bytes
@@ -166,27 +321,70 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
     if ((fitsInLS3Bytes && !cl->format.bigEndian) ||
         (fitsInMS3Bytes && cl->format.bigEndian)) {
 	if (cl->format.bigEndian)
-		zrleEncode24ABE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		return zrleEncode24ABE;
 	else
-		zrleEncode24ALE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		return zrleEncode24ALE;
     }
     else if ((fitsInLS3Bytes && cl->format.bigEndian) ||
              (fitsInMS3Bytes && !cl->format.bigEndian)) {
 	if (cl->format.bigEndian)
-		zrleEncode24BBE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		return zrleEncode24BBE;
 	else
-		zrleEncode24BLE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		return zrleEncode24BLE;
     }
     else {
 	if (cl->format.bigEndian)
-		zrleEncode32BE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		return zrleEncode32BE;
 	else
-		zrleEncode32LE(x, y, w, h, zos, zrleBeforeBuf, cl);
+		return zrleEncode32LE;
     }
   }
-    break;
   }
 
+  return NULL;
+}
+
+
+/*
+ * rfbSendRectEncodingZRLE - send a given rectangle using ZRLE encoding.
+ */
+
+rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
+{
+  zrleOutStream* zos;
+  rfbFramebufferUpdateRectHeader rect;
+  rfbZRLEHeader hdr;
+  zrleEncodeTileProc encodeTile = NULL;
+
+  if (cl->zrleBeforeBuf == NULL) {
+	cl->zrleBeforeBuf = (char *) malloc(ZRLE_BEFORE_BUF_SIZE);
+  }
+
+  if (cl->preferredEncoding == rfbEncodingZYWRLE) {
+	  if (cl->tightQualityLevel < 0) {
+		  cl->zywrleLevel = 1;
+	  } else if (cl->tightQualityLevel < 3) {
+		  cl->zywrleLevel = 3;
+	  } else if (cl->tightQualityLevel < 6) {
+		  cl->zywrleLevel = 2;
+	  } else {
+		  cl->zywrleLevel = 1;
+	  }
+  } else
+	  cl->zywrleLevel = 0;
+
+  if (!cl->zrleData)
+    cl->zrleData = zrleOutStreamNew();
+  zos = cl->zrleData;
+  zos->in.ptr = zos->in.start;
+  zos->out.ptr = zos->out.start;
+
+  encodeTile = zrleTileProc(cl);
+  if (encodeTile)
+    zrleEncodeRect(cl, x, y, w, h, zos, encodeTile,
+                   rfbZRLETileWidth, rfbZRLETileHeight);
+  zrleOutStreamFlush(zos);
+
   rfbStatRecordEncodingSent(cl, rfbEncodingZRLE, sz_rfbFramebufferUpdateRectHeader + sz_rfbZRLEHeader + ZRLE_BUFFER_LENGTH(&zos->out),
       + w * (cl->format.bitsPerPixel / 8) * h);
 
@@ -212,26 +410,71 @@ rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w, int h)
   memcpy(cl->updateBuf+cl->ublen, (char *)&hdr, sz_rfbZRLEHeader);
   cl->ublen += sz_rfbZRLEHeader;
 
-  /* copy into updateBuf and send from there.  Maybe should send directly? */
+  if (cl->ublen + ZRLE_BUFFER_LENGTH(&zos->out) > UPDATE_BUF_SIZE)
+    return rfbSendUpdateData(cl, (char *)zos->out.start, ZRLE_BUFFER_LENGTH(&zos->out));
 
-  for (i = 0; i < ZRLE_BUFFER_LENGTH(&zos->out);) {
+  memcpy(cl->updateBuf+cl->ublen, (uint8_t*)zos->out.start, ZRLE_BUFFER_LENGTH(&zos->out));
+  cl->ublen += ZRLE_BUFFER_LENGTH(&zos->out);
 
-    int bytesToCopy = UPDATE_BUF_SIZE - cl->ublen;
+  return TRUE;
+}
 
-    if (i + bytesToCopy > ZRLE_BUFFER_LENGTH(&zos->out)) {
-      bytesToCopy = ZRLE_BUFFER_LENGTH(&zos->out) - i;
-    }
 
-    memcpy(cl->updateBuf+cl->ublen, (uint8_t*)zos->out.start + i, bytesToCopy);
+/*
+ * rfbSendRectEncodingTRLE - send a given rectangle using TRLE encoding,
+ * ZRLE's tiles at 16x16 pixels without the zlib stream around them.
+ */
 
-    cl->ublen += bytesToCopy;
-    i += bytesToCopy;
+rfbBool rfbSendRectEncodingTRLE(rfbClientPtr cl, int x, int y, int w, int h)
+{
+  zrleOutStream* os;
+  rfbFramebufferUpdateRectHeader rect;
+  zrleEncodeTileProc encodeTile;
 
-    if (cl->ublen == UPDATE_BUF_SIZE) {
+  if (cl->zrleBeforeBuf == NULL) {
+	cl->zrleBeforeBuf = (char *) malloc(ZRLE_BEFORE_BUF_SIZE);
+  }
+  cl->zywrleLevel = 0;
+
+  if (!cl->trleData)
+    cl->trleData = zrleOutStreamNewBuffer();
+  os = cl->trleData;
+  if (!cl->zrleBeforeBuf || !os) {
+    rfbErr("rfbSendRectEncodingTRLE: out of memory\n");
+    return FALSE;
+  }
+  os->in.ptr = os->in.start;
+
+  encodeTile = zrleTileProc(cl);
+  if (encodeTile)
+    zrleEncodeRect(cl, x, y, w, h, os, encodeTile,
+                   rfbTRLETileWidth, rfbTRLETileHeight);
+
+  rfbStatRecordEncodingSent(cl, rfbEncodingTRLE, sz_rfbFramebufferUpdateRectHeader + ZRLE_BUFFER_LENGTH(&os->in),
+      + w * (cl->format.bitsPerPixel / 8) * h);
+
+  if (cl->ublen + sz_rfbFramebufferUpdateRectHeader > UPDATE_BUF_SIZE)
+    {
       if (!rfbSendUpdateBuf(cl))
         return FALSE;
     }
-  }
+
+  rect.r.x = Swap16IfLE(x);
+  rect.r.y = Swap16IfLE(y);
+  rect.r.w = Swap16IfLE(w);
+  rect.r.h = Swap16IfLE(h);
+  rect.encoding = Swap32IfLE(rfbEncodingTRLE);
+
+  memcpy(cl->updateBuf+cl->ublen, (char *)&rect,
+         sz_rfbFramebufferUpdateRectHeader);
+  cl->ublen += sz_rfbFramebufferUpdateRectHeader;
+
+  /* no length, the client finds the end of the tiles by decoding them */
+  if (cl->ublen + ZRLE_BUFFER_LENGTH(&os->in) > UPDATE_BUF_SIZE)
+    return rfbSendUpdateData(cl, (char *)os->in.start, ZRLE_BUFFER_LENGTH(&os->in));
+
+  memcpy(cl->updateBuf+cl->ublen, (uint8_t*)os->in.start, ZRLE_BUFFER_LENGTH(&os->in));
+  cl->ublen += ZRLE_BUFFER_LENGTH(&os->in);
 
   return TRUE;
 }
@@ -244,6 +487,11 @@ void rfbFreeZrleData(rfbClientPtr cl)
 	}
 	cl->zrleData = NULL;
 
+	if (cl->trleData) {
+		zrleOutStreamFree(cl->trleData);
+	}
+	cl->trleData = NULL;
+
 	if (cl->zrleBeforeBuf) {
 		free(cl->zrleBeforeBuf);
 	}
@@ -253,5 +501,7 @@ void rfbFreeZrleData(rfbClientPtr cl)
 		free(cl->paletteHelper);
 	}
 	cl->paletteHelper = NULL;
+
+	zrleFreeEncoder(cl);
 }
 
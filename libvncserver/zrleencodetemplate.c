@@ -24,15 +24,12 @@
  * BPP should be 8, 16 or 32 depending on the bits per pixel.
  * GET_IMAGE_INTO_BUF should be some code which gets a rectangle of pixel data
  * into the given buffer.  EXTRA_ARGS can be defined to pass any other
- * arguments needed by GET_IMAGE_INTO_BUF.
- *
- * Note that the buf argument to ZRLE_ENCODE needs to be at least one pixel
- * bigger than the largest tile of pixel data, since the ZRLE encoding
- * algorithm writes to the position one past the end of the pixel data.
+ * arguments needed by GET_IMAGE_INTO_BUF; it must include the client cl.
  */
 
 #include "zrleoutstream.h"
 #include "zrlepalettehelper.h"
+#include "simd.h"
 #include <assert.h>
 
 /* __RFB_CONCAT2 concatenates its two arguments.  __RFB_CONCAT2E does the same
@@ -77,6 +74,19 @@
 #define BPPOUT BPP
 #endif
 
+#undef SPAN_EQUAL
+#undef RUN_STARTS
+#if BPP==8
+#define SPAN_EQUAL(k,p,n,pix) (k)->spanEqual8((const uint8_t*)(p),n,pix,0xff)
+#define RUN_STARTS(k,p,n,bits,singles) (k)->runStarts8((const uint8_t*)(p),n,bits,singles)
+#elif BPP==15 || BPP==16
+#define SPAN_EQUAL(k,p,n,pix) (k)->spanEqual16((const uint16_t*)(p),n,pix,0xffff)
+#define RUN_STARTS(k,p,n,bits,singles) (k)->runStarts16((const uint16_t*)(p),n,bits,singles)
+#else
+#define SPAN_EQUAL(k,p,n,pix) (k)->spanEqual32((const uint32_t*)(p),n,pix,0xffffffff)
+#define RUN_STARTS(k,p,n,bits,singles) (k)->runStarts32((const uint32_t*)(p),n,bits,singles)
+#endif
+
 #ifndef ZRLE_ONCE
 #define ZRLE_ONCE
 
@@ -91,33 +101,24 @@ void ZRLE_ENCODE_TILE (PIXEL_T* data, int w, int h, zrleOutStream* os,
 
 #if BPP!=8
 #define ZYWRLE_ENCODE
+#ifndef ZYWRLE_HARR_PAIRS
+#define ZYWRLE_HARR_PAIRS(x0,x1,n,stride) rfbSimd()->zywrleHarr(x0,x1,n,stride)
+#endif
 #include "zywrletemplate.c"
 #endif
 
+/* Encode the tile at x, y into os, see zrleEncodeTileProc in zrle.c. */
+
 static void ZRLE_ENCODE (int x, int y, int w, int h,
-		  zrleOutStream* os, void* buf
+		  zrleOutStream* os, void* buf, int *zywrleBuf,
+		  void *paletteHelper
                   EXTRA_ARGS
                   )
 {
-  int ty;
-  for (ty = y; ty < y+h; ty += rfbZRLETileHeight) {
-    int tx, th = rfbZRLETileHeight;
-    if (th > y+h-ty) th = y+h-ty;
-    for (tx = x; tx < x+w; tx += rfbZRLETileWidth) {
-      int tw = rfbZRLETileWidth;
-      if (tw > x+w-tx) tw = x+w-tx;
-
-      GET_IMAGE_INTO_BUF(tx,ty,tw,th,buf);
-
-      if (cl->paletteHelper == NULL) {
-          cl->paletteHelper = (void *) calloc(sizeof(zrlePaletteHelper), 1);
-      }
+  GET_IMAGE_INTO_BUF(x,y,w,h,buf);
 
-      ZRLE_ENCODE_TILE((PIXEL_T*)buf, tw, th, os,
-		      cl->zywrleLevel, cl->zywrleBuf, cl->paletteHelper);
-    }
-  }
-  zrleOutStreamFlush(os);
+  ZRLE_ENCODE_TILE((PIXEL_T*)buf, w, h, os,
+		  cl->zywrleLevel, zywrleBuf, paletteHelper);
 }
 
 
@@ -126,6 +127,7 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
 {
   /* First find the palette and the number of runs */
 
+  const rfbSimdKernels *simd = rfbSimd();
   zrlePaletteHelper *ph;
 
   int runs = 0;
@@ -138,22 +140,32 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
   int plainRleBytes;
   int i;
 
-  PIXEL_T* ptr = data;
-  PIXEL_T* end = ptr + h * w;
-  *end = ~*(end-1); /* one past the end is different so the while loop ends */
+  uint32_t starts[(rfbZRLETileWidth * rfbZRLETileHeight + 31) / 32];
+  uint32_t word;
+  PIXEL_T* ptr;
+  PIXEL_T last, prev;
+
+  assert(w * h <= rfbZRLETileWidth * rfbZRLETileHeight);
+  runs = RUN_STARTS(simd, data, w * h, starts, &singlePixels) - singlePixels;
 
   ph = (zrlePaletteHelper *) paletteHelper;
   zrlePaletteHelperInit(ph);
 
-  while (ptr < end) {
-    PIXEL_T pix = *ptr;
-    if (*++ptr != pix) {
-      singlePixels++;
-    } else {
-      while (*++ptr == pix) ;
-      runs++;
+  /* Every run adds its pixel to the palette. A run's pixel is never that
+     of the run before, but often that of the one before that, as in text;
+     it is in the palette already then. At the maximum size any pixel
+     makes the palette overflow, and after that nothing changes. */
+  last = prev = data[0];
+  zrlePaletteHelperInsert(ph, data[0]);
+  for (i = 0; i < (w * h + 31) / 32 && ph->size <= ZRLE_PALETTE_MAX_SIZE; i++) {
+    word = i == 0 ? starts[0] & ~1u : starts[i];
+    for (; word; word &= word - 1) {
+      ptr = data + i * 32 + rfbSimdLowestBit(word);
+      if (*ptr != prev || ph->size == ZRLE_PALETTE_MAX_SIZE)
+        zrlePaletteHelperInsert(ph, *ptr);
+      prev = last;
+      last = *ptr;
     }
-    zrlePaletteHelperInsert(ph, pix);
   }
 
   /* Solid tile is a special case */
@@ -225,8 +237,7 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
       int len;
       runStart = ptr;
       pix = *ptr++;
-      while (*ptr == pix && ptr < end)
-        ptr++;
+      ptr += SPAN_EQUAL(simd, ptr, end - ptr, pix);
       len = ptr - runStart;
       if (len <= 2 && usePalette) {
         int index = zrlePaletteHelperLookup(ph, pix);
@@ -313,4 +324,6 @@ void ZRLE_ENCODE_TILE(PIXEL_T* data, int w, int h, zrleOutStream* os,
 #undef ZRLE_ENCODE
 #undef ZRLE_ENCODE_TILE
 #undef ZYWRLE_ENCODE_TILE
+#undef SPAN_EQUAL
+#undef RUN_STARTS
 #undef BPPOUT
@@ -90,13 +90,38 @@ zrleOutStream *zrleOutStreamNew(void)
     free(os);
     return NULL;
   }
+  os->deflating = TRUE;
+
+  return os;
+}
+
+/*
+ * A stream for one tile encoded apart from the others. It does not
+ * compress; what is written grows os->in, to be written to the client's
+ * stream later.
+ */
+
+zrleOutStream *zrleOutStreamNewBuffer(void)
+{
+  zrleOutStream *os;
+
+  os = calloc(sizeof(zrleOutStream), 1);
+  if (os == NULL)
+    return NULL;
+
+  if (!zrleBufferAlloc(&os->in, ZRLE_IN_BUFFER_SIZE)) {
+    free(os);
+    return NULL;
+  }
+  os->deflating = FALSE;
 
   return os;
 }
 
 void zrleOutStreamFree (zrleOutStream *os)
 {
-  deflateEnd(&os->zs);
+  if (os->deflating)
+    deflateEnd(&os->zs);
   zrleBufferFree(&os->in);
   zrleBufferFree(&os->out);
   free(os);
@@ -155,6 +180,15 @@ static int zrleOutStreamOverrun(zrleOutStream *os,
   rfbLog("zrleOutStreamOverrun\n");
 #endif
 
+  if (!os->deflating) {
+    if (!zrleBufferGrow(&os->in, size > os->in.end - os->in.start ?
+			size : os->in.end - os->in.start)) {
+      rfbLog("zrleOutStreamOverrun: failed to grow input buffer\n");
+      return 0;
+    }
+    return size;
+  }
+
   while (os->in.end - os->in.ptr < size && os->in.ptr > os->in.start) {
     os->zs.next_in = os->in.start;
     os->zs.avail_in = ZRLE_BUFFER_LENGTH (&os->in);
@@ -36,11 +36,14 @@ typedef struct {
   zrleBuffer out;
 
   z_stream   zs;
+  /* FALSE for a stream that only collects what is written in in */
+  rfbBool    deflating;
 } zrleOutStream;
 
 #define ZRLE_BUFFER_LENGTH(b) ((b)->ptr - (b)->start)
 
 zrleOutStream *zrleOutStreamNew           (void);
+zrleOutStream *zrleOutStreamNewBuffer     (void);
 void           zrleOutStreamFree          (zrleOutStream *os);
 rfbBool        zrleOutStreamFlush         (zrleOutStream *os);
 void           zrleOutStreamWriteBytes    (zrleOutStream *os,
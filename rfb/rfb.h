@@ -361,6 +361,108 @@ typedef struct _rfbScreenInfo
 	It is set to 0.5 per default. */
     float fdQuota;
 
+    /** Private state of the socket event backend (epoll with a select()
+	fallback), see rfbCheckFds() and rfbProcessEvents(). */
+    struct rfbPollContext *pollContext;
+
+    /** Number of worker threads used when rfbRunEventLoop() runs in the
+	background. 0 (the default) keeps the classic mode with an input and
+	an output thread per client, a negative value starts one worker per
+	CPU core. */
+    int backgroundWorkers;
+    /** Private state of the worker pool background mode. */
+    struct rfbBackgroundPool *backgroundPool;
+
+    /** Bytes of encoded rectangles kept to be sent again to other clients
+	with the same pixel format and encoding settings, see
+	libvncserver/encodecache.c. 0 (the default) disables the cache; set
+	it before rfbInitServer(). */
+    int encodeCacheSize;
+    struct rfbEncodeCache *encodeCache;
+
+    /** Updates covering at most this many pixels are sent without waiting
+	for deferUpdateTime to pass; 0 always defers. */
+    int deferUpdateSmallArea;
+    /** Send a deferred update early once no new damage came in for this
+	many milliseconds; 0 always waits the full deferUpdateTime. Only
+	has an effect when below deferUpdateTime. */
+    int deferUpdateQuietTime;
+
+    /** When > 0, writes to clients never block: output the socket does
+	not take right away is queued, and no new framebuffer updates are
+	encoded for a client while this many bytes or more are waiting, so
+	a slow client gets fewer, coarser updates instead of stalling the
+	server. A client that takes nothing for maxClientWait is closed.
+	0 (the default) keeps the blocking writes. */
+    int sendQueueSize;
+
+    /** Keep a shadow copy of the framebuffer and let rfbMarkRectAsModified()
+	and rfbMarkRegionAsModified() pass on only the tiles that really
+	differ from it, see libvncserver/damage.c. Meant for integrations that
+	mark the whole screen every frame. Set it before rfbInitServer(). */
+    rfbBool detectDamage;
+    /** Threads comparing large areas for detectDamage: 0 (the default) is
+	one per core, 1 compares on the calling thread only. */
+    int damageThreads;
+    struct rfbDamageDetector *damageDetector;
+    /** Framebuffer bytes compared against the shadow copy so far, and how
+	many of them were in tiles that had changed. */
+    uint64_t damageBytesScanned;
+    uint64_t damageBytesChanged;
+
+    /** With detectDamage, also look for marked areas whose content moved up
+	or down, as when scrolling, and send them with CopyRect like
+	rfbScheduleCopyRegion() does. */
+    rfbBool detectMoves;
+    /** Framebuffer bytes sent as a copy because detectMoves found them. */
+    uint64_t damageBytesMoved;
+
+    /** Remember a hash of every 32x32 tile each client was sent, and leave
+	tiles out of updates when the client already has the same pixels
+	there, see libvncserver/tilehash.c. Costs 16 bytes per tile and
+	client. */
+    rfbBool clientTileHashes;
+
+    /** Threads sharing the encoding of large updates: the subrectangles
+	of Tight, the tiles of ZRLE, ZYWRLE and TRLE, and the rectangles or
+	stripes of Raw, RRE, CoRRE, Hextile and Ultra. 0 (the default) and
+	1 encode on the thread sending the update only, a negative value
+	uses one per CPU core. Set it before rfbInitServer(). */
+    int encodeThreads;
+    struct rfbWorkerPool *encodePool;
+
+    /** Let Tight lower the JPEG quality for clients on slow links, use
+	JPEG only for subrectangles that look like photos, and send what
+	went out lossy again without loss once the damage stops, see
+	libvncserver/adaptive.c. Only affects clients that enabled JPEG;
+	their quality level is the most that is used. */
+    rfbBool adaptiveTight;
+    /** With adaptiveTight, refine lossy areas once no damage came in for
+	this many milliseconds; 0 never refines. */
+    int adaptiveRefineDelay;
+
+    /** Clients with the same pixel format, other than the server's, share
+	one translated copy of the framebuffer that is brought up to date
+	where it changed when the first of them needs it, see
+	libvncserver/translatecache.c. Costs a framebuffer of memory per
+	pixel format. Set it before rfbInitServer(). */
+    rfbBool shareTranslation;
+    struct rfbTranslateCaches *translateCaches;
+
+    /** Scaled screens only: where the framebuffer changed since this
+	copy was last scaled. It is rescaled there when an update for one of
+	its clients is sent, see libvncserver/scale.c. */
+    struct sraRegion *scaledDirtyRegion;
+#if defined(LIBVNCSERVER_HAVE_LIBPTHREAD) || defined(LIBVNCSERVER_HAVE_WIN32THREADS)
+    MUTEX(scaledDirtyMutex);
+#endif
+
+    /** Clients without cursor shape updates get the cursor composited into
+	their pixels as they are encoded instead of drawn into frameBuffer
+	and removed again, so the framebuffer stays untouched and encoding
+	for several clients does not wait on cursorMutex. Tight clients and
+	scaled ones still get it drawn. */
+    rfbBool compositeCursor;
 } rfbScreenInfo, *rfbScreenInfoPtr;
 
 
@@ -680,6 +782,62 @@ typedef struct _rfbClientRec {
     rfbBool useExtDesktopSize;
     int requestedDesktopSizeChange;
     int lastDesktopSizeChangeError;
+
+    /** Set while the client is queued on the screen's list of clients with
+	pending input, output or deferred work, so rfbProcessEvents() does not
+	have to visit idle clients. */
+    rfbBool pollPending;
+    /** Set while a task for this client is queued or running in the worker
+	pool background mode; guarded by updateMutex. */
+    rfbBool workerBusy;
+    /** Where rfbSendUpdateBuf() copies the rectangle being encoded to while
+	it is recorded for the encoded rectangle cache. */
+    struct rfbEncodeCapture *encodeCapture;
+    /** Reset the Tight zlib streams for every rectangle, so the bytes do
+	not depend on what this client was sent before. */
+    rfbBool tightResetStreams;
+    /** When the framebuffer was last changed inside modifiedRegion or
+	copyRegion, see deferUpdateQuietTime. */
+    struct timeval lastDamage;
+    /** Output rfbWriteExact() could not write yet, see sendQueueSize;
+	guarded by outputMutex. */
+    struct rfbSendQueue *sendQueue;
+    /** Which socket events the event backend reports for this client,
+	see libvncserver/rfbpoll.c. */
+    int pollInterest;
+    /** What the framebuffer update being sent consists of so far, see
+	rfbBeginOutputBatch(). */
+    struct rfbOutputBatch *outputBatch;
+    /** Hashes of the tiles this client has, see clientTileHashes; guarded
+	by updateMutex. */
+    struct rfbTileHashes *tileHashes;
+    /** Framebuffer bytes, in the client's pixel format, that were left out
+	of updates because the client already had them. */
+    uint64_t tileBytesSuppressed;
+    /** Buffers and palettes of the Tight encoder, one set per subrectangle
+	encoded at the same time, see libvncserver/tight.c. */
+    struct rfbTightEncoder *tightEncoder;
+    /** Link throughput and lossy areas of this client for adaptiveTight,
+	see libvncserver/adaptive.c; guarded by updateMutex. */
+    struct rfbAdaptiveState *adaptive;
+    /** Tiles of ZRLE and ZYWRLE encoded at the same time on the encode
+	pool, see libvncserver/zrle.c. */
+    struct rfbZrleEncoder *zrleEncoder;
+    /** The tiles of the TRLE rectangle being sent, see
+	libvncserver/zrle.c. */
+    void* trleData;
+    /** Clients encoding rectangles of this one's updates on the encode
+	pool, see libvncserver/parallelrects.c. */
+    struct rfbParallelRects *parallelRects;
+    /** Set on those: the task whose buffer rfbSendUpdateBuf() appends to
+	instead of writing. */
+    struct rfbParallelTask *parallelTask;
+    /** The translated framebuffer this client shares with shareTranslation;
+	translateLookupTable points to it as well then. */
+    struct rfbTranslateCache *translateCache;
+    /** The cursor composited into this client's pixels during an update
+	with compositeCursor. */
+    struct rfbCursorOverlay *cursorOverlay;
 } rfbClientRec, *rfbClientPtr;
 
 /**
@@ -734,6 +892,12 @@ extern int rfbReadExact(rfbClientPtr cl, char *buf, int len);
 extern int rfbReadExactTimeout(rfbClientPtr cl, char *buf, int len,int timeout);
 extern int rfbPeekExactTimeout(rfbClientPtr cl, char *buf, int len,int timeout);
 extern int rfbWriteExact(rfbClientPtr cl, const char *buf, int len);
+extern int rfbSendQueueLength(rfbClientPtr cl);
+extern rfbBool rfbSendQueueFull(rfbClientPtr cl);
+extern int rfbFlushSendQueue(rfbClientPtr cl, int timeout);
+extern void rfbBeginOutputBatch(rfbClientPtr cl);
+extern int rfbWriteBatched(rfbClientPtr cl, const char *buf, int len, rfbBool copy);
+extern int rfbEndOutputBatch(rfbClientPtr cl);
 extern int rfbCheckFds(rfbScreenInfoPtr rfbScreen,long usec);
 extern rfbSocket rfbConnect(rfbScreenInfoPtr rfbScreen, char* host, int port);
 extern rfbSocket rfbConnectToTcpAddr(char* host, int port);
@@ -778,6 +942,8 @@ extern void rfbProcessUDPInput(rfbScreenInfoPtr rfbScreen);
 extern rfbBool rfbSendFramebufferUpdate(rfbClientPtr cl, sraRegionPtr updateRegion);
 extern rfbBool rfbSendRectEncodingRaw(rfbClientPtr cl, int x,int y,int w,int h);
 extern rfbBool rfbSendUpdateBuf(rfbClientPtr cl);
+extern rfbBool rfbSendUpdateData(rfbClientPtr cl, const char *buf, int len);
+extern rfbBool rfbSendUpdateDataRef(rfbClientPtr cl, const char *buf, int len);
 extern void rfbSendServerCutText(rfbScreenInfoPtr rfbScreen,char *str, int len);
 extern rfbBool rfbSendCopyRegion(rfbClientPtr cl,sraRegionPtr reg,int dx,int dy);
 extern rfbBool rfbSendLastRectMarker(rfbClientPtr cl);
@@ -924,6 +1090,7 @@ extern void rfbDefaultPtrAddEvent(int buttonMask,int x,int y,rfbClientPtr cl);
 /* zrle.c */
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 extern rfbBool rfbSendRectEncodingZRLE(rfbClientPtr cl, int x, int y, int w,int h);
+extern rfbBool rfbSendRectEncodingTRLE(rfbClientPtr cl, int x, int y, int w,int h);
 #endif
 
 /* stats.c */
@@ -939,6 +939,15 @@ typedef struct {
 #define rfbZRLETileHeight 64
 
 
+/*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+ * TRLE - the tiles of ZRLE at 16x16 pixels, without zlib and without a
+ * length: they follow the rectangle header directly.
+ */
+
+#define rfbTRLETileWidth 16
+#define rfbTRLETileHeight 16
+
+
 /*- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
  * ZLIBHEX - zlib compressed Hextile Encoding.  Essentially, this is the
  * hextile encoding with zlib compression on the tiles that can not be
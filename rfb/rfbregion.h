@@ -41,11 +41,7 @@ extern sraRegion *sraRgnBBox(const sraRegion *src);
 
 /* -=- rectangle iterator */
 
-typedef struct sraRectangleIterator {
-  rfbBool reverseX,reverseY;
-  int ptrSize,ptrPos;
-  struct sraSpan** sPtrs;
-} sraRectangleIterator;
+typedef struct sraRectangleIterator sraRectangleIterator;
 
 extern sraRectangleIterator *sraRgnGetIterator(sraRegion *s);
 extern sraRectangleIterator *sraRgnGetReverseIterator(sraRegion *s,rfbBool reverseX,rfbBool reverseY);
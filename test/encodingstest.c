@@ -27,6 +27,7 @@ static encoding_t testEncodings[]={
 	{ rfbEncodingZlibHex, "zlibhex" },
 	{ rfbEncodingZRLE, "zrle" },
 	{ rfbEncodingZYWRLE, "zywrle" },
+	{ rfbEncodingTRLE, "trle" },
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
 	{ rfbEncodingTight, "tight" },
 #endif
@@ -0,0 +1,398 @@
+/*
+ * regionbench.c - time the sraRgn* operations a server does for typical
+ * damage patterns.
+ *
+ * Every trace marks its damage rectangles the way rfbMarkRectAsModified()
+ * does for a number of clients and then runs the region part of
+ * rfbSendFramebufferUpdate() for each of them. The area printed along
+ * with the timings must be the same for every region implementation.
+ *
+ * Afterwards the first frames of each trace are run again for one client
+ * next to a model that keeps every region as a bitmap. The exit status is
+ * non-zero if the regions ever differ from the bitmaps or an update has
+ * overlapping rectangles.
+ *
+ * Usage: regionbench [frames [clients]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rfb/rfb.h>
+#include <rfb/rfbregion.h>
+
+#define WIDTH  1920
+#define HEIGHT 1080
+#define CHECK_FRAMES 10
+
+/* the regions of a client as one byte per pixel */
+typedef struct {
+  unsigned char modified[WIDTH * HEIGHT], copy[WIDTH * HEIGHT];
+  unsigned char requested[WIDTH * HEIGHT];
+  unsigned char update[WIDTH * HEIGHT], updateCopy[WIDTH * HEIGHT];
+  unsigned char tmp[WIDTH * HEIGHT], raster[WIDTH * HEIGHT];
+} benchModel;
+
+typedef struct {
+  sraRegionPtr modifiedRegion, copyRegion, requestedRegion;
+  int copyDX, copyDY;
+  benchModel *model;
+} benchClient;
+
+static unsigned long seed;
+static int failed;
+
+static void
+bitmapRect(unsigned char *b, int x1, int y1, int x2, int y2)
+{
+  int y;
+
+  for(y = y1; y < y2; y++)
+    memset(b + y * WIDTH + x1, 1, x2 - x1);
+}
+
+static int
+bitmapEmpty(const unsigned char *b)
+{
+  int i;
+
+  for(i = 0; i < WIDTH * HEIGHT; i++)
+    if(b[i])
+      return 0;
+  return 1;
+}
+
+/* op: '|' dst |= src, '&' dst &= src, '-' dst &= ~src */
+static void
+bitmapOp(unsigned char *dst, const unsigned char *src, char op)
+{
+  int i;
+
+  for(i = 0; i < WIDTH * HEIGHT; i++)
+    switch(op) {
+    case '|': dst[i] |= src[i]; break;
+    case '&': dst[i] &= src[i]; break;
+    default: dst[i] &= !src[i];
+    }
+}
+
+/* what sraRgnOffset() does, clipped to the screen */
+static void
+bitmapOffset(unsigned char *dst, const unsigned char *src, int dx, int dy)
+{
+  int x, y;
+
+  memset(dst, 0, WIDTH * HEIGHT);
+  for(y = 0; y < HEIGHT; y++)
+    for(x = 0; x < WIDTH; x++)
+      if(src[y * WIDTH + x] && x + dx >= 0 && x + dx < WIDTH &&
+	 y + dy >= 0 && y + dy < HEIGHT)
+	dst[(y + dy) * WIDTH + x + dx] = 1;
+}
+
+/* Paint the rectangles of a region and compare them with the bitmap. */
+static void
+checkRegion(benchModel *m, sraRegionPtr region, const unsigned char *expected,
+	    const char *what)
+{
+  sraRectangleIterator *i;
+  sraRect rect;
+  int x, y, overlap = 0;
+
+  memset(m->raster, 0, WIDTH * HEIGHT);
+  i = sraRgnGetIterator(region);
+  while(sraRgnIteratorNext(i, &rect)) {
+    if(rect.x1 < 0) rect.x1 = 0;
+    if(rect.y1 < 0) rect.y1 = 0;
+    if(rect.x2 > WIDTH) rect.x2 = WIDTH;
+    if(rect.y2 > HEIGHT) rect.y2 = HEIGHT;
+    for(y = rect.y1; y < rect.y2; y++)
+      for(x = rect.x1; x < rect.x2; x++)
+	overlap |= m->raster[y * WIDTH + x]++;
+  }
+  sraRgnReleaseIterator(i);
+
+  if(overlap || memcmp(m->raster, expected, WIDTH * HEIGHT) != 0) {
+    printf("MISMATCH in %s%s\n", what, overlap ? " (overlapping rectangles)" : "");
+    failed = 1;
+  }
+}
+
+static int
+randomInt(int n)
+{
+  seed = seed * 1103515245 + 12345;
+  return (int)((seed >> 16) % n);
+}
+
+static void
+markRect(benchClient *clients, int count, int x1, int y1, int x2, int y2)
+{
+  sraRegionPtr region;
+  int i;
+
+  if(x2 > WIDTH) x2 = WIDTH;
+  if(y2 > HEIGHT) y2 = HEIGHT;
+  if(x1 >= x2 || y1 >= y2)
+    return;
+  region = sraRgnCreateRect(x1, y1, x2, y2);
+  for(i = 0; i < count; i++) {
+    sraRgnOr(clients[i].modifiedRegion, region);
+    if(clients[i].model)
+      bitmapRect(clients[i].model->modified, x1, y1, x2, y2);
+  }
+  sraRgnDestroy(region);
+}
+
+/* like rfbScheduleCopyRegion() for one client */
+static void
+copyRect(benchClient *cl, int x1, int y1, int x2, int y2, int dx, int dy)
+{
+  sraRegionPtr copyRegion = sraRgnCreateRect(x1, y1, x2, y2), modified;
+
+  if(!sraRgnEmpty(cl->copyRegion) && (dx != cl->copyDX || dy != cl->copyDY)) {
+    sraRgnOr(cl->modifiedRegion, cl->copyRegion);
+    sraRgnMakeEmpty(cl->copyRegion);
+  }
+  modified = sraRgnCreateRgn(cl->modifiedRegion);
+  sraRgnAnd(modified, copyRegion);
+  sraRgnOffset(modified, dx, dy);
+  sraRgnSubtract(cl->modifiedRegion, copyRegion);
+  sraRgnOr(cl->modifiedRegion, modified);
+  sraRgnDestroy(modified);
+  sraRgnOr(cl->copyRegion, copyRegion);
+  sraRgnDestroy(copyRegion);
+
+  if(cl->model) {
+    benchModel *m = cl->model;
+    if(!bitmapEmpty(m->copy) && (dx != cl->copyDX || dy != cl->copyDY)) {
+      bitmapOp(m->modified, m->copy, '|');
+      memset(m->copy, 0, WIDTH * HEIGHT);
+    }
+    memset(m->raster, 0, WIDTH * HEIGHT);
+    bitmapRect(m->raster, x1, y1, x2, y2);
+    memcpy(m->update, m->modified, WIDTH * HEIGHT);
+    bitmapOp(m->update, m->raster, '&');
+    bitmapOffset(m->tmp, m->update, dx, dy);
+    bitmapOp(m->modified, m->raster, '-');
+    bitmapOp(m->modified, m->tmp, '|');
+    bitmapOp(m->copy, m->raster, '|');
+  }
+
+  cl->copyDX = dx;
+  cl->copyDY = dy;
+}
+
+/* the region handling of rfbSendFramebufferUpdate(); returns the area sent */
+static unsigned long
+sendUpdate(benchClient *cl, unsigned long *rects)
+{
+  sraRegionPtr updateRegion, updateCopyRegion, tmpRegion;
+  sraRectangleIterator *i;
+  sraRect rect;
+  unsigned long area = 0;
+  benchModel *m = cl->model;
+
+  if(m) {
+    bitmapOp(m->copy, m->modified, '-');
+    memcpy(m->update, m->modified, WIDTH * HEIGHT);
+    bitmapOp(m->update, m->copy, '|');
+    bitmapOp(m->update, m->requested, '&');
+    memcpy(m->updateCopy, m->copy, WIDTH * HEIGHT);
+    bitmapOp(m->updateCopy, m->requested, '&');
+    bitmapOffset(m->tmp, m->requested, cl->copyDX, cl->copyDY);
+    bitmapOp(m->updateCopy, m->tmp, '&');
+    bitmapOp(m->update, m->updateCopy, '-');
+    bitmapOp(m->modified, m->copy, '|');
+    bitmapOp(m->modified, m->update, '-');
+    bitmapOp(m->modified, m->updateCopy, '-');
+    memset(m->copy, 0, WIDTH * HEIGHT);
+    memset(m->requested, 0, WIDTH * HEIGHT);
+  }
+
+  sraRgnSubtract(cl->copyRegion, cl->modifiedRegion);
+  updateRegion = sraRgnCreateRgn(cl->modifiedRegion);
+  sraRgnOr(updateRegion, cl->copyRegion);
+  sraRgnAnd(updateRegion, cl->requestedRegion);
+
+  updateCopyRegion = sraRgnCreateRgn(cl->copyRegion);
+  sraRgnAnd(updateCopyRegion, cl->requestedRegion);
+  tmpRegion = sraRgnCreateRgn(cl->requestedRegion);
+  sraRgnOffset(tmpRegion, cl->copyDX, cl->copyDY);
+  sraRgnAnd(updateCopyRegion, tmpRegion);
+  sraRgnDestroy(tmpRegion);
+  sraRgnSubtract(updateRegion, updateCopyRegion);
+
+  sraRgnOr(cl->modifiedRegion, cl->copyRegion);
+  sraRgnSubtract(cl->modifiedRegion, updateRegion);
+  sraRgnSubtract(cl->modifiedRegion, updateCopyRegion);
+  sraRgnMakeEmpty(cl->requestedRegion);
+  sraRgnMakeEmpty(cl->copyRegion);
+  cl->copyDX = cl->copyDY = 0;
+
+  i = sraRgnGetReverseIterator(updateCopyRegion, FALSE, TRUE);
+  while(sraRgnIteratorNext(i, &rect)) {
+    area += (rect.x2 - rect.x1) * (rect.y2 - rect.y1);
+    (*rects)++;
+  }
+  sraRgnReleaseIterator(i);
+  i = sraRgnGetIterator(updateRegion);
+  while(sraRgnIteratorNext(i, &rect)) {
+    area += (rect.x2 - rect.x1) * (rect.y2 - rect.y1);
+    (*rects)++;
+  }
+  sraRgnReleaseIterator(i);
+
+  if(m) {
+    checkRegion(m, updateRegion, m->update, "update");
+    checkRegion(m, updateCopyRegion, m->updateCopy, "copied update");
+    checkRegion(m, cl->modifiedRegion, m->modified, "remaining damage");
+  }
+
+  sraRgnDestroy(updateRegion);
+  sraRgnDestroy(updateCopyRegion);
+
+  /* the client asks for the next update right away */
+  tmpRegion = sraRgnCreateRect(0, 0, WIDTH, HEIGHT);
+  sraRgnOr(cl->requestedRegion, tmpRegion);
+  sraRgnDestroy(tmpRegion);
+  if(m)
+    memset(m->requested, 1, WIDTH * HEIGHT);
+  return area;
+}
+
+/* a terminal: glyphs get drawn along the lines, plus a blinking cursor */
+static void
+traceTerminal(benchClient *clients, int count, int frame)
+{
+  int i, pos;
+
+  for(i = 0; i < 80; i++) {
+    pos = frame * 80 + i;
+    markRect(clients, count, 8 + (pos % 200) * 8, 20 + (pos / 200 % 60) * 16,
+	     16 + (pos % 200) * 8, 36 + (pos / 200 % 60) * 16);
+  }
+  markRect(clients, count, 1800, 1000, 1808, 1016);
+}
+
+/* a busy desktop: thousands of small widgets repainting all over the place */
+static void
+traceDesktop(benchClient *clients, int count, int frame)
+{
+  int i, x, y;
+
+  for(i = 0; i < 2000; i++) {
+    x = randomInt(WIDTH);
+    y = randomInt(HEIGHT);
+    markRect(clients, count, x, y, x + 4 + randomInt(60), y + 4 + randomInt(28));
+  }
+}
+
+/* a browser window scrolling, with animations in it */
+static void
+traceBrowser(benchClient *clients, int count, int frame)
+{
+  int i, x, y;
+
+  for(i = 0; i < count; i++)
+    copyRect(&clients[i], 300, 140, 1500, 1000, 0, -40);
+  markRect(clients, count, 300, 1000, 1500, 1040);
+  for(i = 0; i < 300; i++) {
+    x = 300 + randomInt(1100);
+    y = 100 + randomInt(900);
+    markRect(clients, count, x, y, x + 8 + randomInt(100), y + 8 + randomInt(40));
+  }
+}
+
+/* a video playing in a window, and a few small updates around it */
+static void
+traceVideo(benchClient *clients, int count, int frame)
+{
+  int i, x, y;
+
+  markRect(clients, count, 640, 360, 1280, 720);
+  for(i = 0; i < 50; i++) {
+    x = randomInt(WIDTH);
+    y = randomInt(HEIGHT);
+    markRect(clients, count, x, y, x + 4 + randomInt(40), y + 4 + randomInt(20));
+  }
+}
+
+typedef void (*traceProc)(benchClient *clients, int count, int frame);
+
+static void
+runTrace(const char *name, traceProc trace, int frames, int count,
+	 benchModel *model)
+{
+  benchClient *clients = (benchClient*)calloc(count, sizeof(benchClient));
+  struct timeval start, end;
+  unsigned long area = 0, rects = 0;
+  double ms;
+  int frame, i;
+
+  for(i = 0; i < count; i++) {
+    clients[i].modifiedRegion = sraRgnCreate();
+    clients[i].copyRegion = sraRgnCreate();
+    clients[i].requestedRegion = sraRgnCreateRect(0, 0, WIDTH, HEIGHT);
+  }
+  if(model) {
+    memset(model, 0, sizeof(*model));
+    memset(model->requested, 1, WIDTH * HEIGHT);
+    clients[0].model = model;
+  }
+  seed = 1;
+
+  gettimeofday(&start, NULL);
+  for(frame = 0; frame < frames; frame++) {
+    trace(clients, count, frame);
+    for(i = 0; i < count; i++)
+      area += sendUpdate(&clients[i], &rects);
+  }
+  gettimeofday(&end, NULL);
+
+  ms = (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_usec - start.tv_usec) / 1000.0;
+  printf("%-10s %9.3f ms/frame %10lu rects %14lu area\n",
+	 name, ms / frames, rects, area);
+
+  for(i = 0; i < count; i++) {
+    sraRgnDestroy(clients[i].modifiedRegion);
+    sraRgnDestroy(clients[i].copyRegion);
+    sraRgnDestroy(clients[i].requestedRegion);
+  }
+  free(clients);
+}
+
+int
+main(int argc, char **argv)
+{
+  int frames = 100, clients = 4;
+  benchModel *model;
+
+  if(argc > 1)
+    frames = atoi(argv[1]);
+  if(argc > 2)
+    clients = atoi(argv[2]);
+  if(frames <= 0 || clients <= 0) {
+    fprintf(stderr, "Usage: %s [frames [clients]]\n", argv[0]);
+    return 1;
+  }
+
+  printf("%d frames, %d clients, %dx%d\n", frames, clients, WIDTH, HEIGHT);
+  runTrace("terminal", traceTerminal, frames, clients, NULL);
+  runTrace("desktop", traceDesktop, frames, clients, NULL);
+  runTrace("browser", traceBrowser, frames, clients, NULL);
+  runTrace("video", traceVideo, frames, clients, NULL);
+
+  model = (benchModel*)malloc(sizeof(benchModel));
+  if(!model)
+    return 1;
+  if(frames > CHECK_FRAMES)
+    frames = CHECK_FRAMES;
+  printf("checking %d frames against bitmaps\n", frames);
+  runTrace("terminal", traceTerminal, frames, 1, model);
+  runTrace("desktop", traceDesktop, frames, 1, model);
+  runTrace("browser", traceBrowser, frames, 1, model);
+  runTrace("video", traceVideo, frames, 1, model);
+  free(model);
+  return failed;
+}
@@ -0,0 +1,256 @@
+/*
+ * simdbench.c - throughput of the encoder kernels in libvncserver/simd.c.
+ *
+ * Every kernel the CPU supports is run over buffers shaped like what the
+ * Tight encoder sees: one solid colour, runs of colours as in a desktop
+ * with gradients and icons, and two colours as in text. The same buffers
+ * go through the vertical pass of the scaler as rows of a 32 bit screen.
+ * The result of each run must be the same as that of the portable
+ * kernels; the exit status is non-zero if it is not.
+ *
+ * Each kernel is timed for at least ms milliseconds (200 by default); with
+ * 0 every kernel runs only a few times, which is enough for the check.
+ *
+ * Usage: simdbench [megapixels [ms]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rfb/rfb.h>
+#include "simd.h"
+
+#define PATTERNS 3
+
+static const char *patternNames[PATTERNS] = { "solid", "runs", "text" };
+
+static unsigned long seed;
+
+static int
+randomInt(int n)
+{
+  seed = seed * 1103515245 + 12345;
+  return (int)((seed >> 16) % n);
+}
+
+/* Fill p with a pattern; the bits outside mask are random so the kernels
+   have to mask them away. */
+static void
+fillPattern(uint32_t *p, int n, int pattern, uint32_t mask)
+{
+  uint32_t c = 0x336699, fg = 0xeeeeee, bg = 0x202020;
+  int i, run = 0;
+
+  seed = 1;
+  for(i = 0; i < n; i++) {
+    switch(pattern) {
+    case 0:
+      break;
+    case 1:
+      if(run-- == 0) {
+	c = randomInt(0x1000000);
+	run = randomInt(64);
+      }
+      break;
+    default:
+      c = randomInt(8) == 0 ? fg : bg;
+    }
+    p[i] = (c & mask) | (((uint32_t)randomInt(0x10000) << 16) & ~mask);
+  }
+}
+
+static double
+elapsed(struct timeval *start)
+{
+  struct timeval end;
+
+  gettimeofday(&end, NULL);
+  return (end.tv_sec - start->tv_sec) * 1000.0 + (end.tv_usec - start->tv_usec) / 1000.0;
+}
+
+/*
+ * The span loops the encoder runs: spanEqual finds the runs of the
+ * palette and solid checks, spanTwo the end of a two colour area. Both
+ * return a checksum of what the kernels returned.
+ */
+
+#define DEFINE_BENCH_FUNCTIONS(bpp)                                           \
+                                                                              \
+static unsigned long                                                          \
+runEqual##bpp(const rfbSimdKernels *k, const uint##bpp##_t *p, int n,         \
+              uint##bpp##_t mask)                                             \
+{                                                                             \
+  unsigned long sum = 0;                                                      \
+  int pos = 0, span;                                                          \
+                                                                              \
+  while(pos < n) {                                                            \
+    span = 1 + k->spanEqual##bpp(p + pos + 1, n - pos - 1, p[pos] & mask,     \
+                                 mask);                                       \
+    sum = sum * 31 + span;                                                    \
+    pos += span;                                                              \
+  }                                                                           \
+  return sum;                                                                 \
+}                                                                             \
+                                                                              \
+static unsigned long                                                          \
+runTwo##bpp(const rfbSimdKernels *k, const uint##bpp##_t *p, int n,           \
+            uint##bpp##_t mask)                                               \
+{                                                                             \
+  unsigned long sum = 0;                                                      \
+  int pos = 0, span, na;                                                      \
+                                                                              \
+  while(pos < n - 1) {                                                        \
+    span = 2 + k->spanTwo##bpp(p + pos + 2, n - pos - 2, p[pos] & mask,       \
+                               p[pos + 1] & mask, mask, &na);                 \
+    sum = (sum * 31 + span) * 31 + na;                                        \
+    pos += span;                                                              \
+  }                                                                           \
+  return sum;                                                                 \
+}
+
+DEFINE_BENCH_FUNCTIONS(8)
+DEFINE_BENCH_FUNCTIONS(16)
+DEFINE_BENCH_FUNCTIONS(32)
+
+/* rows of an odd width, so that the kernels have pixels left over */
+#define SCALE_WIDTH 1021
+
+static unsigned long
+runScale(const rfbSimdKernels *k, const uint32_t *p, int n, uint32_t *acc)
+{
+  static const int shift[3] = { 16, 8, 0 };
+  uint32_t *red = acc, *green = acc + SCALE_WIDTH, *blue = acc + 2 * SCALE_WIDTH;
+  unsigned long sum = 0;
+  int row, i;
+
+  memset(acc, 0, 3 * SCALE_WIDTH * sizeof(uint32_t));
+  for(row = 0; (row + 1) * SCALE_WIDTH <= n; row++) {
+    /* weights go up to 256, and at most 256 rows are summed up */
+    if(row % 256 == 0)
+      for(i = 0; i < 3 * SCALE_WIDTH; i++) {
+	sum = sum * 31 + acc[i];
+	acc[i] = 0;
+      }
+    k->scaleAccumulate32(p + row * SCALE_WIDTH, SCALE_WIDTH, shift,
+			 row * 37 % 257, red, green, blue);
+  }
+  for(i = 0; i < 3 * SCALE_WIDTH; i++)
+    sum = sum * 31 + acc[i];
+  return sum;
+}
+
+static unsigned long
+runKernel(const rfbSimdKernels *k, int kernel, int bpp, const void *p, int n)
+{
+  switch(kernel * 3 + bpp / 16) {
+  case 0: return runEqual8(k, (const uint8_t *)p, n, 0xff);
+  case 1: return runEqual16(k, (const uint16_t *)p, n, 0xffff);
+  case 2: return runEqual32(k, (const uint32_t *)p, n, 0xffffff);
+  case 3: return runTwo8(k, (const uint8_t *)p, n, 0xff);
+  case 4: return runTwo16(k, (const uint16_t *)p, n, 0xffff);
+  default: return runTwo32(k, (const uint32_t *)p, n, 0xffffff);
+  }
+}
+
+static void
+toDepth(const uint32_t *src, void *dst, int n, int bpp)
+{
+  int i;
+
+  for(i = 0; i < n; i++)
+    switch(bpp) {
+    case 8: ((uint8_t *)dst)[i] = (uint8_t)(src[i] ^ (src[i] >> 8) ^ (src[i] >> 16)); break;
+    case 16: ((uint16_t *)dst)[i] = (uint16_t)(src[i] ^ (src[i] >> 16)); break;
+    default: ((uint32_t *)dst)[i] = src[i];
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+  static const char *kernelNames[2] = { "spanEqual", "spanTwo" };
+  static const int depths[3] = { 8, 16, 32 };
+  const rfbSimdKernels *list[8];
+  int nImpl, n, minMs, pattern, kernel, d, impl, repeat, repeats, failed = 0;
+  uint32_t *pixels, *acc;
+  void *buf;
+  unsigned long expected = 0, sum;
+  struct timeval start;
+  double ms;
+  char name[32];
+
+  n = argc > 1 ? atoi(argv[1]) : 4;
+  minMs = argc > 2 ? atoi(argv[2]) : 200;
+  if(n <= 0 || minMs < 0) {
+    fprintf(stderr, "Usage: %s [megapixels [ms]]\n", argv[0]);
+    return 1;
+  }
+  n <<= 20;
+  pixels = (uint32_t *)malloc(n * sizeof(uint32_t));
+  buf = malloc(n * sizeof(uint32_t));
+  acc = (uint32_t *)malloc(3 * SCALE_WIDTH * sizeof(uint32_t));
+  if(!pixels || !buf || !acc)
+    return 1;
+
+  nImpl = rfbSimdList(list, 8);
+  if(nImpl > 8)
+    nImpl = 8;
+  printf("%d Mpixels, fastest kernels: %s\n", n >> 20, rfbSimd()->name);
+
+  for(pattern = 0; pattern < PATTERNS; pattern++)
+    for(d = 0; d < 3; d++) {
+      /* 32 bpp pixels carry bits the kernels must mask off */
+      fillPattern(pixels, n, pattern, depths[d] == 32 ? 0xffffff : 0xffffffff);
+      toDepth(pixels, buf, n, depths[d]);
+      for(kernel = 0; kernel < 2; kernel++)
+	for(impl = 0; impl < nImpl; impl++) {
+	  sum = runKernel(list[impl], kernel, depths[d], buf, n);
+	  if(impl == 0)
+	    expected = sum;
+	  repeats = 0;
+	  gettimeofday(&start, NULL);
+	  do {
+	    for(repeat = 0; repeat < 4; repeat++)
+	      runKernel(list[impl], kernel, depths[d], buf, n);
+	    repeats += 4;
+	  } while((ms = elapsed(&start)) < minMs);
+	  if(ms <= 0)
+	    ms = 0.001;
+	  snprintf(name, sizeof(name), "%s%d", kernelNames[kernel], depths[d]);
+	  printf("%-6s %-12s %-7s %10.1f MB/s%s\n", patternNames[pattern], name,
+		 list[impl]->name,
+		 (double)n * (depths[d] / 8) * repeats / (ms * 1000.0),
+		 sum != expected ? "  MISMATCH" : "");
+	  if(sum != expected)
+	    failed = 1;
+	}
+    }
+
+  for(pattern = 0; pattern < PATTERNS; pattern++) {
+    fillPattern(pixels, n, pattern, 0xffffffff);
+    for(impl = 0; impl < nImpl; impl++) {
+      sum = runScale(list[impl], pixels, n, acc);
+      if(impl == 0)
+	expected = sum;
+      repeats = 0;
+      gettimeofday(&start, NULL);
+      do {
+	runScale(list[impl], pixels, n, acc);
+	repeats++;
+      } while((ms = elapsed(&start)) < minMs);
+      if(ms <= 0)
+	ms = 0.001;
+      printf("%-6s %-12s %-7s %10.1f MB/s%s\n", patternNames[pattern],
+	     "scale32", list[impl]->name,
+	     (double)n * 4 * repeats / (ms * 1000.0),
+	     sum != expected ? "  MISMATCH" : "");
+      if(sum != expected)
+	failed = 1;
+    }
+  }
+
+  free(pixels);
+  free(buf);
+  free(acc);
+  return failed;
+}
@@ -0,0 +1,372 @@
+/*
+ * translatebench.c - pixels per second of the pixel format translation.
+ *
+ * A 32 bit framebuffer with 8 bit channels is translated to the formats
+ * clients commonly ask for, first through the RGB lookup tables the way
+ * libvncserver/tabletranstemplate.c does, then by every implementation of
+ * the translate kernels in libvncserver/simd.c the CPU supports. The
+ * kernels must produce the same pixels as the tables.
+ *
+ * Then whatever rfbSetTranslateFunction() picks, kernels or lookup tables,
+ * translates 32, 16 and two 24 bit servers to the same formats, and the pixels
+ * must be what the formula of the tables gives. The exit status is
+ * non-zero if any pixel differs.
+ *
+ * Each translation is timed for at least ms milliseconds (200 by
+ * default); with 0 it runs once, which is enough for the checks.
+ *
+ * Usage: translatebench [pixels [ms]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rfb/rfb.h>
+#include "simd.h"
+
+#define FORMATS 6
+
+/* bits per pixel, max and shift of red, green and blue, swapped */
+static const struct {
+  const char *name;
+  int bpp, redMax, greenMax, blueMax, redShift, greenShift, blueShift, swap;
+} formats[FORMATS] = {
+  { "rgb565",    16,  31, 63,  31, 11,  5,  0, 0 },
+  { "rgb565-be", 16,  31, 63,  31, 11,  5,  0, 1 },
+  { "rgb555",    16,  31, 31,  31, 10,  5,  0, 0 },
+  { "bgr233",     8,   7,  7,   3,  0,  3,  6, 0 },
+  { "rgb888-24", 24, 255, 255, 255, 16,  8,  0, 0 },
+  { "bgr888-be", 32, 255, 255, 255,  0,  8, 16, 1 }
+};
+
+static unsigned long seed;
+
+static int
+randomInt(int n)
+{
+  seed = seed * 1103515245 + 12345;
+  return (int)((seed >> 16) % n);
+}
+
+/* Flat areas and gradients with some noise, red at 16, green at 8 and
+   blue at 0 like most 32 bit servers. */
+static void
+fillPixels(uint32_t *p, int n)
+{
+  int i, c;
+
+  seed = 1;
+  for(i = 0; i < n; i++) {
+    c = randomInt(9) - 4;
+    if((i / 640) % 3 == 0)
+      p[i] = (i / 97) % 2 ? 0xececec : 0x204080;
+    else
+      p[i] = (uint32_t)(((i + c) & 255) << 16 | ((i / 3 + c) & 255) << 8 |
+			((i / 7 - c) & 255));
+  }
+}
+
+/* The RGB tables of libvncserver/tableinittctemplate.c for one format. */
+static void
+initTables(uint32_t *tables, const rfbSimdPixelFormat *f)
+{
+  int c, i;
+
+  for(c = 0; c < 3; c++)
+    for(i = 0; i < 256; i++)
+      tables[c * 256 + i] =
+	(uint32_t)((i * f->outMax[c] + 255 / 2) / 255) << f->outShift[c];
+}
+
+static void
+translateWithTables(const uint32_t *tables, const rfbSimdPixelFormat *f,
+		    int bpp, const uint32_t *src, uint8_t *dst, int n)
+{
+  const uint32_t *red = tables, *green = tables + 256, *blue = tables + 512;
+  uint32_t v;
+  int i;
+
+  for(i = 0; i < n; i++) {
+    v = red[(src[i] >> f->inShift[0]) & 255] |
+      green[(src[i] >> f->inShift[1]) & 255] |
+      blue[(src[i] >> f->inShift[2]) & 255];
+    switch(bpp) {
+    case 8:
+      dst[i] = (uint8_t)v;
+      break;
+    case 16:
+      ((uint16_t *)dst)[i] = f->swap ? Swap16(v) : (uint16_t)v;
+      break;
+    case 24:
+      if(f->swap)
+	v = Swap24(v);
+      dst[3 * i] = (uint8_t)v;
+      dst[3 * i + 1] = (uint8_t)(v >> 8);
+      dst[3 * i + 2] = (uint8_t)(v >> 16);
+      break;
+    default:
+      ((uint32_t *)dst)[i] = f->swap ? Swap32(v) : v;
+    }
+  }
+}
+
+static void
+translateWithKernels(const rfbSimdKernels *k, const rfbSimdPixelFormat *f,
+		     int bpp, const uint32_t *src, uint8_t *dst, int n)
+{
+  switch(bpp) {
+  case 8:
+    k->translate8(src, dst, n, f);
+    break;
+  case 16:
+    k->translate16(src, (uint16_t *)dst, n, f);
+    break;
+  case 24:
+    k->translate24(src, dst, n, f);
+    break;
+  default:
+    k->translate32(src, (uint32_t *)dst, n, f);
+  }
+}
+
+/* server formats for the library check, with the channels of the 32 bit
+   test pixels cut down to their size */
+#define SERVER_FORMATS 4
+
+static const struct {
+  const char *name;
+  int bpp, redMax, greenMax, blueMax, redShift, greenShift, blueShift;
+} serverFormats[SERVER_FORMATS] = {
+  { "rgb888",    32, 255, 255, 255, 16, 8, 0 },
+  { "rgb565",    16,  31,  63,  31, 11, 5, 0 },
+  { "rgb888-24", 24, 255, 255, 255, 16, 8, 0 },
+  { "bgr888-24", 24, 255, 255, 255, 0, 8, 16 }
+};
+
+static void
+setPixelFormat(rfbPixelFormat *f, int bpp, int redMax, int greenMax,
+	       int blueMax, int redShift, int greenShift, int blueShift,
+	       int bigEndian)
+{
+  memset(f, 0, sizeof(*f));
+  f->bitsPerPixel = bpp;
+  f->depth = bpp == 32 ? 24 : bpp;
+  f->bigEndian = bigEndian;
+  f->trueColour = 1;
+  f->redMax = redMax;
+  f->greenMax = greenMax;
+  f->blueMax = blueMax;
+  f->redShift = redShift;
+  f->greenShift = greenShift;
+  f->blueShift = blueShift;
+}
+
+/* a pixel of f, stored in f's byte order */
+static void
+putPixel(uint8_t *p, const rfbPixelFormat *f, uint32_t v)
+{
+  int i, bytes = f->bitsPerPixel / 8;
+
+  for(i = 0; i < bytes; i++)
+    p[f->bigEndian ? bytes - 1 - i : i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint32_t
+getPixel(const uint8_t *p, const rfbPixelFormat *f)
+{
+  int i, bytes = f->bitsPerPixel / 8;
+  uint32_t v = 0;
+
+  for(i = 0; i < bytes; i++)
+    v |= (uint32_t)p[f->bigEndian ? bytes - 1 - i : i] << (8 * i);
+  return v;
+}
+
+/* what the lookup tables of libvncserver/tableinittctemplate.c compute */
+static uint32_t
+referencePixel(uint32_t v, const rfbPixelFormat *in, const rfbPixelFormat *out)
+{
+  uint32_t r = (v >> in->redShift) & in->redMax;
+  uint32_t g = (v >> in->greenShift) & in->greenMax;
+  uint32_t b = (v >> in->blueShift) & in->blueMax;
+
+  return (r * out->redMax + in->redMax / 2) / in->redMax << out->redShift |
+    (g * out->greenMax + in->greenMax / 2) / in->greenMax << out->greenShift |
+    (b * out->blueMax + in->blueMax / 2) / in->blueMax << out->blueShift;
+}
+
+/*
+ * Translate through a client the way rfbSetPixelFormat() sets it up;
+ * 16 bit servers go through the single table and, with
+ * rfbEconomicTranslate, through the RGB tables. Returns non-zero on a
+ * mismatch.
+ */
+static int
+checkLibrary(const uint32_t *pixels, int n)
+{
+  rfbScreenInfo screen;
+  rfbClientRec cl;
+  uint8_t *src, *dst;
+  int sfmt, fmt, economic, i, bytes, mismatch, failed = 0;
+  uint32_t v, want;
+
+  src = (uint8_t *)malloc(n * 4 + 4);
+  dst = (uint8_t *)malloc(n * 4 + 4);
+  if(!src || !dst)
+    return 1;
+
+  rfbLogEnable(0);
+  for(sfmt = 0; sfmt < SERVER_FORMATS; sfmt++) {
+#ifndef LIBVNCSERVER_ALLOW24BPP
+    if(serverFormats[sfmt].bpp == 24)
+      continue;
+#endif
+    memset(&screen, 0, sizeof(screen));
+    setPixelFormat(&screen.serverFormat, serverFormats[sfmt].bpp,
+		   serverFormats[sfmt].redMax, serverFormats[sfmt].greenMax,
+		   serverFormats[sfmt].blueMax, serverFormats[sfmt].redShift,
+		   serverFormats[sfmt].greenShift,
+		   serverFormats[sfmt].blueShift, !rfbEndianTest);
+    for(i = 0; i < n; i++) {
+      v = (pixels[i] >> 16 & 255) * screen.serverFormat.redMax / 255
+	<< screen.serverFormat.redShift |
+	(pixels[i] >> 8 & 255) * screen.serverFormat.greenMax / 255
+	<< screen.serverFormat.greenShift |
+	(pixels[i] & 255) * screen.serverFormat.blueMax / 255
+	<< screen.serverFormat.blueShift;
+      putPixel(src + i * (serverFormats[sfmt].bpp / 8), &screen.serverFormat, v);
+    }
+
+    for(economic = 0; economic < (serverFormats[sfmt].bpp == 16 ? 2 : 1);
+	economic++)
+      for(fmt = 0; fmt < FORMATS; fmt++) {
+	memset(&cl, 0, sizeof(cl));
+	cl.screen = &screen;
+	cl.host = "translatebench";
+	setPixelFormat(&cl.format, formats[fmt].bpp, formats[fmt].redMax,
+		       formats[fmt].greenMax, formats[fmt].blueMax,
+		       formats[fmt].redShift, formats[fmt].greenShift,
+		       formats[fmt].blueShift,
+		       formats[fmt].swap ? rfbEndianTest : !rfbEndianTest);
+	rfbEconomicTranslate = economic;
+	if(!rfbSetTranslateFunction(&cl)) {
+	  printf("%-9s to %-9s  no translation\n", serverFormats[sfmt].name,
+		 formats[fmt].name);
+	  failed = 1;
+	  continue;
+	}
+	bytes = formats[fmt].bpp / 8;
+	memset(dst, 0, n * bytes);
+	cl.translateFn(cl.translateLookupTable, &screen.serverFormat,
+		       &cl.format, (char *)src, (char *)dst,
+		       n * (serverFormats[sfmt].bpp / 8), n, 1);
+	mismatch = 0;
+	for(i = 0; i < n && !mismatch; i++) {
+	  v = getPixel(src + i * (serverFormats[sfmt].bpp / 8),
+		       &screen.serverFormat);
+	  want = referencePixel(v, &screen.serverFormat, &cl.format);
+	  mismatch = getPixel(dst + i * bytes, &cl.format) != want;
+	}
+	printf("%-9s to %-9s %s%s\n", serverFormats[sfmt].name,
+	       formats[fmt].name, economic ? "economic " : "",
+	       mismatch ? "MISMATCH" : "ok");
+	if(mismatch)
+	  failed = 1;
+	free(cl.translateLookupTable);
+      }
+  }
+  rfbEconomicTranslate = FALSE;
+  rfbLogEnable(1);
+
+  free(src);
+  free(dst);
+  return failed;
+}
+
+static double
+elapsed(struct timeval *start)
+{
+  struct timeval end;
+
+  gettimeofday(&end, NULL);
+  return (end.tv_sec - start->tv_sec) * 1000.0 + (end.tv_usec - start->tv_usec) / 1000.0;
+}
+
+int
+main(int argc, char **argv)
+{
+  const rfbSimdKernels *list[8];
+  int nImpl, nPixels, minMs, fmt, impl, repeats, bytes, failed = 0, mismatch;
+  uint32_t *src, tables[3 * 256];
+  uint8_t *expected, *dst;
+  rfbSimdPixelFormat f;
+  struct timeval start;
+  double ms;
+
+  nPixels = argc > 1 ? atoi(argv[1]) : 1024 * 768;
+  minMs = argc > 2 ? atoi(argv[2]) : 200;
+  if(nPixels <= 0 || minMs < 0) {
+    fprintf(stderr, "Usage: %s [pixels [ms]]\n", argv[0]);
+    return 1;
+  }
+  src = (uint32_t *)malloc(nPixels * sizeof(uint32_t));
+  expected = (uint8_t *)malloc(nPixels * 4);
+  dst = (uint8_t *)malloc(nPixels * 4);
+  if(!src || !expected || !dst)
+    return 1;
+  fillPixels(src, nPixels);
+
+  nImpl = rfbSimdList(list, 8);
+  if(nImpl > 8)
+    nImpl = 8;
+  printf("%d pixels, fastest kernels: %s\n", nPixels, rfbSimd()->name);
+
+  for(fmt = 0; fmt < FORMATS; fmt++) {
+    f.inShift[0] = 16;
+    f.inShift[1] = 8;
+    f.inShift[2] = 0;
+    f.outMax[0] = formats[fmt].redMax;
+    f.outMax[1] = formats[fmt].greenMax;
+    f.outMax[2] = formats[fmt].blueMax;
+    f.outShift[0] = formats[fmt].redShift;
+    f.outShift[1] = formats[fmt].greenShift;
+    f.outShift[2] = formats[fmt].blueShift;
+    f.swap = formats[fmt].swap;
+    bytes = nPixels * (formats[fmt].bpp / 8);
+    initTables(tables, &f);
+
+    /* impl -1 is the tables */
+    for(impl = -1; impl < nImpl; impl++) {
+      memset(dst, 0, bytes);
+      repeats = 0;
+      gettimeofday(&start, NULL);
+      do {
+	if(impl < 0)
+	  translateWithTables(tables, &f, formats[fmt].bpp, src, dst, nPixels);
+	else
+	  translateWithKernels(list[impl], &f, formats[fmt].bpp, src, dst,
+			       nPixels);
+	repeats++;
+      } while((ms = elapsed(&start)) < minMs);
+      if(ms <= 0)
+	ms = 0.001;
+      if(impl < 0)
+	memcpy(expected, dst, bytes);
+      mismatch = memcmp(dst, expected, bytes) != 0;
+      printf("%-9s %-7s %8.1f Mpixels/s%s\n", formats[fmt].name,
+	     impl < 0 ? "tables" : list[impl]->name,
+	     (double)nPixels * repeats / (ms * 1000.0),
+	     mismatch ? "  MISMATCH" : "");
+      if(mismatch)
+	failed = 1;
+    }
+  }
+
+  if(checkLibrary(src, nPixels))
+    failed = 1;
+
+  free(src);
+  free(expected);
+  free(dst);
+  return failed;
+}
@@ -0,0 +1,240 @@
+/*
+ * zrlebench.c - tiles per second of the ZRLE and ZYWRLE kernels.
+ *
+ * Every implementation in libvncserver/simd.c the CPU supports runs the
+ * two passes over a 64x64 tile that use them: the palette pass of ZRLE,
+ * which counts the runs and builds the palette, and the wavelet transform
+ * of ZYWRLE at its highest level. The tiles look like text, like a
+ * desktop with windows and gradients, and like a photo. The result of
+ * each pass must be the same as that of the portable kernels; the exit
+ * status is non-zero if it is not.
+ *
+ * Each pass is timed for at least ms milliseconds (200 by default); with
+ * 0 every pass runs once, which is enough for the check.
+ *
+ * Usage: zrlebench [tiles [ms]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rfb/rfb.h>
+#include "simd.h"
+#include "zrlepalettehelper.h"
+
+#define TILE 64
+#define TILE_PIXELS (TILE * TILE)
+#define ZYWRLE_LEVELS 3
+#define CONTENTS 3
+
+static const char *contentNames[CONTENTS] = { "text", "ui", "photo" };
+
+static unsigned long seed;
+
+static int
+randomInt(int n)
+{
+  seed = seed * 1103515245 + 12345;
+  return (int)((seed >> 16) % n);
+}
+
+static uint32_t
+rgb(int r, int g, int b)
+{
+  return (uint32_t)((r & 255) << 16 | (g & 255) << 8 | (b & 255));
+}
+
+/* One tile of content at p; every tile differs a little. */
+static void
+fillTile(uint32_t *p, int content, int t)
+{
+  int x, y, ch = 0, shade, c;
+
+  for(y = 0; y < TILE; y++)
+    for(x = 0; x < TILE; x++) {
+      switch(content) {
+      case 0:
+	/* dark glyphs of 8x16 with a few shades of antialiasing */
+	if(x % 8 == 0)
+	  ch = (int)(((unsigned)(x / 8 + (y / 16) * 8 + t) * 2654435761u) >> 8);
+	if(x % 8 < 6 && y % 16 >= 3 && y % 16 < 13 &&
+	   (ch >> ((x % 8) * 2 + (y % 16) % 5)) & 1) {
+	  shade = (ch >> (y % 16)) & 3;
+	  p[y * TILE + x] = rgb(16 + shade * 60, 16 + shade * 60, 16 + shade * 60);
+	} else
+	  p[y * TILE + x] = rgb(250, 250, 250);
+	break;
+      case 1:
+	/* a title bar with a gradient over framed flat areas */
+	if(y < 12)
+	  p[y * TILE + x] = rgb(40, 80 + x, 160 + y * 4);
+	else if(x % 24 == t % 24 || y % 20 == 0)
+	  p[y * TILE + x] = rgb(120, 120, 120);
+	else
+	  p[y * TILE + x] = (x / 24 + y / 20 + t) % 3 ? rgb(236, 236, 236) : rgb(255, 255, 255);
+	break;
+      default:
+	/* smooth gradients with sensor noise */
+	c = randomInt(9) - 4;
+	p[y * TILE + x] = rgb(x * 3 + t + c, y * 3 + c, (x + y) * 2 + c);
+      }
+    }
+}
+
+/* The coefficients ZYWRLE transforms: Y, U and V in the low three bytes,
+   and a fourth byte the kernels must leave alone. */
+static void
+toCoefficients(const uint32_t *p, int *coef)
+{
+  int i, r, g, b;
+  signed char *q;
+
+  for(i = 0; i < TILE_PIXELS; i++) {
+    r = p[i] >> 16 & 255;
+    g = p[i] >> 8 & 255;
+    b = p[i] & 255;
+    q = (signed char *)(coef + i);
+    q[0] = (signed char)(((r + 2 * g + b) >> 2) - 128);
+    q[1] = (signed char)((b - g) >> 1);
+    q[2] = (signed char)((r - g) >> 1);
+    q[3] = 0x5a;
+  }
+}
+
+static double
+elapsed(struct timeval *start)
+{
+  struct timeval end;
+
+  gettimeofday(&end, NULL);
+  return (end.tv_sec - start->tv_sec) * 1000.0 + (end.tv_usec - start->tv_usec) / 1000.0;
+}
+
+/*
+ * The passes as the encoder runs them, see zrleEncodeTile in
+ * libvncserver/zrleencodetemplate.c and Wavelet in
+ * common/zywrletemplate.c. Both return a checksum of their results.
+ */
+
+static unsigned long
+paletteTiles(const rfbSimdKernels *k, uint32_t *tiles, int nTiles,
+	     zrlePaletteHelper *ph)
+{
+  uint32_t starts[TILE_PIXELS / 32], word, *data, *ptr, last, prev;
+  unsigned long sum = 0;
+  int t, i, runs, singlePixels;
+
+  for(t = 0; t < nTiles; t++) {
+    data = tiles + t * TILE_PIXELS;
+    runs = k->runStarts32(data, TILE_PIXELS, starts, &singlePixels) - singlePixels;
+    zrlePaletteHelperInit(ph);
+    last = prev = data[0];
+    zrlePaletteHelperInsert(ph, data[0]);
+    for(i = 0; i < TILE_PIXELS / 32 && ph->size <= ZRLE_PALETTE_MAX_SIZE; i++) {
+      word = i == 0 ? starts[0] & ~1u : starts[i];
+      for(; word; word &= word - 1) {
+	ptr = data + i * 32 + rfbSimdLowestBit(word);
+	if(*ptr != prev || ph->size == ZRLE_PALETTE_MAX_SIZE)
+	  zrlePaletteHelperInsert(ph, *ptr);
+	prev = last;
+	last = *ptr;
+      }
+    }
+    sum = ((sum * 31 + runs) * 31 + singlePixels) * 31 + ph->size;
+    for(i = 0; i < ph->size && i < ZRLE_PALETTE_MAX_SIZE; i++)
+      sum = sum * 31 + ph->palette[i];
+  }
+  return sum;
+}
+
+static unsigned long
+waveletTiles(const rfbSimdKernels *k, const int *coef, int *work, int nTiles)
+{
+  unsigned long sum = 0;
+  int t, l, i, s;
+  int *top, *end;
+
+  for(t = 0; t < nTiles; t++) {
+    memcpy(work, coef + t * TILE_PIXELS, TILE_PIXELS * sizeof(int));
+    for(l = 0; l < ZYWRLE_LEVELS; l++) {
+      s = TILE << l;
+      for(top = work, end = work + TILE_PIXELS; top < end; top += s)
+	k->zywrleHarr(top, top + (1 << l), TILE >> (l + 1), 2 << l);
+      s = (2 << l) * TILE;
+      for(top = work, end = work + (TILE >> (l + 1)) * s; top < end; top += s)
+	k->zywrleHarr(top, top + (TILE << l), TILE >> l, 1 << l);
+    }
+    for(i = 0; i < TILE_PIXELS; i++)
+      sum = sum * 31 + (unsigned int)work[i];
+  }
+  return sum;
+}
+
+int
+main(int argc, char **argv)
+{
+  static const char *passNames[2] = { "palette", "wavelet" };
+  const rfbSimdKernels *list[8];
+  int nImpl, nTiles, minMs, content, pass, impl, t, repeats, failed = 0;
+  uint32_t *tiles;
+  int *coef, *work;
+  zrlePaletteHelper *ph;
+  unsigned long expected = 0, sum;
+  struct timeval start;
+  double ms;
+
+  nTiles = argc > 1 ? atoi(argv[1]) : 256;
+  minMs = argc > 2 ? atoi(argv[2]) : 200;
+  if(nTiles <= 0 || minMs < 0) {
+    fprintf(stderr, "Usage: %s [tiles [ms]]\n", argv[0]);
+    return 1;
+  }
+  tiles = (uint32_t *)malloc(nTiles * TILE_PIXELS * sizeof(uint32_t));
+  coef = (int *)malloc(nTiles * TILE_PIXELS * sizeof(int));
+  work = (int *)malloc(TILE_PIXELS * sizeof(int));
+  ph = (zrlePaletteHelper *)malloc(sizeof(zrlePaletteHelper));
+  if(!tiles || !coef || !work || !ph)
+    return 1;
+
+  nImpl = rfbSimdList(list, 8);
+  if(nImpl > 8)
+    nImpl = 8;
+  printf("%d tiles of %dx%d, fastest kernels: %s\n", nTiles, TILE, TILE,
+	 rfbSimd()->name);
+
+  for(content = 0; content < CONTENTS; content++) {
+    seed = 1;
+    for(t = 0; t < nTiles; t++) {
+      fillTile(tiles + t * TILE_PIXELS, content, t);
+      toCoefficients(tiles + t * TILE_PIXELS, coef + t * TILE_PIXELS);
+    }
+    for(pass = 0; pass < 2; pass++)
+      for(impl = 0; impl < nImpl; impl++) {
+	repeats = 0;
+	gettimeofday(&start, NULL);
+	do {
+	  if(pass == 0)
+	    sum = paletteTiles(list[impl], tiles, nTiles, ph);
+	  else
+	    sum = waveletTiles(list[impl], coef, work, nTiles);
+	  repeats++;
+	} while((ms = elapsed(&start)) < minMs);
+	if(ms <= 0)
+	  ms = 0.001;
+	if(impl == 0)
+	  expected = sum;
+	printf("%-6s %-8s %-7s %10.0f tiles/s%s\n", contentNames[content],
+	       passNames[pass], list[impl]->name,
+	       (double)nTiles * repeats * 1000.0 / ms,
+	       sum != expected ? "  MISMATCH" : "");
+	if(sum != expected)
+	  failed = 1;
+      }
+  }
+
+  free(tiles);
+  free(coef);
+  free(work);
+  free(ph);
+  return failed;
+}